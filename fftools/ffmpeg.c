@@ -334,11 +334,14 @@ static void ffmpeg_cleanup(int ret)
                    av_err2str(AVERROR(errno)));
     }
     av_freep(&vstats_filename);
+    av_freep(&sched_stats_filename);
+    av_freep(&resume_filename);
     of_enc_stats_close();
 
     hw_device_free_all();
 
     av_freep(&filter_nbthreads);
+    av_freep(&filter_thread_type);
 
     av_freep(&input_files);
     av_freep(&output_files);
@@ -545,7 +548,8 @@ void update_benchmark(const char *fmt, ...)
     }
 }
 
-static void print_report(int is_last_report, int64_t timer_start, int64_t cur_time, int64_t pts)
+static void print_report(Scheduler *sch, int is_last_report,
+                         int64_t timer_start, int64_t cur_time, int64_t pts)
 {
     AVBPrint buf, buf_script;
     int64_t total_size = of_filesize(output_files[0]);
@@ -578,7 +582,7 @@ static void print_report(int is_last_report, int64_t timer_start, int64_t cur_ti
 
     vid = 0;
     av_bprint_init(&buf, 0, AV_BPRINT_SIZE_AUTOMATIC);
-    av_bprint_init(&buf_script, 0, AV_BPRINT_SIZE_AUTOMATIC);
+    av_bprint_init(&buf_script, 0, AV_BPRINT_SIZE_UNLIMITED);
     for (OutputStream *ost = ost_iter(NULL); ost; ost = ost_iter(ost)) {
         const float q = ost->enc ? atomic_load(&ost->quality) / (float) FF_QP2LAMBDA : -1;
 
@@ -681,22 +685,57 @@ static void print_report(int is_last_report, int64_t timer_start, int64_t cur_ti
     av_bprint_finalize(&buf, NULL);
 
     if (progress_avio) {
+        if (sched_stats_filename) {
+            av_bprintf(&buf_script, "sched_stats=");
+            sch_print_stats(sch, &buf_script, 1);
+            av_bprintf(&buf_script, "\n");
+        }
         av_bprintf(&buf_script, "progress=%s\n",
                    is_last_report ? "end" : "continue");
         avio_write(progress_avio, buf_script.str,
                    FFMIN(buf_script.len, buf_script.size - 1));
         avio_flush(progress_avio);
-        av_bprint_finalize(&buf_script, NULL);
         if (is_last_report) {
             if ((ret = avio_closep(&progress_avio)) < 0)
                 av_log(NULL, AV_LOG_ERROR,
                        "Error closing progress log, loss of information possible: %s\n", av_err2str(ret));
         }
     }
+    av_bprint_finalize(&buf_script, NULL);
 
     first_report = 0;
 }
 
+static void write_sched_stats(Scheduler *sch)
+{
+    const char *url = strcmp(sched_stats_filename, "-") ? sched_stats_filename : "pipe:";
+    AVIOContext *avio = NULL;
+    AVBPrint buf;
+    int ret;
+
+    ret = avio_open2(&avio, url, AVIO_FLAG_WRITE, &int_cb, NULL);
+    if (ret < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Failed to open scheduler statistics URL "
+               "\"%s\": %s\n", url, av_err2str(ret));
+        return;
+    }
+
+    av_bprint_init(&buf, 0, AV_BPRINT_SIZE_UNLIMITED);
+    sch_print_stats(sch, &buf, 0);
+    av_bprintf(&buf, "\n");
+
+    if (av_bprint_is_complete(&buf))
+        avio_write(avio, buf.str, buf.len);
+    else
+        av_log(NULL, AV_LOG_ERROR, "Out of memory printing scheduler statistics\n");
+    av_bprint_finalize(&buf, NULL);
+
+    ret = avio_closep(&avio);
+    if (ret < 0)
+        av_log(NULL, AV_LOG_ERROR, "Error closing scheduler statistics file, "
+               "loss of information possible: %s\n", av_err2str(ret));
+}
+
 static void print_stream_maps(void)
 {
     av_log(NULL, AV_LOG_INFO, "Stream mapping:\n");
@@ -880,7 +919,7 @@ static int transcode(Scheduler *sch)
                 break;
 
         /* dump report by using the output first video and audio streams */
-        print_report(0, timer_start, cur_time, transcode_ts);
+        print_report(sch, 0, timer_start, cur_time, transcode_ts);
     }
 
     ret = sch_stop(sch, &transcode_ts);
@@ -893,8 +932,11 @@ static int transcode(Scheduler *sch)
 
     term_exit();
 
+    if (sched_stats_filename)
+        write_sched_stats(sch);
+
     /* dump report by using the first video and audio streams */
-    print_report(1, timer_start, av_gettime_relative(), transcode_ts);
+    print_report(sch, 1, timer_start, av_gettime_relative(), transcode_ts);
 
     return ret;
 }
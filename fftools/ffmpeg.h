@@ -176,6 +176,7 @@ typedef struct OptionsContext {
     SpecifierOptList hwaccel_output_formats;
     SpecifierOptList autorotate;
     SpecifierOptList apply_cropping;
+    SpecifierOptList gop_threads;
 
     /* output options */
     StreamMap *stream_maps;
@@ -227,6 +228,7 @@ typedef struct OptionsContext {
     SpecifierOptList copy_initial_nonkeyframes;
     SpecifierOptList copy_prior_start;
     SpecifierOptList filters;
+    SpecifierOptList filter_pipelines;
 #if FFMPEG_OPT_FILTER_SCRIPT
     SpecifierOptList filter_scripts;
 #endif
@@ -248,6 +250,8 @@ typedef struct OptionsContext {
     SpecifierOptList enc_time_bases;
     SpecifierOptList autoscale;
     SpecifierOptList bits_per_raw_sample;
+    SpecifierOptList enc_batch;
+    SpecifierOptList enc_batch_latency;
     SpecifierOptList enc_stats_pre;
     SpecifierOptList enc_stats_post;
     SpecifierOptList mux_stats;
@@ -342,6 +346,10 @@ typedef struct OutputFilterOptions {
     // for simple filtergraphs only, view specifier passed
     // along to the decoder
     const ViewSpecifier *vs;
+
+    // for simple filtergraphs only, how to split the filtergraph
+    // into stages running in separate threads
+    const char         *pipeline;
 } OutputFilterOptions;
 
 typedef struct InputFilter {
@@ -413,6 +421,10 @@ typedef struct DecoderOpts {
     // Either forced (when DECODER_FLAG_FRAMERATE_FORCED is set) or
     // estimated (otherwise) video framerate.
     AVRational                  framerate;
+
+    // number of keyframe-delimited segments of a video stream to decode
+    // in parallel, each by its own decoder instance; 0 to disable
+    int                         gop_threads;
 } DecoderOpts;
 
 typedef struct Decoder {
@@ -707,6 +719,11 @@ extern Decoder     **decoders;
 extern int        nb_decoders;
 
 extern char *vstats_filename;
+extern char *sched_stats_filename;
+extern char *resume_filename;
+extern int64_t resume_time;
+extern int64_t resume_input_pos;
+extern int resume_finished;
 
 extern float dts_delta_threshold;
 extern float dts_error_threshold;
@@ -730,9 +747,14 @@ extern AVIOContext *progress_avio;
 extern float max_error_rate;
 
 extern char *filter_nbthreads;
+extern char *filter_thread_type;
+extern int filter_band_height;
+extern int filter_fuse_pointwise;
+extern int filter_format_cost;
 extern int filter_complex_nbthreads;
 extern int vstats_version;
 extern int auto_conversion_filters;
+extern int scale_cascade;
 
 extern const AVIOInterruptCB int_cb;
 
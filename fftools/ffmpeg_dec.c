@@ -22,6 +22,7 @@
 #include "libavutil/avstring.h"
 #include "libavutil/dict.h"
 #include "libavutil/error.h"
+#include "libavutil/fifo.h"
 #include "libavutil/log.h"
 #include "libavutil/mem.h"
 #include "libavutil/opt.h"
@@ -36,6 +37,60 @@
 
 #include "ffmpeg.h"
 
+// maximum number of decoded frames a segment holds before its worker waits
+// for them to be sent downstream
+#define GOP_SEGMENT_FRAMES 16
+
+/**
+ * Stream properties that a decoder may only learn while decoding, e.g. the
+ * frame rate from H.264 SPS timing info. The workers report them so the
+ * decoder thread can update its own codec context, which it reads when
+ * post-processing the frames.
+ */
+typedef struct DecStreamProps {
+    AVRational              framerate;
+    AVRational              sample_aspect_ratio;
+    int                     width;
+    int                     height;
+    enum AVPixelFormat      pix_fmt;
+    enum AVFieldOrder       field_order;
+    enum AVColorRange       color_range;
+    enum AVColorPrimaries   color_primaries;
+    enum AVColorTransferCharacteristic color_trc;
+    enum AVColorSpace       colorspace;
+    enum AVChromaLocation   chroma_sample_location;
+    int                     profile;
+    int                     level;
+    int                     bits_per_raw_sample;
+} DecStreamProps;
+
+/**
+ * A run of packets starting with a keyframe, decoded independently of the
+ * other segments by one of the GOP threads.
+ */
+typedef struct DecSegment {
+    // AVPacket*; written by the decoder thread until the segment is
+    // submitted, then owned by the worker decoding it
+    AVFifo             *pkts;
+    // AVFrame*; decoded frames not yet sent downstream, at most
+    // GOP_SEGMENT_FRAMES
+    AVFifo             *frames;
+    // properties of the worker's decoder when it queued its latest frame
+    DecStreamProps      props;
+    // the worker is done with the segment
+    int                 done;
+    int                 ret;
+    uint64_t            decode_errors;
+} DecSegment;
+
+typedef struct GopWorker {
+    struct DecoderPriv *dp;
+    AVCodecContext     *dec_ctx;
+    pthread_t           thread;
+    // the segment being decoded
+    DecSegment         *seg;
+} GopWorker;
+
 typedef struct DecoderPriv {
     Decoder             dec;
 
@@ -74,6 +129,8 @@ typedef struct DecoderPriv {
 
     Scheduler          *sch;
     unsigned            sch_idx;
+    // the thread count is taken from the scheduler's thread budget
+    int                 threads_budget;
 
     // this decoder's index in decoders or -1
     int                 index;
@@ -102,6 +159,34 @@ typedef struct DecoderPriv {
         AVDictionary       *opts;
         const AVCodec      *codec;
     } standalone_init;
+
+    // Parallel decoding of keyframe-delimited segments. The decoder thread
+    // collects the packets of a segment, hands it to the first idle worker
+    // and sends the decoded frames downstream in segment order.
+    struct {
+        GopWorker          *workers;
+        int              nb_workers;
+        // number of worker threads started
+        int                 running;
+
+        // a ring of nb_workers + 1 segments; the counters below are never
+        // wrapped, the segment being collected is segs[submitted % nb_segs]
+        DecSegment         *segs;
+        unsigned         nb_segs;
+        uint64_t            output;
+        uint64_t            started;
+        uint64_t            submitted;
+        int                 terminate;
+
+        // protects all of the above while the workers are running
+        pthread_mutex_t     lock;
+        // signalled when a segment is submitted or on termination
+        pthread_cond_t      cond_submit;
+        // signalled when a worker outputs a frame or finishes a segment
+        pthread_cond_t      cond_output;
+        // signalled when a frame is taken from a segment or on termination
+        pthread_cond_t      cond_frames;
+    } gop;
 } DecoderPriv;
 
 static DecoderPriv *dp_from_dec(Decoder *d)
@@ -115,6 +200,37 @@ typedef struct DecThreadContext {
     AVPacket        *pkt;
 } DecThreadContext;
 
+static void gop_free(DecoderPriv *dp)
+{
+    for (int i = 0; i < dp->gop.nb_workers; i++)
+        avcodec_free_context(&dp->gop.workers[i].dec_ctx);
+    av_freep(&dp->gop.workers);
+
+    for (unsigned i = 0; i < dp->gop.nb_segs; i++) {
+        DecSegment *seg = &dp->gop.segs[i];
+        AVPacket *pkt;
+        AVFrame *frame;
+
+        while (seg->pkts && av_fifo_read(seg->pkts, &pkt, 1) >= 0)
+            av_packet_free(&pkt);
+        while (seg->frames && av_fifo_read(seg->frames, &frame, 1) >= 0)
+            av_frame_free(&frame);
+        av_fifo_freep2(&seg->pkts);
+        av_fifo_freep2(&seg->frames);
+    }
+    av_freep(&dp->gop.segs);
+
+    if (dp->gop.nb_segs) {
+        pthread_mutex_destroy(&dp->gop.lock);
+        pthread_cond_destroy(&dp->gop.cond_submit);
+        pthread_cond_destroy(&dp->gop.cond_output);
+        pthread_cond_destroy(&dp->gop.cond_frames);
+    }
+
+    dp->gop.nb_workers = 0;
+    dp->gop.nb_segs    = 0;
+}
+
 void dec_free(Decoder **pdec)
 {
     Decoder *dec = *pdec;
@@ -125,6 +241,7 @@ void dec_free(Decoder **pdec)
     dp = dp_from_dec(dec);
 
     avcodec_free_context(&dp->dec_ctx);
+    gop_free(dp);
 
     av_frame_free(&dp->frame);
     av_frame_free(&dp->frame_tmp_ref);
@@ -694,33 +811,70 @@ static int transcode_subtitles(DecoderPriv *dp, const AVPacket *pkt,
     return process_subtitle(dp, frame);
 }
 
-static int packet_decode(DecoderPriv *dp, AVPacket *pkt, AVFrame *frame)
+/* Send a decoded frame downstream; must be called in decoding order. */
+static int frame_send(DecoderPriv *dp, AVFrame *frame)
 {
-    AVCodecContext *dec = dp->dec_ctx;
-    const char *type_desc = av_get_media_type_string(dec->codec_type);
+    FrameData *fd;
+    unsigned outputs_mask = 1;
     int ret;
 
-    if (dec->codec_type == AVMEDIA_TYPE_SUBTITLE)
-        return transcode_subtitles(dp, pkt, frame);
+    fd = frame_data(frame);
+    if (!fd)
+        return AVERROR(ENOMEM);
+    fd->dec.frame_num = dp->dec.frames_decoded;
 
-    // With fate-indeo3-2, we're getting 0-sized packets before EOF for some
-    // reason. This seems like a semi-critical bug. Don't trigger EOF, and
-    // skip the packet.
-    if (pkt && pkt->size == 0)
-        return 0;
+    if (dp->dec_ctx->codec_type == AVMEDIA_TYPE_AUDIO) {
+        dp->dec.samples_decoded += frame->nb_samples;
 
-    if (pkt && (dp->flags & DECODER_FLAG_TS_UNRELIABLE)) {
-        pkt->pts = AV_NOPTS_VALUE;
-        pkt->dts = AV_NOPTS_VALUE;
+        audio_ts_process(dp, frame);
+    } else {
+        ret = video_frame_process(dp, frame, &outputs_mask);
+        if (ret < 0) {
+            av_log(dp, AV_LOG_FATAL,
+                   "Error while processing the decoded data\n");
+            return ret;
+        }
     }
 
-    if (pkt) {
-        FrameData *fd = packet_data(pkt);
-        if (!fd)
-            return AVERROR(ENOMEM);
-        fd->wallclock[LATENCY_PROBE_DEC_PRE] = av_gettime_relative();
+    dp->dec.frames_decoded++;
+
+    for (int i = 0; i < stdc_count_ones(outputs_mask); i++) {
+        AVFrame *to_send = frame;
+        int pos;
+
+        av_assert0(outputs_mask);
+        pos = stdc_trailing_zeros(outputs_mask);
+        outputs_mask &= ~(1U << pos);
+
+        // this is not the last output and sch_dec_send() consumes the frame
+        // given to it, so make a temporary reference
+        if (outputs_mask) {
+            to_send = dp->frame_tmp_ref;
+            ret = av_frame_ref(to_send, frame);
+            if (ret < 0)
+                return ret;
+        }
+
+        ret = sch_dec_send(dp->sch, dp->sch_idx, pos, to_send);
+        if (ret < 0) {
+            av_frame_unref(to_send);
+            return ret == AVERROR_EOF ? AVERROR_EXIT : ret;
+        }
     }
 
+    return 0;
+}
+
+/* Feed a packet (or EOF, when pkt is NULL) to the given decoder context and
+ * pass all the frames it returns to frame_out(). */
+static int decode_ctx(DecoderPriv *dp, AVCodecContext *dec, AVPacket *pkt,
+                      AVFrame *frame, uint64_t *decode_errors,
+                      int (*frame_out)(void *opaque, AVFrame *frame),
+                      void *opaque)
+{
+    const char *type_desc = av_get_media_type_string(dec->codec_type);
+    int ret;
+
     ret = avcodec_send_packet(dec, pkt);
     if (ret < 0 && !(ret == AVERROR_EOF && !pkt)) {
         // In particular, we don't expect AVERROR(EAGAIN), because we read all
@@ -734,7 +888,7 @@ static int packet_decode(DecoderPriv *dp, AVPacket *pkt, AVFrame *frame)
                pkt ? "packet" : "EOF", av_err2str(ret));
 
         if (ret != AVERROR_EOF) {
-            dp->dec.decode_errors++;
+            (*decode_errors)++;
             if (!exit_on_error)
                 ret = 0;
         }
@@ -744,7 +898,6 @@ static int packet_decode(DecoderPriv *dp, AVPacket *pkt, AVFrame *frame)
 
     while (1) {
         FrameData *fd;
-        unsigned outputs_mask = 1;
 
         av_frame_unref(frame);
 
@@ -759,7 +912,7 @@ static int packet_decode(DecoderPriv *dp, AVPacket *pkt, AVFrame *frame)
             return ret;
         } else if (ret < 0) {
             av_log(dp, AV_LOG_ERROR, "Decoding error: %s\n", av_err2str(ret));
-            dp->dec.decode_errors++;
+            (*decode_errors)++;
 
             if (exit_on_error)
                 return ret;
@@ -781,56 +934,349 @@ static int packet_decode(DecoderPriv *dp, AVPacket *pkt, AVFrame *frame)
         }
         fd->dec.pts                 = frame->pts;
         fd->dec.tb                  = dec->pkt_timebase;
-        fd->dec.frame_num           = dec->frame_num - 1;
         fd->bits_per_raw_sample     = dec->bits_per_raw_sample;
 
         fd->wallclock[LATENCY_PROBE_DEC_POST] = av_gettime_relative();
 
         frame->time_base = dec->pkt_timebase;
 
-        if (dec->codec_type == AVMEDIA_TYPE_AUDIO) {
-            dp->dec.samples_decoded += frame->nb_samples;
+        ret = frame_out(opaque, frame);
+        if (ret < 0)
+            return ret;
+    }
+}
+
+static int frame_send_cb(void *opaque, AVFrame *frame)
+{
+    return frame_send(opaque, frame);
+}
 
-            audio_ts_process(dp, frame);
-        } else {
-            ret = video_frame_process(dp, frame, &outputs_mask);
-            if (ret < 0) {
-                av_log(dp, AV_LOG_FATAL,
-                       "Error while processing the decoded data\n");
-                return ret;
-            }
+static void gop_props_get(DecStreamProps *props, const AVCodecContext *dec)
+{
+    props->framerate              = dec->framerate;
+    props->sample_aspect_ratio    = dec->sample_aspect_ratio;
+    props->width                  = dec->width;
+    props->height                 = dec->height;
+    props->pix_fmt                = dec->pix_fmt;
+    props->field_order            = dec->field_order;
+    props->color_range            = dec->color_range;
+    props->color_primaries        = dec->color_primaries;
+    props->color_trc              = dec->color_trc;
+    props->colorspace             = dec->colorspace;
+    props->chroma_sample_location = dec->chroma_sample_location;
+    props->profile                = dec->profile;
+    props->level                  = dec->level;
+    props->bits_per_raw_sample    = dec->bits_per_raw_sample;
+}
+
+static void gop_props_set(AVCodecContext *dec, const DecStreamProps *props)
+{
+    dec->framerate              = props->framerate;
+    dec->sample_aspect_ratio    = props->sample_aspect_ratio;
+    dec->width                  = props->width;
+    dec->height                 = props->height;
+    dec->pix_fmt                = props->pix_fmt;
+    dec->field_order            = props->field_order;
+    dec->color_range            = props->color_range;
+    dec->color_primaries        = props->color_primaries;
+    dec->color_trc              = props->color_trc;
+    dec->colorspace             = props->colorspace;
+    dec->chroma_sample_location = props->chroma_sample_location;
+    dec->profile                = props->profile;
+    dec->level                  = props->level;
+    dec->bits_per_raw_sample    = props->bits_per_raw_sample;
+}
+
+static int gop_frame_queue(void *opaque, AVFrame *frame)
+{
+    GopWorker   *w = opaque;
+    DecoderPriv *dp = w->dp;
+    AVFrame *queued;
+    int ret;
+
+    queued = av_frame_alloc();
+    if (!queued)
+        return AVERROR(ENOMEM);
+    av_frame_move_ref(queued, frame);
+
+    pthread_mutex_lock(&dp->gop.lock);
+    // the decoder thread drains the segments in order, so a full segment
+    // other than the oldest one waits until the ones before it are sent
+    while (!dp->gop.terminate &&
+           av_fifo_can_read(w->seg->frames) >= GOP_SEGMENT_FRAMES)
+        pthread_cond_wait(&dp->gop.cond_frames, &dp->gop.lock);
+    if (dp->gop.terminate) {
+        ret = AVERROR_EXIT;
+    } else {
+        gop_props_get(&w->seg->props, w->dec_ctx);
+        ret = av_fifo_write(w->seg->frames, &queued, 1);
+        if (ret >= 0)
+            pthread_cond_signal(&dp->gop.cond_output);
+    }
+    pthread_mutex_unlock(&dp->gop.lock);
+
+    if (ret < 0)
+        av_frame_free(&queued);
+    return ret;
+}
+
+static int gop_decode_segment(GopWorker *w, AVFrame *frame)
+{
+    DecSegment *seg = w->seg;
+    AVPacket *pkt;
+    int ret = 0;
+
+    while (av_fifo_read(seg->pkts, &pkt, 1) >= 0) {
+        if (ret >= 0)
+            ret = decode_ctx(w->dp, w->dec_ctx, pkt, frame, &seg->decode_errors,
+                             gop_frame_queue, w);
+        av_packet_free(&pkt);
+    }
+
+    // drain the decoder at the end of the segment, leaving it ready for
+    // the next one
+    if (ret >= 0) {
+        ret = decode_ctx(w->dp, w->dec_ctx, NULL, frame, &seg->decode_errors,
+                         gop_frame_queue, w);
+        if (ret == AVERROR_EOF)
+            ret = 0;
+    }
+    av_frame_unref(frame);
+    avcodec_flush_buffers(w->dec_ctx);
+
+    return ret;
+}
+
+static void *gop_worker_thread(void *arg)
+{
+    GopWorker   *w = arg;
+    DecoderPriv *dp = w->dp;
+    AVFrame *frame;
+    int ret = 0;
+
+    frame = av_frame_alloc();
+    if (!frame)
+        ret = AVERROR(ENOMEM);
+
+    pthread_mutex_lock(&dp->gop.lock);
+    while (1) {
+        while (!dp->gop.terminate && dp->gop.started == dp->gop.submitted)
+            pthread_cond_wait(&dp->gop.cond_submit, &dp->gop.lock);
+        if (dp->gop.terminate)
+            break;
+
+        w->seg = &dp->gop.segs[dp->gop.started++ % dp->gop.nb_segs];
+        pthread_mutex_unlock(&dp->gop.lock);
+
+        if (ret >= 0)
+            ret = gop_decode_segment(w, frame);
+
+        pthread_mutex_lock(&dp->gop.lock);
+        w->seg->done = 1;
+        w->seg->ret  = ret;
+        pthread_cond_signal(&dp->gop.cond_output);
+    }
+    pthread_mutex_unlock(&dp->gop.lock);
+
+    av_frame_free(&frame);
+
+    return NULL;
+}
+
+static int gop_start(DecoderPriv *dp)
+{
+    int ret;
+
+    // get_format()/get_buffer() are not installed on the workers, so they
+    // can only output the base view
+    if (dp->multiview_user_config || dp->nb_views_requested > 1 ||
+        (dp->nb_views_requested == 1 &&
+         (dp->views_requested[0].vs.type != VIEW_SPECIFIER_TYPE_IDX ||
+          dp->views_requested[0].vs.val))) {
+        av_log(dp, AV_LOG_WARNING, "Multiview decoding is not supported "
+               "with GOP threads, decoding serially\n");
+        gop_free(dp);
+        return 0;
+    }
+
+    for (int i = 0; i < dp->gop.nb_workers; i++) {
+        ret = pthread_create(&dp->gop.workers[i].thread, NULL,
+                             gop_worker_thread, &dp->gop.workers[i]);
+        if (ret) {
+            av_log(dp, AV_LOG_ERROR, "pthread_create() failed: %s\n",
+                   strerror(ret));
+            return AVERROR(ret);
         }
+        dp->gop.running++;
+    }
 
-        dp->dec.frames_decoded++;
+    av_log(dp, AV_LOG_VERBOSE, "Decoding keyframe-delimited segments in "
+           "%d threads\n", dp->gop.nb_workers);
 
-        for (int i = 0; i < stdc_count_ones(outputs_mask); i++) {
-            AVFrame *to_send = frame;
-            int pos;
+    return 0;
+}
+
+static void gop_stop(DecoderPriv *dp)
+{
+    if (!dp->gop.running)
+        return;
 
-            av_assert0(outputs_mask);
-            pos = stdc_trailing_zeros(outputs_mask);
-            outputs_mask &= ~(1U << pos);
+    pthread_mutex_lock(&dp->gop.lock);
+    dp->gop.terminate = 1;
+    pthread_cond_broadcast(&dp->gop.cond_submit);
+    pthread_cond_broadcast(&dp->gop.cond_frames);
+    pthread_mutex_unlock(&dp->gop.lock);
 
-            // this is not the last output and sch_dec_send() consumes the frame
-            // given to it, so make a temporary reference
-            if (outputs_mask) {
-                to_send = dp->frame_tmp_ref;
-                ret = av_frame_ref(to_send, frame);
-                if (ret < 0)
-                    return ret;
-            }
+    for (int i = 0; i < dp->gop.running; i++)
+        pthread_join(dp->gop.workers[i].thread, NULL);
+    dp->gop.running = 0;
+}
 
-            ret = sch_dec_send(dp->sch, dp->sch_idx, pos, to_send);
-            if (ret < 0) {
-                av_frame_unref(to_send);
-                return ret == AVERROR_EOF ? AVERROR_EXIT : ret;
-            }
+enum GopOutputMode {
+    // only send what is already decoded
+    GOP_OUTPUT_AVAILABLE,
+    // until there is a free segment to collect packets into
+    GOP_OUTPUT_FREE_SEGMENT,
+    // all submitted segments
+    GOP_OUTPUT_ALL,
+};
+
+/* Send the decoded frames downstream in segment order. */
+static int gop_output(DecoderPriv *dp, enum GopOutputMode mode)
+{
+    int ret = 0;
+
+    pthread_mutex_lock(&dp->gop.lock);
+
+    while (dp->gop.output < dp->gop.submitted) {
+        DecSegment *seg = &dp->gop.segs[dp->gop.output % dp->gop.nb_segs];
+        AVFrame *frame;
+
+        if (av_fifo_read(seg->frames, &frame, 1) >= 0) {
+            // frame_send() reads the stream properties from dec_ctx, which
+            // is only accessed by this thread
+            gop_props_set(dp->dec_ctx, &seg->props);
+            pthread_cond_broadcast(&dp->gop.cond_frames);
+            pthread_mutex_unlock(&dp->gop.lock);
+
+            ret = frame_send(dp, frame);
+            av_frame_free(&frame);
+            if (ret < 0)
+                return ret;
+
+            pthread_mutex_lock(&dp->gop.lock);
+            continue;
+        }
+
+        if (seg->done) {
+            dp->dec.decode_errors += seg->decode_errors;
+            ret = seg->ret;
+
+            seg->done          = 0;
+            seg->ret           = 0;
+            seg->decode_errors = 0;
+            dp->gop.output++;
+
+            if (ret < 0)
+                break;
+            continue;
         }
+
+        if (mode == GOP_OUTPUT_AVAILABLE ||
+            (mode == GOP_OUTPUT_FREE_SEGMENT &&
+             dp->gop.submitted - dp->gop.output < dp->gop.nb_segs))
+            break;
+
+        pthread_cond_wait(&dp->gop.cond_output, &dp->gop.lock);
     }
+
+    pthread_mutex_unlock(&dp->gop.lock);
+
+    return ret;
 }
 
+static void gop_submit(DecoderPriv *dp)
+{
+    DecSegment *seg = &dp->gop.segs[dp->gop.submitted % dp->gop.nb_segs];
+
+    if (!av_fifo_can_read(seg->pkts))
+        return;
+
+    pthread_mutex_lock(&dp->gop.lock);
+    dp->gop.submitted++;
+    pthread_cond_signal(&dp->gop.cond_submit);
+    pthread_mutex_unlock(&dp->gop.lock);
+}
+
+static int gop_decode(DecoderPriv *dp, AVPacket *pkt)
+{
+    DecSegment *seg;
+    AVPacket *queued;
+    int ret;
+
+    if (!pkt) {
+        gop_submit(dp);
+        ret = gop_output(dp, GOP_OUTPUT_ALL);
+        return ret < 0 ? ret : AVERROR_EOF;
+    }
+
+    if (pkt->flags & AV_PKT_FLAG_KEY)
+        gop_submit(dp);
+
+    ret = gop_output(dp, GOP_OUTPUT_FREE_SEGMENT);
+    if (ret < 0)
+        return ret;
+
+    queued = av_packet_alloc();
+    if (!queued)
+        return AVERROR(ENOMEM);
+    av_packet_move_ref(queued, pkt);
+
+    // the segment being collected is not accessed by the workers
+    seg = &dp->gop.segs[dp->gop.submitted % dp->gop.nb_segs];
+    ret = av_fifo_write(seg->pkts, &queued, 1);
+    if (ret < 0) {
+        av_packet_free(&queued);
+        return ret;
+    }
+
+    return gop_output(dp, GOP_OUTPUT_AVAILABLE);
+}
+
+static int packet_decode(DecoderPriv *dp, AVPacket *pkt, AVFrame *frame)
+{
+    AVCodecContext *dec = dp->dec_ctx;
+
+    if (dec->codec_type == AVMEDIA_TYPE_SUBTITLE)
+        return transcode_subtitles(dp, pkt, frame);
+
+    // With fate-indeo3-2, we're getting 0-sized packets before EOF for some
+    // reason. This seems like a semi-critical bug. Don't trigger EOF, and
+    // skip the packet.
+    if (pkt && pkt->size == 0)
+        return 0;
+
+    if (pkt && (dp->flags & DECODER_FLAG_TS_UNRELIABLE)) {
+        pkt->pts = AV_NOPTS_VALUE;
+        pkt->dts = AV_NOPTS_VALUE;
+    }
+
+    if (pkt) {
+        FrameData *fd = packet_data(pkt);
+        if (!fd)
+            return AVERROR(ENOMEM);
+        fd->wallclock[LATENCY_PROBE_DEC_PRE] = av_gettime_relative();
+    }
+
+    if (dp->gop.running)
+        return gop_decode(dp, pkt);
+
+    return decode_ctx(dp, dec, pkt, frame, &dp->dec.decode_errors,
+                      frame_send_cb, dp);
+}
 static int dec_open(DecoderPriv *dp, AVDictionary **dec_opts,
                     const DecoderOpts *o, AVFrame *param_out);
+static int dec_codec_open(DecoderPriv *dp);
 
 static int dec_standalone_open(DecoderPriv *dp, const AVPacket *pkt)
 {
@@ -921,6 +1367,18 @@ static int decoder_thread(void *arg)
 
     dec_thread_set_name(dp);
 
+    if (dp->dec_ctx && !avcodec_is_open(dp->dec_ctx)) {
+        ret = dec_codec_open(dp);
+        if (ret < 0)
+            goto finish;
+    }
+
+    if (dp->gop.nb_workers) {
+        ret = gop_start(dp);
+        if (ret < 0)
+            goto finish;
+    }
+
     while (!input_status) {
         int flush_buffers, have_data;
 
@@ -1018,6 +1476,7 @@ static int decoder_thread(void *arg)
     }
 
 finish:
+    gop_stop(dp);
     dec_thread_uninit(&dt);
 
     return ret;
@@ -1519,6 +1978,155 @@ static int hw_device_setup_for_decode(DecoderPriv *dp,
     return 0;
 }
 
+static int gop_init(DecoderPriv *dp, const AVCodec *codec,
+                    const DecoderOpts *o, const AVDictionary *dec_opts)
+{
+    const AVCodecDescriptor *desc = avcodec_descriptor_get(codec->id);
+    int ret;
+
+    if (dp->hwaccel_id != HWACCEL_NONE) {
+        av_log(dp, AV_LOG_WARNING, "GOP threads cannot be used with hardware "
+               "accelerated decoding, decoding serially\n");
+        return 0;
+    }
+    if (!desc || !(desc->props & AV_CODEC_PROP_INTRA_ONLY))
+        av_log(dp, AV_LOG_WARNING, "%s is not an intra-only codec, GOP threads "
+               "assume every keyframe starts a closed GOP\n", codec->name);
+
+    ret = pthread_mutex_init(&dp->gop.lock, NULL);
+    if (ret)
+        return AVERROR(ret);
+    ret = pthread_cond_init(&dp->gop.cond_submit, NULL);
+    if (ret) {
+        pthread_mutex_destroy(&dp->gop.lock);
+        return AVERROR(ret);
+    }
+    ret = pthread_cond_init(&dp->gop.cond_output, NULL);
+    if (ret) {
+        pthread_cond_destroy(&dp->gop.cond_submit);
+        pthread_mutex_destroy(&dp->gop.lock);
+        return AVERROR(ret);
+    }
+    ret = pthread_cond_init(&dp->gop.cond_frames, NULL);
+    if (ret) {
+        pthread_cond_destroy(&dp->gop.cond_output);
+        pthread_cond_destroy(&dp->gop.cond_submit);
+        pthread_mutex_destroy(&dp->gop.lock);
+        return AVERROR(ret);
+    }
+
+    // one segment for each worker and one being collected
+    dp->gop.segs = av_calloc(o->gop_threads + 1, sizeof(*dp->gop.segs));
+    if (!dp->gop.segs) {
+        pthread_cond_destroy(&dp->gop.cond_frames);
+        pthread_cond_destroy(&dp->gop.cond_output);
+        pthread_cond_destroy(&dp->gop.cond_submit);
+        pthread_mutex_destroy(&dp->gop.lock);
+        return AVERROR(ENOMEM);
+    }
+    dp->gop.nb_segs = o->gop_threads + 1;
+
+    for (unsigned i = 0; i < dp->gop.nb_segs; i++) {
+        DecSegment *seg = &dp->gop.segs[i];
+
+        seg->pkts   = av_fifo_alloc2(8, sizeof(AVPacket*), AV_FIFO_FLAG_AUTO_GROW);
+        seg->frames = av_fifo_alloc2(GOP_SEGMENT_FRAMES, sizeof(AVFrame*), 0);
+        if (!seg->pkts || !seg->frames)
+            return AVERROR(ENOMEM);
+    }
+
+    dp->gop.workers = av_calloc(o->gop_threads, sizeof(*dp->gop.workers));
+    if (!dp->gop.workers)
+        return AVERROR(ENOMEM);
+    dp->gop.nb_workers = o->gop_threads;
+
+    // the workers decode in threads of their own on top of the decoder
+    // thread, which the thread budget must leave room for
+    sch_threads_reserve(dp->sch, dp->gop.nb_workers);
+
+    for (int i = 0; i < dp->gop.nb_workers; i++) {
+        GopWorker *w = &dp->gop.workers[i];
+        AVDictionary *opts = NULL;
+
+        w->dp      = dp;
+        w->dec_ctx = avcodec_alloc_context3(codec);
+        if (!w->dec_ctx)
+            return AVERROR(ENOMEM);
+
+        ret = avcodec_parameters_to_context(w->dec_ctx, o->par);
+        if (ret < 0)
+            return ret;
+
+        w->dec_ctx->pkt_timebase = o->time_base;
+
+        // the parallelism comes from the workers, so unless asked otherwise
+        // each of them decodes in a single thread
+        ret = av_dict_copy(&opts, dec_opts, 0);
+        if (ret >= 0 && !av_dict_get(opts, "threads", NULL, 0))
+            ret = av_dict_set(&opts, "threads", "1", 0);
+        if (ret >= 0)
+            ret = av_opt_set_dict2(w->dec_ctx, &opts, AV_OPT_SEARCH_CHILDREN);
+        av_dict_free(&opts);
+        if (ret < 0)
+            return ret;
+
+        w->dec_ctx->flags |= AV_CODEC_FLAG_COPY_OPAQUE;
+        if (o->flags & DECODER_FLAG_BITEXACT)
+            w->dec_ctx->flags |= AV_CODEC_FLAG_BITEXACT;
+        w->dec_ctx->apply_cropping = 0;
+
+        ret = avcodec_open2(w->dec_ctx, codec, NULL);
+        if (ret < 0) {
+            av_log(dp, AV_LOG_ERROR, "Error while opening GOP decoder: %s\n",
+                   av_err2str(ret));
+            return ret;
+        }
+    }
+
+    return 0;
+}
+
+static int codec_open(void *arg)
+{
+    AVCodecContext *dec_ctx = arg;
+    return avcodec_open2(dec_ctx, dec_ctx->codec, NULL);
+}
+
+static int dec_codec_open(DecoderPriv *dp)
+{
+    int ret;
+
+    if (dp->threads_budget && !dp->dec_ctx->thread_count)
+        dp->dec_ctx->thread_count = sch_threads(dp->sch, SCH_DEC_IN(dp->sch_idx));
+
+    // the codec's worker threads inherit the CPUs of the decoding task
+    ret = sch_affinity_run(dp->sch, SCH_DEC_IN(dp->sch_idx),
+                           codec_open, dp->dec_ctx);
+    if (ret < 0) {
+        av_log(dp, AV_LOG_ERROR, "Error while opening decoder: %s\n",
+               av_err2str(ret));
+        return ret;
+    }
+
+    if (dp->dec_ctx->hw_device_ctx) {
+        // Update decoder extra_hw_frames option to account for the
+        // frames held in queues inside the ffmpeg utility.  This is
+        // called after avcodec_open2() because the user-set value of
+        // extra_hw_frames becomes valid in there, and we need to add
+        // this on top of it.
+        int extra_frames = DEFAULT_FRAME_THREAD_QUEUE_SIZE;
+        if (dp->dec_ctx->extra_hw_frames >= 0)
+            dp->dec_ctx->extra_hw_frames += extra_frames;
+        else
+            dp->dec_ctx->extra_hw_frames = extra_frames;
+    }
+
+    dp->dec.subtitle_header      = dp->dec_ctx->subtitle_header;
+    dp->dec.subtitle_header_size = dp->dec_ctx->subtitle_header_size;
+
+    return 0;
+}
+
 static int dec_open(DecoderPriv *dp, AVDictionary **dec_opts,
                     const DecoderOpts *o, AVFrame *param_out)
 {
@@ -1570,6 +2178,12 @@ static int dec_open(DecoderPriv *dp, AVDictionary **dec_opts,
     dp->dec_ctx->get_buffer2           = get_buffer;
     dp->dec_ctx->pkt_timebase          = o->time_base;
 
+    if (o->gop_threads && codec->type == AVMEDIA_TYPE_VIDEO) {
+        ret = gop_init(dp, codec, o, *dec_opts);
+        if (ret < 0)
+            return ret;
+    }
+
     if (!av_dict_get(*dec_opts, "threads", NULL, 0))
         av_dict_set(dec_opts, "threads", "auto", 0);
 
@@ -1599,28 +2213,21 @@ static int dec_open(DecoderPriv *dp, AVDictionary **dec_opts,
     dp->apply_cropping          = dp->dec_ctx->apply_cropping;
     dp->dec_ctx->apply_cropping = 0;
 
-    if ((ret = avcodec_open2(dp->dec_ctx, codec, NULL)) < 0) {
-        av_log(dp, AV_LOG_ERROR, "Error while opening decoder: %s\n",
-               av_err2str(ret));
-        return ret;
-    }
-
-    if (dp->dec_ctx->hw_device_ctx) {
-        // Update decoder extra_hw_frames option to account for the
-        // frames held in queues inside the ffmpeg utility.  This is
-        // called after avcodec_open2() because the user-set value of
-        // extra_hw_frames becomes valid in there, and we need to add
-        // this on top of it.
-        int extra_frames = DEFAULT_FRAME_THREAD_QUEUE_SIZE;
-        if (dp->dec_ctx->extra_hw_frames >= 0)
-            dp->dec_ctx->extra_hw_frames += extra_frames;
-        else
-            dp->dec_ctx->extra_hw_frames = extra_frames;
+    // the share of the thread budget is only known once all the tasks have
+    // been created, so in that case the codec is opened by the decoding thread;
+    // standalone decoders are opened there anyway and request their share
+    // in dec_create()
+    if (dp->index < 0 && !dp->dec_ctx->thread_count &&
+        (codec->capabilities & (AV_CODEC_CAP_FRAME_THREADS | AV_CODEC_CAP_SLICE_THREADS |
+                                AV_CODEC_CAP_OTHER_THREADS)))
+        dp->threads_budget = sch_threads_request(dp->sch, SCH_DEC_IN(dp->sch_idx), 1);
+
+    if (dp->index >= 0 || !dp->threads_budget) {
+        ret = dec_codec_open(dp);
+        if (ret < 0)
+            return ret;
     }
 
-    dp->dec.subtitle_header      = dp->dec_ctx->subtitle_header;
-    dp->dec.subtitle_header_size = dp->dec_ctx->subtitle_header_size;
-
     if (param_out) {
         if (dp->dec_ctx->codec_type == AVMEDIA_TYPE_AUDIO) {
             param_out->format               = dp->dec_ctx->sample_fmt;
@@ -1727,6 +2334,10 @@ int dec_create(const OptionsContext *o, const char *arg, Scheduler *sch)
     if (ret < 0)
         return ret;
 
+    // the codec is not known yet, so ask for a share of the thread budget
+    // in case it supports threading
+    dp->threads_budget = sch_threads_request(sch, SCH_DEC_IN(dp->sch_idx), 1);
+
     ret = av_dict_copy(&dp->standalone_init.opts, o->g->codec_opts, 0);
     if (ret < 0)
         return ret;
@@ -1380,6 +1380,14 @@ static int ist_add(const OptionsContext *o, Demuxer *d, AVStream *st, AVDictiona
             if (!ds->dec_opts.hwaccel_device)
                 return AVERROR(ENOMEM);
         }
+
+        opt_match_per_stream_int(ist, &o->gop_threads, ic, st,
+                                 &ds->dec_opts.gop_threads);
+        if (ds->dec_opts.gop_threads < 0) {
+            av_log(ist, AV_LOG_ERROR, "Invalid number of GOP threads: %d\n",
+                   ds->dec_opts.gop_threads);
+            return AVERROR(EINVAL);
+        }
     }
 
     ret = choose_decoder(o, ist, ic, st, ds->dec_opts.hwaccel_id,
@@ -1641,6 +1649,28 @@ int ifile_open(const OptionsContext *o, const char *filename, Scheduler *sch)
         av_log(d, AV_LOG_WARNING, "-t and -to cannot be used together; using -t.\n");
     }
 
+    if (resume_time) {
+        int64_t skip;
+
+        if (start_time_eof != AV_NOPTS_VALUE) {
+            av_log(d, AV_LOG_ERROR, "-sseof cannot be combined with -resume\n");
+            return AVERROR(EINVAL);
+        }
+        // skip what the checkpointed run has already transcoded; the input
+        // position recorded in the checkpoint already includes its -ss
+        if (resume_input_pos != AV_NOPTS_VALUE) {
+            skip       = resume_input_pos - (start_time == AV_NOPTS_VALUE ? 0 : start_time);
+            start_time = resume_input_pos;
+        } else {
+            skip       = resume_time;
+            start_time = (start_time == AV_NOPTS_VALUE ? 0 : start_time) + resume_time;
+        }
+        if (recording_time != INT64_MAX && (recording_time -= skip) <= 0) {
+            av_log(d, AV_LOG_ERROR, "Checkpoint lies beyond the end of the input\n");
+            return AVERROR(EINVAL);
+        }
+    }
+
     if (stop_time != INT64_MAX && recording_time == INT64_MAX) {
         int64_t start = start_time == AV_NOPTS_VALUE ? 0 : start_time;
         if (stop_time <= start) {
@@ -162,6 +162,12 @@ static int set_encoder_id(OutputFile *of, OutputStream *ost)
     return 0;
 }
 
+static int codec_open(void *arg)
+{
+    AVCodecContext *enc_ctx = arg;
+    return avcodec_open2(enc_ctx, enc_ctx->codec, NULL);
+}
+
 int enc_open(void *opaque, const AVFrame *frame)
 {
     OutputStream *ost = opaque;
@@ -319,7 +325,15 @@ int enc_open(void *opaque, const AVFrame *frame)
         return ret;
     }
 
-    if ((ret = avcodec_open2(ost->enc_ctx, enc, NULL)) < 0) {
+    // the thread count is automatic, use the share of the thread budget if any
+    if (!enc_ctx->thread_count)
+        enc_ctx->thread_count = sch_threads(e->sch, SCH_ENC(e->sch_idx));
+
+    // enc_open() runs in the filtering thread, so pin the codec's worker
+    // threads to the CPUs of the encoding task explicitly
+    ret = sch_affinity_run(e->sch, SCH_ENC(e->sch_idx),
+                           codec_open, ost->enc_ctx);
+    if (ret < 0) {
         if (ret != AVERROR_EXPERIMENTAL)
             av_log(ost, AV_LOG_ERROR, "Error while opening encoder - maybe "
                    "incorrect parameters such as bit_rate, rate, width or height.\n");
@@ -30,9 +30,12 @@
 #include "libavutil/avstring.h"
 #include "libavutil/bprint.h"
 #include "libavutil/channel_layout.h"
+#include "libavutil/cpu.h"
+#include "libavutil/eval.h"
 #include "libavutil/mem.h"
 #include "libavutil/opt.h"
 #include "libavutil/pixdesc.h"
+#include "libavutil/parseutils.h"
 #include "libavutil/pixfmt.h"
 #include "libavutil/samplefmt.h"
 #include "libavutil/time.h"
@@ -68,8 +71,19 @@ typedef struct FilterGraphPriv {
 
     Scheduler       *sch;
     unsigned         sch_idx;
+
+    // A pipelined simple filtergraph is split into a chain of stages, each
+    // running in its own thread. The first stage owns the following ones.
+    FilterGraph     *stage_next;
+    int              stage_idx;
+    // this stage's description followed by the remaining stages and the
+    // output constraints, used for negotiating the format at the cut
+    char            *stage_probe_desc;
 } FilterGraphPriv;
 
+// name of the filter marking the end of a stage in stage_probe_desc
+#define STAGE_CUT_NAME "null@ffmpeg_stage_cut"
+
 static FilterGraphPriv *fgp_from_fg(FilterGraph *fg)
 {
     return (FilterGraphPriv*)fg;
@@ -233,6 +247,11 @@ typedef struct OutputFilterPriv {
     int64_t                 next_pts;
     FPSConvContext          fps;
 
+    // end of the latest frame passed to the next stage of a pipeline, sent
+    // along with EOF when the sink did not report where the stream ended
+    int64_t                 stage_eof_pts;
+    AVRational              stage_eof_tb;
+
     unsigned                flags;
 } OutputFilterPriv;
 
@@ -552,6 +571,346 @@ static int graph_opts_apply(AVFilterGraphSegment *seg)
     return 0;
 }
 
+typedef struct CascadeRung {
+    AVFilterChain  *chain;
+    AVFilterParams *scale;
+    // output size, 0 if derived from the other dimension
+    int             w, h;
+} CascadeRung;
+
+static int cascade_rung_cmp_h(const void *a, const void *b)
+{
+    const CascadeRung *ra = a, *rb = b;
+    return FFDIFFSIGN(rb->h, ra->h);
+}
+
+static int cascade_rung_cmp_w(const void *a, const void *b)
+{
+    const CascadeRung *ra = a, *rb = b;
+    return FFDIFFSIGN(rb->w, ra->w);
+}
+
+/* Get the output size of a scale filter if it does not depend on its input,
+ * a dimension derived from the other one while keeping the aspect ratio
+ * is returned as 0. */
+static int cascade_rung_size(const AVDictionary *opts, int *w, int *h)
+{
+    const AVDictionaryEntry *e;
+    const char *dims[2][2] = { { "w", "width" }, { "h", "height" } };
+    int *vals[2] = { w, h };
+
+    e = av_dict_get(opts, "s", NULL, 0);
+    if (!e)
+        e = av_dict_get(opts, "size", NULL, 0);
+    if (e)
+        return av_parse_video_size(w, h, e->value);
+
+    for (int i = 0; i < 2; i++) {
+        double d;
+
+        e = av_dict_get(opts, dims[i][0], NULL, 0);
+        if (!e)
+            e = av_dict_get(opts, dims[i][1], NULL, 0);
+        // default is the input size
+        if (!e)
+            return AVERROR(EINVAL);
+
+        if (av_expr_parse_and_eval(&d, e->value, NULL, NULL, NULL, NULL,
+                                   NULL, NULL, NULL, 0, NULL) < 0 ||
+            d != (int)d)
+            return AVERROR(EINVAL);
+        *vals[i] = FFMAX((int)d, 0);
+    }
+
+    return *w || *h ? 0 : AVERROR(EINVAL);
+}
+
+static int cascade_opt_is_size(const char *key)
+{
+    static const char *const sizes[] = { "w", "width", "h", "height", "s", "size" };
+
+    for (int i = 0; i < FF_ARRAY_ELEMS(sizes); i++)
+        if (!strcmp(key, sizes[i]))
+            return 1;
+    return 0;
+}
+
+/* Check that two scale filters differ only in their output size, so that
+ * one can be fed from the other without changing what is done to the
+ * pixels, e.g. the conversion matrix, range, algorithm or interlacing. */
+static int cascade_opts_equal(const AVDictionary *a, const AVDictionary *b)
+{
+    const AVDictionary *dicts[2] = { a, b };
+
+    for (int i = 0; i < 2; i++) {
+        const AVDictionaryEntry *e = NULL;
+
+        while ((e = av_dict_iterate(dicts[i], e))) {
+            const AVDictionaryEntry *o;
+
+            if (cascade_opt_is_size(e->key))
+                continue;
+
+            o = av_dict_get(dicts[!i], e->key, NULL, 0);
+            if (!o || strcmp(o->value, e->value))
+                return 0;
+        }
+    }
+
+    return 1;
+}
+
+/* Copy the options of a scale filter other than its output size. */
+static int cascade_opts_copy(AVDictionary **dst, const AVDictionary *src)
+{
+    const AVDictionaryEntry *e = NULL;
+
+    while ((e = av_dict_iterate(src, e))) {
+        int ret;
+
+        if (cascade_opt_is_size(e->key))
+            continue;
+
+        ret = av_dict_set(dst, e->key, e->value, 0);
+        if (ret < 0)
+            return ret;
+    }
+
+    return 0;
+}
+
+/* Find the scale filter starting a chain that is the only consumer of the
+ * given label. */
+static int cascade_rung_find(AVFilterGraphSegment *seg, const char *label,
+                             CascadeRung *rung)
+{
+    int nb_in = 0, nb_out = 0;
+
+    rung->scale = NULL;
+
+    for (size_t i = 0; i < seg->nb_chains; i++) {
+        AVFilterChain *ch = seg->chains[i];
+
+        for (size_t j = 0; j < ch->nb_filters; j++) {
+            AVFilterParams *p = ch->filters[j];
+
+            for (unsigned k = 0; k < p->nb_outputs; k++)
+                nb_out += p->outputs[k]->label && !strcmp(p->outputs[k]->label, label);
+            for (unsigned k = 0; k < p->nb_inputs; k++) {
+                if (!p->inputs[k]->label || strcmp(p->inputs[k]->label, label))
+                    continue;
+
+                nb_in++;
+                if (!j && p->nb_inputs == 1 && p->filter_name &&
+                    !strcmp(p->filter_name, "scale")) {
+                    rung->chain = ch;
+                    rung->scale = p;
+                }
+            }
+        }
+    }
+
+    if (nb_in != 1 || nb_out != 1 || !rung->scale)
+        return AVERROR(EINVAL);
+
+    return cascade_rung_size(rung->scale->opts, &rung->w, &rung->h);
+}
+
+static int cascade_label_set(AVFilterPadParams *pad, const char *fmt, int idx)
+{
+    av_freep(&pad->label);
+    pad->label = av_asprintf(fmt, idx);
+    return pad->label ? 0 : AVERROR(ENOMEM);
+}
+
+static void cascade_params_free(AVFilterParams **pp)
+{
+    AVFilterParams *p = *pp;
+
+    if (!p)
+        return;
+
+    for (unsigned i = 0; i < p->nb_outputs; i++) {
+        av_freep(&p->outputs[i]->label);
+        av_freep(&p->outputs[i]);
+    }
+    av_freep(&p->outputs);
+    av_dict_free(&p->opts);
+    av_freep(&p->filter_name);
+    av_freep(pp);
+}
+
+static AVFilterParams *cascade_params_alloc(const char *name, unsigned nb_outputs)
+{
+    AVFilterParams *p = av_mallocz(sizeof(*p));
+
+    if (!p)
+        return NULL;
+
+    p->filter_name = av_strdup(name);
+    if (!p->filter_name)
+        goto fail;
+
+    if (nb_outputs) {
+        p->outputs = av_calloc(nb_outputs, sizeof(*p->outputs));
+        if (!p->outputs)
+            goto fail;
+        for (; p->nb_outputs < nb_outputs; p->nb_outputs++) {
+            p->outputs[p->nb_outputs] = av_mallocz(sizeof(*p->outputs[0]));
+            if (!p->outputs[p->nb_outputs])
+                goto fail;
+        }
+    }
+
+    return p;
+fail:
+    cascade_params_free(&p);
+    return NULL;
+}
+
+/* Turn a split feeding scale filters into a cascade, where each scale filter
+ * takes the output of the next larger one rather than the full size input. */
+static int cascade_split(void *logctx, AVFilterGraphSegment *seg,
+                         AVFilterParams *split, int *nb_labels)
+{
+    const AVDictionaryEntry *e = av_dict_get(split->opts, "outputs", NULL, 0);
+    int nb_rungs = e ? strtol(e->value, NULL, 0) : 2;
+    int (*cmp)(const void *, const void *) = cascade_rung_cmp_h;
+    CascadeRung *rungs;
+    int ret = 0;
+
+    if (nb_rungs < 2 || split->nb_outputs != nb_rungs ||
+        av_dict_count(split->opts) != !!e)
+        return 0;
+
+    rungs = av_calloc(nb_rungs, sizeof(*rungs));
+    if (!rungs)
+        return AVERROR(ENOMEM);
+
+    for (int i = 0; i < nb_rungs; i++) {
+        if (!split->outputs[i]->label ||
+            cascade_rung_find(seg, split->outputs[i]->label, &rungs[i]) < 0)
+            goto finish;
+
+        if (!rungs[i].h)
+            cmp = cascade_rung_cmp_w;
+
+        if (i && !cascade_opts_equal(rungs[0].scale->opts, rungs[i].scale->opts)) {
+            av_log(logctx, AV_LOG_VERBOSE, "Not cascading scale filters fed by "
+                   "a split, their options other than the size differ\n");
+            goto finish;
+        }
+    }
+
+    // order the rungs by the dimension all of them specify, the other one
+    // must not grow along the cascade
+    for (int i = 0; i < nb_rungs; i++)
+        if (!(cmp == cascade_rung_cmp_h ? rungs[i].h : rungs[i].w))
+            goto finish;
+    qsort(rungs, nb_rungs, sizeof(*rungs), cmp);
+    for (int i = 1; i < nb_rungs; i++)
+        if ((rungs[i].w && rungs[i - 1].w && rungs[i].w > rungs[i - 1].w) ||
+            (rungs[i].h && rungs[i - 1].h && rungs[i].h > rungs[i - 1].h))
+            goto finish;
+
+    // the split only feeds the largest rung now
+    for (int i = 1; i < nb_rungs; i++) {
+        av_freep(&split->outputs[i]->label);
+        av_freep(&split->outputs[i]);
+    }
+    split->nb_outputs = 1;
+    ret = av_dict_set(&split->opts, "outputs", "1", 0);
+    if (ret < 0)
+        goto finish;
+    ret = cascade_label_set(split->outputs[0], "ffmpeg_scale_cascade_%d", *nb_labels);
+    if (ret < 0)
+        goto finish;
+    ret = cascade_label_set(rungs[0].scale->inputs[0], "ffmpeg_scale_cascade_%d",
+                            (*nb_labels)++);
+    if (ret < 0)
+        goto finish;
+
+    /* Each rung but the last feeds the next one through a new split. Its own
+     * output goes through a scale filter with the same options but no size,
+     * so that formats required downstream of it are not forced upon the
+     * smaller rungs; that filter passes frames through when no conversion is
+     * needed. */
+    for (int i = 0; i < nb_rungs - 1; i++) {
+        AVFilterChain   *ch = rungs[i].chain;
+        AVFilterParams **filters, *split_rung, *conv;
+
+        filters = av_realloc_array(ch->filters, ch->nb_filters + 2, sizeof(*filters));
+        if (!filters) {
+            ret = AVERROR(ENOMEM);
+            goto finish;
+        }
+        ch->filters = filters;
+
+        split_rung = cascade_params_alloc("split", 2);
+        conv       = cascade_params_alloc("scale", 0);
+        if (!split_rung || !conv ||
+            av_dict_set(&split_rung->opts, "outputs", "2", 0) < 0 ||
+            cascade_opts_copy(&conv->opts, rungs[i].scale->opts) < 0) {
+            cascade_params_free(&split_rung);
+            cascade_params_free(&conv);
+            ret = AVERROR(ENOMEM);
+            goto finish;
+        }
+
+        ret = cascade_label_set(split_rung->outputs[1],
+                                "ffmpeg_scale_cascade_%d", *nb_labels);
+        if (ret >= 0)
+            ret = cascade_label_set(rungs[i + 1].scale->inputs[0],
+                                    "ffmpeg_scale_cascade_%d", *nb_labels);
+        if (ret < 0) {
+            cascade_params_free(&split_rung);
+            cascade_params_free(&conv);
+            goto finish;
+        }
+        (*nb_labels)++;
+
+        conv->outputs    = rungs[i].scale->outputs;
+        conv->nb_outputs = rungs[i].scale->nb_outputs;
+        rungs[i].scale->outputs    = NULL;
+        rungs[i].scale->nb_outputs = 0;
+
+        memmove(&filters[3], &filters[1], (ch->nb_filters - 1) * sizeof(*filters));
+        filters[1] = split_rung;
+        filters[2] = conv;
+        ch->nb_filters += 2;
+    }
+
+    av_log(logctx, AV_LOG_VERBOSE, "Cascading %d scale filters fed by a split\n",
+           nb_rungs);
+
+finish:
+    av_freep(&rungs);
+    return ret;
+}
+
+static int scale_cascade_apply(void *logctx, AVFilterGraphSegment *seg)
+{
+    int nb_labels = 0;
+
+    for (size_t i = 0; i < seg->nb_chains; i++) {
+        AVFilterChain *ch = seg->chains[i];
+
+        for (size_t j = 0; j < ch->nb_filters; j++) {
+            AVFilterParams *p = ch->filters[j];
+            int ret;
+
+            if (!p->filter_name || strcmp(p->filter_name, "split"))
+                continue;
+
+            ret = cascade_split(logctx, seg, p, &nb_labels);
+            if (ret < 0)
+                return ret;
+        }
+    }
+
+    return 0;
+}
+
 static int graph_parse(AVFilterGraph *graph, const char *desc,
                        AVFilterInOut **inputs, AVFilterInOut **outputs,
                        AVBufferRef *hw_device)
@@ -566,6 +925,12 @@ static int graph_parse(AVFilterGraph *graph, const char *desc,
     if (ret < 0)
         return ret;
 
+    if (scale_cascade) {
+        ret = scale_cascade_apply(graph, seg);
+        if (ret < 0)
+            goto fail;
+    }
+
     ret = avfilter_graph_segment_create_filters(seg, 0);
     if (ret < 0)
         goto fail;
@@ -652,6 +1017,7 @@ static OutputFilter *ofilter_alloc(FilterGraph *fg, enum AVMediaType type)
     ofp->color_space  = AVCOL_SPC_UNSPECIFIED;
     ofp->color_range  = AVCOL_RANGE_UNSPECIFIED;
     ofp->index        = fg->nb_outputs - 1;
+    ofp->stage_eof_pts = AV_NOPTS_VALUE;
 
     snprintf(ofp->log_name, sizeof(ofp->log_name), "%co%d",
              av_get_media_type_string(type)[0], ofp->index);
@@ -1028,6 +1394,9 @@ void fg_free(FilterGraph **pfg)
     av_freep(&fg->outputs);
     av_freep(&fgp->graph_desc);
     av_freep(&fgp->nb_threads);
+    av_freep(&fgp->stage_probe_desc);
+
+    fg_free(&fgp->stage_next);
 
     av_frame_free(&fgp->frame);
     av_frame_free(&fgp->frame_enc);
@@ -1170,6 +1539,14 @@ int fg_create(FilterGraph **pfg, char *graph_desc, Scheduler *sch)
         goto fail;
     fgp->sch_idx = ret;
 
+    // only video filters use slice threading
+    for (int i = 0; i < fg->nb_outputs; i++) {
+        if (fg->outputs[i]->type == AVMEDIA_TYPE_VIDEO) {
+            sch_threads_request(sch, SCH_FILTER_IN(fgp->sch_idx, 0), 1);
+            break;
+        }
+    }
+
 fail:
     avfilter_inout_free(&inputs);
     avfilter_inout_free(&outputs);
@@ -1181,60 +1558,424 @@ fail:
     return 0;
 }
 
+/* Find the top-level filter separators in a filtergraph description.
+ * Returns the number of filters, or a negative error code if the description
+ * is not a single filterchain without link labels. */
+static int filterchain_split(const char *desc, size_t *seps)
+{
+    int quoted = 0, nb_seps = 0;
+
+    for (size_t i = 0; desc[i]; i++) {
+        if (quoted) {
+            if (desc[i] == '\'')
+                quoted = 0;
+        } else if (desc[i] == '\'') {
+            quoted = 1;
+        } else if (desc[i] == '\\') {
+            if (desc[i + 1])
+                i++;
+        } else if (desc[i] == '[' || desc[i] == ';') {
+            return AVERROR(EINVAL);
+        } else if (desc[i] == ',') {
+            if (seps)
+                seps[nb_seps] = i;
+            nb_seps++;
+        }
+    }
+
+    return nb_seps + 1;
+}
+
+static int pipeline_cuts(void *logctx, AVFilterGraph *graph,
+                         const char *spec, uint8_t *cut)
+{
+    const int nb_filters = graph->nb_filters;
+    int nb_stages, weight = 0, acc = 0, stage = 1;
+    char *end;
+
+    nb_stages = strtol(spec, &end, 10);
+    if (!strcmp(spec, "auto")) {
+        nb_stages = av_cpu_count();
+    } else if (*end || end == spec) {
+        // a list of filters to cut after
+        char *names = av_strdup(spec), *saveptr = NULL;
+        int ret = 0;
+
+        if (!names)
+            return AVERROR(ENOMEM);
+
+        for (char *name = av_strtok(names, "|", &saveptr); name;
+             name = av_strtok(NULL, "|", &saveptr)) {
+            int found = 0;
+
+            for (int i = 0; i < nb_filters - 1; i++) {
+                const AVFilterContext *f = graph->filters[i];
+                if (!strcmp(name, f->name) || !strcmp(name, f->filter->name))
+                    cut[i] = found = 1;
+            }
+            if (!found) {
+                av_log(logctx, AV_LOG_ERROR, "No filter '%s' to split the "
+                       "filtergraph after\n", name);
+                ret = AVERROR(EINVAL);
+                break;
+            }
+        }
+
+        av_free(names);
+        return ret;
+    } else if (nb_stages <= 0) {
+        av_log(logctx, AV_LOG_ERROR, "Invalid number of filtergraph stages: %s\n",
+               spec);
+        return AVERROR(EINVAL);
+    }
+
+    // balance the stages by the number of filters that touch frame data,
+    // metadata-only filters stay with the preceding stage
+    for (int i = 0; i < nb_filters; i++)
+        weight += !(graph->filters[i]->filter->flags & AVFILTER_FLAG_METADATA_ONLY);
+    nb_stages = FFMIN(nb_stages, weight);
+
+    for (int i = 0; i < nb_filters - 1 && stage < nb_stages; i++) {
+        if (graph->filters[i]->filter->flags & AVFILTER_FLAG_METADATA_ONLY)
+            continue;
+
+        acc++;
+        if ((int64_t)acc * nb_stages >= (int64_t)weight * stage) {
+            cut[i] = 1;
+            stage++;
+        }
+    }
+
+    return 0;
+}
+
+/* Split a simple filtergraph description into stages as requested by spec.
+ * On success *pstages is NULL if the filtergraph is not to be split. */
+static int pipeline_split(void *logctx, const char *graph_desc, const char *spec,
+                          char ***pstages, int *nb_stages)
+{
+    AVFilterInOut *inputs = NULL, *outputs = NULL;
+    AVFilterGraph *graph = NULL;
+    uint8_t *cut = NULL;
+    size_t *seps = NULL;
+    char **stages = NULL;
+    size_t start = 0;
+    int nb_filters, nb_cuts = 0, ret;
+
+    *pstages   = NULL;
+    *nb_stages = 0;
+
+    nb_filters = filterchain_split(graph_desc, NULL);
+    if (nb_filters < 0) {
+        av_log(logctx, AV_LOG_WARNING, "Filtergraph '%s' is not a single "
+               "filterchain, it will not be split into stages\n", graph_desc);
+        return 0;
+    } else if (nb_filters < 2)
+        return 0;
+
+    seps = av_malloc_array(nb_filters - 1, sizeof(*seps));
+    cut  = av_calloc(nb_filters, sizeof(*cut));
+    if (!seps || !cut) {
+        ret = AVERROR(ENOMEM);
+        goto fail;
+    }
+    filterchain_split(graph_desc, seps);
+
+    graph = avfilter_graph_alloc();
+    if (!graph) {
+        ret = AVERROR(ENOMEM);
+        goto fail;
+    }
+    graph->nb_threads = 1;
+
+    ret = graph_parse(graph, graph_desc, &inputs, &outputs, NULL);
+    if (ret < 0)
+        goto fail;
+    if (graph->nb_filters != nb_filters) {
+        ret = 0;
+        goto fail;
+    }
+
+    ret = pipeline_cuts(logctx, graph, spec, cut);
+    if (ret < 0)
+        goto fail;
+
+    for (int i = 0; i < nb_filters - 1; i++)
+        nb_cuts += cut[i];
+    if (!nb_cuts)
+        goto fail;
+
+    stages = av_calloc(nb_cuts + 1, sizeof(*stages));
+    if (!stages) {
+        ret = AVERROR(ENOMEM);
+        goto fail;
+    }
+
+    for (int i = 0; i < nb_filters; i++) {
+        size_t end = (i < nb_filters - 1) ? seps[i] : strlen(graph_desc);
+
+        if (i < nb_filters - 1 && !cut[i])
+            continue;
+
+        stages[*nb_stages] = av_strndup(graph_desc + start, end - start);
+        if (!stages[*nb_stages]) {
+            ret = AVERROR(ENOMEM);
+            goto fail;
+        }
+        av_log(logctx, AV_LOG_VERBOSE, "Filtergraph stage %d: %s\n",
+               *nb_stages, stages[*nb_stages]);
+
+        (*nb_stages)++;
+        start = end + 1;
+    }
+
+    *pstages = stages;
+    stages   = NULL;
+
+fail:
+    if (stages) {
+        for (int i = 0; i < *nb_stages; i++)
+            av_freep(&stages[i]);
+        av_freep(&stages);
+        *nb_stages = 0;
+    }
+    avfilter_inout_free(&inputs);
+    avfilter_inout_free(&outputs);
+    avfilter_graph_free(&graph);
+    av_freep(&seps);
+    av_freep(&cut);
+    return ret;
+}
+
+static int stage_bind(FilterGraph *fg_src, FilterGraph *fg, const char *name)
+{
+    FilterGraphPriv  *fgp_src = fgp_from_fg(fg_src);
+    FilterGraphPriv      *fgp = fgp_from_fg(fg);
+    OutputFilterPriv     *ofp = ofp_from_ofilter(fg_src->outputs[0]);
+    InputFilterPriv      *ifp = ifp_from_ifilter(fg->inputs[0]);
+
+    if (ifp->type != ofp->ofilter.type) {
+        av_log(fgp, AV_LOG_ERROR, "Tried to connect %s output to %s input\n",
+               av_get_media_type_string(ofp->ofilter.type),
+               av_get_media_type_string(ifp->type));
+        return AVERROR(EINVAL);
+    }
+
+    ofp->ofilter.bound = 1;
+    ofp->log_parent    = NULL;
+    av_strlcpy(ofp->log_name, fgp_src->log_name, sizeof(ofp->log_name));
+
+    ifp->bound         = 1;
+    ifp->type_src      = ifp->type;
+
+    ifp->opts.trim_start_us = AV_NOPTS_VALUE;
+    ifp->opts.trim_end_us   = INT64_MAX;
+
+    ofp->name          = av_strdup(name);
+    ifp->opts.name     = av_strdup(name);
+    ifp->opts.fallback = av_frame_alloc();
+    if (!ofp->name || !ifp->opts.name || !ifp->opts.fallback)
+        return AVERROR(ENOMEM);
+
+    return sch_connect(fgp->sch, SCH_FILTER_OUT(fgp_src->sch_idx, 0),
+                                 SCH_FILTER_IN(fgp->sch_idx, 0));
+}
+
+/* Make the stages of a pipelined filtergraph process the frames exactly as
+ * the unsplit filtergraph would. */
+static int pipeline_finalise(FilterGraph *fg, const char **desc, int nb_stages)
+{
+    FilterGraphPriv  *fgp_last;
+    OutputFilterPriv *ofp_last;
+    AVBPrint conv, args;
+    int ret = 0;
+
+    for (fgp_last = fgp_from_fg(fg); fgp_last->stage_next;
+         fgp_last = fgp_from_fg(fgp_last->stage_next))
+        ;
+    ofp_last = ofp_from_ofilter(fgp_last->fg.outputs[0]);
+
+    // the output constraints are applied to the whole filtergraph during
+    // format negotiation, so every stage has to take them into account
+    av_bprint_init(&conv, 0, AV_BPRINT_SIZE_UNLIMITED);
+    av_bprint_init(&args, 0, AV_BPRINT_SIZE_UNLIMITED);
+
+    if ((ofp_last->width || ofp_last->height) &&
+        (ofp_last->flags & OFILTER_FLAG_AUTOSCALE)) {
+        const AVDictionaryEntry *e = NULL;
+
+        av_bprintf(&args, "%d:%d", ofp_last->width, ofp_last->height);
+        while ((e = av_dict_iterate(ofp_last->sws_opts, e)))
+            av_bprintf(&args, ":%s=%s", e->key, e->value);
+
+        av_bprintf(&conv, ",scale=");
+        av_bprint_escape(&conv, args.str, "[],;", AV_ESCAPE_MODE_BACKSLASH, 0);
+        av_bprint_clear(&args);
+    }
+
+    choose_pix_fmts(ofp_last, &args);
+    choose_color_spaces(ofp_last, &args);
+    choose_color_ranges(ofp_last, &args);
+    if (args.len) {
+        av_bprintf(&conv, ",format=");
+        av_bprint_escape(&conv, args.str, "[],;", AV_ESCAPE_MODE_BACKSLASH, 0);
+    }
+
+    for (int i = 0; i < nb_stages - 1; i++, fg = fgp_from_fg(fg)->stage_next) {
+        FilterGraphPriv  *fgp = fgp_from_fg(fg);
+        OutputFilterPriv *ofp = ofp_from_ofilter(fg->outputs[0]);
+        AVBPrint probe;
+
+        fgp->disable_conversions = fgp_last->disable_conversions;
+
+        ret = av_dict_copy(&ofp->sws_opts, ofp_last->sws_opts, 0);
+        if (ret < 0)
+            goto fail;
+        ret = av_dict_copy(&ofp->swr_opts, ofp_last->swr_opts, 0);
+        if (ret < 0)
+            goto fail;
+
+        av_bprint_init(&probe, 0, AV_BPRINT_SIZE_UNLIMITED);
+        av_bprintf(&probe, "%s,"STAGE_CUT_NAME, desc[i]);
+        for (int j = i + 1; j < nb_stages; j++)
+            av_bprintf(&probe, ",%s", desc[j]);
+        av_bprintf(&probe, "%s", conv.str);
+
+        ret = av_bprint_finalize(&probe, &fgp->stage_probe_desc);
+        if (ret < 0)
+            goto fail;
+    }
+
+    if (!av_bprint_is_complete(&conv) || !av_bprint_is_complete(&args))
+        ret = AVERROR(ENOMEM);
+fail:
+    av_bprint_finalize(&conv, NULL);
+    av_bprint_finalize(&args, NULL);
+    return ret;
+}
+
 int init_simple_filtergraph(InputStream *ist, OutputStream *ost,
                             char *graph_desc,
                             Scheduler *sch, unsigned sched_idx_enc,
                             const OutputFilterOptions *opts)
 {
-    FilterGraph *fg;
+    FilterGraph *fg = NULL, **pfg = &ost->fg_simple;
     FilterGraphPriv *fgp;
-    int ret;
+    char **stages = NULL;
+    const char **stage_desc;
+    int nb_stages = 0, ret;
+
+    if (opts->pipeline) {
+        if (ost->type != AVMEDIA_TYPE_VIDEO) {
+            av_log(ost, AV_LOG_WARNING, "Only video filtergraphs can be "
+                   "split into stages, ignoring -filter_pipeline\n");
+        } else {
+            ret = pipeline_split(ost, graph_desc, opts->pipeline,
+                                 &stages, &nb_stages);
+            if (ret < 0) {
+                av_freep(&graph_desc);
+                return ret;
+            }
+        }
+    }
 
-    ret = fg_create(&ost->fg_simple, graph_desc, sch);
-    if (ret < 0)
-        return ret;
-    fg  = ost->fg_simple;
-    fgp = fgp_from_fg(fg);
+    if (stages) {
+        av_freep(&graph_desc);
+    } else {
+        stages    = &graph_desc;
+        nb_stages = 1;
+    }
 
-    fgp->is_simple = 1;
+    stage_desc = av_calloc(nb_stages, sizeof(*stage_desc));
+    if (!stage_desc) {
+        ret = AVERROR(ENOMEM);
+        goto fail;
+    }
 
-    snprintf(fgp->log_name, sizeof(fgp->log_name), "%cf%s",
-             av_get_media_type_string(ost->type)[0], opts->name);
+    for (int i = 0; i < nb_stages; i++) {
+        char name[32];
 
-    if (fg->nb_inputs != 1 || fg->nb_outputs != 1) {
-        av_log(fg, AV_LOG_ERROR, "Simple filtergraph '%s' was expected "
-               "to have exactly 1 input and 1 output. "
-               "However, it had %d input(s) and %d output(s). Please adjust, "
-               "or use a complex filtergraph (-filter_complex) instead.\n",
-               graph_desc, fg->nb_inputs, fg->nb_outputs);
-        return AVERROR(EINVAL);
+        // the filtergraph takes ownership of its description
+        stage_desc[i] = stages[i];
+        ret = fg_create(pfg, stages[i], sch);
+        stages[i] = NULL;
+        if (ret < 0)
+            goto fail;
+        fg  = *pfg;
+        fgp = fgp_from_fg(fg);
+        pfg = &fgp->stage_next;
+
+        fgp->is_simple = 1;
+        fgp->stage_idx = i;
+
+        snprintf(fgp->log_name, sizeof(fgp->log_name), "%cf%s",
+                 av_get_media_type_string(ost->type)[0], opts->name);
+        if (nb_stages > 1)
+            av_strlcatf(fgp->log_name, sizeof(fgp->log_name), "@%d", i);
+
+        if (fg->nb_inputs != 1 || fg->nb_outputs != 1) {
+            av_log(fg, AV_LOG_ERROR, "Simple filtergraph '%s' was expected "
+                   "to have exactly 1 input and 1 output. "
+                   "However, it had %d input(s) and %d output(s). Please adjust, "
+                   "or use a complex filtergraph (-filter_complex) instead.\n",
+                   stage_desc[i], fg->nb_inputs, fg->nb_outputs);
+            ret = AVERROR(EINVAL);
+            goto fail;
+        }
+
+        if (i) {
+            FilterGraph *fg_prev = ost->fg_simple;
+            while (fgp_from_fg(fg_prev)->stage_next != fg)
+                fg_prev = fgp_from_fg(fg_prev)->stage_next;
+
+            snprintf(name, sizeof(name), "%s@%d", opts->name, i);
+            ret = stage_bind(fg_prev, fg, name);
+        } else
+            ret = ifilter_bind_ist(fg->inputs[0], ist, opts->vs);
+        if (ret < 0)
+            goto fail;
+
+        if (opts->nb_threads) {
+            av_freep(&fgp->nb_threads);
+            fgp->nb_threads = av_strdup(opts->nb_threads);
+            if (!fgp->nb_threads) {
+                ret = AVERROR(ENOMEM);
+                goto fail;
+            }
+        }
     }
+
     if (fg->outputs[0]->type != ost->type) {
         av_log(fg, AV_LOG_ERROR, "Filtergraph has a %s output, cannot connect "
                "it to %s output stream\n",
                av_get_media_type_string(fg->outputs[0]->type),
                av_get_media_type_string(ost->type));
-        return AVERROR(EINVAL);
+        ret = AVERROR(EINVAL);
+        goto fail;
     }
 
     ost->filter = fg->outputs[0];
 
-    ret = ifilter_bind_ist(fg->inputs[0], ist, opts->vs);
-    if (ret < 0)
-        return ret;
-
     ret = ofilter_bind_ost(fg->outputs[0], ost, sched_idx_enc, opts);
     if (ret < 0)
-        return ret;
+        goto fail;
 
-    if (opts->nb_threads) {
-        av_freep(&fgp->nb_threads);
-        fgp->nb_threads = av_strdup(opts->nb_threads);
-        if (!fgp->nb_threads)
-            return AVERROR(ENOMEM);
+    if (nb_stages > 1) {
+        av_log(ost, AV_LOG_VERBOSE, "Filtergraph split into %d stages\n",
+               nb_stages);
+
+        ret = pipeline_finalise(ost->fg_simple, stage_desc, nb_stages);
+        if (ret < 0)
+            goto fail;
     }
 
-    return 0;
+fail:
+    for (int i = 0; i < nb_stages; i++)
+        av_freep(&stages[i]);
+    if (stages != &graph_desc)
+        av_freep(&stages);
+    av_freep(&stage_desc);
+    return ret;
 }
 
 static int fg_complex_bind_input(FilterGraph *fg, InputFilter *ifilter)
@@ -1877,6 +2618,60 @@ static int graph_is_meta(AVFilterGraph *graph)
 
 static int sub2video_frame(InputFilter *ifilter, AVFrame *frame, int buffer);
 
+/* Negotiate formats on the remainder of a pipelined filtergraph, to find the
+ * format the unsplit filtergraph would use at the end of this stage. */
+static int stage_negotiate_cut(FilterGraph *fg, AVBufferRef *hw_device)
+{
+    FilterGraphPriv  *fgp = fgp_from_fg(fg);
+    InputFilterPriv  *ifp = ifp_from_ifilter(fg->inputs[0]);
+    OutputFilterPriv *ofp = ofp_from_ofilter(fg->outputs[0]);
+    AVFilterInOut *inputs = NULL, *outputs = NULL;
+    AVFilterContext *sink, *cut;
+    AVFilterGraph *graph;
+    int ret;
+
+    graph = avfilter_graph_alloc();
+    if (!graph)
+        return AVERROR(ENOMEM);
+    graph->nb_threads = 1;
+
+    ret = graph_parse(graph, fgp->stage_probe_desc, &inputs, &outputs, hw_device);
+    if (ret < 0)
+        goto fail;
+
+    ret = configure_input_filter(fg, graph, fg->inputs[0], inputs);
+    if (ret < 0)
+        goto fail;
+
+    ret = avfilter_graph_create_filter(&sink, avfilter_get_by_name("buffersink"),
+                                       "out", NULL, NULL, graph);
+    if (ret < 0)
+        goto fail;
+    ret = avfilter_link(outputs->filter_ctx, outputs->pad_idx, sink, 0);
+    if (ret < 0)
+        goto fail;
+
+    if (fgp->disable_conversions)
+        avfilter_graph_set_auto_convert(graph, AVFILTER_AUTO_CONVERT_NONE);
+    ret = avfilter_graph_negotiate_formats(graph, NULL);
+    if (ret < 0)
+        goto fail;
+
+    cut = avfilter_graph_get_filter(graph, STAGE_CUT_NAME);
+    av_assert0(cut);
+
+    ofp->format      = cut->inputs[0]->format;
+    ofp->color_space = cut->inputs[0]->colorspace;
+    ofp->color_range = cut->inputs[0]->color_range;
+
+fail:
+    avfilter_inout_free(&inputs);
+    avfilter_inout_free(&outputs);
+    avfilter_graph_free(&graph);
+    ifp->filter = NULL;
+    return ret;
+}
+
 static int configure_filtergraph(FilterGraph *fg, FilterGraphThread *fgt)
 {
     FilterGraphPriv *fgp = fgp_from_fg(fg);
@@ -1924,8 +2719,30 @@ static int configure_filtergraph(FilterGraph *fg, FilterGraphThread *fgt)
         fgt->graph->nb_threads = filter_complex_nbthreads;
     }
 
+    if (filter_thread_type) {
+        ret = av_opt_set(fgt->graph, "thread_type", filter_thread_type, 0);
+        if (ret < 0)
+            goto fail;
+    }
+    fgt->graph->band_height    = filter_band_height;
+    fgt->graph->fuse_pointwise = filter_fuse_pointwise;
+    fgt->graph->format_cost    = filter_format_cost;
+
+    // the thread count is automatic, use the share of the thread budget if any
+    if (!fgt->graph->nb_threads)
+        fgt->graph->nb_threads = sch_threads(fgp->sch, SCH_FILTER_IN(fgp->sch_idx, 0));
+
     hw_device = hw_device_for_filter();
 
+    if (fgp->stage_probe_desc) {
+        ret = stage_negotiate_cut(fg, hw_device);
+        if (ret < 0) {
+            av_log(fg, AV_LOG_ERROR, "Error negotiating the output format of "
+                   "the filtergraph stage: %s\n", av_err2str(ret));
+            goto fail;
+        }
+    }
+
     if ((ret = graph_parse(fgt->graph, graph_desc, &inputs, &outputs, hw_device)) < 0)
         goto fail;
 
@@ -2039,6 +2856,12 @@ static int ifilter_parameters_from_frame(InputFilter *ifilter, const AVFrame *fr
                      (ifp->opts.flags & IFILTER_FLAG_CFR) ? av_inv_q(ifp->opts.framerate)         :
                      frame->time_base;
 
+    // continue with the frame rate the previous stage had at its output
+    if (fgp_from_fg(ifilter->graph)->stage_idx && frame->opaque_ref) {
+        const FrameData *fd = (const FrameData*)frame->opaque_ref->data;
+        ifp->opts.framerate = fd->frame_rate_filter;
+    }
+
     ifp->format              = frame->format;
 
     ifp->width               = frame->width;
@@ -2389,6 +3212,10 @@ static int close_output(OutputFilterPriv *ofp, FilterGraphThread *fgt)
 
         av_assert0(!frame->buf[0]);
 
+        // the next stage of a pipeline takes this as EOF with parameters
+        if (fgp->stage_next)
+            frame->opaque = (void*)(intptr_t)FRAME_OPAQUE_EOF;
+
         av_log(ofp, AV_LOG_WARNING,
                "No filtered frames for output stream, trying to "
                "initialize anyway.\n");
@@ -2398,6 +3225,28 @@ static int close_output(OutputFilterPriv *ofp, FilterGraphThread *fgt)
             av_frame_unref(frame);
             return ret;
         }
+    } else if (fgp->stage_next) {
+        // the next stage closes its buffer source with the timestamp this
+        // stage's filters ended at, as it would if they were part of its graph
+        AVFrame *frame = fgt->frame;
+
+        av_frame_unref(frame);
+        frame->pts = ofp->filter ? av_buffersink_get_eof_pts(ofp->filter) :
+                                   AV_NOPTS_VALUE;
+        if (frame->pts != AV_NOPTS_VALUE) {
+            frame->time_base = av_buffersink_get_time_base(ofp->filter);
+        } else {
+            frame->pts       = ofp->stage_eof_pts;
+            frame->time_base = ofp->stage_eof_tb;
+        }
+        frame->opaque    = (void*)(intptr_t)FRAME_OPAQUE_EOF;
+
+        ret = frame->pts == AV_NOPTS_VALUE ? 0 :
+              sch_filter_send(fgp->sch, fgp->sch_idx, ofp->index, frame);
+        if (ret < 0 && ret != AVERROR_EOF) {
+            av_frame_unref(frame);
+            return ret;
+        }
     }
 
     fgt->eof_out[ofp->index] = 1;
@@ -2415,7 +3264,9 @@ static int fg_output_frame(OutputFilterPriv *ofp, FilterGraphThread *fgt,
 
     int64_t nb_frames = !!frame, nb_frames_prev = 0;
 
-    if (type == AVMEDIA_TYPE_VIDEO && (frame || fgt->got_frame))
+    // frames are passed on unchanged to the next stage of a pipeline
+    if (type == AVMEDIA_TYPE_VIDEO && (frame || fgt->got_frame) &&
+        !fgp->stage_next)
         video_sync_process(ofp, frame, &nb_frames, &nb_frames_prev);
 
     for (int64_t i = 0; i < nb_frames; i++) {
@@ -2433,7 +3284,17 @@ static int fg_output_frame(OutputFilterPriv *ofp, FilterGraphThread *fgt,
             if (ret < 0)
                 return ret;
 
-            frame_out->pts = ofp->next_pts;
+            if (!fgp->stage_next)
+                frame_out->pts = ofp->next_pts;
+            else if (frame_out->pts != AV_NOPTS_VALUE) {
+                int64_t end = frame_out->pts + frame_out->duration;
+                if (ofp->stage_eof_pts == AV_NOPTS_VALUE ||
+                    av_compare_ts(end, frame_out->time_base,
+                                  ofp->stage_eof_pts, ofp->stage_eof_tb) > 0) {
+                    ofp->stage_eof_pts = end;
+                    ofp->stage_eof_tb  = frame_out->time_base;
+                }
+            }
 
             if (ofp->fps.dropped_keyframe) {
                 frame_out->flags |= AV_FRAME_FLAG_KEY;
@@ -2547,7 +3408,7 @@ static int fg_output_step(OutputFilterPriv *ofp, FilterGraphThread *fgt,
         fd->bits_per_raw_sample = 0;
 
     if (ofp->ofilter.type == AVMEDIA_TYPE_VIDEO) {
-        if (!frame->duration) {
+        if (!frame->duration && !fgp->stage_next) {
             AVRational fr = av_buffersink_get_frame_rate(filter);
             if (fr.num > 0 && fr.den > 0)
                 frame->duration = av_rescale_q(1, av_inv_q(fr), frame->time_base);
@@ -3020,6 +3881,14 @@ static int filter_thread(void *arg)
             ret = send_frame(fg, &fgt, ifilter, fgt.frame);
         } else {
             av_assert1(o == FRAME_OPAQUE_EOF);
+
+            // the previous stage of a pipeline sends its output parameters
+            // along with EOF, in case it never produced any frames
+            if (fgp->stage_idx && !fgt.graph && fgt.frame->format >= 0) {
+                av_frame_unref(ifp->opts.fallback);
+                av_frame_move_ref(ifp->opts.fallback, fgt.frame);
+            }
+
             ret = send_eof(&fgt, ifilter, fgt.frame->pts, fgt.frame->time_base);
         }
         av_frame_unref(fgt.frame);
@@ -3098,4 +3967,8 @@ void fg_send_command(FilterGraph *fg, double time, const char *target,
     fgp->frame->opaque = (void*)(intptr_t)FRAME_OPAQUE_SEND_COMMAND;
 
     sch_filter_command(fgp->sch, fgp->sch_idx, fgp->frame);
+
+    // the filters of a pipelined filtergraph are spread over its stages
+    if (fgp->stage_next)
+        fg_send_command(fgp->stage_next, time, target, command, arg, all_filters);
 }
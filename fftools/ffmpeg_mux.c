@@ -206,6 +206,50 @@ static int mux_fixup_ts(Muxer *mux, MuxStream *ms, AVPacket *pkt)
     return 0;
 }
 
+/* Tell the segment muxer where in the input this packet comes from, so that
+ * its checkpoint records where a resumed run has to seek to. */
+static int resume_pos_attach(OutputStream *ost, AVPacket *pkt)
+{
+    const FrameData *fd = pkt->opaque_ref ? (FrameData*)pkt->opaque_ref->data : NULL;
+    const InputFile  *f = ost->ist ? ost->ist->file : NULL;
+    AVDictionary *meta = NULL;
+    uint8_t *sd;
+    size_t sd_size;
+    int64_t pos;
+    int ret;
+
+    if (!fd || !f)
+        return 0;
+
+    if (ost->enc) {
+        if (fd->dec.pts == AV_NOPTS_VALUE)
+            return 0;
+        pos = av_rescale_q(fd->dec.pts, fd->dec.tb, AV_TIME_BASE_Q);
+    } else {
+        if (fd->dts_est == AV_NOPTS_VALUE)
+            return 0;
+        pos = fd->dts_est;
+    }
+
+    // undo the input timestamp offset, giving the -ss value for this packet
+    pos -= f->ts_offset;
+    if (f->ctx->start_time != AV_NOPTS_VALUE)
+        pos -= f->ctx->start_time;
+
+    ret = av_dict_set_int(&meta, "input_pos", pos, 0);
+    if (ret < 0)
+        return ret;
+    sd = av_packet_pack_dictionary(meta, &sd_size);
+    av_dict_free(&meta);
+    if (!sd)
+        return AVERROR(ENOMEM);
+
+    ret = av_packet_add_side_data(pkt, AV_PKT_DATA_STRINGS_METADATA, sd, sd_size);
+    if (ret < 0)
+        av_free(sd);
+    return ret;
+}
+
 static int write_packet(Muxer *mux, OutputStream *ost, AVPacket *pkt)
 {
     MuxStream *ms = ms_from_ost(ost);
@@ -233,6 +277,12 @@ static int write_packet(Muxer *mux, OutputStream *ost, AVPacket *pkt)
     if (ms->stats.io)
         enc_stats_write(ost, &ms->stats, NULL, pkt, frame_num);
 
+    if (resume_filename && (pkt->flags & AV_PKT_FLAG_KEY)) {
+        ret = resume_pos_attach(ost, pkt);
+        if (ret < 0)
+            goto fail;
+    }
+
     ret = av_interleaved_write_frame(s, pkt);
     if (ret < 0) {
         av_log(ost, AV_LOG_ERROR,
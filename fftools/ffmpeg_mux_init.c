@@ -954,6 +954,9 @@ ost_bind_filter(const Muxer *mux, MuxStream *ms, OutputFilter *ofilter,
 
     snprintf(name, sizeof(name), "#%d:%d", mux->of.index, ost->index);
 
+    opt_match_per_stream_str(ost, &o->filter_pipelines, mux->fc, ost->st,
+                             &opts.pipeline);
+
     if (ost->type == AVMEDIA_TYPE_VIDEO) {
         if (!keep_pix_fmt) {
             ret = avcodec_get_supported_config(enc_ctx, NULL,
@@ -1150,7 +1153,7 @@ static int ost_add(Muxer *mux, const OptionsContext *o, enum AVMediaType type,
     AVStream *st;
     AVDictionary *encoder_opts = NULL;
     int ret = 0, keep_pix_fmt = 0, autoscale = 1;
-    int threads_manual = 0;
+    int threads_manual = 0, batch_size = 1;
     AVRational enc_tb = { 0, 0 };
     enum VideoSyncMethod vsync_method = VSYNC_AUTO;
     const char *bsfs = NULL, *time_base = NULL, *codec_tag = NULL;
@@ -1231,6 +1234,25 @@ static int ost_add(Muxer *mux, const OptionsContext *o, enum AVMediaType type,
         if (ret < 0)
             return ret;
 
+        opt_match_per_stream_int(ost, &o->enc_batch, oc, st, &batch_size);
+        if (batch_size > 1) {
+            int64_t batch_latency = 10000;
+
+            opt_match_per_stream_int64(ost, &o->enc_batch_latency, oc, st,
+                                       &batch_latency);
+            ret = sch_enc_batch(mux->sch, ms->sch_idx_enc, batch_size,
+                                batch_latency);
+            if (ret < 0) {
+                av_log(ost, AV_LOG_ERROR, "Invalid encoder batch latency: %"PRId64"\n",
+                       batch_latency);
+                return ret;
+            }
+        } else if (batch_size < 1) {
+            av_log(ost, AV_LOG_ERROR, "Invalid encoder batch size: %d\n",
+                   batch_size);
+            return AVERROR(EINVAL);
+        }
+
         av_strlcat(ms->log_name, "/",       sizeof(ms->log_name));
         av_strlcat(ms->log_name, enc->name, sizeof(ms->log_name));
     } else {
@@ -1388,8 +1410,15 @@ static int ost_add(Muxer *mux, const OptionsContext *o, enum AVMediaType type,
             goto fail;
 
         // default to automatic thread count
-        if (!threads_manual)
+        if (!threads_manual) {
             ost->enc_ctx->thread_count = 0;
+
+            // encoding is usually more expensive than decoding, so encoders
+            // get a larger share of the thread budget
+            if (enc->capabilities & (AV_CODEC_CAP_FRAME_THREADS | AV_CODEC_CAP_SLICE_THREADS |
+                                     AV_CODEC_CAP_OTHER_THREADS))
+                sch_threads_request(mux->sch, SCH_ENC(ms->sch_idx_enc), 2);
+        }
     } else {
         ret = filter_codec_opts(o->g->codec_opts, AV_CODEC_ID_NONE, oc, st,
                                 NULL, &encoder_opts,
@@ -3254,6 +3283,21 @@ int of_open(const OptionsContext *o, const char *filename, Scheduler *sch)
         }
     }
 
+    if (resume_time) {
+        if (o->start_time != AV_NOPTS_VALUE) {
+            av_log(mux, AV_LOG_ERROR, "-ss on outputs cannot be combined with -resume\n");
+            return AVERROR(EINVAL);
+        }
+        // the output starts at the checkpoint now
+        if (recording_time != INT64_MAX) {
+            recording_time -= resume_time;
+            if (recording_time <= 0) {
+                av_log(mux, AV_LOG_ERROR, "Checkpoint lies beyond the end of the output\n");
+                return AVERROR(EINVAL);
+            }
+        }
+    }
+
     of->recording_time = recording_time;
     of->start_time     = o->start_time;
 
@@ -3271,6 +3315,22 @@ int of_open(const OptionsContext *o, const char *filename, Scheduler *sch)
     }
     mux->fc = oc;
 
+    if (resume_filename) {
+        if (strcmp(oc->oformat->name, "segment") &&
+            strcmp(oc->oformat->name, "stream_segment,ssegment")) {
+            av_log(mux, AV_LOG_FATAL, "Only the segment muxer can resume from "
+                   "a checkpoint\n");
+            return AVERROR(EINVAL);
+        }
+        if (nb_output_files > 1) {
+            av_log(mux, AV_LOG_FATAL, "-resume supports a single output file\n");
+            return AVERROR(EINVAL);
+        }
+        av_dict_set(&mux->opts, "segment_checkpoint", resume_filename,
+                    AV_DICT_DONT_OVERWRITE);
+        av_dict_set(&mux->opts, "segment_resume", "1", 0);
+    }
+
     av_strlcat(mux->log_name, "/",               sizeof(mux->log_name));
     av_strlcat(mux->log_name, oc->oformat->name, sizeof(mux->log_name));
 
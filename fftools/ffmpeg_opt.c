@@ -20,6 +20,7 @@
 
 #include "config.h"
 
+#include <errno.h>
 #include <stdint.h>
 
 #if HAVE_SYS_RESOURCE_H
@@ -42,6 +43,7 @@
 #include "libavutil/avassert.h"
 #include "libavutil/avstring.h"
 #include "libavutil/avutil.h"
+#include "libavutil/cpu.h"
 #include "libavutil/mathematics.h"
 #include "libavutil/mem.h"
 #include "libavutil/opt.h"
@@ -51,6 +53,11 @@
 HWDevice *filter_hw_device;
 
 char *vstats_filename;
+char *sched_stats_filename;
+char *resume_filename;
+int64_t resume_time;
+int64_t resume_input_pos = AV_NOPTS_VALUE;
+int resume_finished;
 
 float audio_drift_threshold = 0.1;
 float dts_delta_threshold   = 10;
@@ -74,9 +81,14 @@ int print_stats       = -1;
 int stdin_interaction = 1;
 float max_error_rate  = 2.0/3;
 char *filter_nbthreads;
+char *filter_thread_type;
+int filter_band_height = 0;
+int filter_fuse_pointwise = 1;
+int filter_format_cost = 0;
 int filter_complex_nbthreads = 0;
 int vstats_version = 2;
 int auto_conversion_filters = 1;
+int scale_cascade = 0;
 int64_t stats_period = 500000;
 
 
@@ -414,6 +426,13 @@ static int opt_filter_threads(void *optctx, const char *opt, const char *arg)
     return 0;
 }
 
+static int opt_filter_thread_type(void *optctx, const char *opt, const char *arg)
+{
+    av_free(filter_thread_type);
+    filter_thread_type = av_strdup(arg);
+    return filter_thread_type ? 0 : AVERROR(ENOMEM);
+}
+
 static int opt_abort_on(void *optctx, const char *opt, const char *arg)
 {
     static const AVOption opts[] = {
@@ -615,6 +634,126 @@ static int opt_sdp_file(void *optctx, const char *opt, const char *arg)
     return sch_sdp_filename(sch, arg);
 }
 
+static int opt_sched_mem_limit(void *optctx, const char *opt, const char *arg)
+{
+    Scheduler *sch = optctx;
+    double mem_limit;
+    int ret;
+
+    ret = parse_number(opt, arg, OPT_TYPE_INT64, 0, INT64_MAX, &mem_limit);
+    if (ret < 0)
+        return ret;
+
+    return sch_mem_limit(sch, (int64_t)mem_limit);
+}
+
+static int opt_sched_stats(void *optctx, const char *opt, const char *arg)
+{
+    Scheduler *sch = optctx;
+
+    av_free(sched_stats_filename);
+    sched_stats_filename = av_strdup(arg);
+    if (!sched_stats_filename)
+        return AVERROR(ENOMEM);
+
+    sch_enable_stats(sch);
+    return 0;
+}
+
+static int opt_threads_total(void *optctx, const char *opt, const char *arg)
+{
+    Scheduler *sch = optctx;
+    double nb_threads;
+    int ret;
+
+    if (!strcmp(arg, "auto")) {
+        sch_threads_total(sch, av_cpu_count());
+        return 0;
+    }
+
+    ret = parse_number(opt, arg, OPT_TYPE_INT, 0, INT_MAX, &nb_threads);
+    if (ret < 0)
+        return ret;
+
+    sch_threads_total(sch, (unsigned)nb_threads);
+    return 0;
+}
+
+static int opt_affinity(void *optctx, const char *opt, const char *arg)
+{
+    Scheduler *sch = optctx;
+    return sch_affinity(sch, arg);
+}
+
+static int checkpoint_get(const AVDictionary *checkpoint, const char *key,
+                          int64_t *val)
+{
+    const AVDictionaryEntry *e = av_dict_get(checkpoint, key, NULL, 0);
+    char *end;
+
+    if (!e)
+        return 0;
+
+    errno = 0;
+    *val  = strtoll(e->value, &end, 10);
+    if (!*e->value || *end || errno) {
+        av_log(NULL, AV_LOG_ERROR, "Invalid '%s' in checkpoint %s\n",
+               key, resume_filename);
+        return AVERROR_INVALIDDATA;
+    }
+
+    return 1;
+}
+
+static int opt_resume(void *optctx, const char *opt, const char *arg)
+{
+    AVDictionary *checkpoint = NULL;
+    int64_t finished = 0;
+    char *buf;
+    int ret;
+
+    av_free(resume_filename);
+    resume_filename = av_strdup(arg);
+    if (!resume_filename)
+        return AVERROR(ENOMEM);
+
+    // no checkpoint yet, the output is written from the beginning
+    if (avio_check(arg, AVIO_FLAG_READ) < 0)
+        return 0;
+
+    buf = file_read(arg);
+    if (!buf)
+        return AVERROR(EIO);
+
+    // one key=value pair per line, as written by the segment muxer
+    ret = av_dict_parse_string(&checkpoint, buf, "=", "\n", 0);
+    av_free(buf);
+    if (ret < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Invalid checkpoint: %s\n", arg);
+        goto fail;
+    }
+
+    ret = checkpoint_get(checkpoint, "resume_time", &resume_time);
+    if (!ret || resume_time < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Invalid checkpoint: %s\n", arg);
+        ret = AVERROR_INVALIDDATA;
+    }
+    if (ret < 0 ||
+        (ret = checkpoint_get(checkpoint, "finished", &finished)) < 0 ||
+        (ret = checkpoint_get(checkpoint, "packet.input_pos", &resume_input_pos)) < 0)
+        goto fail;
+    resume_finished = !!finished;
+
+    if (resume_input_pos == AV_NOPTS_VALUE && resume_time && !resume_finished)
+        av_log(NULL, AV_LOG_WARNING, "Checkpoint %s does not record an input "
+               "position, the inputs are skipped by the output duration\n", arg);
+
+    ret = 0;
+fail:
+    av_dict_free(&checkpoint);
+    return ret;
+}
+
 #if CONFIG_VAAPI
 static int opt_vaapi_device(void *optctx, const char *opt, const char *arg)
 {
@@ -1367,6 +1506,13 @@ int ffmpeg_parse_options(int argc, char **argv, Scheduler *sch)
         goto fail;
     }
 
+    if (resume_finished) {
+        av_log(NULL, AV_LOG_INFO, "Checkpoint %s belongs to a finished "
+               "transcode, nothing to do\n", resume_filename);
+        ret = AVERROR_EXIT;
+        goto fail;
+    }
+
     /* configure terminal and setup signal handlers */
     term_init();
 
@@ -1667,6 +1813,18 @@ const OptionDef options[] = {
     { "filter_threads",         OPT_TYPE_FUNC, OPT_FUNC_ARG | OPT_EXPERT,
         { .func_arg = opt_filter_threads },
         "number of non-complex filter threads" },
+    { "filter_thread_type",     OPT_TYPE_FUNC, OPT_FUNC_ARG | OPT_EXPERT,
+        { .func_arg = opt_filter_thread_type },
+        "allowed types of filter multithreading", "slice+frame" },
+    { "filter_band_height",     OPT_TYPE_INT, OPT_EXPERT,
+        { &filter_band_height },
+        "stream bands of this many rows through chains of filters supporting it", "rows" },
+    { "filter_fuse_pointwise",  OPT_TYPE_BOOL, OPT_EXPERT,
+        { &filter_fuse_pointwise },
+        "fuse chains of pointwise filters into a single pass" },
+    { "filter_format_cost",     OPT_TYPE_BOOL, OPT_EXPERT,
+        { &filter_format_cost },
+        "pick filter pixel formats minimizing the conversion work" },
 #if FFMPEG_OPT_FILTER_SCRIPT
     { "filter_script",          OPT_TYPE_STRING, OPT_PERSTREAM | OPT_EXPERT | OPT_OUTPUT,
         { .off = OFFSET(filter_scripts) },
@@ -1692,12 +1850,30 @@ const OptionDef options[] = {
     { "auto_conversion_filters", OPT_TYPE_BOOL, OPT_EXPERT,
         { &auto_conversion_filters },
         "enable automatic conversion filters globally" },
+    { "scale_cascade", OPT_TYPE_BOOL, OPT_EXPERT,
+        { &scale_cascade },
+        "feed scale filters sharing a split from the next larger one" },
     { "stats",               OPT_TYPE_BOOL, 0,
         { &print_stats },
         "print progress report during encoding", },
     { "stats_period",        OPT_TYPE_FUNC, OPT_FUNC_ARG | OPT_EXPERT,
         { .func_arg = opt_stats_period },
         "set the period at which ffmpeg updates stats and -progress output", "time" },
+    { "sched_mem_limit",     OPT_TYPE_FUNC, OPT_FUNC_ARG | OPT_EXPERT,
+        { .func_arg = opt_sched_mem_limit },
+        "limit the memory held by packets and frames queued between threads", "bytes" },
+    { "sched_stats",         OPT_TYPE_FUNC, OPT_FUNC_ARG | OPT_EXPERT,
+        { .func_arg = opt_sched_stats },
+        "write per-thread scheduling statistics as JSON to url at exit", "url" },
+    { "threads_total",       OPT_TYPE_FUNC, OPT_FUNC_ARG | OPT_EXPERT,
+        { .func_arg = opt_threads_total },
+        "share a number of threads between all decoders, encoders and filtergraphs", "number|auto" },
+    { "affinity",            OPT_TYPE_FUNC, OPT_FUNC_ARG | OPT_EXPERT,
+        { .func_arg = opt_affinity },
+        "pin threads to CPUs, per task type or following the NUMA topology", "auto|spec" },
+    { "resume",              OPT_TYPE_FUNC, OPT_FUNC_ARG | OPT_EXPERT,
+        { .func_arg = opt_resume },
+        "continue an interrupted segmented transcode from a checkpoint", "filename" },
     { "attach",              OPT_TYPE_FUNC, OPT_FUNC_ARG | OPT_PERFILE | OPT_EXPERT | OPT_OUTPUT,
         { .func_arg = opt_attach },
         "add an attachment to the output file", "filename" },
@@ -1727,6 +1903,12 @@ const OptionDef options[] = {
     { "bits_per_raw_sample", OPT_TYPE_INT, OPT_EXPERT | OPT_PERSTREAM | OPT_OUTPUT,
         { .off = OFFSET(bits_per_raw_sample) },
         "set the number of bits per raw sample", "number" },
+    { "enc_batch",           OPT_TYPE_INT, OPT_EXPERT | OPT_PERSTREAM | OPT_OUTPUT,
+        { .off = OFFSET(enc_batch) },
+        "number of frames handed to the encoder thread at once", "number" },
+    { "enc_batch_latency",   OPT_TYPE_TIME, OPT_EXPERT | OPT_PERSTREAM | OPT_OUTPUT,
+        { .off = OFFSET(enc_batch_latency) },
+        "how long the encoder thread waits for a batch to fill up", "duration" },
 
     { "stats_enc_pre",      OPT_TYPE_STRING, OPT_PERSTREAM | OPT_EXPERT | OPT_OUTPUT,
         { .off = OFFSET(enc_stats_pre)      },
@@ -1811,6 +1993,9 @@ const OptionDef options[] = {
         { .func_arg = opt_video_filters },
         "alias for -filter:v (apply filters to video streams)", "filter_graph",
         .u1.name_canon = "filter", },
+    { "filter_pipeline",            OPT_TYPE_STRING, OPT_VIDEO | OPT_EXPERT | OPT_PERSTREAM | OPT_OUTPUT,
+        { .off = OFFSET(filter_pipelines) },
+        "split a simple filtergraph into stages running in separate threads", "auto|stages|filters" },
     { "intra_matrix",               OPT_TYPE_STRING, OPT_VIDEO | OPT_EXPERT | OPT_PERSTREAM | OPT_OUTPUT,
         { .off = OFFSET(intra_matrices) },
         "specify intra matrix coeffs", "matrix" },
@@ -1851,6 +2036,9 @@ const OptionDef options[] = {
     { "hwaccels",                   OPT_TYPE_FUNC,   OPT_EXIT | OPT_EXPERT,
         { .func_arg = show_hwaccels },
         "show available HW acceleration methods" },
+    { "gop_threads",                OPT_TYPE_INT,    OPT_VIDEO | OPT_EXPERT | OPT_PERSTREAM | OPT_INPUT,
+        { .off = OFFSET(gop_threads) },
+        "decode independent keyframe-delimited segments in parallel", "count" },
     { "autorotate",                 OPT_TYPE_BOOL,   OPT_VIDEO | OPT_PERSTREAM | OPT_EXPERT | OPT_INPUT,
         { .off = OFFSET(autorotate) },
         "automatically insert correct rotate filters" },
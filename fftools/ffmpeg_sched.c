@@ -19,9 +19,21 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
  */
 
+#include "config.h"
+
+#if HAVE_SCHED_GETAFFINITY
+#ifndef _GNU_SOURCE
+# define _GNU_SOURCE
+#endif
+#include <sched.h>
+#endif
+
+#include <errno.h>
 #include <stdatomic.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <stdio.h>
+#include <string.h>
 
 #include "cmdutils.h"
 #include "ffmpeg_sched.h"
@@ -32,6 +44,8 @@
 #include "libavcodec/packet.h"
 
 #include "libavutil/avassert.h"
+#include "libavutil/avstring.h"
+#include "libavutil/bprint.h"
 #include "libavutil/error.h"
 #include "libavutil/fifo.h"
 #include "libavutil/frame.h"
@@ -54,12 +68,24 @@ typedef struct SchWaiter {
     pthread_cond_t      cond;
     atomic_int          choked;
 
+    // number of times the task was choked/unchoked by the scheduler
+    atomic_uint         nb_choke;
+    atomic_uint         nb_unchoke;
+
     // the following are internal state of schedule_update_locked() and must not
     // be accessed outside of it
     int                 choked_prev;
     int                 choked_next;
 } SchWaiter;
 
+#if HAVE_SCHED_GETAFFINITY && defined(CPU_SET)
+#define SCH_HAVE_AFFINITY 1
+#else
+#define SCH_HAVE_AFFINITY 0
+#endif
+
+typedef struct SchAffinity SchAffinity;
+
 typedef struct SchTask {
     Scheduler          *parent;
     SchedulerNode       node;
@@ -69,6 +95,21 @@ typedef struct SchTask {
 
     pthread_t           thread;
     int                 thread_running;
+
+    // relative share of Scheduler.threads_total requested by the task, and
+    // the number of threads it was assigned from it in sch_start()
+    unsigned            threads_weight;
+    int                 threads;
+
+    // statistics in microseconds, only collected when Scheduler.stats is set;
+    // written by the task thread only
+    atomic_int_least64_t time_start;
+    atomic_int_least64_t time_end;
+    // waiting for input to arrive
+    atomic_int_least64_t time_blocked_in;
+    // waiting for the destination to accept output, or for the scheduler
+    // to unchoke the task
+    atomic_int_least64_t time_blocked_out;
 } SchTask;
 
 typedef struct SchDecOutput {
@@ -142,6 +183,8 @@ typedef struct SchEnc {
     ThreadQueue        *queue;
     // tq_send() to queue returned EOF
     int                 in_finished;
+    // number of frames the queue hands over at once
+    unsigned            batch_size;
 
     // temporary storage used by sch_enc_send()
     AVPacket           *send_pkt;
@@ -304,6 +347,24 @@ struct Scheduler {
     char               *sdp_filename;
     int                 sdp_auto;
 
+    // memory budget shared by all the thread queues
+    ThreadQueueMem      queue_mem;
+
+    // collect per-task timing statistics
+    int                 stats;
+
+    // number of worker threads shared by all the tasks, 0 when unlimited
+    unsigned            threads_total;
+    // part of threads_total taken by threads with a fixed count
+    unsigned            threads_reserved;
+
+    // CPUs the tasks are pinned to, see sch_affinity()
+    SchAffinity        *affinity;
+    unsigned         nb_affinity;
+    // CPUs of each NUMA node, for automatic placement
+    SchAffinity        *numa_nodes;
+    unsigned         nb_numa_nodes;
+
     enum SchedulerState state;
     atomic_int          terminate;
     atomic_int          task_failed;
@@ -353,6 +414,8 @@ static int waiter_init(SchWaiter *w)
     int ret;
 
     atomic_init(&w->choked, 0);
+    atomic_init(&w->nb_choke, 0);
+    atomic_init(&w->nb_unchoke, 0);
 
     ret = pthread_mutex_init(&w->lock, NULL);
     if (ret)
@@ -371,17 +434,40 @@ static void waiter_uninit(SchWaiter *w)
     pthread_cond_destroy(&w->cond);
 }
 
-static int queue_alloc(ThreadQueue **ptq, unsigned nb_streams, unsigned queue_size,
-                       enum QueueType type)
+static size_t pkt_size(const void *obj)
+{
+    const AVPacket *pkt = obj;
+    return sizeof(*pkt) + (pkt->buf ? pkt->buf->size : pkt->size);
+}
+
+static size_t frame_size(const void *obj)
+{
+    const AVFrame *frame = obj;
+    size_t size = sizeof(*frame);
+
+    for (int i = 0; i < FF_ARRAY_ELEMS(frame->buf) && frame->buf[i]; i++)
+        size += frame->buf[i]->size;
+    for (int i = 0; i < frame->nb_extended_buf; i++)
+        size += frame->extended_buf[i]->size;
+
+    return size;
+}
+
+static int queue_alloc(Scheduler *sch, ThreadQueue **ptq, unsigned nb_streams,
+                       unsigned queue_size, enum QueueType type)
 {
     ThreadQueue *tq;
     ObjPool *op;
+    unsigned max_queue_size = queue_size;
 
     if (queue_size <= 0) {
-        if (type == QUEUE_FRAMES)
-            queue_size = DEFAULT_FRAME_THREAD_QUEUE_SIZE;
-        else
-            queue_size = DEFAULT_PACKET_THREAD_QUEUE_SIZE;
+        if (type == QUEUE_FRAMES) {
+            queue_size     = DEFAULT_FRAME_THREAD_QUEUE_SIZE;
+            max_queue_size = queue_size;
+        } else {
+            queue_size     = DEFAULT_PACKET_THREAD_QUEUE_SIZE;
+            max_queue_size = MAX_PACKET_THREAD_QUEUE_SIZE;
+        }
     }
 
     if (type == QUEUE_FRAMES) {
@@ -398,13 +484,17 @@ static int queue_alloc(ThreadQueue **ptq, unsigned nb_streams, unsigned queue_si
     if (!op)
         return AVERROR(ENOMEM);
 
-    tq = tq_alloc(nb_streams, queue_size, op,
+    tq = tq_alloc(nb_streams, queue_size, max_queue_size, op,
                   (type == QUEUE_PACKETS) ? pkt_move : frame_move);
     if (!tq) {
         objpool_free(&op);
         return AVERROR(ENOMEM);
     }
 
+    if (sch->queue_mem.limit)
+        tq_set_mem_limit(tq, &sch->queue_mem,
+                         (type == QUEUE_PACKETS) ? pkt_size : frame_size);
+
     *ptq = tq;
     return 0;
 }
@@ -440,6 +530,23 @@ static void task_init(Scheduler *sch, SchTask *task, enum SchedulerNodeType type
 
     task->func      = func;
     task->func_arg  = func_arg;
+
+    atomic_init(&task->time_start,       0);
+    atomic_init(&task->time_end,         0);
+    atomic_init(&task->time_blocked_in,  0);
+    atomic_init(&task->time_blocked_out, 0);
+}
+
+static int64_t stats_time(const Scheduler *sch)
+{
+    return sch->stats ? av_gettime_relative() : 0;
+}
+
+static void stats_add(const Scheduler *sch, atomic_int_least64_t *dst,
+                      int64_t start)
+{
+    if (sch->stats)
+        atomic_fetch_add(dst, av_gettime_relative() - start);
 }
 
 static int64_t trailing_dts(const Scheduler *sch, int count_finished)
@@ -567,6 +674,9 @@ void sch_free(Scheduler **psch)
 
     av_freep(&sch->sdp_filename);
 
+    av_freep(&sch->affinity);
+    av_freep(&sch->numa_nodes);
+
     pthread_mutex_destroy(&sch->schedule_lock);
 
     pthread_mutex_destroy(&sch->mux_ready_lock);
@@ -574,6 +684,8 @@ void sch_free(Scheduler **psch)
     pthread_mutex_destroy(&sch->mux_done_lock);
     pthread_cond_destroy(&sch->mux_done_cond);
 
+    tq_mem_uninit(&sch->queue_mem);
+
     av_freep(psch);
 }
 
@@ -594,6 +706,12 @@ Scheduler *sch_alloc(void)
     sch->class    = &scheduler_class;
     sch->sdp_auto = 1;
 
+    ret = tq_mem_init(&sch->queue_mem, 0);
+    if (ret < 0) {
+        av_freep(&sch);
+        return NULL;
+    }
+
     ret = pthread_mutex_init(&sch->schedule_lock, NULL);
     if (ret)
         goto fail;
@@ -616,6 +734,289 @@ fail:
     return NULL;
 }
 
+int sch_mem_limit(Scheduler *sch, int64_t mem_limit)
+{
+    if (mem_limit < 0 || mem_limit > SIZE_MAX)
+        return AVERROR(EINVAL);
+
+    sch->queue_mem.limit = mem_limit;
+    return 0;
+}
+
+#if SCH_HAVE_AFFINITY
+struct SchAffinity {
+    enum SchedulerNodeType type;
+    // -1 for all nodes of the type
+    int                    idx;
+    cpu_set_t              cpus;
+};
+
+static const struct {
+    const char            *name;
+    enum SchedulerNodeType type;
+} affinity_types[] = {
+    { "demux",  SCH_NODE_TYPE_DEMUX     },
+    { "dec",    SCH_NODE_TYPE_DEC       },
+    { "filter", SCH_NODE_TYPE_FILTER_IN },
+    { "enc",    SCH_NODE_TYPE_ENC       },
+    { "mux",    SCH_NODE_TYPE_MUX       },
+};
+
+// parse a list of CPUs and CPU ranges such as 0-3,8,10-11
+static int cpulist_parse(const char *str, cpu_set_t *cpus)
+{
+    CPU_ZERO(cpus);
+
+    while (*str) {
+        char *end;
+        long first, last;
+
+        first = last = strtol(str, &end, 10);
+        if (end == str)
+            return AVERROR(EINVAL);
+        if (*end == '-') {
+            str  = end + 1;
+            last = strtol(str, &end, 10);
+            if (end == str)
+                return AVERROR(EINVAL);
+        }
+        if (first < 0 || last < first || last >= CPU_SETSIZE)
+            return AVERROR(EINVAL);
+
+        for (long i = first; i <= last; i++)
+            CPU_SET(i, cpus);
+
+        str = end + (*end == ',');
+        if (*end && *end != ',')
+            return AVERROR(EINVAL);
+    }
+
+    return CPU_COUNT(cpus) ? 0 : AVERROR(EINVAL);
+}
+
+static int numa_nodes_read(Scheduler *sch)
+{
+    for (unsigned i = 0;; i++) {
+        char path[64], cpulist[4096];
+        SchAffinity *node;
+        FILE *f;
+        int ret;
+
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%u/cpulist", i);
+        f = fopen(path, "r");
+        if (!f)
+            return 0;
+
+        if (!fgets(cpulist, sizeof(cpulist), f))
+            cpulist[0] = 0;
+        fclose(f);
+        cpulist[strcspn(cpulist, "\n")] = 0;
+
+        ret = GROW_ARRAY(sch->numa_nodes, sch->nb_numa_nodes);
+        if (ret < 0)
+            return ret;
+        node = &sch->numa_nodes[sch->nb_numa_nodes - 1];
+
+        // nodes without CPUs only hold memory
+        if (cpulist_parse(cpulist, &node->cpus) < 0)
+            sch->nb_numa_nodes--;
+    }
+}
+
+int sch_affinity(Scheduler *sch, const char *spec)
+{
+    char *str, *entry, *saveptr = NULL;
+    int ret = 0;
+
+    av_assert0(sch->state == SCH_STATE_UNINIT);
+
+    if (!strcmp(spec, "auto")) {
+        av_freep(&sch->numa_nodes);
+        sch->nb_numa_nodes = 0;
+
+        ret = numa_nodes_read(sch);
+        if (ret < 0)
+            return ret;
+        if (sch->nb_numa_nodes < 2) {
+            av_log(sch, AV_LOG_VERBOSE, "Only %u NUMA node(s) with CPUs, "
+                   "threads will not be pinned\n", sch->nb_numa_nodes);
+            sch->nb_numa_nodes = 0;
+        }
+        return 0;
+    }
+
+    str = av_strdup(spec);
+    if (!str)
+        return AVERROR(ENOMEM);
+
+    for (entry = av_strtok(str, ";", &saveptr); entry;
+         entry = av_strtok(NULL, ";", &saveptr)) {
+        char *cpus = strchr(entry, '='), *idx;
+        SchAffinity *a;
+        size_t type_len;
+        unsigned type;
+
+        if (!cpus)
+            goto invalid;
+        *cpus++ = 0;
+
+        idx      = strchr(entry, ':');
+        type_len = idx ? idx - entry : strlen(entry);
+        for (type = 0; type < FF_ARRAY_ELEMS(affinity_types); type++)
+            if (strlen(affinity_types[type].name) == type_len &&
+                !strncmp(affinity_types[type].name, entry, type_len))
+                break;
+        if (type == FF_ARRAY_ELEMS(affinity_types))
+            goto invalid;
+
+        ret = GROW_ARRAY(sch->affinity, sch->nb_affinity);
+        if (ret < 0)
+            goto finish;
+        a = &sch->affinity[sch->nb_affinity - 1];
+
+        a->type = affinity_types[type].type;
+        a->idx  = -1;
+        if (idx) {
+            char *end;
+            long val = strtol(idx + 1, &end, 10);
+            if (end == idx + 1 || *end || val < 0 || val > INT_MAX)
+                goto invalid;
+            a->idx = val;
+        }
+
+        if (cpulist_parse(cpus, &a->cpus) < 0)
+            goto invalid;
+    }
+
+finish:
+    av_free(str);
+    return ret;
+invalid:
+    av_log(sch, AV_LOG_ERROR, "Invalid CPU affinity: %s\n", spec);
+    ret = AVERROR(EINVAL);
+    goto finish;
+}
+
+/* With automatic placement, decoders are spread over the NUMA nodes and every
+ * other task runs on the node of the task feeding it, so that frames are used
+ * on the node where they were first written. */
+static unsigned affinity_numa_node(const Scheduler *sch, SchedulerNode node,
+                                   int depth)
+{
+    if (depth > 8)
+        return 0;
+
+    switch (node.type) {
+    case SCH_NODE_TYPE_DEC:
+        return node.idx % sch->nb_numa_nodes;
+    case SCH_NODE_TYPE_ENC:
+        return affinity_numa_node(sch, sch->enc[node.idx].src, depth + 1);
+    case SCH_NODE_TYPE_FILTER_IN:
+    case SCH_NODE_TYPE_FILTER_OUT: {
+        const SchFilterGraph *fg = &sch->filters[node.idx];
+        // graphs with only source filters are spread like decoders
+        return fg->nb_inputs ?
+               affinity_numa_node(sch, fg->inputs[0].src, depth + 1) :
+               node.idx % sch->nb_numa_nodes;
+    }
+    case SCH_NODE_TYPE_MUX: {
+        const SchMux *mux = &sch->mux[node.idx];
+        return mux->nb_streams ?
+               affinity_numa_node(sch, mux->streams[0].src, depth + 1) : 0;
+    }
+    case SCH_NODE_TYPE_DEMUX: {
+        const SchDemux *d = &sch->demux[node.idx];
+        for (unsigned i = 0; i < d->nb_streams; i++)
+            for (unsigned j = 0; j < d->streams[i].nb_dst; j++)
+                if (d->streams[i].dst[j].type == SCH_NODE_TYPE_DEC)
+                    return affinity_numa_node(sch, d->streams[i].dst[j], depth + 1);
+        return 0;
+    }
+    default:
+        return 0;
+    }
+}
+
+// get the CPUs the given task is pinned to; returns 0 if it is not pinned
+static int affinity_get(const Scheduler *sch, SchedulerNode node, cpu_set_t *cpus)
+{
+    const SchAffinity *match = NULL;
+
+    if (node.type == SCH_NODE_TYPE_FILTER_OUT)
+        node.type = SCH_NODE_TYPE_FILTER_IN;
+
+    // entries for a single task take precedence over those for all of a type
+    for (unsigned i = 0; i < sch->nb_affinity; i++) {
+        const SchAffinity *a = &sch->affinity[i];
+        if (a->type == node.type && (a->idx < 0 || a->idx == node.idx) &&
+            (!match || match->idx < 0 || a->idx >= 0))
+            match = a;
+    }
+
+    if (!match && sch->nb_numa_nodes)
+        match = &sch->numa_nodes[affinity_numa_node(sch, node, 0)];
+
+    if (match)
+        *cpus = match->cpus;
+    return !!match;
+}
+
+static void affinity_set(void *logctx, const cpu_set_t *cpus)
+{
+    if (sched_setaffinity(0, sizeof(*cpus), cpus) < 0)
+        av_log(logctx, AV_LOG_WARNING, "Could not set CPU affinity: %s\n",
+               strerror(errno));
+}
+
+static void task_set_affinity(Scheduler *sch, SchTask *task)
+{
+    cpu_set_t cpus;
+
+    if (affinity_get(sch, task->node, &cpus))
+        affinity_set(task->func_arg, &cpus);
+}
+
+int sch_affinity_run(Scheduler *sch, SchedulerNode node,
+                     int (*func)(void *arg), void *arg)
+{
+    cpu_set_t cpus, saved;
+    int ret;
+
+    if (!affinity_get(sch, node, &cpus) ||
+        sched_getaffinity(0, sizeof(saved), &saved) < 0)
+        return func(arg);
+
+    affinity_set(sch, &cpus);
+    ret = func(arg);
+    affinity_set(sch, &saved);
+
+    return ret;
+}
+#else
+int sch_affinity(Scheduler *sch, const char *spec)
+{
+    av_log(sch, AV_LOG_ERROR, "Setting the CPU affinity is not supported "
+           "on this platform\n");
+    return AVERROR(ENOSYS);
+}
+
+static void task_set_affinity(Scheduler *sch, SchTask *task)
+{
+}
+
+int sch_affinity_run(Scheduler *sch, SchedulerNode node,
+                     int (*func)(void *arg), void *arg)
+{
+    return func(arg);
+}
+#endif
+
+void sch_enable_stats(Scheduler *sch)
+{
+    av_assert0(sch->state == SCH_STATE_UNINIT);
+    sch->stats = 1;
+}
+
 int sch_sdp_filename(Scheduler *sch, const char *sdp_filename)
 {
     av_freep(&sch->sdp_filename);
@@ -769,7 +1170,7 @@ int sch_add_dec(Scheduler *sch, SchThreadFunc func, void *ctx, int send_end_ts)
     if (ret < 0)
         return ret;
 
-    ret = queue_alloc(&dec->queue, 1, 0, QUEUE_PACKETS);
+    ret = queue_alloc(sch, &dec->queue, 1, 0, QUEUE_PACKETS);
     if (ret < 0)
         return ret;
 
@@ -813,13 +1214,169 @@ int sch_add_enc(Scheduler *sch, SchThreadFunc func, void *ctx,
     if (!enc->send_pkt)
         return AVERROR(ENOMEM);
 
-    ret = queue_alloc(&enc->queue, 1, 0, QUEUE_FRAMES);
+    ret = queue_alloc(sch, &enc->queue, 1, 0, QUEUE_FRAMES);
     if (ret < 0)
         return ret;
+    enc->batch_size = 1;
 
     return idx;
 }
 
+static SchTask *task_get(Scheduler *sch, SchedulerNode node)
+{
+    switch (node.type) {
+    case SCH_NODE_TYPE_DEMUX:
+        av_assert0(node.idx < sch->nb_demux);
+        return &sch->demux[node.idx].task;
+    case SCH_NODE_TYPE_MUX:
+        av_assert0(node.idx < sch->nb_mux);
+        return &sch->mux[node.idx].task;
+    case SCH_NODE_TYPE_DEC:
+        av_assert0(node.idx < sch->nb_dec);
+        return &sch->dec[node.idx].task;
+    case SCH_NODE_TYPE_ENC:
+        av_assert0(node.idx < sch->nb_enc);
+        return &sch->enc[node.idx].task;
+    case SCH_NODE_TYPE_FILTER_IN:
+    case SCH_NODE_TYPE_FILTER_OUT:
+        av_assert0(node.idx < sch->nb_filters);
+        return &sch->filters[node.idx].task;
+    default: av_assert0(0);
+    }
+}
+
+void sch_threads_total(Scheduler *sch, unsigned nb_threads)
+{
+    av_assert0(sch->state == SCH_STATE_UNINIT);
+    sch->threads_total = nb_threads;
+}
+
+void sch_threads_reserve(Scheduler *sch, unsigned nb_threads)
+{
+    av_assert0(sch->state == SCH_STATE_UNINIT);
+    sch->threads_reserved += nb_threads;
+}
+
+int sch_threads_request(Scheduler *sch, SchedulerNode node, unsigned weight)
+{
+    av_assert0(sch->state == SCH_STATE_UNINIT);
+
+    if (!sch->threads_total)
+        return 0;
+
+    task_get(sch, node)->threads_weight = weight;
+    return 1;
+}
+
+int sch_threads(Scheduler *sch, SchedulerNode node)
+{
+    av_assert0(sch->state >= SCH_STATE_STARTED);
+    return task_get(sch, node)->threads;
+}
+
+static int threads_assign(Scheduler *sch)
+{
+    SchTask **tasks;
+    unsigned nb_tasks = 0, nb_requests = 0, weight_total = 0, assigned = 0;
+    unsigned budget, spare;
+
+    if (!sch->threads_total)
+        return 0;
+
+    // tasks that did not request a share run their single-threaded codecs
+    // and filters on their own thread, which is not accounted for
+    tasks = av_malloc_array(sch->nb_dec + sch->nb_filters + sch->nb_enc,
+                            sizeof(*tasks));
+    if (!tasks)
+        return AVERROR(ENOMEM);
+
+    for (unsigned i = 0; i < sch->nb_dec; i++)
+        tasks[nb_tasks++] = &sch->dec[i].task;
+    for (unsigned i = 0; i < sch->nb_filters; i++)
+        tasks[nb_tasks++] = &sch->filters[i].task;
+    for (unsigned i = 0; i < sch->nb_enc; i++)
+        tasks[nb_tasks++] = &sch->enc[i].task;
+
+    for (unsigned i = 0; i < nb_tasks; i++) {
+        weight_total += tasks[i]->threads_weight;
+        nb_requests  += !!tasks[i]->threads_weight;
+    }
+
+    // threads with a fixed count, e.g. GOP decoding workers, come first
+    budget = sch->threads_total - FFMIN(sch->threads_reserved, sch->threads_total);
+
+    // every task needs a thread of its own, as a count of 0 would mean
+    // automatic; only what is left is divided by weight, so the budget is
+    // exceeded only when there are more tasks than threads
+    if (nb_requests > budget)
+        av_log(sch, AV_LOG_WARNING, "%u tasks share a budget of %u threads "
+               "(%u reserved), using one thread for each of them\n",
+               nb_requests, sch->threads_total, sch->threads_reserved);
+    spare = budget - FFMIN(nb_requests, budget);
+
+    for (unsigned i = 0; i < nb_tasks; i++) {
+        SchTask *t = tasks[i];
+        if (!t->threads_weight)
+            continue;
+        t->threads = 1 + (uint64_t)spare * t->threads_weight / weight_total;
+        assigned  += t->threads;
+    }
+
+    // hand out the threads lost to rounding down, to the tasks furthest
+    // below their exact share first
+    while (assigned < budget) {
+        SchTask *best = NULL;
+        int64_t best_deficit = 0;
+        for (unsigned i = 0; i < nb_tasks; i++) {
+            const SchTask *t = tasks[i];
+            // exact share minus the assigned threads, times weight_total
+            int64_t deficit = (int64_t)spare * t->threads_weight -
+                              (int64_t)(t->threads - 1) * weight_total;
+            if (t->threads_weight && (!best || deficit > best_deficit)) {
+                best         = tasks[i];
+                best_deficit = deficit;
+            }
+        }
+        if (!best)
+            break;
+        best->threads++;
+        assigned++;
+    }
+
+    for (unsigned i = 0; i < nb_tasks; i++) {
+        const SchTask *t = tasks[i];
+        if (t->threads_weight)
+            av_log(sch, AV_LOG_VERBOSE, "Assigned %d of %u threads to %s %u\n",
+                   t->threads, sch->threads_total,
+                   t->node.type == SCH_NODE_TYPE_DEC ? "decoder" :
+                   t->node.type == SCH_NODE_TYPE_ENC ? "encoder" : "filtergraph",
+                   t->node.idx);
+    }
+
+    av_freep(&tasks);
+    return 0;
+}
+
+int sch_enc_batch(Scheduler *sch, unsigned enc_idx, unsigned batch_size,
+                  int64_t max_latency_us)
+{
+    SchEnc *enc;
+
+    av_assert0(enc_idx < sch->nb_enc);
+    av_assert0(sch->state < SCH_STATE_STARTED);
+    enc = &sch->enc[enc_idx];
+
+    if (!batch_size || max_latency_us <= 0)
+        return AVERROR(EINVAL);
+
+    // frames held in the queue are accounted for in the decoders' frame
+    // pools, so the batch cannot grow beyond the queue
+    enc->batch_size = FFMIN(batch_size, DEFAULT_FRAME_THREAD_QUEUE_SIZE);
+    tq_set_batch(enc->queue, enc->batch_size, max_latency_us);
+
+    return 0;
+}
+
 static const AVClass sch_fg_class = {
     .class_name                = "SchFilterGraph",
     .version                   = LIBAVUTIL_VERSION_INT,
@@ -861,7 +1418,7 @@ int sch_add_filtergraph(Scheduler *sch, unsigned nb_inputs, unsigned nb_outputs,
     if (ret < 0)
         return ret;
 
-    ret = queue_alloc(&fg->queue, fg->nb_inputs + 1, 0, QUEUE_FRAMES);
+    ret = queue_alloc(sch, &fg->queue, fg->nb_inputs + 1, 0, QUEUE_FRAMES);
     if (ret < 0)
         return ret;
 
@@ -1327,8 +1884,10 @@ static void schedule_update_locked(Scheduler *sch)
     for (unsigned type = 0; type < 2; type++)
         for (unsigned i = 0; i < (type ? sch->nb_filters : sch->nb_demux); i++) {
             SchWaiter *w = type ? &sch->filters[i].waiter : &sch->demux[i].waiter;
-            if (w->choked_prev != w->choked_next)
+            if (w->choked_prev != w->choked_next) {
+                atomic_fetch_add(w->choked_next ? &w->nb_choke : &w->nb_unchoke, 1);
                 waiter_set(w, w->choked_next);
+            }
         }
 
 }
@@ -1514,7 +2073,7 @@ static int start_prepare(Scheduler *sch)
             }
         }
 
-        ret = queue_alloc(&mux->queue, mux->nb_streams, mux->queue_size,
+        ret = queue_alloc(sch, &mux->queue, mux->nb_streams, mux->queue_size,
                           QUEUE_PACKETS);
         if (ret < 0)
             return ret;
@@ -1575,6 +2134,11 @@ int sch_start(Scheduler *sch)
         return ret;
 
     av_assert0(sch->state == SCH_STATE_UNINIT);
+
+    ret = threads_assign(sch);
+    if (ret < 0)
+        return ret;
+
     sch->state = SCH_STATE_STARTED;
 
     for (unsigned i = 0; i < sch->nb_mux; i++) {
@@ -2010,22 +2574,29 @@ int sch_demux_send(Scheduler *sch, unsigned demux_idx, AVPacket *pkt,
                    unsigned flags)
 {
     SchDemux *d;
-    int terminate;
+    int64_t t;
+    int terminate, ret;
 
     av_assert0(demux_idx < sch->nb_demux);
     d = &sch->demux[demux_idx];
 
+    t = stats_time(sch);
+
     terminate = waiter_wait(sch, &d->waiter);
     if (terminate)
         return AVERROR_EXIT;
 
     // flush the downstreams after seek
     if (pkt->stream_index == -1)
-        return demux_flush(sch, d, pkt);
+        ret = demux_flush(sch, d, pkt);
+    else {
+        av_assert0(pkt->stream_index < d->nb_streams);
+        ret = demux_send_for_stream(sch, d, &d->streams[pkt->stream_index], pkt, flags);
+    }
 
-    av_assert0(pkt->stream_index < d->nb_streams);
+    stats_add(sch, &d->task.time_blocked_out, t);
 
-    return demux_send_for_stream(sch, d, &d->streams[pkt->stream_index], pkt, flags);
+    return ret;
 }
 
 static int demux_done(Scheduler *sch, unsigned demux_idx)
@@ -2053,12 +2624,15 @@ static int demux_done(Scheduler *sch, unsigned demux_idx)
 int sch_mux_receive(Scheduler *sch, unsigned mux_idx, AVPacket *pkt)
 {
     SchMux *mux;
+    int64_t t;
     int ret, stream_idx;
 
     av_assert0(mux_idx < sch->nb_mux);
     mux = &sch->mux[mux_idx];
 
+    t = stats_time(sch);
     ret = tq_receive(mux->queue, &stream_idx, pkt);
+    stats_add(sch, &mux->task.time_blocked_in, t);
     pkt->stream_index = stream_idx;
     return ret;
 }
@@ -2137,6 +2711,7 @@ static int mux_done(Scheduler *sch, unsigned mux_idx)
 int sch_dec_receive(Scheduler *sch, unsigned dec_idx, AVPacket *pkt)
 {
     SchDec *dec;
+    int64_t t;
     int ret, dummy;
 
     av_assert0(dec_idx < sch->nb_dec);
@@ -2152,7 +2727,9 @@ int sch_dec_receive(Scheduler *sch, unsigned dec_idx, AVPacket *pkt)
         dec->expect_end_ts = 0;
     }
 
+    t   = stats_time(sch);
     ret = tq_receive(dec->queue, &dummy, pkt);
+    stats_add(sch, &dec->task.time_blocked_in, t);
     av_assert0(dummy <= 0);
 
     // got a flush packet, on the next call to this function the decoder
@@ -2215,6 +2792,7 @@ int sch_dec_send(Scheduler *sch, unsigned dec_idx,
 {
     SchDec *dec;
     SchDecOutput *o;
+    int64_t t;
     int ret;
     unsigned nb_done = 0;
 
@@ -2240,7 +2818,9 @@ int sch_dec_send(Scheduler *sch, unsigned dec_idx,
                 return ret;
         }
 
+        t   = stats_time(sch);
         ret = dec_send_to_dst(sch, o->dst[i], finished, to_send);
+        stats_add(sch, &dec->task.time_blocked_out, t);
         if (ret < 0) {
             av_frame_unref(to_send);
             if (ret == AVERROR_EOF) {
@@ -2282,12 +2862,15 @@ static int dec_done(Scheduler *sch, unsigned dec_idx)
 int sch_enc_receive(Scheduler *sch, unsigned enc_idx, AVFrame *frame)
 {
     SchEnc *enc;
+    int64_t t;
     int ret, dummy;
 
     av_assert0(enc_idx < sch->nb_enc);
     enc = &sch->enc[enc_idx];
 
+    t   = stats_time(sch);
     ret = tq_receive(enc->queue, &dummy, frame);
+    stats_add(sch, &enc->task.time_blocked_in, t);
     av_assert0(dummy <= 0);
 
     return ret;
@@ -2326,6 +2909,7 @@ finish:
 int sch_enc_send(Scheduler *sch, unsigned enc_idx, AVPacket *pkt)
 {
     SchEnc *enc;
+    int64_t t;
     int ret;
 
     av_assert0(enc_idx < sch->nb_enc);
@@ -2344,7 +2928,9 @@ int sch_enc_send(Scheduler *sch, unsigned enc_idx, AVPacket *pkt)
                 return ret;
         }
 
+        t   = stats_time(sch);
         ret = enc_send_to_dst(sch, enc->dst[i], finished, to_send);
+        stats_add(sch, &enc->task.time_blocked_out, t);
         if (ret < 0) {
             av_packet_unref(to_send);
             if (ret == AVERROR_EOF)
@@ -2396,14 +2982,18 @@ int sch_filter_receive(Scheduler *sch, unsigned fg_idx,
     }
 
     if (*in_idx == fg->nb_inputs) {
+        int64_t t = stats_time(sch);
         int terminate = waiter_wait(sch, &fg->waiter);
+        stats_add(sch, &fg->task.time_blocked_out, t);
         return terminate ? AVERROR_EOF : AVERROR(EAGAIN);
     }
 
     while (1) {
+        int64_t t = stats_time(sch);
         int ret, idx;
 
         ret = tq_receive(fg->queue, &idx, frame);
+        stats_add(sch, &fg->task.time_blocked_in, t);
         if (idx < 0)
             return AVERROR_EOF;
         else if (ret >= 0) {
@@ -2441,6 +3031,8 @@ int sch_filter_send(Scheduler *sch, unsigned fg_idx, unsigned out_idx, AVFrame *
 {
     SchFilterGraph *fg;
     SchedulerNode  dst;
+    int64_t t;
+    int ret;
 
     av_assert0(fg_idx < sch->nb_filters);
     fg = &sch->filters[fg_idx];
@@ -2448,9 +3040,13 @@ int sch_filter_send(Scheduler *sch, unsigned fg_idx, unsigned out_idx, AVFrame *
     av_assert0(out_idx < fg->nb_outputs);
     dst = fg->outputs[out_idx].dst;
 
-    return (dst.type == SCH_NODE_TYPE_ENC)                                    ?
-           send_to_enc   (sch, &sch->enc[dst.idx],                     frame) :
-           send_to_filter(sch, &sch->filters[dst.idx], dst.idx_stream, frame);
+    t   = stats_time(sch);
+    ret = (dst.type == SCH_NODE_TYPE_ENC)                                    ?
+          send_to_enc   (sch, &sch->enc[dst.idx],                     frame) :
+          send_to_filter(sch, &sch->filters[dst.idx], dst.idx_stream, frame);
+    stats_add(sch, &fg->task.time_blocked_out, t);
+
+    return ret;
 }
 
 static int filter_done(Scheduler *sch, unsigned fg_idx)
@@ -2511,6 +3107,12 @@ static void *task_wrapper(void *arg)
     int ret;
     int err = 0;
 
+    // threads created by the task, e.g. by filters, inherit this
+    task_set_affinity(sch, task);
+
+    if (sch->stats)
+        atomic_store(&task->time_start, av_gettime_relative());
+
     ret = task->func(task->func_arg);
     if (ret < 0)
         av_log(task->func_arg, AV_LOG_ERROR,
@@ -2525,6 +3127,9 @@ static void *task_wrapper(void *arg)
     if (ret < 0)
         atomic_store(&sch->task_failed, 1);
 
+    if (sch->stats)
+        atomic_store(&task->time_end, av_gettime_relative());
+
     av_log(task->func_arg, ret < 0 ? AV_LOG_ERROR : AV_LOG_VERBOSE,
            "Terminating thread with return code %d (%s)\n", ret,
            ret < 0 ? av_err2str(ret) : "success");
@@ -2605,3 +3210,127 @@ int sch_stop(Scheduler *sch, int64_t *finish_ts)
 
     return ret;
 }
+
+static void stats_print_string(AVBPrint *bp, const char *str)
+{
+    av_bprint_chars(bp, '"', 1);
+    for (; *str; str++) {
+        if (*str == '"' || *str == '\\')
+            av_bprintf(bp, "\\%c", *str);
+        else if ((unsigned char)*str < 0x20)
+            av_bprintf(bp, "\\u%04x", *str);
+        else
+            av_bprint_chars(bp, *str, 1);
+    }
+    av_bprint_chars(bp, '"', 1);
+}
+
+static void stats_print_task(AVBPrint *bp, SchTask *task, unsigned idx,
+                             int64_t now)
+{
+    const AVClass *class = *(const AVClass**)task->func_arg;
+    int64_t start       = atomic_load(&task->time_start);
+    int64_t end         = atomic_load(&task->time_end);
+    int64_t blocked_in  = atomic_load(&task->time_blocked_in);
+    int64_t blocked_out = atomic_load(&task->time_blocked_out);
+    int64_t running     = 0;
+
+    if (start)
+        running = FFMAX((end ? end : now) - start - blocked_in - blocked_out, 0);
+
+    av_bprintf(bp, "{\"index\":%u,\"name\":", idx);
+    stats_print_string(bp, class->item_name(task->func_arg));
+    av_bprintf(bp, ",\"running_us\":%"PRId64",\"blocked_input_us\":%"PRId64
+               ",\"blocked_output_us\":%"PRId64, running, blocked_in, blocked_out);
+}
+
+static void stats_print_waiter(AVBPrint *bp, SchWaiter *w)
+{
+    av_bprintf(bp, ",\"choke_count\":%u,\"unchoke_count\":%u",
+               atomic_load(&w->nb_choke), atomic_load(&w->nb_unchoke));
+}
+
+static void stats_print_queue(AVBPrint *bp, ThreadQueue *tq)
+{
+    uint64_t nb_items = 0, nb_wakeups = 0;
+
+    if (tq)
+        tq_receive_stats(tq, &nb_items, &nb_wakeups);
+
+    av_bprintf(bp, ",\"queue_max_items\":%zu,\"queue_received\":%"PRIu64
+               ",\"queue_wakeups\":%"PRIu64, tq ? tq_max_items(tq) : 0,
+               nb_items, nb_wakeups);
+}
+
+static void stats_print_section(AVBPrint *bp, const char *name,
+                                int first, int compact)
+{
+    av_bprintf(bp, "%s%s\"%s\":[", first ? "" : ",", compact ? "" : "\n  ", name);
+}
+
+static void stats_print_section_end(AVBPrint *bp, unsigned nb_nodes, int compact)
+{
+    av_bprintf(bp, "%s]", nb_nodes && !compact ? "\n  " : "");
+}
+
+void sch_print_stats(Scheduler *sch, AVBPrint *bp, int compact)
+{
+    const char *indent = compact ? "" : "\n    ";
+    int64_t now = av_gettime_relative();
+
+    av_bprintf(bp, "{");
+
+    stats_print_section(bp, "demux", 1, compact);
+    for (unsigned i = 0; i < sch->nb_demux; i++) {
+        SchDemux *d = &sch->demux[i];
+        av_bprintf(bp, "%s%s", i ? "," : "", indent);
+        stats_print_task(bp, &d->task, i, now);
+        stats_print_waiter(bp, &d->waiter);
+        av_bprintf(bp, "}");
+    }
+    stats_print_section_end(bp, sch->nb_demux, compact);
+
+    stats_print_section(bp, "decode", 0, compact);
+    for (unsigned i = 0; i < sch->nb_dec; i++) {
+        SchDec *dec = &sch->dec[i];
+        av_bprintf(bp, "%s%s", i ? "," : "", indent);
+        stats_print_task(bp, &dec->task, i, now);
+        stats_print_queue(bp, dec->queue);
+        av_bprintf(bp, "}");
+    }
+    stats_print_section_end(bp, sch->nb_dec, compact);
+
+    stats_print_section(bp, "filter", 0, compact);
+    for (unsigned i = 0; i < sch->nb_filters; i++) {
+        SchFilterGraph *fg = &sch->filters[i];
+        av_bprintf(bp, "%s%s", i ? "," : "", indent);
+        stats_print_task(bp, &fg->task, i, now);
+        stats_print_waiter(bp, &fg->waiter);
+        stats_print_queue(bp, fg->queue);
+        av_bprintf(bp, "}");
+    }
+    stats_print_section_end(bp, sch->nb_filters, compact);
+
+    stats_print_section(bp, "encode", 0, compact);
+    for (unsigned i = 0; i < sch->nb_enc; i++) {
+        SchEnc *enc = &sch->enc[i];
+        av_bprintf(bp, "%s%s", i ? "," : "", indent);
+        stats_print_task(bp, &enc->task, i, now);
+        stats_print_queue(bp, enc->queue);
+        av_bprintf(bp, ",\"batch_size\":%u", enc->batch_size);
+        av_bprintf(bp, "}");
+    }
+    stats_print_section_end(bp, sch->nb_enc, compact);
+
+    stats_print_section(bp, "mux", 0, compact);
+    for (unsigned i = 0; i < sch->nb_mux; i++) {
+        SchMux *mux = &sch->mux[i];
+        av_bprintf(bp, "%s%s", i ? "," : "", indent);
+        stats_print_task(bp, &mux->task, i, now);
+        stats_print_queue(bp, mux->queue);
+        av_bprintf(bp, "}");
+    }
+    stats_print_section_end(bp, sch->nb_mux, compact);
+
+    av_bprintf(bp, "%s}", compact ? "" : "\n");
+}
@@ -27,6 +27,8 @@
 
 #include "ffmpeg_utils.h"
 
+#include "libavutil/bprint.h"
+
 /*
  * This file contains the API for the transcode scheduler.
  *
@@ -254,6 +256,17 @@ int sch_add_mux(Scheduler *sch, SchThreadFunc func, int (*init)(void *),
  */
 #define DEFAULT_PACKET_THREAD_QUEUE_SIZE 8
 
+/**
+ * Number of packets a packet thread queue of the default size may grow to
+ * when its consumer falls behind; it shrinks back once the consumer keeps up.
+ * Frame queues do not grow, as decoders size their frame pools from
+ * DEFAULT_FRAME_THREAD_QUEUE_SIZE.
+ *
+ * Both bound the number of items only. The bytes they hold, e.g. of large
+ * raw frames, are only capped when a limit is set with sch_mem_limit().
+ */
+#define MAX_PACKET_THREAD_QUEUE_SIZE 128
+
 /**
  * Default size of a frame thread queue.
  */
@@ -298,6 +311,89 @@ int sch_mux_stream_ready(Scheduler *sch, unsigned mux_idx, unsigned stream_idx);
  */
 int sch_sdp_filename(Scheduler *sch, const char *sdp_filename);
 
+/**
+ * Limit the memory held by packets and frames in the queues between tasks.
+ *
+ * A task sending to a queue that is not empty waits while the limit is
+ * exceeded, until an item is received from any queue. Without a limit, the
+ * queues are only bounded in number of items. Must be called before any
+ * tasks are added.
+ *
+ * @param mem_limit limit in bytes, 0 for no limit
+ */
+int sch_mem_limit(Scheduler *sch, int64_t mem_limit);
+
+/**
+ * Limit the total number of worker threads used by the codecs and filters
+ * of all the tasks. The limit is shared between the tasks that request a
+ * share with sch_threads_request(). Must be called before sch_start().
+ */
+void sch_threads_total(Scheduler *sch, unsigned nb_threads);
+
+/**
+ * Take nb_threads threads with a fixed count, e.g. the GOP decoding workers,
+ * out of the budget set with sch_threads_total() before it is divided. Must
+ * be called before sch_start().
+ */
+void sch_threads_reserve(Scheduler *sch, unsigned nb_threads);
+
+/**
+ * Request a share of the thread budget set with sch_threads_total() for the
+ * given decoder, filtergraph or encoder. When the scheduler is started, each
+ * requesting task gets one thread and the rest of the budget is divided
+ * between them proportionally to their weights. The budget is thus only
+ * exceeded when there are more requesting tasks than threads.
+ *
+ * @retval 1 the request was accepted, the number of threads must be obtained
+ *           with sch_threads() once the task is running
+ * @retval 0 there is no thread budget
+ */
+int sch_threads_request(Scheduler *sch, SchedulerNode node, unsigned weight);
+
+/**
+ * @return the number of threads assigned to the task from the thread budget,
+ *         0 if it did not request a share; may only be called after
+ *         sch_start()
+ */
+int sch_threads(Scheduler *sch, SchedulerNode node);
+
+/**
+ * Pin the threads of the tasks to sets of CPUs. Threads created by a task,
+ * e.g. filter worker threads, inherit its CPUs. Must be called before
+ * sch_start(), may be called several times.
+ *
+ * @param spec either "auto", which spreads the decoders over the NUMA nodes
+ *             and places every other task on the node of the task feeding it,
+ *             or a ';'-separated list of TYPE[:INDEX]=CPUS entries, where TYPE
+ *             is one of demux, dec, filter, enc, mux, and CPUS a list of CPUs
+ *             and CPU ranges such as 0-3,8
+ */
+int sch_affinity(Scheduler *sch, const char *spec);
+
+/**
+ * Run func with the calling thread temporarily pinned to the CPUs of the given
+ * task, so that threads it creates, e.g. codec worker threads created when
+ * opening a codec, inherit them.
+ */
+int sch_affinity_run(Scheduler *sch, SchedulerNode node,
+                     int (*func)(void *arg), void *arg);
+
+/**
+ * Collect statistics on how long each task spends running, waiting for input
+ * and waiting for its output to be accepted. Must be called before
+ * sch_start().
+ */
+void sch_enable_stats(Scheduler *sch);
+
+/**
+ * Print the statistics collected for every task as a JSON object. Queue
+ * high-water marks and choke counts are always available, the timings only
+ * after sch_enable_stats(). May be called while the tasks are running.
+ *
+ * @param compact print everything on a single line
+ */
+void sch_print_stats(Scheduler *sch, AVBPrint *bp, int compact);
+
 /**
  * Add an encoder to the scheduler.
  *
@@ -315,6 +411,19 @@ int sch_sdp_filename(Scheduler *sch, const char *sdp_filename);
 int sch_add_enc(Scheduler *sch, SchThreadFunc func, void *ctx,
                 int (*open_cb)(void *func_arg, const struct AVFrame *frame));
 
+/**
+ * Hand frames over to the encoder task in batches, which reduces the number of
+ * times it has to be woken up when frames are small and cheap to encode. Must
+ * be called before sch_start().
+ *
+ * @param batch_size number of frames to hand over at once; limited to
+ *                   DEFAULT_FRAME_THREAD_QUEUE_SIZE
+ * @param max_latency_us how long an idle encoder waits for a batch to fill up
+ *                   before taking the frames queued so far; must be positive
+ */
+int sch_enc_batch(Scheduler *sch, unsigned enc_idx, unsigned batch_size,
+                  int64_t max_latency_us);
+
 /**
  * Add an pre-encoding sync queue to the scheduler.
  *
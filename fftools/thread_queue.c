@@ -16,15 +16,18 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
  */
 
+#include <stdatomic.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <string.h>
 
 #include "libavutil/avassert.h"
+#include "libavutil/cpu.h"
 #include "libavutil/error.h"
-#include "libavutil/fifo.h"
 #include "libavutil/intreadwrite.h"
 #include "libavutil/mem.h"
 #include "libavutil/thread.h"
+#include "libavutil/time.h"
 
 #include "objpool.h"
 #include "thread_queue.h"
@@ -34,22 +37,67 @@ enum {
     FINISHED_RECV = (1 << 1),
 };
 
-typedef struct FifoElem {
-    void        *obj;
-    unsigned int stream_idx;
-} FifoElem;
+/* number of times a blocked sender or receiver polls the ring before it
+ * parks on the condition variable */
+#define SPIN_COUNT 128
+
+/* how long a sender waits when only the memory budget keeps it from
+ * sending and no queue sharing the budget receives anything, before it
+ * sends anyway; this keeps queues forming a cycle (e.g. subtitle
+ * heartbeats) from waiting on each other forever */
+#define MEM_WAIT_US 100000
+
+/**
+ * Ring entry. seq equals the write position it can be written at when the
+ * slot is free, and that position + 1 once it holds an item; the reader
+ * advances it by the ring size when it is done with the item.
+ */
+typedef struct RingSlot {
+    atomic_size_t   seq;
+    void           *obj;
+    unsigned int    stream_idx;
+    size_t          size;
+} RingSlot;
 
 struct ThreadQueue {
-    int              *finished;
+    atomic_int       *finished;
     unsigned int    nb_streams;
 
-    AVFifo  *fifo;
+    RingSlot     *slots;
+    size_t     nb_slots;
+    atomic_size_t write_pos;
+    atomic_size_t read_pos;
+    /* current number of items senders may queue, between base_limit and
+     * nb_slots */
+    atomic_size_t limit;
+    size_t        base_limit;
+    /* largest number of items queued at once */
+    atomic_size_t max_items;
+
+    /* a sleeping receiver is only woken once this many items are queued,
+     * or after max_latency_us */
+    size_t        batch_size;
+    int64_t       max_latency_us;
+    /* items received, and times the receiver slept before receiving them */
+    atomic_uint_least64_t nb_received;
+    atomic_uint_least64_t nb_wakeups;
+
+    ThreadQueueMem *mem;
+    size_t        (*obj_size)(const void *obj);
 
     ObjPool *obj_pool;
     void   (*obj_move)(void *dst, void *src);
 
+    int             spin_count;
+
+    /* threads that found the ring full or empty and went to sleep; only
+     * touched by the other side when non-zero, so the lock is not taken
+     * in the common case */
+    atomic_int      send_waiters;
+    atomic_int      recv_waiters;
     pthread_mutex_t lock;
-    pthread_cond_t  cond;
+    pthread_cond_t  cond_send;
+    pthread_cond_t  cond_recv;
 };
 
 void tq_free(ThreadQueue **ptq)
@@ -59,25 +107,32 @@ void tq_free(ThreadQueue **ptq)
     if (!tq)
         return;
 
-    if (tq->fifo) {
-        FifoElem elem;
-        while (av_fifo_read(tq->fifo, &elem, 1) >= 0)
-            objpool_release(tq->obj_pool, &elem.obj);
+    if (tq->slots) {
+        size_t end = atomic_load(&tq->write_pos);
+
+        /* return the budget of items nobody received */
+        for (size_t pos = atomic_load(&tq->read_pos); tq->mem && pos != end; pos++)
+            atomic_fetch_sub(&tq->mem->used, tq->slots[pos % tq->nb_slots].size);
+
+        for (size_t i = 0; i < tq->nb_slots; i++)
+            objpool_release(tq->obj_pool, &tq->slots[i].obj);
     }
-    av_fifo_freep2(&tq->fifo);
+    av_freep(&tq->slots);
 
     objpool_free(&tq->obj_pool);
 
     av_freep(&tq->finished);
 
-    pthread_cond_destroy(&tq->cond);
+    pthread_cond_destroy(&tq->cond_recv);
+    pthread_cond_destroy(&tq->cond_send);
     pthread_mutex_destroy(&tq->lock);
 
     av_freep(ptq);
 }
 
 ThreadQueue *tq_alloc(unsigned int nb_streams, size_t queue_size,
-                      ObjPool *obj_pool, void (*obj_move)(void *dst, void *src))
+                      size_t max_queue_size, ObjPool *obj_pool,
+                      void (*obj_move)(void *dst, void *src))
 {
     ThreadQueue *tq;
     int ret;
@@ -86,15 +141,23 @@ ThreadQueue *tq_alloc(unsigned int nb_streams, size_t queue_size,
     if (!tq)
         return NULL;
 
-    ret = pthread_cond_init(&tq->cond, NULL);
+    ret = pthread_cond_init(&tq->cond_send, NULL);
     if (ret) {
         av_freep(&tq);
         return NULL;
     }
 
+    ret = pthread_cond_init(&tq->cond_recv, NULL);
+    if (ret) {
+        pthread_cond_destroy(&tq->cond_send);
+        av_freep(&tq);
+        return NULL;
+    }
+
     ret = pthread_mutex_init(&tq->lock, NULL);
     if (ret) {
-        pthread_cond_destroy(&tq->cond);
+        pthread_cond_destroy(&tq->cond_recv);
+        pthread_cond_destroy(&tq->cond_send);
         av_freep(&tq);
         return NULL;
     }
@@ -102,123 +165,464 @@ ThreadQueue *tq_alloc(unsigned int nb_streams, size_t queue_size,
     tq->finished = av_calloc(nb_streams, sizeof(*tq->finished));
     if (!tq->finished)
         goto fail;
+    for (unsigned int i = 0; i < nb_streams; i++)
+        atomic_init(&tq->finished[i], 0);
     tq->nb_streams = nb_streams;
 
-    tq->fifo = av_fifo_alloc2(queue_size, sizeof(FifoElem), 0);
-    if (!tq->fifo)
+    /* every slot owns an object for its whole lifetime, so the pool is
+     * never touched by the sending threads; the sequence numbers cannot
+     * tell a full slot from a free one in a ring of size one */
+    tq->nb_slots = FFMAX3(queue_size, max_queue_size, 2);
+    tq->slots    = av_calloc(tq->nb_slots, sizeof(*tq->slots));
+    if (!tq->slots)
         goto fail;
+    for (size_t i = 0; i < tq->nb_slots; i++) {
+        atomic_init(&tq->slots[i].seq, i);
+        if (objpool_get(obj_pool, &tq->slots[i].obj) < 0)
+            goto fail;
+    }
+    atomic_init(&tq->write_pos, 0);
+    atomic_init(&tq->read_pos,  0);
+    tq->base_limit = FFMAX(queue_size, 2);
+    atomic_init(&tq->limit, tq->base_limit);
+    atomic_init(&tq->max_items, 0);
+    atomic_init(&tq->nb_received, 0);
+    atomic_init(&tq->nb_wakeups, 0);
+    tq->batch_size = 1;
+    atomic_init(&tq->send_waiters, 0);
+    atomic_init(&tq->recv_waiters, 0);
+    /* polling only helps when the other side runs on another core */
+    tq->spin_count = av_cpu_count() > 1 ? SPIN_COUNT : 0;
 
     tq->obj_pool = obj_pool;
     tq->obj_move = obj_move;
 
     return tq;
 fail:
+    /* the pool stays owned by the caller on failure */
+    if (tq->slots) {
+        for (size_t i = 0; i < tq->nb_slots; i++)
+            objpool_release(obj_pool, &tq->slots[i].obj);
+    }
+    av_freep(&tq->slots);
     tq_free(&tq);
     return NULL;
 }
 
-int tq_send(ThreadQueue *tq, unsigned int stream_idx, void *data)
+int tq_mem_init(ThreadQueueMem *mem, size_t limit)
 {
-    int *finished;
     int ret;
 
-    av_assert0(stream_idx < tq->nb_streams);
-    finished = &tq->finished[stream_idx];
+    atomic_init(&mem->used, 0);
+    atomic_init(&mem->waiters, 0);
+    mem->limit = limit;
+
+    ret = pthread_mutex_init(&mem->lock, NULL);
+    if (ret)
+        return AVERROR(ret);
+
+    ret = pthread_cond_init(&mem->cond, NULL);
+    if (ret) {
+        pthread_mutex_destroy(&mem->lock);
+        return AVERROR(ret);
+    }
+
+    return 0;
+}
+
+void tq_mem_uninit(ThreadQueueMem *mem)
+{
+    pthread_cond_destroy(&mem->cond);
+    pthread_mutex_destroy(&mem->lock);
+}
+
+void tq_set_mem_limit(ThreadQueue *tq, ThreadQueueMem *mem,
+                      size_t (*obj_size)(const void *obj))
+{
+    tq->mem      = mem;
+    tq->obj_size = obj_size;
+}
+
+void tq_set_batch(ThreadQueue *tq, size_t batch_size, int64_t max_latency_us)
+{
+    av_assert0(max_latency_us > 0);
+    tq->batch_size     = FFMIN(FFMAX(batch_size, 1), tq->nb_slots);
+    tq->max_latency_us = max_latency_us;
+}
+
+size_t tq_max_items(ThreadQueue *tq)
+{
+    return atomic_load(&tq->max_items);
+}
+
+void tq_receive_stats(ThreadQueue *tq, uint64_t *nb_items, uint64_t *nb_wakeups)
+{
+    *nb_items   = atomic_load_explicit(&tq->nb_received, memory_order_relaxed);
+    *nb_wakeups = atomic_load_explicit(&tq->nb_wakeups,  memory_order_relaxed);
+}
+
+static void wake(ThreadQueue *tq, atomic_int *waiters, pthread_cond_t *cond)
+{
+    if (!atomic_load(waiters))
+        return;
 
     pthread_mutex_lock(&tq->lock);
+    pthread_cond_broadcast(cond);
+    pthread_mutex_unlock(&tq->lock);
+}
 
-    if (*finished & FINISHED_SEND) {
-        ret = AVERROR(EINVAL);
-        goto finish;
+static void wake_mem(ThreadQueueMem *mem)
+{
+    if (!mem || !atomic_load(&mem->waiters))
+        return;
+
+    pthread_mutex_lock(&mem->lock);
+    pthread_cond_broadcast(&mem->cond);
+    pthread_mutex_unlock(&mem->lock);
+}
+
+static int ring_full(ThreadQueue *tq)
+{
+    size_t      pos = atomic_load(&tq->write_pos);
+    RingSlot  *slot = &tq->slots[pos % tq->nb_slots];
+    return (ptrdiff_t)(atomic_load(&slot->seq) - pos) < 0;
+}
+
+static int over_mem_limit(ThreadQueue *tq, size_t nb_items, size_t size)
+{
+    /* an empty queue always accepts an item, so every queue makes progress
+     * however the budget is shared */
+    return tq->mem && nb_items &&
+           atomic_load(&tq->mem->used) + size > tq->mem->limit;
+}
+
+/* whether a sender of an item with the given size has to wait */
+static int send_blocked(ThreadQueue *tq, size_t size, int ignore_mem)
+{
+    size_t nb_items = atomic_load(&tq->write_pos) - atomic_load(&tq->read_pos);
+    size_t limit    = atomic_load(&tq->limit);
+
+    if (!ignore_mem && over_mem_limit(tq, nb_items, size))
+        return 1;
+
+    /* the consumer is not keeping up, queue more items while the memory
+     * budget allows it rather than stalling the sender */
+    while (nb_items >= limit && limit < tq->nb_slots) {
+        if (atomic_compare_exchange_weak(&tq->limit, &limit,
+                                         FFMIN(limit * 2, tq->nb_slots)))
+            limit = FFMIN(limit * 2, tq->nb_slots);
     }
 
-    while (!(*finished & FINISHED_RECV) && !av_fifo_can_write(tq->fifo))
-        pthread_cond_wait(&tq->cond, &tq->lock);
+    return nb_items >= limit || ring_full(tq);
+}
 
-    if (*finished & FINISHED_RECV) {
-        ret = AVERROR_EOF;
-        *finished |= FINISHED_SEND;
-    } else {
-        FifoElem elem = { .stream_idx = stream_idx };
+/* the consumer keeps up again: once the queue drains to a quarter of its
+ * limit, halve the limit back towards the configured size, so a queue
+ * that grew during a burst does not keep that much data in flight */
+static void shrink_limit(ThreadQueue *tq)
+{
+    size_t limit = atomic_load_explicit(&tq->limit, memory_order_relaxed);
+    size_t nb_items;
 
-        ret = objpool_get(tq->obj_pool, &elem.obj);
-        if (ret < 0)
-            goto finish;
+    if (limit <= tq->base_limit)
+        return;
+
+    nb_items = atomic_load(&tq->write_pos) - atomic_load(&tq->read_pos);
+    if (nb_items <= limit / 4)
+        atomic_compare_exchange_strong(&tq->limit, &limit,
+                                       FFMAX(limit / 2, tq->base_limit));
+}
+
+/* whether enough items are queued to wake a sleeping receiver */
+static int batch_ready(ThreadQueue *tq)
+{
+    return tq->batch_size <= 1 ||
+           atomic_load(&tq->write_pos) - atomic_load(&tq->read_pos) >= tq->batch_size;
+}
+
+/* whether no slot is claimed by a sender; a slot claimed by a sender that
+ * has not finished writing it yet does not count as empty */
+static int ring_empty(ThreadQueue *tq)
+{
+    return atomic_load(&tq->write_pos) == atomic_load(&tq->read_pos);
+}
+
+/* whether the oldest item has been written and can be read */
+static int ring_readable(ThreadQueue *tq)
+{
+    size_t      pos = atomic_load(&tq->read_pos);
+    RingSlot  *slot = &tq->slots[pos % tq->nb_slots];
+    return atomic_load(&slot->seq) == pos + 1;
+}
 
-        tq->obj_move(elem.obj, data);
+static int ring_write(ThreadQueue *tq, unsigned int stream_idx, void *data,
+                      size_t size)
+{
+    size_t pos = atomic_load_explicit(&tq->write_pos, memory_order_relaxed);
+    RingSlot *slot;
 
-        ret = av_fifo_write(tq->fifo, &elem, 1);
-        av_assert0(ret >= 0);
-        pthread_cond_broadcast(&tq->cond);
+    while (1) {
+        ptrdiff_t diff;
+
+        slot = &tq->slots[pos % tq->nb_slots];
+        diff = atomic_load_explicit(&slot->seq, memory_order_acquire) - pos;
+        if (!diff) {
+            if (atomic_compare_exchange_weak_explicit(&tq->write_pos, &pos, pos + 1,
+                                                      memory_order_relaxed,
+                                                      memory_order_relaxed))
+                break;
+        } else if (diff < 0)
+            return AVERROR(EAGAIN);
+        else
+            pos = atomic_load_explicit(&tq->write_pos, memory_order_relaxed);
     }
 
-finish:
-    pthread_mutex_unlock(&tq->lock);
+    tq->obj_move(slot->obj, data);
+    slot->stream_idx = stream_idx;
+    slot->size       = size;
+    atomic_store(&slot->seq, pos + 1);
 
-    return ret;
+    return 0;
+}
+
+static void update_max_items(ThreadQueue *tq)
+{
+    size_t nb_items = atomic_load(&tq->write_pos) - atomic_load(&tq->read_pos);
+    size_t max      = atomic_load_explicit(&tq->max_items, memory_order_relaxed);
+
+    /* the positions are read separately, so the count may be off by a
+     * concurrent receive, which is good enough for statistics */
+    while (nb_items > max && nb_items <= tq->nb_slots &&
+           !atomic_compare_exchange_weak(&tq->max_items, &max, nb_items))
+        ;
+}
+
+/* claim the oldest item; it must be handed back with ring_read_done() */
+static RingSlot *ring_read(ThreadQueue *tq, size_t *ppos)
+{
+    size_t pos = atomic_load_explicit(&tq->read_pos, memory_order_relaxed);
+
+    while (1) {
+        RingSlot *slot = &tq->slots[pos % tq->nb_slots];
+        ptrdiff_t diff = atomic_load_explicit(&slot->seq, memory_order_acquire) - (pos + 1);
+
+        if (!diff) {
+            if (atomic_compare_exchange_weak_explicit(&tq->read_pos, &pos, pos + 1,
+                                                      memory_order_relaxed,
+                                                      memory_order_relaxed)) {
+                *ppos = pos;
+                return slot;
+            }
+        } else if (diff < 0)
+            return NULL;
+        else
+            pos = atomic_load_explicit(&tq->read_pos, memory_order_relaxed);
+    }
+}
+
+static void ring_read_done(ThreadQueue *tq, RingSlot *slot, size_t pos)
+{
+    if (tq->mem)
+        atomic_fetch_sub(&tq->mem->used, slot->size);
+    atomic_store(&slot->seq, pos + tq->nb_slots);
 }
 
-static int receive_locked(ThreadQueue *tq, int *stream_idx,
-                          void *data)
+int tq_send(ThreadQueue *tq, unsigned int stream_idx, void *data)
 {
-    FifoElem elem;
-    unsigned int nb_finished = 0;
+    atomic_int *finished;
+    size_t size = 0;
+    int ignore_mem = 0, mem_wait = 0;
+
+    av_assert0(stream_idx < tq->nb_streams);
+    finished = &tq->finished[stream_idx];
+
+    if (atomic_load(finished) & FINISHED_SEND)
+        return AVERROR(EINVAL);
+
+    if (tq->mem)
+        size = tq->obj_size(data);
+
+    for (int spin = 0;; spin++) {
+        if (atomic_load(finished) & FINISHED_RECV) {
+            atomic_fetch_or(finished, FINISHED_SEND);
+            return AVERROR_EOF;
+        }
+
+        if (!send_blocked(tq, size, ignore_mem)) {
+            /* reserve the memory first, so the receiver never releases
+             * more than has been accounted */
+            if (tq->mem)
+                atomic_fetch_add(&tq->mem->used, size);
+            if (ring_write(tq, stream_idx, data, size) >= 0) {
+                update_max_items(tq);
+                if (batch_ready(tq))
+                    wake(tq, &tq->recv_waiters, &tq->cond_recv);
+                return 0;
+            }
+            if (tq->mem)
+                atomic_fetch_sub(&tq->mem->used, size);
+        }
+
+        if (spin < tq->spin_count)
+            continue;
+
+        /* the waiter count is raised before the state is checked again, so
+         * a receiver that frees a slot after that check sees it and wakes us */
+        pthread_mutex_lock(&tq->lock);
+        atomic_fetch_add(&tq->send_waiters, 1);
+        if (!(atomic_load(finished) & FINISHED_RECV) && send_blocked(tq, size, ignore_mem)) {
+            /* the receiver may be waiting for a batch we cannot complete */
+            if (tq->batch_size > 1)
+                pthread_cond_broadcast(&tq->cond_recv);
+            /* only the budget blocks us, which any queue sharing it may
+             * release; wait for that below instead */
+            if (tq->mem && !send_blocked(tq, size, 1))
+                mem_wait = 1;
+            else
+                pthread_cond_wait(&tq->cond_send, &tq->lock);
+        }
+        atomic_fetch_sub(&tq->send_waiters, 1);
+        pthread_mutex_unlock(&tq->lock);
+
+        if (mem_wait) {
+            ThreadQueueMem *mem = tq->mem;
+
+            pthread_mutex_lock(&mem->lock);
+            atomic_fetch_add(&mem->waiters, 1);
+            if (!(atomic_load(finished) & FINISHED_RECV) && send_blocked(tq, size, 0)) {
+                int64_t timeout_us = av_gettime() + MEM_WAIT_US;
+                struct timespec tv = { .tv_sec  =  timeout_us / 1000000,
+                                       .tv_nsec = (timeout_us % 1000000) * 1000 };
+                if (pthread_cond_timedwait(&mem->cond, &mem->lock, &tv) == ETIMEDOUT)
+                    ignore_mem = 1;
+            }
+            atomic_fetch_sub(&mem->waiters, 1);
+            pthread_mutex_unlock(&mem->lock);
+            mem_wait = 0;
+        }
+    }
+}
 
-    while (av_fifo_read(tq->fifo, &elem, 1) >= 0) {
-        if (tq->finished[elem.stream_idx] & FINISHED_RECV) {
-            objpool_release(tq->obj_pool, &elem.obj);
+static int receive_nonblock(ThreadQueue *tq, int *stream_idx,
+                            void *data)
+{
+    RingSlot *slot;
+    size_t pos;
+    unsigned int nb_finished;
+    int ret = AVERROR(EAGAIN), nb_read = 0;
+
+    while ((slot = ring_read(tq, &pos))) {
+        nb_read++;
+
+        if (atomic_load(&tq->finished[slot->stream_idx]) & FINISHED_RECV) {
+            /* drop the contents, the object goes straight back to the slot */
+            objpool_release(tq->obj_pool, &slot->obj);
+            ret = objpool_get(tq->obj_pool, &slot->obj);
+            av_assert0(ret >= 0);
+            ring_read_done(tq, slot, pos);
+            ret = AVERROR(EAGAIN);
             continue;
         }
 
-        tq->obj_move(data, elem.obj);
-        objpool_release(tq->obj_pool, &elem.obj);
-        *stream_idx = elem.stream_idx;
-        return 0;
+        tq->obj_move(data, slot->obj);
+        *stream_idx = slot->stream_idx;
+        ring_read_done(tq, slot, pos);
+        atomic_fetch_add_explicit(&tq->nb_received, 1, memory_order_relaxed);
+        ret = 0;
+        goto finish;
     }
 
+    nb_finished = 0;
     for (unsigned int i = 0; i < tq->nb_streams; i++) {
-        if (!tq->finished[i])
+        int finished = atomic_load(&tq->finished[i]);
+
+        if (!finished)
             continue;
 
         /* return EOF to the consumer at most once for each stream */
-        if (!(tq->finished[i] & FINISHED_RECV)) {
-            tq->finished[i] |= FINISHED_RECV;
+        if (!(finished & FINISHED_RECV)) {
+            /* items sent before the stream was finished may still sit
+             * behind a slot another sender claimed but has not written
+             * yet; the EOF must wait until the ring is drained, or those
+             * items would be dropped as belonging to a finished stream */
+            if (!ring_empty(tq)) {
+                ret = AVERROR(EAGAIN);
+                goto finish;
+            }
+
+            atomic_fetch_or(&tq->finished[i], FINISHED_RECV);
             *stream_idx   = i;
-            return AVERROR_EOF;
+            ret = AVERROR_EOF;
+            goto finish;
         }
 
         nb_finished++;
     }
 
-    return nb_finished == tq->nb_streams ? AVERROR_EOF : AVERROR(EAGAIN);
+    ret = nb_finished == tq->nb_streams ? AVERROR_EOF : AVERROR(EAGAIN);
+
+finish:
+    // signal senders waiting for space, once for all items read
+    if (nb_read) {
+        shrink_limit(tq);
+        wake(tq, &tq->send_waiters, &tq->cond_send);
+        wake_mem(tq->mem);
+    }
+
+    return ret;
 }
 
-int tq_receive(ThreadQueue *tq, int *stream_idx, void *data)
+static int receive_ready(ThreadQueue *tq)
 {
-    int ret;
+    if (!ring_empty(tq)) {
+        /* the sender still writing the oldest slot wakes us once done */
+        if (!ring_readable(tq))
+            return 0;
+        /* a sender blocked on a full queue must not wait for the batch */
+        if (batch_ready(tq) || atomic_load(&tq->send_waiters))
+            return 1;
+    }
 
-    *stream_idx = -1;
+    for (unsigned int i = 0; i < tq->nb_streams; i++)
+        if ((atomic_load(&tq->finished[i]) & (FINISHED_SEND | FINISHED_RECV)) == FINISHED_SEND)
+            return 1;
 
-    pthread_mutex_lock(&tq->lock);
+    return 0;
+}
 
-    while (1) {
-        size_t can_read = av_fifo_can_read(tq->fifo);
+int tq_receive(ThreadQueue *tq, int *stream_idx, void *data)
+{
+    int ret, slept = 0;
 
-        ret = receive_locked(tq, stream_idx, data);
+    *stream_idx = -1;
 
-        // signal other threads if the fifo state changed
-        if (can_read != av_fifo_can_read(tq->fifo))
-            pthread_cond_broadcast(&tq->cond);
+    for (int spin = 0;; spin++) {
+        ret = receive_nonblock(tq, stream_idx, data);
+        if (ret != AVERROR(EAGAIN))
+            break;
 
-        if (ret == AVERROR(EAGAIN)) {
-            pthread_cond_wait(&tq->cond, &tq->lock);
+        if (spin < tq->spin_count)
             continue;
-        }
 
-        break;
+        pthread_mutex_lock(&tq->lock);
+        atomic_fetch_add(&tq->recv_waiters, 1);
+        if (!receive_ready(tq)) {
+            if (tq->batch_size > 1) {
+                /* on timeout, take whatever part of the batch is queued */
+                int64_t timeout_us = av_gettime() + tq->max_latency_us;
+                struct timespec tv = { .tv_sec  =  timeout_us / 1000000,
+                                       .tv_nsec = (timeout_us % 1000000) * 1000 };
+                pthread_cond_timedwait(&tq->cond_recv, &tq->lock, &tv);
+            } else
+                pthread_cond_wait(&tq->cond_recv, &tq->lock);
+            slept = 1;
+        }
+        atomic_fetch_sub(&tq->recv_waiters, 1);
+        pthread_mutex_unlock(&tq->lock);
     }
 
-    pthread_mutex_unlock(&tq->lock);
+    if (slept && ret >= 0)
+        atomic_fetch_add_explicit(&tq->nb_wakeups, 1, memory_order_relaxed);
 
     return ret;
 }
@@ -227,28 +631,21 @@ void tq_send_finish(ThreadQueue *tq, unsigned int stream_idx)
 {
     av_assert0(stream_idx < tq->nb_streams);
 
-    pthread_mutex_lock(&tq->lock);
-
     /* mark the stream as send-finished;
      * next time the consumer thread tries to read this stream it will get
      * an EOF and recv-finished flag will be set */
-    tq->finished[stream_idx] |= FINISHED_SEND;
-    pthread_cond_broadcast(&tq->cond);
-
-    pthread_mutex_unlock(&tq->lock);
+    atomic_fetch_or(&tq->finished[stream_idx], FINISHED_SEND);
+    wake(tq, &tq->recv_waiters, &tq->cond_recv);
 }
 
 void tq_receive_finish(ThreadQueue *tq, unsigned int stream_idx)
 {
     av_assert0(stream_idx < tq->nb_streams);
 
-    pthread_mutex_lock(&tq->lock);
-
     /* mark the stream as recv-finished;
      * next time the producer thread tries to send for this stream, it will
      * get an EOF and send-finished flag will be set */
-    tq->finished[stream_idx] |= FINISHED_RECV;
-    pthread_cond_broadcast(&tq->cond);
-
-    pthread_mutex_unlock(&tq->lock);
+    atomic_fetch_or(&tq->finished[stream_idx], FINISHED_RECV);
+    wake(tq, &tq->send_waiters, &tq->cond_send);
+    wake_mem(tq->mem);
 }
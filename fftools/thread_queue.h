@@ -19,12 +19,47 @@
 #ifndef FFTOOLS_THREAD_QUEUE_H
 #define FFTOOLS_THREAD_QUEUE_H
 
+#include <stdatomic.h>
+#include <stdint.h>
 #include <string.h>
 
+#include "libavutil/thread.h"
+
 #include "objpool.h"
 
 typedef struct ThreadQueue ThreadQueue;
 
+/**
+ * Memory budget shared between several queues.
+ */
+typedef struct ThreadQueueMem {
+    /**
+     * Sum of the sizes of all items currently stored in the queues using
+     * this budget.
+     */
+    atomic_size_t used;
+    /**
+     * A queue holding at least one item blocks senders while adding the
+     * next item would exceed this. Blocked senders are woken whenever an
+     * item is received from any queue sharing the budget. The limit is
+     * soft: a sender blocked only by it while nothing at all is received
+     * for a while sends anyway, so queues depending on each other cannot
+     * deadlock.
+     */
+    size_t        limit;
+
+    /* senders waiting for budget to be released */
+    atomic_int      waiters;
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+} ThreadQueueMem;
+
+/**
+ * Initialize a budget with the given limit in bytes.
+ */
+int  tq_mem_init(ThreadQueueMem *mem, size_t limit);
+void tq_mem_uninit(ThreadQueueMem *mem);
+
 /**
  * Allocate a queue for sending data between threads.
  *
@@ -32,14 +67,54 @@ typedef struct ThreadQueue ThreadQueue;
  *                   maintained
  * @param queue_size number of items that can be stored in the queue without
  *                   blocking
+ * @param max_queue_size if larger than queue_size, the number of items is
+ *                   doubled up to this value whenever a sender would
+ *                   otherwise block, unless the memory budget is exhausted
  * @param obj_pool object pool that will be used to allocate items stored in the
  *                 queue; the pool becomes owned by the queue
  * @param callback that moves the contents between two data pointers
  */
 ThreadQueue *tq_alloc(unsigned int nb_streams, size_t queue_size,
-                      ObjPool *obj_pool, void (*obj_move)(void *dst, void *src));
+                      size_t max_queue_size, ObjPool *obj_pool,
+                      void (*obj_move)(void *dst, void *src));
 void         tq_free(ThreadQueue **tq);
 
+/**
+ * Account the items stored in the queue against a memory budget. Must be
+ * called before any item is sent.
+ *
+ * @param mem the budget, must outlive the queue
+ * @param obj_size callback returning the number of bytes an item occupies
+ */
+void tq_set_mem_limit(ThreadQueue *tq, ThreadQueueMem *mem,
+                      size_t (*obj_size)(const void *obj));
+
+/**
+ * Hand items to a sleeping receiver in batches rather than one by one. The
+ * receiver is only woken once batch_size items are queued, when a sender
+ * would block, or when the stream state changes. Must be called before any
+ * item is sent.
+ *
+ * @param batch_size number of items to accumulate, clipped to the queue size;
+ *                   1 disables batching
+ * @param max_latency_us a receiver waiting for a batch takes the items queued
+ *                   so far after this long; must be positive, as the sender
+ *                   may itself be waiting for the receiver's output
+ */
+void tq_set_batch(ThreadQueue *tq, size_t batch_size, int64_t max_latency_us);
+
+/**
+ * @return the largest number of items that were stored in the queue at once;
+ *         may be called from any thread
+ */
+size_t tq_max_items(ThreadQueue *tq);
+
+/**
+ * Get the number of items received, and the number of times the receiver
+ * had to wait for items before receiving one. May be called from any thread.
+ */
+void tq_receive_stats(ThreadQueue *tq, uint64_t *nb_items, uint64_t *nb_wakeups);
+
 /**
  * Send an item for the given stream to the queue.
  *
@@ -34,6 +34,7 @@
 #include "libavutil/pixdesc.h"
 #include "libavutil/rational.h"
 #include "libavutil/samplefmt.h"
+#include "libavutil/thread.h"
 
 #include "audio.h"
 #include "avfilter.h"
@@ -175,6 +176,10 @@ int avfilter_link(AVFilterContext *src, unsigned srcpad,
     li = av_mallocz(sizeof(*li));
     if (!li)
         return AVERROR(ENOMEM);
+    if (ff_mutex_init(&li->pool_lock, NULL)) {
+        av_free(li);
+        return AVERROR(ENOMEM);
+    }
     link = &li->l.pub;
 
     src->outputs[srcpad] = dst->inputs[dstpad] = link;
@@ -203,6 +208,7 @@ static void link_free(AVFilterLink **link)
 
     ff_framequeue_free(&li->fifo);
     ff_frame_pool_uninit(&li->frame_pool);
+    ff_mutex_destroy(&li->pool_lock);
     av_channel_layout_uninit(&(*link)->ch_layout);
 
     av_buffer_unref(&li->l.hw_frames_ctx);
@@ -236,7 +242,9 @@ static void update_link_current_pts(FilterLinkInternal *li, int64_t pts)
 
 void ff_filter_set_ready(AVFilterContext *filter, unsigned priority)
 {
+    ff_graph_wave_lock(filter->graph);
     filter->ready = FFMAX(filter->ready, priority);
+    ff_graph_wave_unlock(filter->graph);
 }
 
 /**
@@ -247,10 +255,12 @@ static void filter_unblock(AVFilterContext *filter)
 {
     unsigned i;
 
+    ff_graph_wave_lock(filter->graph);
     for (i = 0; i < filter->nb_outputs; i++) {
         FilterLinkInternal * const li = ff_link_internal(filter->outputs[i]);
         li->frame_blocked_in = 0;
     }
+    ff_graph_wave_unlock(filter->graph);
 }
 
 
@@ -617,6 +627,8 @@ int avfilter_process_command(AVFilterContext *filter, const char *cmd, const cha
     }else if(!strcmp(cmd, "enable")) {
         return set_enable_expr(filter, arg);
     }else if(filter->filter->process_command) {
+        if (filter->graph)
+            fffiltergraph(filter->graph)->params_version++;
         return filter->filter->process_command(filter, cmd, arg, res, res_len, flags);
     }
     return AVERROR(ENOSYS);
@@ -657,8 +669,9 @@ static const AVClass *filter_child_class_iterate(void **iter)
 #define TFLAGS AV_OPT_FLAG_FILTERING_PARAM|AV_OPT_FLAG_RUNTIME_PARAM
 static const AVOption avfilter_options[] = {
     { "thread_type", "Allowed thread types", OFFSET(thread_type), AV_OPT_TYPE_FLAGS,
-        { .i64 = AVFILTER_THREAD_SLICE }, 0, INT_MAX, FLAGS, .unit = "thread_type" },
+        { .i64 = AVFILTER_THREAD_SLICE | AVFILTER_THREAD_FRAME }, 0, INT_MAX, FLAGS, .unit = "thread_type" },
         { "slice", NULL, 0, AV_OPT_TYPE_CONST, { .i64 = AVFILTER_THREAD_SLICE }, .flags = FLAGS, .unit = "thread_type" },
+        { "frame", NULL, 0, AV_OPT_TYPE_CONST, { .i64 = AVFILTER_THREAD_FRAME }, .flags = FLAGS, .unit = "thread_type" },
     { "enable", "set enable expression", OFFSET(enable_str), AV_OPT_TYPE_STRING, {.str=NULL}, .flags = TFLAGS },
     { "threads", "Allowed number of threads", OFFSET(nb_threads), AV_OPT_TYPE_INT,
         { .i64 = 0 }, 0, INT_MAX, FLAGS, .unit = "threads" },
@@ -691,6 +704,509 @@ static int default_execute(AVFilterContext *ctx, avfilter_action_func *func, voi
     return 0;
 }
 
+typedef struct FrameBatch {
+    // frames handed to the filter, and their timestamps
+    AVFrame   **in;
+    int64_t    *pts;
+    int        *rets;
+    int         nb_max;
+
+    // frames output by the filter, in the order it produced them
+    AVMutex     lock;
+    AVFrame   **out;
+    int         nb_out;
+} FrameBatch;
+
+static void frame_batch_free(FrameBatch **pb)
+{
+    FrameBatch *b = *pb;
+
+    if (!b)
+        return;
+
+    for (int i = 0; i < b->nb_max; i++)
+        av_frame_free(&b->in[i]);
+    for (int i = 0; i < b->nb_out; i++)
+        av_frame_free(&b->out[i]);
+
+    av_freep(&b->in);
+    av_freep(&b->pts);
+    av_freep(&b->rets);
+    av_freep(&b->out);
+    ff_mutex_destroy(&b->lock);
+
+    av_freep(pb);
+}
+
+static int frame_batch_alloc(AVFilterContext *ctx)
+{
+    FrameBatch *b;
+    int ret;
+
+    av_assert0(ctx->nb_inputs == 1 && ctx->nb_outputs == 1 &&
+               ctx->input_pads[0].type == AVMEDIA_TYPE_VIDEO &&
+               ctx->input_pads[0].filter_frame && !ctx->filter->activate);
+
+    b = av_mallocz(sizeof(*b));
+    if (!b)
+        return AVERROR(ENOMEM);
+
+    ret = ff_mutex_init(&b->lock, NULL);
+    if (ret) {
+        av_free(b);
+        return AVERROR(ret);
+    }
+
+    b->nb_max = ff_filter_get_nb_threads(ctx);
+    b->in     = av_calloc(b->nb_max, sizeof(*b->in));
+    b->pts    = av_calloc(b->nb_max, sizeof(*b->pts));
+    b->rets   = av_calloc(b->nb_max, sizeof(*b->rets));
+
+    fffilterctx(ctx)->frame_batch = b;
+
+    if (!b->in || !b->pts || !b->rets)
+        return AVERROR(ENOMEM);
+
+    return 0;
+}
+
+static int frame_batch_capture(FrameBatch *b, AVFrame *frame)
+{
+    int ret;
+
+    ff_mutex_lock(&b->lock);
+    ret = av_dynarray_add_nofree(&b->out, &b->nb_out, frame);
+    ff_mutex_unlock(&b->lock);
+
+    if (ret < 0)
+        av_frame_free(&frame);
+    return ret;
+}
+
+typedef struct PointwiseChain {
+    AVFilterContext **filters;
+    int               nb_filters;
+
+    // composed table of every component, and FFFilterGraph.params_version
+    // when they were composed
+    uint16_t         *tables[4];
+    uint16_t         *tmp;
+    unsigned          version;
+    int               valid;
+
+    int               nb_threads;
+    AVFrame          *in, *out;
+} PointwiseChain;
+
+static int pointwise_chain_usable(PointwiseChain *c, const AVFrame *frame);
+static void pointwise_chain_rows(const PointwiseChain *c, AVFrame *out,
+                                 const AVFrame *in, int jobnr, int nb_jobs);
+
+typedef struct BandChain {
+    AVFilterContext **filters;
+    int               nb_filters;
+    int               nb_bands;
+
+    // number of filters fused into a pointwise chain starting at every
+    // filter, 0 if none starts there
+    int              *fused;
+
+    // input of every filter, then the output of the last one
+    AVFrame         **frames;
+    int              *rets;
+    int               nb_rets;
+} BandChain;
+
+static void band_chain_free(BandChain **pc)
+{
+    BandChain *c = *pc;
+
+    if (!c)
+        return;
+
+    av_freep(&c->filters);
+    av_freep(&c->fused);
+    av_freep(&c->frames);
+    av_freep(&c->rets);
+
+    av_freep(pc);
+}
+
+int ff_filter_band_chain_init(AVFilterContext **filters, int nb_filters,
+                              int band_height)
+{
+    FFFilterContext *ctxi = fffilterctx(filters[0]);
+    const AVFilterLink *inlink = filters[0]->inputs[0];
+    BandChain *c;
+
+    band_chain_free(&ctxi->band_chain);
+
+    c = av_mallocz(sizeof(*c));
+    if (!c)
+        return AVERROR(ENOMEM);
+    ctxi->band_chain = c;
+
+    c->nb_rets  = ff_filter_get_nb_threads(filters[0]);
+    c->filters  = av_memdup(filters, nb_filters * sizeof(*filters));
+    c->fused    = av_calloc(nb_filters, sizeof(*c->fused));
+    c->frames   = av_calloc(nb_filters + 1, sizeof(*c->frames));
+    c->rets     = av_calloc(c->nb_rets, sizeof(*c->rets));
+    if (!c->filters || !c->fused || !c->frames || !c->rets)
+        return AVERROR(ENOMEM);
+    c->nb_filters = nb_filters;
+    c->nb_bands   = FFMAX((inlink->h + band_height - 1) / band_height, 1);
+
+    /* Fused pointwise chains are applied as a single member. */
+    for (int i = 0; i < nb_filters; i++) {
+        const PointwiseChain *pc = fffilterctx(filters[i])->pointwise_chain;
+        if (pc) {
+            av_assert0(i + pc->nb_filters <= nb_filters);
+            c->fused[i] = pc->nb_filters;
+        }
+    }
+
+    /* The bands are spread over the threads instead. */
+    for (int i = 0; i < nb_filters; i++)
+        frame_batch_free(&fffilterctx(filters[i])->frame_batch);
+
+    return 0;
+}
+
+static int band_chain_usable(const BandChain *c, const AVFrame *frame)
+{
+    const AVFilterLink *inlink = c->filters[0]->inputs[0];
+
+    if (frame->width  != inlink->w || frame->height != inlink->h ||
+        frame->format != inlink->format)
+        return 0;
+
+    /* The timeline and commands are evaluated per filter and per frame. */
+    for (int i = 0; i < c->nb_filters; i++)
+        if (c->filters[i]->enable_str || c->filters[i]->command_queue)
+            return 0;
+
+    for (int i = 0; i < c->nb_filters; i++)
+        if (c->fused[i] &&
+            !pointwise_chain_usable(fffilterctx(c->filters[i])->pointwise_chain, frame))
+            return 0;
+
+    return 1;
+}
+
+static int band_chain_job(AVFilterContext *ctx, void *arg, int jobnr, int nb_jobs)
+{
+    BandChain *c = arg;
+
+    for (int band = jobnr; band < c->nb_bands; band += nb_jobs) {
+        for (int i = 0; i < c->nb_filters; i++) {
+            AVFilterLink *link = c->filters[i]->inputs[0];
+            int ret;
+
+            if (c->fused[i]) {
+                pointwise_chain_rows(fffilterctx(c->filters[i])->pointwise_chain,
+                                     c->frames[i + c->fused[i]], c->frames[i],
+                                     band, c->nb_bands);
+                i += c->fused[i] - 1;
+                continue;
+            }
+
+            ret = link->dstpad->filter_band(link, c->frames[i + 1],
+                                            c->frames[i], band, c->nb_bands);
+            if (ret < 0)
+                return ret;
+        }
+    }
+
+    return 0;
+}
+
+static int band_chain_filter_frame(BandChain *c, AVFrame *frame)
+{
+    AVFilterContext *last = c->filters[c->nb_filters - 1];
+    AVFrame *out = NULL;
+    int nb_jobs, ret = 0;
+
+    c->frames[0] = frame;
+    for (int i = 0; i < c->nb_filters; i++) {
+        const AVFilterPad *pad = c->filters[i]->inputs[0]->dstpad;
+        AVFilterLink *outlink  = c->filters[i]->outputs[0];
+        AVFrame *in = c->frames[i];
+        const int fused = c->fused[i];
+
+        /* The inner links of a fused chain are not used, and the composed
+           table can be applied in place. */
+        if (fused) {
+            for (int j = 1; j < fused; j++)
+                c->frames[++i] = in;
+            outlink = c->filters[i]->outputs[0];
+        }
+
+        if ((fused || pad->flags & AVFILTERPAD_FLAG_BAND_IN_PLACE) &&
+            av_frame_is_writable(in)) {
+            c->frames[i + 1] = in;
+            continue;
+        }
+
+        c->frames[i + 1] = ff_get_video_buffer(outlink, outlink->w, outlink->h);
+        if (!c->frames[i + 1]) {
+            ret = AVERROR(ENOMEM);
+            goto finish;
+        }
+        ret = av_frame_copy_props(c->frames[i + 1], in);
+        if (ret < 0)
+            goto finish;
+    }
+
+    nb_jobs = FFMIN(c->nb_bands, c->nb_rets);
+    ff_filter_execute(c->filters[0], band_chain_job, c, c->rets, nb_jobs);
+    for (int i = 0; i < nb_jobs; i++)
+        if (c->rets[i] < 0) {
+            ret = c->rets[i];
+            goto finish;
+        }
+
+    /* Account for the frames that went through the inner links. */
+    for (int i = 1; i < c->nb_filters; i++) {
+        FilterLink *l = ff_filter_link(c->filters[i]->inputs[0]);
+        l->frame_count_in++;
+        l->frame_count_out++;
+    }
+
+finish:
+    /* Frames processed in place appear several times in a row. */
+    for (int i = 0; i < c->nb_filters; i++) {
+        if (c->frames[i] == c->frames[i + 1])
+            c->frames[i] = NULL;
+        else
+            av_frame_free(&c->frames[i]);
+    }
+    if (ret < 0) {
+        av_frame_free(&c->frames[c->nb_filters]);
+        return ret;
+    }
+
+    FFSWAP(AVFrame*, out, c->frames[c->nb_filters]);
+    return ff_filter_frame(last->outputs[0], out);
+}
+
+static void pointwise_chain_free(PointwiseChain **pc)
+{
+    PointwiseChain *c = *pc;
+
+    if (!c)
+        return;
+
+    av_freep(&c->filters);
+    for (int i = 0; i < FF_ARRAY_ELEMS(c->tables); i++)
+        av_freep(&c->tables[i]);
+    av_freep(&c->tmp);
+
+    av_freep(pc);
+}
+
+/**
+ * Check that every component can be accessed as a whole byte or native
+ * 16-bit word, and that the components cover the whole pixel.
+ */
+static int pointwise_format_supported(enum AVPixelFormat format)
+{
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(format);
+
+    if (desc->flags & (AV_PIX_FMT_FLAG_PAL | AV_PIX_FMT_FLAG_BITSTREAM |
+                       AV_PIX_FMT_FLAG_HWACCEL | AV_PIX_FMT_FLAG_FLOAT |
+                       AV_PIX_FMT_FLAG_BAYER) ||
+        av_get_bits_per_pixel(desc) != av_get_padded_bits_per_pixel(desc))
+        return 0;
+
+    for (int i = 0; i < desc->nb_components; i++) {
+        const AVComponentDescriptor *comp = &desc->comp[i];
+
+        if (comp->shift || comp->depth < 8 || comp->depth > 16)
+            return 0;
+        if (comp->depth > 8 &&
+            (comp->step & 1 || comp->offset & 1 ||
+             !(desc->flags & AV_PIX_FMT_FLAG_BE) != !HAVE_BIGENDIAN))
+            return 0;
+    }
+
+    return 1;
+}
+
+static int pointwise_chain_compose(PointwiseChain *c)
+{
+    const AVFilterLink *inlink = c->filters[0]->inputs[0];
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(inlink->format);
+
+    c->version = fffiltergraph(c->filters[0]->graph)->params_version;
+    c->valid   = 0;
+
+    for (int comp = 0; comp < desc->nb_components; comp++) {
+        const int size = 1 << desc->comp[comp].depth;
+        uint16_t *table = c->tables[comp];
+
+        for (int x = 0; x < size; x++)
+            table[x] = x;
+
+        for (int i = 0; i < c->nb_filters; i++) {
+            AVFilterLink *link = c->filters[i]->inputs[0];
+            int ret = link->dstpad->get_lut(link, comp, c->tmp);
+            if (ret < 0)
+                return ret;
+            for (int x = 0; x < size; x++)
+                table[x] = c->tmp[FFMIN(table[x], size - 1)];
+        }
+    }
+
+    c->valid = 1;
+    return 0;
+}
+
+int ff_filter_pointwise_chain_init(AVFilterContext **filters, int nb_filters)
+{
+    FFFilterContext *ctxi = fffilterctx(filters[0]);
+    const AVFilterLink *inlink = filters[0]->inputs[0];
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(inlink->format);
+    PointwiseChain *c;
+    int ret;
+
+    pointwise_chain_free(&ctxi->pointwise_chain);
+
+    if (!pointwise_format_supported(inlink->format) ||
+        ff_filter_link((AVFilterLink *)inlink)->hw_frames_ctx)
+        return AVERROR(ENOSYS);
+
+    c = av_mallocz(sizeof(*c));
+    if (!c)
+        return AVERROR(ENOMEM);
+    ctxi->pointwise_chain = c;
+
+    c->nb_threads = ff_filter_get_nb_threads(filters[0]);
+    c->filters    = av_memdup(filters, nb_filters * sizeof(*filters));
+    c->tmp        = av_malloc_array(1 << 16, sizeof(*c->tmp));
+    if (!c->filters || !c->tmp)
+        return AVERROR(ENOMEM);
+    c->nb_filters = nb_filters;
+
+    for (int i = 0; i < desc->nb_components; i++) {
+        c->tables[i] = av_malloc_array(1 << desc->comp[i].depth, sizeof(*c->tables[i]));
+        if (!c->tables[i])
+            return AVERROR(ENOMEM);
+    }
+
+    ret = pointwise_chain_compose(c);
+    if (ret < 0) {
+        pointwise_chain_free(&ctxi->pointwise_chain);
+        return ret;
+    }
+
+    /* The frames are spread over the slice threads instead. */
+    for (int i = 0; i < nb_filters; i++) {
+        fffilterctx(filters[i])->pointwise_fused = 1;
+        frame_batch_free(&fffilterctx(filters[i])->frame_batch);
+    }
+
+    return 0;
+}
+
+static int pointwise_chain_usable(PointwiseChain *c, const AVFrame *frame)
+{
+    const AVFilterLink *inlink = c->filters[0]->inputs[0];
+
+    if (frame->width  != inlink->w || frame->height != inlink->h ||
+        frame->format != inlink->format)
+        return 0;
+
+    /* The timeline and queued commands are evaluated per filter and frame. */
+    for (int i = 0; i < c->nb_filters; i++)
+        if (c->filters[i]->enable_str || c->filters[i]->command_queue)
+            return 0;
+
+    /* Commands processed since the tables were composed may have changed
+       the parameters of the filters. */
+    if (c->version != fffiltergraph(c->filters[0]->graph)->params_version)
+        pointwise_chain_compose(c);
+
+    return c->valid;
+}
+
+static void pointwise_chain_rows(const PointwiseChain *c, AVFrame *out,
+                                 const AVFrame *in, int jobnr, int nb_jobs)
+{
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(in->format);
+
+    for (int i = 0; i < desc->nb_components; i++) {
+        const AVComponentDescriptor *comp = &desc->comp[i];
+        const int chroma = i == 1 || i == 2;
+        const int w = chroma ? AV_CEIL_RSHIFT(in->width,  desc->log2_chroma_w) : in->width;
+        const int h = chroma ? AV_CEIL_RSHIFT(in->height, desc->log2_chroma_h) : in->height;
+        const int slice_start = (h *  jobnr   ) / nb_jobs;
+        const int slice_end   = (h * (jobnr+1)) / nb_jobs;
+        const uint16_t *table = c->tables[i];
+
+        for (int y = slice_start; y < slice_end; y++) {
+            const uint8_t *src = in ->data[comp->plane] + y * in ->linesize[comp->plane] + comp->offset;
+            uint8_t       *dst = out->data[comp->plane] + y * out->linesize[comp->plane] + comp->offset;
+
+            if (comp->depth == 8) {
+                for (int x = 0; x < w; x++)
+                    dst[x * comp->step] = table[src[x * comp->step]];
+            } else {
+                const int mask = (1 << comp->depth) - 1;
+                const int step = comp->step >> 1;
+                const uint16_t *src16 = (const uint16_t *)src;
+                uint16_t       *dst16 = (uint16_t *)dst;
+
+                for (int x = 0; x < w; x++)
+                    dst16[x * step] = table[src16[x * step] & mask];
+            }
+        }
+    }
+}
+
+static int pointwise_chain_job(AVFilterContext *ctx, void *arg, int jobnr, int nb_jobs)
+{
+    PointwiseChain *c = arg;
+
+    pointwise_chain_rows(c, c->out, c->in, jobnr, nb_jobs);
+    return 0;
+}
+
+static int pointwise_chain_filter_frame(PointwiseChain *c, AVFrame *in)
+{
+    AVFilterLink *outlink = c->filters[c->nb_filters - 1]->outputs[0];
+    AVFrame *out;
+    int nb_jobs;
+
+    if (av_frame_is_writable(in)) {
+        out = in;
+    } else {
+        out = ff_get_video_buffer(outlink, outlink->w, outlink->h);
+        if (!out) {
+            av_frame_free(&in);
+            return AVERROR(ENOMEM);
+        }
+        av_frame_copy_props(out, in);
+    }
+
+    c->in  = in;
+    c->out = out;
+    nb_jobs = FFMIN(in->height, c->nb_threads);
+    ff_filter_execute(c->filters[0], pointwise_chain_job, c, NULL, nb_jobs);
+    c->in = c->out = NULL;
+
+    if (out != in)
+        av_frame_free(&in);
+
+    /* Account for the frames that went through the inner links. */
+    for (int i = 1; i < c->nb_filters; i++) {
+        FilterLink *l = ff_filter_link(c->filters[i]->inputs[0]);
+        l->frame_count_in++;
+        l->frame_count_out++;
+    }
+
+    return ff_filter_frame(outlink, out);
+}
+
 AVFilterContext *ff_filter_alloc(const AVFilter *filter, const char *inst_name)
 {
     FFFilterContext *ctx;
@@ -815,6 +1331,10 @@ void avfilter_free(AVFilterContext *filter)
 
     av_buffer_unref(&filter->hw_device_ctx);
 
+    frame_batch_free(&fffilterctx(filter)->frame_batch);
+    band_chain_free(&fffilterctx(filter)->band_chain);
+    pointwise_chain_free(&fffilterctx(filter)->pointwise_chain);
+
     av_freep(&filter->name);
     av_freep(&filter->input_pads);
     av_freep(&filter->output_pads);
@@ -907,7 +1427,7 @@ int ff_filter_process_command(AVFilterContext *ctx, const char *cmd,
 int avfilter_init_dict(AVFilterContext *ctx, AVDictionary **options)
 {
     FFFilterContext *ctxi = fffilterctx(ctx);
-    int ret = 0;
+    int thread_type, ret = 0;
 
     if (ctxi->initialized) {
         av_log(ctx, AV_LOG_ERROR, "Filter already initialized\n");
@@ -920,13 +1440,24 @@ int avfilter_init_dict(AVFilterContext *ctx, AVDictionary **options)
         return ret;
     }
 
+    thread_type      = ctx->thread_type & ctx->graph->thread_type;
+    ctx->thread_type = 0;
+
     if (ctx->filter->flags & AVFILTER_FLAG_SLICE_THREADS &&
-        ctx->thread_type & ctx->graph->thread_type & AVFILTER_THREAD_SLICE &&
+        thread_type & AVFILTER_THREAD_SLICE &&
         fffiltergraph(ctx->graph)->thread_execute) {
-        ctx->thread_type       = AVFILTER_THREAD_SLICE;
-        ctxi->execute    = fffiltergraph(ctx->graph)->thread_execute;
-    } else {
-        ctx->thread_type = 0;
+        ctx->thread_type |= AVFILTER_THREAD_SLICE;
+        ctxi->execute     = fffiltergraph(ctx->graph)->thread_execute;
+    }
+
+    if (ctx->filter->flags & AVFILTER_FLAG_FRAME_THREADS &&
+        thread_type & AVFILTER_THREAD_FRAME &&
+        fffiltergraph(ctx->graph)->thread_execute &&
+        ff_filter_get_nb_threads(ctx) > 1) {
+        ret = frame_batch_alloc(ctx);
+        if (ret < 0)
+            return ret;
+        ctx->thread_type |= AVFILTER_THREAD_FRAME;
     }
 
     if (ctx->filter->init)
@@ -999,6 +1530,21 @@ static int ff_filter_frame_framed(AVFilterLink *link, AVFrame *frame)
     if (!(filter_frame = dst->filter_frame))
         filter_frame = default_filter_frame;
 
+    /* A band chain may start with a fused pointwise chain. */
+    if (fffilterctx(dstctx)->band_chain &&
+        band_chain_usable(fffilterctx(dstctx)->band_chain, frame)) {
+        ret = band_chain_filter_frame(fffilterctx(dstctx)->band_chain, frame);
+        l->frame_count_out++;
+        return ret;
+    }
+
+    if (fffilterctx(dstctx)->pointwise_chain &&
+        pointwise_chain_usable(fffilterctx(dstctx)->pointwise_chain, frame)) {
+        ret = pointwise_chain_filter_frame(fffilterctx(dstctx)->pointwise_chain, frame);
+        l->frame_count_out++;
+        return ret;
+    }
+
     if (dst->flags & AVFILTERPAD_FLAG_NEEDS_WRITABLE) {
         ret = ff_inlink_make_frame_writable(link, &frame);
         if (ret < 0)
@@ -1026,6 +1572,9 @@ int ff_filter_frame(AVFilterLink *link, AVFrame *frame)
     int ret;
     FF_TPRINTF_START(NULL, filter_frame); ff_tlog_link(NULL, link, 1); ff_tlog(NULL, " "); tlog_ref(NULL, frame, 1);
 
+    if (li->capture)
+        return frame_batch_capture(li->capture, frame);
+
     /* Consistency checks */
     if (link->type == AVMEDIA_TYPE_VIDEO) {
         if (strcmp(link->dst->filter->name, "buffersink") &&
@@ -1175,6 +1724,126 @@ static int ff_filter_frame_to_filter(AVFilterLink *link)
     return ret;
 }
 
+static int frame_batch_job(AVFilterContext *ctx, void *arg, int jobnr, int nb_jobs)
+{
+    FrameBatch *b = arg;
+    AVFrame *frame = b->in[jobnr];
+
+    b->in[jobnr] = NULL;
+    return ctx->input_pads[0].filter_frame(ctx->inputs[0], frame);
+}
+
+static int frame_batch_activate(AVFilterContext *filter)
+{
+    FFFilterContext *ctxi = fffilterctx(filter);
+    FrameBatch *b = ctxi->frame_batch;
+    AVFilterLink *inlink = filter->inputs[0], *outlink = filter->outputs[0];
+    FilterLinkInternal *li_in  = ff_link_internal(inlink);
+    FilterLinkInternal *li_out = ff_link_internal(outlink);
+    avfilter_execute_func *execute = ctxi->execute;
+    size_t queued = ff_framequeue_queued_frames(&li_in->fifo);
+    int nb_frames, ret = 0;
+
+    /* The timeline and commands are evaluated in frame order, leave those
+       frames to the regular path. */
+    if (!queued || filter->enable_str || filter->command_queue)
+        return FFERROR_NOT_READY;
+
+    /* Wait for a frame for every thread, unless the input has ended. */
+    if (queued < b->nb_max && !li_in->status_in) {
+        if (li_out->frame_wanted_out && !li_in->frame_wanted_out)
+            ff_inlink_request_frame(inlink);
+        return 0;
+    }
+
+    /* The output frames are matched to the input frames by their timestamps,
+       which must thus be distinct. */
+    nb_frames = FFMIN(queued, b->nb_max);
+    for (int i = 0; i < nb_frames; i++) {
+        int64_t pts = ff_framequeue_peek(&li_in->fifo, i)->pts;
+
+        for (int j = 0; j < i && pts != AV_NOPTS_VALUE; j++)
+            if (b->pts[j] == pts)
+                pts = AV_NOPTS_VALUE;
+        if (pts == AV_NOPTS_VALUE) {
+            nb_frames = i;
+            break;
+        }
+        b->pts[i] = pts;
+    }
+    if (nb_frames < 2)
+        return FFERROR_NOT_READY;
+
+    for (int i = 0; i < nb_frames; i++) {
+        ff_inlink_consume_frame(inlink, &b->in[i]);
+        av_assert1(b->in[i]);
+
+        if (inlink->dstpad->flags & AVFILTERPAD_FLAG_NEEDS_WRITABLE) {
+            ret = ff_inlink_make_frame_writable(inlink, &b->in[i]);
+            if (ret < 0)
+                goto fail;
+        }
+    }
+    filter_unblock(filter);
+
+    /* Setting up the frame pool of the output is not thread-safe. */
+    if (!ff_filter_link(outlink)->hw_frames_ctx) {
+        AVFrame *frame = ff_get_video_buffer(outlink, outlink->w, outlink->h);
+        if (!frame) {
+            ret = AVERROR(ENOMEM);
+            goto fail;
+        }
+        av_frame_free(&frame);
+    }
+
+    /* Each frame is processed by a thread of the graph, so the slices of a
+       frame must not be dispatched to the same threads. */
+    filter->is_disabled = 0;
+    li_out->capture     = b;
+    ctxi->execute       = default_execute;
+    fffiltergraph(filter->graph)->thread_execute(filter, frame_batch_job, b,
+                                                 b->rets, nb_frames);
+    ctxi->execute       = execute;
+    li_out->capture     = NULL;
+
+    for (int i = 0; i < nb_frames; i++) {
+        for (int j = 0; j < b->nb_out; j++) {
+            if (b->out[j] && b->out[j]->pts == b->pts[i]) {
+                int err = ff_filter_frame(outlink, b->out[j]);
+                b->out[j] = NULL;
+                if (err < 0 && ret >= 0)
+                    ret = err;
+                break;
+            }
+        }
+        if (b->rets[i] < 0 && ret >= 0)
+            ret = b->rets[i];
+    }
+    /* frames whose timestamps were changed by the filter, in breach of
+       AVFILTER_FLAG_FRAME_THREADS */
+    for (int j = 0; j < b->nb_out; j++) {
+        if (b->out[j]) {
+            int err = ff_filter_frame(outlink, b->out[j]);
+            b->out[j] = NULL;
+            if (err < 0 && ret >= 0)
+                ret = err;
+        }
+    }
+    av_freep(&b->out);
+    b->nb_out = 0;
+
+    if (ret < 0 && ret != li_in->status_out)
+        link_set_out_status(inlink, ret, AV_NOPTS_VALUE);
+    else
+        ff_filter_set_ready(filter, 300);
+    return ret;
+
+fail:
+    for (int i = 0; i < nb_frames; i++)
+        av_frame_free(&b->in[i]);
+    return ret;
+}
+
 static int forward_status_change(AVFilterContext *filter, FilterLinkInternal *li_in)
 {
     AVFilterLink *in = &li_in->l.pub;
@@ -1225,6 +1894,12 @@ static int ff_filter_activate_default(AVFilterContext *filter)
         }
     }
 
+    if (fffilterctx(filter)->frame_batch) {
+        int ret = frame_batch_activate(filter);
+        if (ret != FFERROR_NOT_READY)
+            return ret;
+    }
+
     for (i = 0; i < filter->nb_inputs; i++) {
         FilterLinkInternal *li = ff_link_internal(filter->inputs[i]);
         if (samples_ready(li, li->l.min_samples)) {
@@ -1387,7 +2062,9 @@ int ff_filter_activate(AVFilterContext *filter)
     /* Generic timeline support is not yet implemented but should be easy */
     av_assert1(!(filter->filter->flags & AVFILTER_FLAG_SUPPORT_TIMELINE_GENERIC &&
                  filter->filter->activate));
+    ff_graph_wave_lock(filter->graph);
     filter->ready = 0;
+    ff_graph_wave_unlock(filter->graph);
     ret = filter->filter->activate ? filter->filter->activate(filter) :
           ff_filter_activate_default(filter);
     if (ret == FFERROR_NOT_READY)
@@ -1589,8 +2266,11 @@ void ff_inlink_set_status(AVFilterLink *link, int status)
     FilterLinkInternal * const li = ff_link_internal(link);
     if (li->status_out)
         return;
+    /* filter_unblock() on the source filter may clear these concurrently */
+    ff_graph_wave_lock(link->dst->graph);
     li->frame_wanted_out = 0;
     li->frame_blocked_in = 0;
+    ff_graph_wave_unlock(link->dst->graph);
     link_set_out_status(link, status, AV_NOPTS_VALUE);
     while (ff_framequeue_queued_frames(&li->fifo)) {
            AVFrame *frame = ff_framequeue_take(&li->fifo);
@@ -1651,5 +2331,8 @@ int ff_outlink_frame_wanted(AVFilterLink *link)
 int ff_filter_execute(AVFilterContext *ctx, avfilter_action_func *func,
                       void *arg, int *ret, int nb_jobs)
 {
+    /* The graph thread pool is busy running the current wave. */
+    if (ctx->graph && fffiltergraph(ctx->graph)->wave_running)
+        return default_execute(ctx, func, arg, ret, nb_jobs);
     return fffilterctx(ctx)->execute(ctx, func, arg, ret, nb_jobs);
 }
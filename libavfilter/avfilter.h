@@ -171,6 +171,15 @@ typedef struct AVFilterFormatsConfig {
  * The filter can create hardware frames using AVFilterContext.hw_device_ctx.
  */
 #define AVFILTER_FLAG_HWDEVICE              (1 << 4)
+/**
+ * The filter supports multithreading by processing several frames
+ * concurrently. The filter must have a single video input and a single
+ * output and use AVFilterPad.filter_frame(), which must then be safe to call
+ * from several threads at once: it may only read the filter's private context,
+ * must output at most one frame for each input frame, with the same pts, and
+ * must not depend on the state of the links, such as the frame counters.
+ */
+#define AVFILTER_FLAG_FRAME_THREADS         (1 << 5)
 /**
  * Some filters support a generic "enable" expression option that can be used
  * to enable or disable a filter in the timeline. Filters supporting this
@@ -452,6 +461,20 @@ unsigned avfilter_filter_pad_count(const AVFilter *filter, int is_output);
  * Process multiple parts of the frame concurrently.
  */
 #define AVFILTER_THREAD_SLICE (1 << 0)
+/**
+ * Process several frames concurrently in filters flagged with
+ * AVFILTER_FLAG_FRAME_THREADS. This delays the output of those filters by up
+ * to as many frames as there are threads, so it is not allowed by default in
+ * AVFilterGraph.thread_type.
+ */
+#define AVFILTER_THREAD_FRAME (1 << 1)
+/**
+ * Activate several ready filters of the graph concurrently, as long as no
+ * two of them are directly linked to each other. Only meaningful in
+ * AVFilterGraph.thread_type; slice threading is run inline by the filters
+ * activated this way. Not allowed by default.
+ */
+#define AVFILTER_THREAD_GRAPH (1 << 2)
 
 /** An instance of a filter */
 struct AVFilterContext {
@@ -769,7 +792,8 @@ typedef struct AVFilterGraph {
      * of AVFILTER_THREAD_* flags.
      *
      * May be set by the caller at any point, the setting will apply to all
-     * filters initialized after that. The default is allowing everything.
+     * filters initialized after that. The default is allowing everything
+     * except AVFILTER_THREAD_FRAME and AVFILTER_THREAD_GRAPH.
      *
      * When a filter in this graph is initialized, this field is combined using
      * bit AND with AVFilterContext.thread_type to get the final mask used for
@@ -807,6 +831,39 @@ typedef struct AVFilterGraph {
     avfilter_execute_func *execute;
 
     char *aresample_swr_opts; ///< swr options to use for the auto-inserted aresample filters, Access ONLY through AVOptions
+
+    /**
+     * Height in rows of the horizontal bands streamed through chains of
+     * adjacent filters supporting it, so that every band goes through the
+     * whole chain while it is still in the CPU cache. The chains are set up
+     * by avfilter_graph_config(), other filters receive whole frames as
+     * usual. Zero (the default) disables band streaming.
+     *
+     * Must be set before avfilter_graph_config().
+     */
+    int band_height;
+
+    /**
+     * If nonzero (the default), avfilter_graph_config() fuses chains of
+     * adjacent pointwise filters, such as lut or negate, into a single pass
+     * over each frame using composed lookup tables. The output is identical
+     * to running the filters one after the other. A fused chain is applied
+     * band by band when it is part of a chain used for band_height.
+     *
+     * Must be set before avfilter_graph_config().
+     */
+    int fuse_pointwise;
+
+    /**
+     * If nonzero, avfilter_graph_config() picks the pixel formats left open
+     * by the filters so as to minimize the estimated work of all the format
+     * conversion filters in the graph, instead of matching each link to its
+     * neighbour. The chosen conversions are logged at verbose level.
+     * Zero (the default) keeps the historical choice.
+     *
+     * Must be set before avfilter_graph_config().
+     */
+    int format_cost;
 } AVFilterGraph;
 
 /**
@@ -885,6 +942,24 @@ enum {
  */
 int avfilter_graph_config(AVFilterGraph *graphctx, void *log_ctx);
 
+/**
+ * Check validity and negotiate the formats of all the links in the graph,
+ * without configuring the links.
+ *
+ * On success the format, colorspace, color_range, sample_rate and ch_layout
+ * fields of every link hold the values that avfilter_graph_config() would
+ * have chosen. This allows inspecting the outcome of format negotiation
+ * without initializing the filters' processing state.
+ *
+ * The graph cannot be configured afterwards; it can only be inspected and
+ * freed with avfilter_graph_free().
+ *
+ * @param graphctx the filter graph
+ * @param log_ctx context used for logging
+ * @return >= 0 in case of success, a negative AVERROR code otherwise
+ */
+int avfilter_graph_negotiate_formats(AVFilterGraph *graphctx, void *log_ctx);
+
 /**
  * Free a graph, destroy its links, and set *graph to NULL.
  * If *graph is NULL, do nothing.
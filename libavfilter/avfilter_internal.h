@@ -27,6 +27,8 @@
 
 #include <stdint.h>
 
+#include "libavutil/thread.h"
+
 #include "avfilter.h"
 #include "filters.h"
 #include "framequeue.h"
@@ -35,6 +37,11 @@ typedef struct FilterLinkInternal {
     FilterLink l;
 
     struct FFFramePool *frame_pool;
+    /**
+     * Serializes the setup of frame_pool by the filters activated
+     * concurrently with AVFILTER_THREAD_GRAPH, see ff_link_pool_lock().
+     */
+    AVMutex pool_lock;
 
     /**
      * Queue of frames waiting to be filtered.
@@ -45,6 +52,8 @@ typedef struct FilterLinkInternal {
      * If set, the source filter can not generate a frame as is.
      * The goal is to avoid repeatedly calling the request_frame() method on
      * the same link.
+     * filter_unblock() clears it from the filter upstream of the source, so
+     * the destination filter must hold the graph wave lock to write it.
      */
     int frame_blocked_in;
 
@@ -79,6 +88,13 @@ typedef struct FilterLinkInternal {
      */
     int age_index;
 
+    /**
+     * Set on the output of a filter while it processes several frames
+     * concurrently. Frames sent on the link are collected there, and are
+     * queued in order once all the frames have been processed.
+     */
+    struct FrameBatch *capture;
+
     /** stage of the initialization of the link properties (dimensions, etc) */
     enum {
         AVLINK_UNINIT = 0,      ///< not started
@@ -100,6 +116,20 @@ typedef struct FFFilterContext {
 
     avfilter_execute_func *execute;
 
+    // state for processing several frames concurrently, allocated when
+    // AVFILTER_THREAD_FRAME is used by the filter
+    struct FrameBatch *frame_batch;
+
+    // chain of filters this filter streams bands through, set on the first
+    // filter of the chain when AVFilterGraph.band_height is used
+    struct BandChain *band_chain;
+
+    // chain of pointwise filters fused into a single pass, set on the first
+    // filter of the chain when AVFilterGraph.fuse_pointwise is used
+    struct PointwiseChain *pointwise_chain;
+    // 1 when this filter is part of such a chain
+    int pointwise_fused;
+
     // 1 when avfilter_init_*() was successfully called on this filter
     // 0 otherwise
     int initialized;
@@ -132,6 +162,25 @@ typedef struct FFFilterGraph {
     void *thread;
     avfilter_execute_func *thread_execute;
     FFFrameQueueGlobal frame_queues;
+
+    /**
+     * Filters activated concurrently by ff_filter_graph_run_once() with
+     * AVFILTER_THREAD_GRAPH. While wave_running is set, updates that may
+     * touch a filter other than the one being activated, such as its
+     * readiness, are serialized by wave_lock. Link frame pools have a lock
+     * of their own.
+     */
+    AVMutex wave_lock;
+    int wave_running;
+    AVFilterContext **wave;
+    int *wave_rets;
+    int wave_alloc;
+
+    /**
+     * Incremented whenever a filter of the graph processes a command, so
+     * that state derived from the filter parameters can be refreshed.
+     */
+    unsigned params_version;
 } FFFilterGraph;
 
 static inline FFFilterGraph *fffiltergraph(AVFilterGraph *graph)
@@ -139,6 +188,37 @@ static inline FFFilterGraph *fffiltergraph(AVFilterGraph *graph)
     return (FFFilterGraph*)graph;
 }
 
+static inline void ff_graph_wave_lock(AVFilterGraph *graph)
+{
+    if (graph && fffiltergraph(graph)->wave_running)
+        ff_mutex_lock(&fffiltergraph(graph)->wave_lock);
+}
+
+static inline void ff_graph_wave_unlock(AVFilterGraph *graph)
+{
+    if (graph && fffiltergraph(graph)->wave_running)
+        ff_mutex_unlock(&fffiltergraph(graph)->wave_lock);
+}
+
+/**
+ * Lock the frame pool of a link while a wave runs. The lock is per link so
+ * that filters allocating on different links do not wait for each other.
+ * Returns whether the lock was taken, to be passed to ff_link_pool_unlock().
+ */
+static inline int ff_link_pool_lock(FilterLinkInternal *li)
+{
+    if (!li->l.graph || !fffiltergraph(li->l.graph)->wave_running)
+        return 0;
+    ff_mutex_lock(&li->pool_lock);
+    return 1;
+}
+
+static inline void ff_link_pool_unlock(FilterLinkInternal *li, int locked)
+{
+    if (locked)
+        ff_mutex_unlock(&li->pool_lock);
+}
+
 /**
  * Update the position of a link in the age heap.
  */
@@ -162,6 +242,26 @@ void ff_filter_graph_remove_filter(AVFilterGraph *graph, AVFilterContext *filter
 
 int ff_filter_activate(AVFilterContext *filter);
 
+/**
+ * Stream frames received by filters[0] through all the filters as bands of
+ * band_height rows, replacing any previous chain on filters[0]. All filters
+ * must support AVFilterPad.filter_band and be linked one after the other
+ * with links of the same dimensions and format.
+ */
+int ff_filter_band_chain_init(AVFilterContext **filters, int nb_filters,
+                              int band_height);
+
+/**
+ * Process frames received by filters[0] with a single lookup table per
+ * component, composed from the tables of all the filters. All filters must
+ * support AVFilterPad.get_lut and be linked one after the other with links
+ * of the same dimensions and format.
+ *
+ * @return 0 on success, AVERROR(ENOSYS) if the format is not supported,
+ *         another negative AVERROR on error
+ */
+int ff_filter_pointwise_chain_init(AVFilterContext **filters, int nb_filters);
+
 /**
  * Parse filter options into a dictionary.
  *
@@ -49,6 +49,8 @@ static const AVOption filtergraph_options[] = {
     { "thread_type", "Allowed thread types", OFFSET(thread_type), AV_OPT_TYPE_FLAGS,
         { .i64 = AVFILTER_THREAD_SLICE }, 0, INT_MAX, F|V|A, .unit = "thread_type" },
         { "slice", NULL, 0, AV_OPT_TYPE_CONST, { .i64 = AVFILTER_THREAD_SLICE }, .flags = F|V|A, .unit = "thread_type" },
+        { "frame", NULL, 0, AV_OPT_TYPE_CONST, { .i64 = AVFILTER_THREAD_FRAME }, .flags = F|V|A, .unit = "thread_type" },
+        { "graph", NULL, 0, AV_OPT_TYPE_CONST, { .i64 = AVFILTER_THREAD_GRAPH }, .flags = F|V|A, .unit = "thread_type" },
     { "threads",     "Maximum number of threads", OFFSET(nb_threads), AV_OPT_TYPE_INT,
         { .i64 = 0 }, 0, INT_MAX, F|V|A, .unit = "threads"},
         {"auto", "autodetect a suitable number of threads to use", 0, AV_OPT_TYPE_CONST, {.i64 = 0 }, .flags = F|V|A, .unit = "threads"},
@@ -56,6 +58,12 @@ static const AVOption filtergraph_options[] = {
         AV_OPT_TYPE_STRING, {.str = NULL}, 0, 0, F|V },
     {"aresample_swr_opts"   , "default aresample filter options"    , OFFSET(aresample_swr_opts)    ,
         AV_OPT_TYPE_STRING, {.str = NULL}, 0, 0, F|A },
+    { "band_height", "Height of the bands streamed through filter chains", OFFSET(band_height), AV_OPT_TYPE_INT,
+        { .i64 = 0 }, 0, INT_MAX, F|V },
+    { "fuse_pointwise", "Fuse chains of pointwise filters", OFFSET(fuse_pointwise), AV_OPT_TYPE_BOOL,
+        { .i64 = 1 }, 0, 1, F|V },
+    { "format_cost", "Pick pixel formats minimizing the conversion work", OFFSET(format_cost), AV_OPT_TYPE_BOOL,
+        { .i64 = 0 }, 0, 1, F|V },
     { NULL },
 };
 
@@ -92,6 +100,7 @@ AVFilterGraph *avfilter_graph_alloc(void)
     ret->av_class = &filtergraph_class;
     av_opt_set_defaults(ret);
     ff_framequeue_global_init(&graph->frame_queues);
+    ff_mutex_init(&graph->wave_lock, NULL);
 
     return ret;
 }
@@ -128,6 +137,9 @@ void avfilter_graph_free(AVFilterGraph **graphp)
     ff_graph_thread_free(graphi);
 
     av_freep(&graphi->sink_links);
+    av_freep(&graphi->wave);
+    av_freep(&graphi->wave_rets);
+    ff_mutex_destroy(&graphi->wave_lock);
 
     av_opt_free(graph);
 
@@ -1168,6 +1180,248 @@ static void swap_sample_fmts(AVFilterGraph *graph)
 
 }
 
+/**
+ * Estimate the work needed to convert one pixel from src to dst, in bits
+ * touched plus penalties for the costlier steps of the conversion. Any
+ * loss of information weighs more than the conversion itself, so that the
+ * cheapest format is never picked at the expense of quality.
+ */
+static int pix_fmt_conversion_cost(enum AVPixelFormat src, enum AVPixelFormat dst)
+{
+    const AVPixFmtDescriptor *s = av_pix_fmt_desc_get(src);
+    const AVPixFmtDescriptor *d = av_pix_fmt_desc_get(dst);
+    int cost, loss;
+
+    if (src == dst)
+        return 0;
+
+    cost = av_get_padded_bits_per_pixel(s) + av_get_padded_bits_per_pixel(d);
+    if ((s->flags ^ d->flags) & (AV_PIX_FMT_FLAG_RGB | AV_PIX_FMT_FLAG_XYZ))
+        cost += 32; /* color matrix */
+    if (s->log2_chroma_w != d->log2_chroma_w ||
+        s->log2_chroma_h != d->log2_chroma_h)
+        cost += 16; /* chroma resampling */
+    if (s->comp[0].depth != d->comp[0].depth ||
+        ((s->flags ^ d->flags) & (AV_PIX_FMT_FLAG_FLOAT | AV_PIX_FMT_FLAG_BE)))
+        cost += 8;  /* sample conversion */
+    /* excess resolution or depth is already paid for in bits touched */
+    loss  = av_get_pix_fmt_loss(dst, src, s->nb_components % 2 == 0);
+    cost += 1024 * av_popcount(loss & ~(FF_LOSS_EXCESS_RESOLUTION | FF_LOSS_EXCESS_DEPTH));
+
+    return cost;
+}
+
+static int pix_fmts_are_sw(const AVFilterFormats *fmts)
+{
+    for (int i = 0; i < fmts->nb_formats; i++)
+        if (av_pix_fmt_desc_get(fmts->formats[i])->flags & AV_PIX_FMT_FLAG_HWACCEL)
+            return 0;
+    return 1;
+}
+
+/**
+ * Check whether the filter is the one inserted to convert video formats,
+ * which converts its first input to its outputs. Other filters with
+ * different input and output formats do the same work whatever the choice.
+ */
+static int is_format_converter(AVFilterContext *f)
+{
+    return f->nb_inputs && f->inputs[0] &&
+           f->inputs[0]->type == AVMEDIA_TYPE_VIDEO &&
+           !strcmp(f->filter->name, ff_filter_get_negotiation(f->inputs[0])->conversion_filter);
+}
+
+/* Largest number of format combinations tried exhaustively. */
+#define FORMAT_SEARCH_MAX (1 << 16)
+
+typedef struct FormatSearch {
+    // input and output formats lists of every conversion
+    AVFilterFormats **conv_in, **conv_out;
+    int nb_convs;
+
+    // lists with a choice left, and the index of the format tried in each
+    AVFilterFormats **lists;
+    int *choice, *best;
+    int nb_lists;
+} FormatSearch;
+
+static enum AVPixelFormat search_format(const FormatSearch *fs,
+                                        const AVFilterFormats *fmts)
+{
+    for (int i = 0; i < fs->nb_lists; i++)
+        if (fs->lists[i] == fmts)
+            return fmts->formats[fs->choice[i]];
+    return fmts->formats[0];
+}
+
+static int64_t search_cost(const FormatSearch *fs)
+{
+    int64_t total = 0;
+
+    for (int i = 0; i < fs->nb_convs; i++)
+        total += pix_fmt_conversion_cost(search_format(fs, fs->conv_in[i]),
+                                         search_format(fs, fs->conv_out[i]));
+    return total;
+}
+
+static int search_add_list(FormatSearch *fs, AVFilterFormats *fmts)
+{
+    if (fmts->nb_formats <= 1)
+        return 0;
+    for (int i = 0; i < fs->nb_lists; i++)
+        if (fs->lists[i] == fmts)
+            return 0;
+    fs->lists[fs->nb_lists++] = fmts;
+    return 1;
+}
+
+/**
+ * Pick the pixel formats of the video links that still have a choice so as
+ * to minimize the estimated work of the conversion filters of the graph.
+ * The links sharing a formats list must agree, so the lists next to a
+ * conversion are decided jointly: all their combinations are tried when
+ * there are at most FORMAT_SEARCH_MAX of them. Otherwise each list is set
+ * in turn to its best format given the others until none changes, which
+ * may end in a local minimum.
+ */
+static int pick_formats_by_cost(AVFilterGraph *graph)
+{
+    FormatSearch fs = { 0 };
+    int64_t combinations = 1, best_cost;
+    int ret = 0;
+
+    fs.conv_in  = av_malloc_array(graph->nb_filters, sizeof(*fs.conv_in));
+    fs.conv_out = av_malloc_array(graph->nb_filters, sizeof(*fs.conv_out));
+    fs.lists    = av_malloc_array(graph->nb_filters, 2 * sizeof(*fs.lists));
+    fs.choice   = av_calloc(graph->nb_filters, 2 * sizeof(*fs.choice));
+    fs.best     = av_calloc(graph->nb_filters, 2 * sizeof(*fs.best));
+    if (!fs.conv_in || !fs.conv_out || !fs.lists || !fs.choice || !fs.best) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+
+    for (int i = 0; i < graph->nb_filters; i++) {
+        AVFilterContext *f = graph->filters[i];
+        AVFilterFormats *in, *out;
+
+        if (!is_format_converter(f) || f->nb_outputs != 1 || !f->outputs[0])
+            continue;
+        in  = f->inputs[0]->incfg.formats;
+        out = f->outputs[0]->incfg.formats;
+        if (!in || !out || !in->nb_formats || !out->nb_formats ||
+            !pix_fmts_are_sw(in) || !pix_fmts_are_sw(out))
+            continue;
+
+        fs.conv_in [fs.nb_convs] = in;
+        fs.conv_out[fs.nb_convs] = out;
+        fs.nb_convs++;
+        if (search_add_list(&fs, in))
+            combinations = FFMIN(combinations * in->nb_formats, FORMAT_SEARCH_MAX + 1);
+        if (search_add_list(&fs, out))
+            combinations = FFMIN(combinations * out->nb_formats, FORMAT_SEARCH_MAX + 1);
+    }
+    if (!fs.nb_lists)
+        goto end;
+
+    best_cost = search_cost(&fs);
+    if (combinations <= FORMAT_SEARCH_MAX) {
+        /* count through all the combinations */
+        for (;;) {
+            int64_t cost;
+            int i;
+
+            for (i = 0; i < fs.nb_lists; i++) {
+                if (++fs.choice[i] < fs.lists[i]->nb_formats)
+                    break;
+                fs.choice[i] = 0;
+            }
+            if (i == fs.nb_lists)
+                break;
+            cost = search_cost(&fs);
+            if (cost < best_cost) {
+                best_cost = cost;
+                memcpy(fs.best, fs.choice, fs.nb_lists * sizeof(*fs.best));
+            }
+        }
+    } else {
+        int change;
+
+        av_log(graph, AV_LOG_VERBOSE, "format plan: %d lists are too many to "
+               "try all combinations, improving one at a time\n", fs.nb_lists);
+        do {
+            change = 0;
+            for (int i = 0; i < fs.nb_lists; i++) {
+                const int cur = fs.choice[i];
+
+                for (int k = 0; k < fs.lists[i]->nb_formats; k++) {
+                    int64_t cost;
+
+                    fs.choice[i] = k;
+                    cost = search_cost(&fs);
+                    if (cost < best_cost) {
+                        best_cost = cost;
+                        fs.best[i] = k;
+                    }
+                }
+                fs.choice[i] = fs.best[i];
+                change |= fs.choice[i] != cur;
+            }
+        } while (change);
+    }
+
+    for (int i = 0; i < fs.nb_lists; i++) {
+        AVFilterFormats *fmts = fs.lists[i];
+
+        av_log(graph, AV_LOG_DEBUG, "picking %s out of %d\n",
+               av_get_pix_fmt_name(fmts->formats[fs.best[i]]), fmts->nb_formats);
+        fmts->formats[0] = fmts->formats[fs.best[i]];
+        fmts->nb_formats = 1;
+    }
+    av_log(graph, AV_LOG_DEBUG, "format plan: estimated cost %"PRId64"\n", best_cost);
+
+end:
+    av_free(fs.conv_in);
+    av_free(fs.conv_out);
+    av_free(fs.lists);
+    av_free(fs.choice);
+    av_free(fs.best);
+    return ret;
+}
+
+/**
+ * Log the format conversions done in the graph with their estimated cost.
+ */
+static void dump_format_plan(AVFilterGraph *graph)
+{
+    int64_t total = 0;
+
+    for (int i = 0; i < graph->nb_filters; i++) {
+        AVFilterContext *filter = graph->filters[i];
+
+        /* every input, as a filter may be fed by several conversions */
+        for (int j = 0; j < filter->nb_inputs; j++) {
+            AVFilterLink *link = filter->inputs[j];
+            AVFilterLink *in;
+            int cost;
+
+            if (!link || link->type != AVMEDIA_TYPE_VIDEO ||
+                !is_format_converter(link->src))
+                continue;
+            in = link->src->inputs[0];
+            if (link->format == in->format ||
+                ((av_pix_fmt_desc_get(in->format)->flags |
+                  av_pix_fmt_desc_get(link->format)->flags) & AV_PIX_FMT_FLAG_HWACCEL))
+                continue;
+            cost = pix_fmt_conversion_cost(in->format, link->format);
+            av_log(graph, AV_LOG_VERBOSE, "format plan: '%s' converts %s to %s for '%s', cost %d\n",
+                   link->src->name, av_get_pix_fmt_name(in->format),
+                   av_get_pix_fmt_name(link->format), filter->name, cost);
+            total += cost;
+        }
+    }
+    av_log(graph, AV_LOG_VERBOSE, "format plan: total conversion cost %"PRId64"\n", total);
+}
+
 static int pick_formats(AVFilterGraph *graph)
 {
     int i, j, ret;
@@ -1245,9 +1499,15 @@ static int graph_config_formats(AVFilterGraph *graph, void *log_ctx)
     swap_samplerates(graph);
     swap_channel_layouts(graph);
 
+    if (graph->format_cost && (ret = pick_formats_by_cost(graph)) < 0)
+        return ret;
+
     if ((ret = pick_formats(graph)) < 0)
         return ret;
 
+    if (graph->format_cost)
+        dump_format_plan(graph);
+
     return 0;
 }
 
@@ -1291,6 +1551,156 @@ static int graph_config_pointers(AVFilterGraph *graph, void *log_ctx)
     return 0;
 }
 
+static int pointwise_member(AVFilterContext *f, uint16_t *scratch)
+{
+    AVFilterLink *inlink, *outlink;
+
+    if (f->nb_inputs != 1 || f->nb_outputs != 1 ||
+        !f->inputs[0] || !f->outputs[0] ||
+        f->inputs[0]->type != AVMEDIA_TYPE_VIDEO ||
+        !f->input_pads[0].get_lut || f->filter->activate)
+        return 0;
+
+    inlink  = f->inputs[0];
+    outlink = f->outputs[0];
+    if (inlink->w != outlink->w || inlink->h != outlink->h ||
+        inlink->format != outlink->format)
+        return 0;
+
+    /* Check that the current parameters can be expressed as a table. */
+    return f->input_pads[0].get_lut(inlink, 0, scratch) >= 0;
+}
+
+/**
+ * Find chains of adjacent pointwise filters and fuse them.
+ */
+static int graph_config_pointwise_chains(AVFilterGraph *graph, void *log_ctx)
+{
+    AVFilterContext **chain;
+    uint16_t *scratch;
+    int ret = 0;
+
+    if (!graph->fuse_pointwise)
+        return 0;
+
+    chain   = av_malloc_array(graph->nb_filters, sizeof(*chain));
+    scratch = av_malloc_array(1 << 16, sizeof(*scratch));
+    if (!chain || !scratch) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+
+    for (unsigned i = 0; i < graph->nb_filters; i++) {
+        AVFilterContext *f = graph->filters[i];
+        int nb = 0;
+
+        if (!pointwise_member(f, scratch))
+            continue;
+        /* Not the first filter of a chain. */
+        if (pointwise_member(f->inputs[0]->src, scratch))
+            continue;
+
+        while (pointwise_member(f, scratch)) {
+            chain[nb++] = f;
+            f = f->outputs[0]->dst;
+        }
+        if (nb < 2)
+            continue;
+
+        ret = ff_filter_pointwise_chain_init(chain, nb);
+        if (ret == AVERROR(ENOSYS)) {
+            ret = 0;
+            continue;
+        } else if (ret < 0)
+            break;
+        av_log(log_ctx, AV_LOG_VERBOSE,
+               "Fusing %d pointwise filters from '%s' to '%s'\n",
+               nb, chain[0]->name, chain[nb - 1]->name);
+    }
+
+end:
+    av_free(chain);
+    av_free(scratch);
+    return ret;
+}
+
+static int band_chain_member(AVFilterContext *f)
+{
+    if (f->nb_inputs != 1 || f->nb_outputs != 1 ||
+        !f->inputs[0] || !f->outputs[0] ||
+        f->inputs[0]->type != AVMEDIA_TYPE_VIDEO ||
+        f->filter->activate)
+        return 0;
+
+    /* Filters of a fused pointwise chain are applied together on the bands. */
+    if (fffilterctx(f)->pointwise_fused)
+        return 1;
+    if (!f->input_pads[0].filter_band)
+        return 0;
+
+    /* Check that the current parameters allow filtering bands. */
+    return f->input_pads[0].filter_band(f->inputs[0], NULL, NULL, 0, 1) >= 0;
+}
+
+static int band_chain_link(const AVFilterLink *link, const AVFilterLink *ref)
+{
+    /* Palettes are not made of rows. */
+    return link->w == ref->w && link->h == ref->h &&
+           link->format == ref->format &&
+           !(av_pix_fmt_desc_get(link->format)->flags & AV_PIX_FMT_FLAG_PAL) &&
+           !ff_filter_link((AVFilterLink *)link)->hw_frames_ctx;
+}
+
+/**
+ * Find chains of adjacent filters supporting band filtering and attach them
+ * to their first filter.
+ */
+static int graph_config_band_chains(AVFilterGraph *graph, void *log_ctx)
+{
+    AVFilterContext **chain = NULL;
+    int ret = 0;
+
+    if (!graph->band_height)
+        return 0;
+
+    chain = av_malloc_array(graph->nb_filters, sizeof(*chain));
+    if (!chain)
+        return AVERROR(ENOMEM);
+
+    for (unsigned i = 0; i < graph->nb_filters; i++) {
+        AVFilterContext *f = graph->filters[i];
+        const AVFilterLink *ref;
+        int nb = 0;
+
+        if (!band_chain_member(f))
+            continue;
+        ref = f->inputs[0];
+        if (!band_chain_link(ref, ref))
+            continue;
+        /* Not the first filter of a chain. */
+        if (band_chain_member(ref->src) && band_chain_link(ref->src->inputs[0], ref))
+            continue;
+
+        while (band_chain_member(f) && band_chain_link(f->inputs[0], ref) &&
+               band_chain_link(f->outputs[0], ref)) {
+            chain[nb++] = f;
+            f = f->outputs[0]->dst;
+        }
+        if (nb < 2)
+            continue;
+
+        ret = ff_filter_band_chain_init(chain, nb, graph->band_height);
+        if (ret < 0)
+            break;
+        av_log(log_ctx, AV_LOG_VERBOSE,
+               "Streaming bands of %d rows from '%s' to '%s' (%d filters)\n",
+               graph->band_height, chain[0]->name, chain[nb - 1]->name, nb);
+    }
+
+    av_free(chain);
+    return ret;
+}
+
 int avfilter_graph_config(AVFilterGraph *graphctx, void *log_ctx)
 {
     int ret;
@@ -1305,6 +1715,22 @@ int avfilter_graph_config(AVFilterGraph *graphctx, void *log_ctx)
         return ret;
     if ((ret = graph_config_pointers(graphctx, log_ctx)))
         return ret;
+    if ((ret = graph_config_pointwise_chains(graphctx, log_ctx)))
+        return ret;
+    if ((ret = graph_config_band_chains(graphctx, log_ctx)))
+        return ret;
+
+    return 0;
+}
+
+int avfilter_graph_negotiate_formats(AVFilterGraph *graphctx, void *log_ctx)
+{
+    int ret;
+
+    if ((ret = graph_check_validity(graphctx, log_ctx)))
+        return ret;
+    if ((ret = graph_config_formats(graphctx, log_ctx)))
+        return ret;
 
     return 0;
 }
@@ -1468,8 +1894,73 @@ int avfilter_graph_request_oldest(AVFilterGraph *graph)
     return 0;
 }
 
+static int wave_job(AVFilterContext *ctx, void *arg, int jobnr, int nb_jobs)
+{
+    AVFilterContext **wave = arg;
+    return ff_filter_activate(wave[jobnr]);
+}
+
+static int filters_linked(const AVFilterContext *a, const AVFilterContext *b)
+{
+    for (unsigned i = 0; i < a->nb_inputs; i++)
+        if (a->inputs[i] && a->inputs[i]->src == b)
+            return 1;
+    for (unsigned i = 0; i < a->nb_outputs; i++)
+        if (a->outputs[i] && a->outputs[i]->dst == b)
+            return 1;
+    return 0;
+}
+
+static int wave_candidate(AVFilterContext *f)
+{
+    return f->nb_outputs && !fffilterctx(f)->frame_batch;
+}
+
+/**
+ * Collect ready filters that can be activated at the same time, best first.
+ * Sinks are left out because their input links feed the age heap, and so are
+ * frame-threaded filters, which need the thread pool for themselves.
+ */
+static int graph_wave_build(AVFilterGraph *graph, AVFilterContext *best)
+{
+    FFFilterGraph *graphi = fffiltergraph(graph);
+    int nb_max = FFMIN(graph->nb_threads, graph->nb_filters);
+    int nb = 0;
+
+    if (!wave_candidate(best))
+        return 0;
+
+    if (graphi->wave_alloc < nb_max) {
+        av_freep(&graphi->wave);
+        av_freep(&graphi->wave_rets);
+        graphi->wave_alloc = 0;
+        graphi->wave      = av_malloc_array(nb_max, sizeof(*graphi->wave));
+        graphi->wave_rets = av_malloc_array(nb_max, sizeof(*graphi->wave_rets));
+        if (!graphi->wave || !graphi->wave_rets)
+            return AVERROR(ENOMEM);
+        graphi->wave_alloc = nb_max;
+    }
+
+    graphi->wave[nb++] = best;
+    for (unsigned i = 0; i < graph->nb_filters && nb < nb_max; i++) {
+        AVFilterContext *f = graph->filters[i];
+        int j;
+
+        if (!f->ready || f == best || !wave_candidate(f))
+            continue;
+        for (j = 0; j < nb; j++)
+            if (filters_linked(f, graphi->wave[j]))
+                break;
+        if (j == nb)
+            graphi->wave[nb++] = f;
+    }
+
+    return nb;
+}
+
 int ff_filter_graph_run_once(AVFilterGraph *graph)
 {
+    FFFilterGraph *graphi = fffiltergraph(graph);
     AVFilterContext *filter;
     unsigned i;
 
@@ -1480,5 +1971,24 @@ int ff_filter_graph_run_once(AVFilterGraph *graph)
             filter = graph->filters[i];
     if (!filter->ready)
         return AVERROR(EAGAIN);
+
+    if (graph->thread_type & AVFILTER_THREAD_GRAPH &&
+        graphi->thread_execute && graph->nb_threads > 1) {
+        int nb = graph_wave_build(graph, filter);
+
+        if (nb < 0)
+            return nb;
+        if (nb > 1) {
+            graphi->wave_running = 1;
+            graphi->thread_execute(filter, wave_job, graphi->wave,
+                                   graphi->wave_rets, nb);
+            graphi->wave_running = 0;
+            for (i = 0; i < nb; i++)
+                if (graphi->wave_rets[i] < 0)
+                    return graphi->wave_rets[i];
+            return 0;
+        }
+    }
+
     return ff_filter_activate(filter);
 }
@@ -60,6 +60,7 @@ typedef struct BufferSinkContext {
     int sample_rates_size;
 
     AVFrame *peeked_frame;
+    int64_t eof_pts;                    ///< timestamp the input ended at
 } BufferSinkContext;
 
 #define NB_ITEMS(list) (list ## _size / sizeof(*list))
@@ -104,6 +105,7 @@ static int get_frame_internal(AVFilterContext *ctx, AVFrame *frame, int flags, i
             /* TODO return the frame instead of copying it */
             return return_or_keep_frame(buf, frame, cur_frame, flags);
         } else if (ff_inlink_acknowledge_status(inlink, &status, &pts)) {
+            buf->eof_pts = pts;
             return status;
         } else if ((flags & AV_BUFFERSINK_FLAG_NO_REQUEST)) {
             return AVERROR(EAGAIN);
@@ -134,6 +136,7 @@ static av_cold int common_init(AVFilterContext *ctx)
     BufferSinkContext *buf = ctx->priv;
 
     buf->warning_limit = 100;
+    buf->eof_pts       = AV_NOPTS_VALUE;
     return 0;
 }
 
@@ -207,6 +210,14 @@ int av_buffersink_get_channels(const AVFilterContext *ctx)
     return ctx->inputs[0]->ch_layout.nb_channels;
 }
 
+int64_t av_buffersink_get_eof_pts(const AVFilterContext *ctx)
+{
+    const BufferSinkContext *buf = ctx->priv;
+
+    av_assert0(ctx->filter->activate == activate);
+    return buf->eof_pts;
+}
+
 int av_buffersink_get_ch_layout(const AVFilterContext *ctx, AVChannelLayout *out)
 {
     AVChannelLayout ch_layout = { 0 };
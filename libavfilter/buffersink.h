@@ -129,6 +129,16 @@ int              av_buffersink_get_sample_rate         (const AVFilterContext *c
 
 AVBufferRef *    av_buffersink_get_hw_frames_ctx       (const AVFilterContext *ctx);
 
+/**
+ * Get the timestamp at which the stream ended, in the time base returned by
+ * av_buffersink_get_time_base().
+ *
+ * @return the timestamp that came with the status returned by the last
+ *         av_buffersink_get_frame*() call that failed with it, or
+ *         AV_NOPTS_VALUE before such a call
+ */
+int64_t          av_buffersink_get_eof_pts             (const AVFilterContext *ctx);
+
 /** @} */
 
 /**
@@ -61,6 +61,14 @@ struct AVFilterPad {
      */
 #define AVFILTERPAD_FLAG_FREE_NAME                       (1 << 1)
 
+    /**
+     * filter_band() supports being called with the same frame as input and
+     * output.
+     *
+     * input pads only.
+     */
+#define AVFILTERPAD_FLAG_BAND_IN_PLACE                   (1 << 2)
+
     /**
      * A combination of AVFILTERPAD_FLAG_* flags.
      */
@@ -92,6 +100,49 @@ struct AVFilterPad {
      */
     int (*filter_frame)(AVFilterLink *link, AVFrame *frame);
 
+    /**
+     * Band filtering callback, for filters whose output rows only depend on
+     * the same rows of the input, with the same dimensions and format on the
+     * input and the output. It must write rows
+     * [h * band / nb_bands, h * (band + 1) / nb_bands) of every plane of out,
+     * h being the height of the plane, the same way filter_frame() would,
+     * reading only the same rows of in. The frame properties have already
+     * been set on out. Never used with paletted formats. It may be called
+     * concurrently for different bands.
+     *
+     * When set, the graph may stream horizontal bands through a chain of such
+     * filters instead of passing whole frames between them, see
+     * AVFilterGraph.band_height. It is first called with out and in set to
+     * NULL when the chain is built, an error then keeps the filter out of it,
+     * e.g. AVERROR(ENOSYS) if its parameters depend on the frame.
+     *
+     * Input pads only.
+     *
+     * @return >= 0 on success, a negative AVERROR on error
+     */
+    int (*filter_band)(AVFilterLink *link, AVFrame *out, AVFrame *in,
+                       int band, int nb_bands);
+
+    /**
+     * Lookup table callback, for filters that map every value of every
+     * component to a new value of the same component, regardless of its
+     * position, of the other components and of the frame, with the same
+     * dimensions and format on the input and the output. Fill table, of
+     * 1 << depth entries with depth the depth of the component comp of the
+     * link format, with the value filter_frame() would currently output for
+     * every input value of that component.
+     *
+     * When set, the graph may fuse chains of such filters into a single pass
+     * over the frame, see AVFilterGraph.fuse_pointwise.
+     *
+     * Input pads only.
+     *
+     * @return >= 0 on success, AVERROR(ENOSYS) if the filter can not be
+     *         described by a lookup table with its current parameters,
+     *         another negative AVERROR on error
+     */
+    int (*get_lut)(AVFilterLink *link, int comp, uint16_t *table);
+
     /**
      * Frame request callback. A call to this should result in some progress
      * towards producing output over the given link. This should return zero
@@ -0,0 +1,465 @@
+/*
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * Drives ff_tvai_window_activate(), the in-flight window of the tvai
+ * filters, with a stub backend that finishes each frame a fixed number of
+ * wait() calls after it was submitted. Checks that the window is kept full
+ * without exceeding it, that frames come out complete and in order, and
+ * that submission errors are propagated.
+ *
+ * Then drives ff_tvai_shots_activate() over more shots than slots, checking
+ * that every shot gets a fresh processor which never receives frames after
+ * the end of its stream, and that the output keeps the input order.
+ */
+
+#include <stdio.h>
+
+#include "libavutil/mem.h"
+#include "libavfilter/avfilter.h"
+#include "libavfilter/buffersink.h"
+#include "libavfilter/buffersrc.h"
+#include "libavfilter/filters.h"
+#include "libavfilter/tvai_shots.h"
+#include "libavfilter/tvai_window.h"
+#include "libavfilter/video.h"
+
+#define STUB_MAX_QUEUED 64
+
+typedef struct StubContext {
+    int maxInFlight;
+    int latency;                    ///< wait() calls until a submitted frame is finished
+    int failAt;                     ///< index of the input frame submit() fails on, -1 for none
+    AVFrame *frames[STUB_MAX_QUEUED];
+    int64_t ready[STUB_MAX_QUEUED];
+    int first, count, submitted;
+    int64_t ticks;
+    int maxQueued, waits, drains;
+} StubContext;
+
+static int stub_submit(AVFilterContext *ctx, void *opaque, AVFrame *in)
+{
+    StubContext *s = opaque;
+    const int i = (s->first + s->count) % STUB_MAX_QUEUED;
+    if (s->submitted++ == s->failAt || s->count == STUB_MAX_QUEUED) {
+        av_frame_free(&in);
+        return AVERROR(EIO);
+    }
+    s->frames[i] = in;
+    s->ready[i]  = s->ticks + s->latency;
+    s->count++;
+    s->maxQueued = FFMAX(s->maxQueued, s->count);
+    return 0;
+}
+
+static int stub_collect(AVFilterContext *ctx, void *opaque)
+{
+    StubContext *s = opaque;
+    while (s->count > 0 && s->ready[s->first] <= s->ticks) {
+        AVFrame *out = s->frames[s->first];
+        int ret;
+        s->frames[s->first] = NULL;
+        s->first = (s->first + 1) % STUB_MAX_QUEUED;
+        s->count--;
+        if ((ret = ff_filter_frame(ctx->outputs[0], out)) < 0)
+            return ret;
+    }
+    return 0;
+}
+
+static int stub_in_flight(void *opaque)
+{
+    return ((StubContext *)opaque)->count;
+}
+
+static int stub_wait(AVFilterContext *ctx, void *opaque)
+{
+    StubContext *s = opaque;
+    if (!s->count)
+        return 0;
+    s->waits++;
+    while (s->ready[s->first] > s->ticks)
+        s->ticks++;
+    return 1;
+}
+
+static int stub_drain(AVFilterContext *ctx, void *opaque)
+{
+    StubContext *s = opaque;
+    int ret;
+    s->drains++;
+    while (s->count > 0) {
+        s->ticks++;
+        if ((ret = stub_collect(ctx, opaque)) < 0)
+            return ret;
+    }
+    return 0;
+}
+
+static const TVAIWindowOps stub_ops = {
+    .submit    = stub_submit,
+    .collect   = stub_collect,
+    .in_flight = stub_in_flight,
+    .wait      = stub_wait,
+    .drain     = stub_drain,
+};
+
+static int stub_activate(AVFilterContext *ctx)
+{
+    StubContext *s = ctx->priv;
+    return ff_tvai_window_activate(ctx, &stub_ops, s, s->maxInFlight);
+}
+
+static av_cold void stub_uninit(AVFilterContext *ctx)
+{
+    StubContext *s = ctx->priv;
+    for (int i = 0; i < STUB_MAX_QUEUED; i++)
+        av_frame_free(&s->frames[i]);
+}
+
+static const AVFilterPad stub_inputs[] = {
+    {
+        .name = "default",
+        .type = AVMEDIA_TYPE_VIDEO,
+    },
+};
+
+static const AVFilterPad stub_outputs[] = {
+    {
+        .name = "default",
+        .type = AVMEDIA_TYPE_VIDEO,
+    },
+};
+
+static const AVFilter stub_filter = {
+    .name        = "tvai_stub",
+    .priv_size   = sizeof(StubContext),
+    .activate    = stub_activate,
+    .uninit      = stub_uninit,
+    FILTER_INPUTS(stub_inputs),
+    FILTER_OUTPUTS(stub_outputs),
+    FILTER_SINGLE_PIXFMT(AV_PIX_FMT_GRAY8),
+};
+
+typedef struct StubShotProcessor {
+    int64_t pts[STUB_MAX_QUEUED], ready[STUB_MAX_QUEUED];
+    int first, count, ended;
+} StubShotProcessor;
+
+typedef struct StubShotsContext {
+    TVAIShots shots;
+    int latency;
+    int scene;                      ///< scene of the previous input frame
+    int acquired, released, alive, maxAlive, lateSubmits;
+} StubShotsContext;
+
+static int64_t shot_ticks;
+
+static void *stub_shot_acquire(AVFilterContext *ctx)
+{
+    StubShotsContext *s = ctx->priv;
+    StubShotProcessor *p = av_mallocz(sizeof(*p));
+    if (p) {
+        s->acquired++;
+        s->alive++;
+        s->maxAlive = FFMAX(s->maxAlive, s->alive);
+    }
+    return p;
+}
+
+static void stub_shot_release(AVFilterContext *ctx, void *processor, int used)
+{
+    StubShotsContext *s = ctx->priv;
+    s->released++;
+    s->alive--;
+    av_free(processor);
+}
+
+static int stub_shot_submit(AVFilterContext *ctx, void *processor, AVFrame *in)
+{
+    StubShotsContext *s = ctx->priv;
+    StubShotProcessor *p = processor;
+    const int i = (p->first + p->count) % STUB_MAX_QUEUED;
+    // A processor cannot be restarted once its stream ended
+    if (p->ended) {
+        s->lateSubmits++;
+        return AVERROR(EIO);
+    }
+    if (p->count == STUB_MAX_QUEUED)
+        return AVERROR(EIO);
+    p->pts[i]   = in->pts;
+    p->ready[i] = shot_ticks + s->latency;
+    p->count++;
+    return 0;
+}
+
+static int stub_shot_output_count(void *processor)
+{
+    StubShotProcessor *p = processor;
+    int n = 0;
+    while (n < p->count && p->ready[(p->first + n) % STUB_MAX_QUEUED] <= shot_ticks)
+        n++;
+    return n;
+}
+
+static int stub_shot_output(AVFilterContext *ctx, void *processor, AVFifo *sources, AVFrame **out)
+{
+    StubShotProcessor *p = processor;
+    const AVFrame *source;
+    AVFrame *frame;
+    *out = NULL;
+    if (!stub_shot_output_count(p))
+        return AVERROR(EIO);
+    if (!(frame = ff_get_video_buffer(ctx->outputs[0], ctx->outputs[0]->w, ctx->outputs[0]->h)))
+        return AVERROR(ENOMEM);
+    if ((source = ff_tvai_sources_match(sources, ctx, p->pts[p->first])))
+        av_frame_copy_props(frame, source);
+    frame->pts = p->pts[p->first];
+    p->first = (p->first + 1) % STUB_MAX_QUEUED;
+    p->count--;
+    *out = frame;
+    return 0;
+}
+
+static int stub_shot_remaining(void *processor)
+{
+    return ((StubShotProcessor *)processor)->count;
+}
+
+static void stub_shot_end_stream(void *processor)
+{
+    ((StubShotProcessor *)processor)->ended = 1;
+}
+
+static int stub_shot_wait(AVFilterContext *ctx, void *const *processors, int count)
+{
+    int pending = 0, i;
+    for (i = 0; i < count; i++)
+        pending += stub_shot_remaining(processors[i]);
+    if (!pending)
+        return 0;
+    for (;;) {
+        for (i = 0; i < count; i++)
+            if (stub_shot_output_count(processors[i]) > 0)
+                return 1;
+        shot_ticks++;
+    }
+}
+
+static double stub_shot_scene_score(AVFilterContext *ctx, AVFrame *frame)
+{
+    StubShotsContext *s = ctx->priv;
+    const int scene = frame->data[0][0];
+    const double score = scene != s->scene ? 100 : 0;
+    s->scene = scene;
+    return score;
+}
+
+static const TVAIShotOps stub_shot_ops = {
+    .acquire      = stub_shot_acquire,
+    .release      = stub_shot_release,
+    .submit       = stub_shot_submit,
+    .output       = stub_shot_output,
+    .output_count = stub_shot_output_count,
+    .remaining    = stub_shot_remaining,
+    .end_stream   = stub_shot_end_stream,
+    .wait         = stub_shot_wait,
+    .scene_score  = stub_shot_scene_score,
+};
+
+static int stub_shots_activate(AVFilterContext *ctx)
+{
+    StubShotsContext *s = ctx->priv;
+    return ff_tvai_shots_activate(ctx, &s->shots);
+}
+
+static av_cold void stub_shots_uninit(AVFilterContext *ctx)
+{
+    StubShotsContext *s = ctx->priv;
+    ff_tvai_shots_uninit(ctx, &s->shots);
+}
+
+static const AVFilter stub_shots_filter = {
+    .name        = "tvai_stub_shots",
+    .priv_size   = sizeof(StubShotsContext),
+    .activate    = stub_shots_activate,
+    .uninit      = stub_shots_uninit,
+    FILTER_INPUTS(stub_inputs),
+    FILTER_OUTPUTS(stub_outputs),
+    FILTER_SINGLE_PIXFMT(AV_PIX_FMT_GRAY8),
+};
+
+#define WIDTH  16
+#define HEIGHT 8
+#define FRAMES 10
+
+static int setup(AVFilterGraph **graph, const AVFilter *filter, AVFilterContext **src,
+                 AVFilterContext **stub, AVFilterContext **sink)
+{
+    char srcArgs[256];
+    int ret;
+
+    if (!(*graph = avfilter_graph_alloc()))
+        return AVERROR(ENOMEM);
+    (*graph)->nb_threads = 1;
+    snprintf(srcArgs, sizeof(srcArgs), "video_size=%dx%d:pix_fmt=%d:time_base=1/25:frame_rate=25",
+             WIDTH, HEIGHT, AV_PIX_FMT_GRAY8);
+    if ((ret = avfilter_graph_create_filter(src, avfilter_get_by_name("buffer"), "src", srcArgs, NULL, *graph)) < 0 ||
+        (ret = avfilter_graph_create_filter(stub, filter, "stub", NULL, NULL, *graph)) < 0 ||
+        (ret = avfilter_graph_create_filter(sink, avfilter_get_by_name("buffersink"), "sink", NULL, NULL, *graph)) < 0 ||
+        (ret = avfilter_link(*src, 0, *stub, 0)) < 0 ||
+        (ret = avfilter_link(*stub, 0, *sink, 0)) < 0)
+        return ret;
+    return avfilter_graph_config(*graph, NULL);
+}
+
+/**
+ * Send frame n filled with value to src, or EOF if n is negative.
+ */
+static int push(AVFilterContext *src, AVFrame *frame, int n, int value)
+{
+    int ret;
+    if (n < 0)
+        return av_buffersrc_add_frame(src, NULL);
+    frame->format = AV_PIX_FMT_GRAY8;
+    frame->width  = WIDTH;
+    frame->height = HEIGHT;
+    if ((ret = av_frame_get_buffer(frame, 0)) < 0)
+        return ret;
+    memset(frame->data[0], value, frame->linesize[0] * HEIGHT);
+    frame->pts      = n;
+    frame->duration = 1;
+    return av_buffersrc_add_frame(src, frame);
+}
+
+static const char *status_name(int ret)
+{
+    return ret == AVERROR(EIO) ? "error propagated" : ret == AVERROR_EOF ? "eof" : "unexpected status";
+}
+
+static int run(int maxInFlight, int latency, int failAt)
+{
+    AVFilterGraph *graph = NULL;
+    AVFilterContext *src, *stub, *sink;
+    AVFrame *frame = av_frame_alloc();
+    StubContext *s;
+    int ret, n, outputs = 0, ordered = 1;
+
+    if (!frame) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    if ((ret = setup(&graph, &stub_filter, &src, &stub, &sink)) < 0)
+        goto end;
+    s = stub->priv;
+    s->maxInFlight = maxInFlight;
+    s->latency     = latency;
+    s->failAt      = failAt;
+
+    for (n = 0; n <= FRAMES; n++) {
+        if ((ret = push(src, frame, n < FRAMES ? n : -1, n)) < 0)
+            break;
+        while ((ret = av_buffersink_get_frame(sink, frame)) >= 0) {
+            ordered &= frame->pts == outputs && frame->data[0][0] == outputs;
+            outputs++;
+            av_frame_unref(frame);
+        }
+        if (ret != AVERROR(EAGAIN) && ret != AVERROR_EOF)
+            break;
+    }
+    printf("inflight=%d latency=%d fail=%d: %d frames %s, max in flight %d, %d waits, %d drains, %s\n",
+           maxInFlight, latency, failAt, outputs, ordered ? "in order" : "out of order",
+           s->maxQueued, s->waits, s->drains, status_name(ret));
+    ret = 0;
+
+end:
+    av_frame_free(&frame);
+    avfilter_graph_free(&graph);
+    return ret;
+}
+
+/**
+ * Run frames split into scenes of the given lengths through maxShots slots.
+ */
+static int run_shots(int maxShots, int maxInFlight, int lookahead, int latency, const int *scenes, int nbScenes)
+{
+    AVFilterGraph *graph = NULL;
+    AVFilterContext *src, *stub, *sink;
+    AVFrame *frame = av_frame_alloc();
+    StubShotsContext *s;
+    int ret, n, scene, outputs = 0, ordered = 1, frames = 0;
+
+    if (!frame) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    if ((ret = setup(&graph, &stub_shots_filter, &src, &stub, &sink)) < 0)
+        goto end;
+    s = stub->priv;
+    s->latency            = latency;
+    s->scene              = -1;
+    s->shots.ops          = &stub_shot_ops;
+    s->shots.maxShots     = maxShots;
+    s->shots.maxInFlight  = maxInFlight;
+    s->shots.lookahead    = lookahead;
+    s->shots.threshold    = 50;
+    if ((ret = ff_tvai_shots_init(&s->shots)) < 0)
+        goto end;
+
+    for (scene = 0; scene <= nbScenes; scene++) {
+        for (n = 0; n < (scene < nbScenes ? scenes[scene] : 1); n++) {
+            if ((ret = push(src, frame, scene < nbScenes ? frames++ : -1, scene)) < 0)
+                goto print;
+            while ((ret = av_buffersink_get_frame(sink, frame)) >= 0) {
+                ordered &= frame->pts == outputs && frame->duration == 1;
+                outputs++;
+                av_frame_unref(frame);
+            }
+            if (ret != AVERROR(EAGAIN) && ret != AVERROR_EOF)
+                goto print;
+        }
+    }
+print:
+    printf("shots=%d inflight=%d lookahead=%d latency=%d: %d frames %s, %d scenes, %d processors acquired, "
+           "%d released, at most %d at once, %d submitted after the end of stream, %s\n",
+           maxShots, maxInFlight, lookahead, latency, outputs, ordered ? "in order" : "out of order", nbScenes,
+           s->acquired, s->released, s->maxAlive, s->lateSubmits, status_name(ret));
+    ret = 0;
+
+end:
+    av_frame_free(&frame);
+    avfilter_graph_free(&graph);
+    return ret;
+}
+
+int main(void)
+{
+    static const int scenes[] = { 4, 3, 5, 1, 6, 2, 4 };
+    if (run(4, 2, -1) < 0 ||
+        run(1, 2, -1) < 0 ||
+        run(3, 0, -1) < 0 ||
+        run(16, 3, -1) < 0 ||
+        run(2, 5, -1) < 0 ||
+        run(4, 2, 6) < 0)
+        return 1;
+    if (run_shots(2, 2, 8, 3, scenes, FF_ARRAY_ELEMS(scenes)) < 0 ||
+        run_shots(3, 4, 4, 2, scenes, FF_ARRAY_ELEMS(scenes)) < 0 ||
+        run_shots(1, 1, 16, 1, scenes, FF_ARRAY_ELEMS(scenes)) < 0)
+        return 1;
+    return 0;
+}
@@ -1,5 +1,16 @@
 #include "tvai_common.h"
 #include <libavutil/mem.h>
+#include <libavutil/csp.h>
+#include <libavutil/pixdesc.h>
+#include <libavutil/bprint.h>
+#include <libavutil/thread.h>
+#include <libavutil/time.h>
+#if HAVE_MMAP
+#include <stdlib.h>
+#include <sys/mman.h>
+#endif
+
+#define TVAI_HUGE_PAGE_SIZE (2 << 20)
 
 int ff_tvai_checkDevice(char* deviceString, DeviceSetting* pDevice, AVFilterContext* ctx) {
   if(tvai_set_device_settings(deviceString, pDevice)) {
@@ -42,24 +53,676 @@ int ff_tvai_checkModel(char* modelName, ModelType modelType, AVFilterContext* ct
   return 0;
 }
 
-void ff_tvai_prepareBufferInput(TVAIBuffer* ioBuffer, AVFrame *in) {
-  ioBuffer->pBuffer = in->data[0];
-  ioBuffer->lineSize = in->linesize[0];
+
+#define TVAI_CACHE_MAX_ENTRIES 32
+
+/**
+ * Processor shared between the filter instances of a process. Entries are
+ * in use by at most one filter at a time, idle entries are kept until they
+ * are evicted in least recently used order.
+ */
+typedef struct TVAICacheEntry {
+    char *key;
+    void *pProcessor;
+    size_t size;                    ///< estimated frame memory of the processor
+    int inUse;
+    uint64_t lastUsed;
+} TVAICacheEntry;
+
+static AVMutex tvai_cache_lock = AV_MUTEX_INITIALIZER;
+static AVOnce tvai_cache_once = AV_ONCE_INIT;
+static TVAICacheEntry tvai_cache[TVAI_CACHE_MAX_ENTRIES];
+static uint64_t tvai_cache_clock;
+static size_t tvai_cache_budget;
+
+static char* tvai_cache_key(const VideoProcessorInfo *pInfo) {
+    const BasicProcessorInfo *basic = &pInfo->basic;
+    AVBPrint bp;
+    char *key;
+    av_bprint_init(&bp, 0, AV_BPRINT_SIZE_UNLIMITED);
+    av_bprintf(&bp, "%s|%s|%d|%f|%d|%d|%d|%d|%dx%d|%dx%d|%d|%.17g|%.17g", basic->modelName, basic->processorName,
+               basic->device.index, basic->device.maxMemory, basic->device.extraThreadCount, basic->scale,
+               basic->canDownloadModel, basic->pixelFormat, basic->inputWidth, basic->inputHeight,
+               pInfo->outputWidth, pInfo->outputHeight, pInfo->frameCount, basic->timebase, basic->framerate);
+    for(int i=0;i<basic->parameterCount;i++)
+        av_bprintf(&bp, "|%s=%s", basic->pParameters[i].pKey, basic->pParameters[i].pValue);
+    if(av_bprint_finalize(&bp, &key) < 0)
+        return NULL;
+    return key;
+}
+
+static void tvai_cache_evict(TVAICacheEntry *entry) {
+    tvai_destroy(entry->pProcessor);
+    av_freep(&entry->key);
+    memset(entry, 0, sizeof(*entry));
+}
+
+/* Must be called with tvai_cache_lock held. */
+static void tvai_cache_trim(size_t budget) {
+    for(;;) {
+        TVAICacheEntry *oldest = NULL;
+        size_t idle = 0;
+        for(int i=0;i<TVAI_CACHE_MAX_ENTRIES;i++) {
+            TVAICacheEntry *entry = &tvai_cache[i];
+            if(!entry->pProcessor || entry->inUse)
+                continue;
+            idle += entry->size;
+            if(!oldest || entry->lastUsed < oldest->lastUsed)
+                oldest = entry;
+        }
+        if(!oldest || idle <= budget)
+            return;
+        av_log(NULL, AV_LOG_VERBOSE, "Evicting cached tvai processor %s\n", oldest->key);
+        tvai_cache_evict(oldest);
+    }
+}
+
+static void tvai_cache_flush(void) {
+    ff_mutex_lock(&tvai_cache_lock);
+    tvai_cache_trim(0);
+    ff_mutex_unlock(&tvai_cache_lock);
+}
+
+static void tvai_cache_init(void) {
+    // Idle processors outlive the filters, destroy them before the process exits
+    atexit(tvai_cache_flush);
+}
+
+void* ff_tvai_processor_acquire(AVFilterContext *ctx, VideoProcessorInfo *pInfo, int cacheBudget) {
+    TVAICacheEntry *entry = NULL;
+    void *pProcessor;
+    char *key;
+    if(cacheBudget <= 0)
+        return tvai_create(pInfo);
+    ff_thread_once(&tvai_cache_once, tvai_cache_init);
+    key = tvai_cache_key(pInfo);
+    if(!key)
+        return NULL;
+
+    ff_mutex_lock(&tvai_cache_lock);
+    tvai_cache_budget = (size_t)cacheBudget << 20;
+    for(int i=0;i<TVAI_CACHE_MAX_ENTRIES;i++) {
+        if(tvai_cache[i].pProcessor && !tvai_cache[i].inUse && !strcmp(tvai_cache[i].key, key)) {
+            entry = &tvai_cache[i];
+            entry->inUse = 1;
+            entry->lastUsed = ++tvai_cache_clock;
+            break;
+        }
+    }
+    ff_mutex_unlock(&tvai_cache_lock);
+    if(entry) {
+        av_log(ctx, AV_LOG_VERBOSE, "Reusing cached processor for %s\n", pInfo->basic.modelName);
+        av_free(key);
+        return entry->pProcessor;
+    }
+
+    pProcessor = tvai_create(pInfo);
+    if(!pProcessor) {
+        av_free(key);
+        return NULL;
+    }
+
+    ff_mutex_lock(&tvai_cache_lock);
+    for(int i=0;i<TVAI_CACHE_MAX_ENTRIES && !entry;i++) {
+        if(!tvai_cache[i].pProcessor)
+            entry = &tvai_cache[i];
+    }
+    if(!entry) {
+        for(int i=0;i<TVAI_CACHE_MAX_ENTRIES;i++) {
+            if(!tvai_cache[i].inUse && (!entry || tvai_cache[i].lastUsed < entry->lastUsed))
+                entry = &tvai_cache[i];
+        }
+        if(entry)
+            tvai_cache_evict(entry);
+    }
+    if(entry) {
+        entry->key = key;
+        entry->pProcessor = pProcessor;
+        entry->size = ((size_t)pInfo->basic.inputWidth*pInfo->basic.inputHeight + (size_t)pInfo->outputWidth*pInfo->outputHeight)*6;
+        entry->inUse = 1;
+        entry->lastUsed = ++tvai_cache_clock;
+        key = NULL;
+    }
+    ff_mutex_unlock(&tvai_cache_lock);
+    if(key)
+        av_log(ctx, AV_LOG_VERBOSE, "Processor cache is full, %s will not be cached\n", pInfo->basic.modelName);
+    av_free(key);
+    return pProcessor;
+}
+
+void ff_tvai_processor_release(AVFilterContext *ctx, void *pProcessor, int used) {
+    TVAICacheEntry *entry = NULL;
+    if(!pProcessor)
+        return;
+    ff_mutex_lock(&tvai_cache_lock);
+    for(int i=0;i<TVAI_CACHE_MAX_ENTRIES && !entry;i++) {
+        if(tvai_cache[i].pProcessor == pProcessor)
+            entry = &tvai_cache[i];
+    }
+    if(!entry) {
+        tvai_destroy(pProcessor);
+    } else if(used) {
+        av_log(ctx, AV_LOG_DEBUG, "Processor released after processing frames, not caching it\n");
+        tvai_cache_evict(entry);
+    } else {
+        entry->inUse = 0;
+        entry->lastUsed = ++tvai_cache_clock;
+        tvai_cache_trim(tvai_cache_budget);
+    }
+    ff_mutex_unlock(&tvai_cache_lock);
+}
+
+int ff_tvai_submit(void *pProcessor, TVAIPipeline *pipe, TVAIBuffer *buffer) {
+    if(pipe)
+        pipe->used = 1;
+    return tvai_process(pProcessor, buffer);
+}
+
+typedef struct TVAIConvertThreadData {
+    const AVFrame *src;
+    AVFrame *dst;
+    int order[3];
+    float kr, kg, kb;
+    float yOffset, yRange, cRange;
+} TVAIConvertThreadData;
+
+static void tvai_setup_matrix(TVAIConvertThreadData *td, const TVAIConverter *conv, const AVFrame *yuv) {
+    const AVLumaCoefficients *coeffs = av_csp_luma_coeffs_from_avcsp(yuv->colorspace);
+    int modelIsRGB = conv->modelFormat == AV_PIX_FMT_RGB48;
+    if(!coeffs || yuv->colorspace == AVCOL_SPC_RGB || yuv->colorspace == AVCOL_SPC_YCGCO)
+        coeffs = av_csp_luma_coeffs_from_avcsp(AVCOL_SPC_BT470BG);
+    td->kr = av_q2d(coeffs->cr);
+    td->kg = av_q2d(coeffs->cg);
+    td->kb = av_q2d(coeffs->cb);
+    if(yuv->color_range == AVCOL_RANGE_JPEG) {
+        td->yOffset = 0;
+        td->yRange = 1023;
+        td->cRange = 1023;
+    } else {
+        td->yOffset = 64;
+        td->yRange = 876;
+        td->cRange = 896;
+    }
+    td->order[0] = modelIsRGB ? 0 : 2;
+    td->order[1] = 1;
+    td->order[2] = modelIsRGB ? 2 : 0;
+}
+
+static av_always_inline uint16_t tvai_unorm16(float v) {
+    return av_clip_uint16(lrintf(v * 65535.0f));
+}
+
+static int tvai_convert_to_model(AVFilterContext *ctx, void *arg, int jobnr, int nb_jobs) {
+    const TVAIConvertThreadData *td = arg;
+    const AVFrame *src = td->src;
+    AVFrame *dst = td->dst;
+    const int w = src->width, start = (src->height * jobnr) / nb_jobs, end = (src->height * (jobnr+1)) / nb_jobs;
+    const int oR = td->order[0], oG = td->order[1], oB = td->order[2];
+    const float crR = 2*(1-td->kr), cbB = 2*(1-td->kb);
+    const float cbG = 2*td->kb*(1-td->kb)/td->kg, crG = 2*td->kr*(1-td->kr)/td->kg;
+    const float yScale = 1.0f/td->yRange, cScale = 1.0f/td->cRange;
+    int x, y;
+    for(y=start;y<end;y++) {
+        uint16_t *d = (uint16_t*)(dst->data[0] + y*dst->linesize[0]);
+        switch(src->format) {
+        case AV_PIX_FMT_GBRP16: {
+            const uint16_t *g = (const uint16_t*)(src->data[0] + y*src->linesize[0]);
+            const uint16_t *b = (const uint16_t*)(src->data[1] + y*src->linesize[1]);
+            const uint16_t *r = (const uint16_t*)(src->data[2] + y*src->linesize[2]);
+            for(x=0;x<w;x++) {
+                d[3*x+oR] = r[x];
+                d[3*x+oG] = g[x];
+                d[3*x+oB] = b[x];
+            }
+            break;
+        }
+        case AV_PIX_FMT_GBRPF32: {
+            const float *g = (const float*)(src->data[0] + y*src->linesize[0]);
+            const float *b = (const float*)(src->data[1] + y*src->linesize[1]);
+            const float *r = (const float*)(src->data[2] + y*src->linesize[2]);
+            for(x=0;x<w;x++) {
+                d[3*x+oR] = tvai_unorm16(r[x]);
+                d[3*x+oG] = tvai_unorm16(g[x]);
+                d[3*x+oB] = tvai_unorm16(b[x]);
+            }
+            break;
+        }
+        case AV_PIX_FMT_YUV420P10:
+        case AV_PIX_FMT_P010: {
+            const int semiPlanar = src->format == AV_PIX_FMT_P010, shift = semiPlanar ? 6 : 0;
+            const uint16_t *py = (const uint16_t*)(src->data[0] + y*src->linesize[0]);
+            const uint16_t *pu = (const uint16_t*)(src->data[1] + (y>>1)*src->linesize[1]);
+            const uint16_t *pv = semiPlanar ? pu + 1 : (const uint16_t*)(src->data[2] + (y>>1)*src->linesize[2]);
+            const int cStep = semiPlanar ? 2 : 1;
+            for(x=0;x<w;x++) {
+                float l = ((py[x] >> shift) - td->yOffset) * yScale;
+                float cb = ((pu[(x>>1)*cStep] >> shift) - 512) * cScale;
+                float cr = ((pv[(x>>1)*cStep] >> shift) - 512) * cScale;
+                d[3*x+oR] = tvai_unorm16(l + crR*cr);
+                d[3*x+oG] = tvai_unorm16(l - cbG*cb - crG*cr);
+                d[3*x+oB] = tvai_unorm16(l + cbB*cb);
+            }
+            break;
+        }
+        default:
+            return AVERROR_BUG;
+        }
+    }
+    return 0;
+}
+
+static int tvai_convert_from_model(AVFilterContext *ctx, void *arg, int jobnr, int nb_jobs) {
+    const TVAIConvertThreadData *td = arg;
+    const AVFrame *src = td->src;
+    AVFrame *dst = td->dst;
+    const int w = dst->width, h = dst->height;
+    const int oR = td->order[0], oG = td->order[1], oB = td->order[2];
+    int x, y;
+    switch(dst->format) {
+    case AV_PIX_FMT_GBRP16:
+    case AV_PIX_FMT_GBRPF32: {
+        const int isFloat = dst->format == AV_PIX_FMT_GBRPF32;
+        const int start = (h * jobnr) / nb_jobs, end = (h * (jobnr+1)) / nb_jobs;
+        for(y=start;y<end;y++) {
+            const uint16_t *s = (const uint16_t*)(src->data[0] + y*src->linesize[0]);
+            uint8_t *g = dst->data[0] + y*dst->linesize[0];
+            uint8_t *b = dst->data[1] + y*dst->linesize[1];
+            uint8_t *r = dst->data[2] + y*dst->linesize[2];
+            for(x=0;x<w;x++) {
+                if(isFloat) {
+                    ((float*)r)[x] = s[3*x+oR] * (1.0f/65535.0f);
+                    ((float*)g)[x] = s[3*x+oG] * (1.0f/65535.0f);
+                    ((float*)b)[x] = s[3*x+oB] * (1.0f/65535.0f);
+                } else {
+                    ((uint16_t*)r)[x] = s[3*x+oR];
+                    ((uint16_t*)g)[x] = s[3*x+oG];
+                    ((uint16_t*)b)[x] = s[3*x+oB];
+                }
+            }
+        }
+        break;
+    }
+    case AV_PIX_FMT_YUV420P10:
+    case AV_PIX_FMT_P010: {
+        // Work on pairs of luma rows so each job owns whole chroma rows
+        const int semiPlanar = dst->format == AV_PIX_FMT_P010, shift = semiPlanar ? 6 : 0;
+        const int ch = (h + 1) >> 1, start = (ch * jobnr) / nb_jobs, end = (ch * (jobnr+1)) / nb_jobs;
+        const float cbScale = 1/(2*(1-td->kb)), crScale = 1/(2*(1-td->kr));
+        const float maxValue = 1023;
+        int cy;
+        for(cy=start;cy<end;cy++) {
+            const int rows = FFMIN(2, h - 2*cy);
+            uint16_t *pu = (uint16_t*)(dst->data[1] + cy*dst->linesize[1]);
+            uint16_t *pv = semiPlanar ? pu + 1 : (uint16_t*)(dst->data[2] + cy*dst->linesize[2]);
+            const int cStep = semiPlanar ? 2 : 1;
+            for(x=0;x<w;x+=2) {
+                const int cols = FFMIN(2, w - x);
+                float sr = 0, sg = 0, sb = 0, l, cb, cr;
+                int i, j;
+                for(j=0;j<rows;j++) {
+                    const uint16_t *s = (const uint16_t*)(src->data[0] + (2*cy+j)*src->linesize[0]);
+                    uint16_t *py = (uint16_t*)(dst->data[0] + (2*cy+j)*dst->linesize[0]);
+                    for(i=0;i<cols;i++) {
+                        float r = s[3*(x+i)+oR] * (1.0f/65535.0f);
+                        float g = s[3*(x+i)+oG] * (1.0f/65535.0f);
+                        float b = s[3*(x+i)+oB] * (1.0f/65535.0f);
+                        l = td->kr*r + td->kg*g + td->kb*b;
+                        py[x+i] = av_clip(lrintf(td->yOffset + l*td->yRange), 0, maxValue) << shift;
+                        sr += r;
+                        sg += g;
+                        sb += b;
+                    }
+                }
+                sr /= rows*cols;
+                sg /= rows*cols;
+                sb /= rows*cols;
+                l = td->kr*sr + td->kg*sg + td->kb*sb;
+                cb = (sb - l)*cbScale;
+                cr = (sr - l)*crScale;
+                pu[(x>>1)*cStep] = av_clip(lrintf(512 + cb*td->cRange), 0, maxValue) << shift;
+                pv[(x>>1)*cStep] = av_clip(lrintf(512 + cr*td->cRange), 0, maxValue) << shift;
+            }
+        }
+        break;
+    }
+    default:
+        return AVERROR_BUG;
+    }
+    return 0;
+}
+
+static void tvai_converter_uninit(TVAIConverter *conv);
+
+static AVFrame* tvai_alloc_stage(enum AVPixelFormat format, int w, int h) {
+    AVFrame *frame = av_frame_alloc();
+    if(!frame)
+        return NULL;
+    frame->format = format;
+    frame->width = w;
+    frame->height = h;
+    if(av_frame_get_buffer(frame, 0) < 0)
+        av_frame_free(&frame);
+    return frame;
+}
+
+static int tvai_converter_init(TVAIConverter *conv, AVFilterContext *ctx, enum AVPixelFormat modelFormat, int convertOutput) {
+    AVFilterLink *inlink = ctx->inputs[0], *outlink = ctx->outputs[0];
+    tvai_converter_uninit(conv);
+    conv->ctx = ctx;
+    conv->modelFormat = modelFormat;
+    if(inlink->format != modelFormat) {
+        conv->input = tvai_alloc_stage(modelFormat, inlink->w, inlink->h);
+        if(!conv->input)
+            return AVERROR(ENOMEM);
+    }
+    if(convertOutput && outlink->format != modelFormat) {
+        conv->output = tvai_alloc_stage(modelFormat, outlink->w, outlink->h);
+        if(!conv->output)
+            return AVERROR(ENOMEM);
+    }
+    if(conv->input || conv->output)
+        av_log(ctx, AV_LOG_VERBOSE, "Converting %s -> %s -> %s for the model\n", av_get_pix_fmt_name(inlink->format),
+               av_get_pix_fmt_name(modelFormat), av_get_pix_fmt_name(convertOutput ? outlink->format : modelFormat));
+    return 0;
+}
+
+static void tvai_converter_uninit(TVAIConverter *conv) {
+    av_frame_free(&conv->input);
+    av_frame_free(&conv->output);
+}
+
+static void tvai_pool_free(void *opaque, uint8_t *data) {
+#if HAVE_MMAP && defined(MADV_HUGEPAGE)
+    if(opaque) {
+        munmap(data, (size_t)(uintptr_t)opaque);
+        return;
+    }
+#endif
+    av_free(data);
+}
+
+static AVBufferRef* tvai_pool_alloc(void *opaque, size_t size) {
+    TVAIFramePool *pool = opaque;
+    AVBufferRef *buf;
+    uint8_t *data;
+    pool->misses++;
+#if HAVE_MMAP && defined(MADV_HUGEPAGE)
+    if(pool->hugePages) {
+        size_t mapped = FFALIGN(size, TVAI_HUGE_PAGE_SIZE);
+        data = mmap(NULL, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(data != MAP_FAILED) {
+            madvise(data, mapped, MADV_HUGEPAGE);
+            buf = av_buffer_create(data, size, tvai_pool_free, (void*)(uintptr_t)mapped, 0);
+            if(!buf)
+                munmap(data, mapped);
+            return buf;
+        }
+    }
+#endif
+    data = av_malloc(size);
+    if(!data)
+        return NULL;
+    buf = av_buffer_create(data, size, tvai_pool_free, NULL, 0);
+    if(!buf)
+        av_free(data);
+    return buf;
+}
+
+int ff_tvai_frame_pool_init(TVAIFramePool *pool, AVFilterLink *outlink, int preallocate, int hugePages) {
+    AVFrame *frames[TVAI_MAX_PREALLOCATED_FRAMES] = { NULL };
+    ptrdiff_t linesizes[4];
+    size_t sizes[4], total = 0;
+    int i, ret;
+    ff_tvai_frame_pool_uninit(pool, NULL);
+    pool->format = outlink->format;
+    pool->width = outlink->w;
+    pool->height = outlink->h;
+    pool->hugePages = hugePages;
+    ret = av_image_fill_linesizes(pool->linesize, pool->format, FFALIGN(pool->width, 32));
+    if(ret < 0)
+        return ret;
+    for(i=0;i<4;i++) {
+        pool->linesize[i] = FFALIGN(pool->linesize[i], 64);
+        linesizes[i] = pool->linesize[i];
+    }
+    ret = av_image_fill_plane_sizes(sizes, pool->format, pool->height, linesizes);
+    if(ret < 0)
+        return ret;
+    for(i=0;i<4;i++) {
+        pool->offset[i] = total;
+        total += sizes[i];
+    }
+    pool->pool = av_buffer_pool_init2(total + 16 + 64 - 1, pool, tvai_pool_alloc, NULL);
+    if(!pool->pool)
+        return AVERROR(ENOMEM);
+
+    // Fault the pages in now so the first frames do not pay for it
+    preallocate = FFMIN(preallocate, TVAI_MAX_PREALLOCATED_FRAMES);
+    for(i=0;i<preallocate;i++) {
+        frames[i] = ff_tvai_frame_pool_get(pool);
+        if(!frames[i])
+            break;
+        memset(frames[i]->buf[0]->data, 0, frames[i]->buf[0]->size);
+    }
+    for(i=0;i<preallocate;i++)
+        av_frame_free(&frames[i]);
+    pool->preallocated = pool->misses;
+    pool->requests = pool->misses = 0;
+    return 0;
+}
+
+AVFrame* ff_tvai_frame_pool_get(TVAIFramePool *pool) {
+    AVFrame *frame = av_frame_alloc();
+    int i;
+    if(!frame)
+        return NULL;
+    frame->buf[0] = av_buffer_pool_get(pool->pool);
+    if(!frame->buf[0]) {
+        av_frame_free(&frame);
+        return NULL;
+    }
+    pool->requests++;
+    frame->format = pool->format;
+    frame->width = pool->width;
+    frame->height = pool->height;
+    for(i=0;i<4 && pool->linesize[i];i++) {
+        frame->data[i] = frame->buf[0]->data + pool->offset[i];
+        frame->linesize[i] = pool->linesize[i];
+    }
+    return frame;
+}
+
+void ff_tvai_frame_pool_uninit(TVAIFramePool *pool, AVFilterContext *ctx) {
+    if(ctx && pool->pool)
+        av_log(ctx, AV_LOG_VERBOSE, "Output frame pool: %"PRId64" hits, %"PRId64" misses, %"PRId64" preallocated%s\n",
+               pool->requests - pool->misses, pool->misses, pool->preallocated, pool->hugePages ? ", huge pages" : "");
+    av_buffer_pool_uninit(&pool->pool);
+}
+
+int ff_tvai_pipeline_init(TVAIPipeline *pipe, AVFilterContext *ctx, enum AVPixelFormat modelFormat, int outputFrames, int hugePages) {
+    int ret;
+    pipe->sources = av_fifo_alloc2(8, sizeof(AVFrame*), AV_FIFO_FLAG_AUTO_GROW);
+    if(!pipe->sources)
+        return AVERROR(ENOMEM);
+    ret = tvai_converter_init(&pipe->converter, ctx, modelFormat, outputFrames >= 0 && !pipe->bandOutput);
+    if(ret < 0 || outputFrames < 0)
+        return ret;
+    return ff_tvai_frame_pool_init(&pipe->pool, ctx->outputs[0], outputFrames, hugePages);
+}
+
+static void tvai_stats_log(TVAIStats *stats, AVFilterContext *ctx) {
+    const int level = stats->exportMetadata ? AV_LOG_INFO : AV_LOG_VERBOSE;
+    const int64_t frames = FFMAX(stats->submitted, 1), outputs = FFMAX(stats->output, 1);
+    AVBPrint bp;
+    if(!stats->submitted)
+        return;
+    av_log(ctx, level, "Frames: %"PRId64" in, %"PRId64" out, %"PRId64" dropped, queue depth %.1f avg %d max\n",
+           stats->submitted, stats->output, stats->dropped, (double)stats->queueDepthSum/frames, stats->queueDepthMax);
+    av_log(ctx, level, "Time per frame: conversion %.2f ms, submit %.2f ms, latency %.2f ms avg %.2f ms max, postflight %.2f ms\n",
+           stats->convertTime/1000.0/frames, stats->submitTime/1000.0/frames, stats->latencySum/1000.0/outputs,
+           stats->latencyMax/1000.0, stats->postflightTime/1000.0);
+    av_bprint_init(&bp, 0, AV_BPRINT_SIZE_AUTOMATIC);
+    for(int i=0;i<TVAI_STATS_LATENCY_BUCKETS;i++) {
+        if(stats->latency[i])
+            av_bprintf(&bp, " %s%dms:%"PRId64, i == TVAI_STATS_LATENCY_BUCKETS - 1 ? ">=" : "<",
+                       1 << (i == TVAI_STATS_LATENCY_BUCKETS - 1 ? i - 1 : i), stats->latency[i]);
+    }
+    av_log(ctx, level, "Latency histogram:%s\n", bp.str);
+    av_bprint_finalize(&bp, NULL);
+}
+
+void ff_tvai_stats_submit(TVAIStats *stats, const void *source, int64_t pts, int64_t start, int queueDepth) {
+    const int64_t now = av_gettime_relative();
+    int i;
+    stats->submitted++;
+    stats->submitTime += now - start;
+    stats->queueDepthSum += queueDepth;
+    stats->queueDepthMax = FFMAX(stats->queueDepthMax, queueDepth);
+    if(stats->pendingCount == TVAI_STATS_MAX_PENDING) {
+        stats->pendingFirst = (stats->pendingFirst + 1) % TVAI_STATS_MAX_PENDING;
+        stats->pendingCount--;
+    }
+    i = (stats->pendingFirst + stats->pendingCount++) % TVAI_STATS_MAX_PENDING;
+    stats->pending[i].source = source;
+    stats->pending[i].pts = pts;
+    stats->pending[i].time = start;
+}
+
+void ff_tvai_stats_output(TVAIStats *stats, const void *source, AVFrame *out, int64_t pts, int queueDepth) {
+    int64_t latency = -1;
+    int match = -1, bucket = 0, kept = 0;
+    if(!out) {
+        stats->dropped++;
+        return;
+    }
+    stats->output++;
+    // Outputs are measured from the submission of the latest input at or
+    // before their pts to the same processor, interpolated frames share the
+    // input preceding them. Processors running in parallel interleave their
+    // submissions, so only the entries of this one are matched and retired.
+    for(int i=0;i<stats->pendingCount;i++) {
+        const int j = (stats->pendingFirst + i) % TVAI_STATS_MAX_PENDING;
+        if(stats->pending[j].source != source)
+            continue;
+        if(stats->pending[j].pts > pts)
+            break;
+        match = i;
+    }
+    if(match >= 0) {
+        latency = av_gettime_relative() - stats->pending[(stats->pendingFirst + match) % TVAI_STATS_MAX_PENDING].time;
+        for(int i=0;i<stats->pendingCount;i++) {
+            const int j = (stats->pendingFirst + i) % TVAI_STATS_MAX_PENDING;
+            if(i < match && stats->pending[j].source == source)
+                continue;
+            stats->pending[(stats->pendingFirst + kept++) % TVAI_STATS_MAX_PENDING] = stats->pending[j];
+        }
+        stats->pendingCount = kept;
+        while(bucket < TVAI_STATS_LATENCY_BUCKETS - 1 && latency >= (1000LL << bucket))
+            bucket++;
+        stats->latency[bucket]++;
+        stats->latencySum += latency;
+        stats->latencyMax = FFMAX(stats->latencyMax, latency);
+    }
+    if(stats->exportMetadata) {
+        if(latency >= 0)
+            av_dict_set_float(&out->metadata, "lavfi.tvai.latency", latency/1000.0, 0);
+        av_dict_set_int(&out->metadata, "lavfi.tvai.queue_depth", queueDepth, 0);
+        av_dict_set_int(&out->metadata, "lavfi.tvai.dropped", stats->dropped, 0);
+        // Time spent since the previous output frame, not running totals
+        av_dict_set_float(&out->metadata, "lavfi.tvai.convert_time", (stats->convertTime - stats->exportedConvertTime)/1000.0, 0);
+        av_dict_set_float(&out->metadata, "lavfi.tvai.submit_time", (stats->submitTime - stats->exportedSubmitTime)/1000.0, 0);
+        stats->exportedConvertTime = stats->convertTime;
+        stats->exportedSubmitTime = stats->submitTime;
+    }
+}
+
+void ff_tvai_pipeline_uninit(TVAIPipeline *pipe, AVFilterContext *ctx) {
+    if(pipe->sources)
+        ff_tvai_sources_reset(pipe->sources);
+    av_fifo_freep2(&pipe->sources);
+    tvai_stats_log(&pipe->stats, ctx);
+    tvai_converter_uninit(&pipe->converter);
+    ff_tvai_frame_pool_uninit(&pipe->pool, ctx);
+}
+
+int ff_tvai_prepareBufferInput(TVAIPipeline *pipe, TVAIBuffer* ioBuffer, AVFrame *in) {
+  TVAIConverter *conv = pipe ? &pipe->converter : NULL;
+  AVFrame *model = in;
+  if(conv && conv->input) {
+    TVAIConvertThreadData td = { .src = in, .dst = conv->input };
+    int64_t start = av_gettime_relative();
+    tvai_setup_matrix(&td, conv, in);
+    ff_filter_execute(conv->ctx, tvai_convert_to_model, &td, NULL,
+                      FFMIN(in->height, ff_filter_get_nb_threads(conv->ctx)));
+    model = conv->input;
+    pipe->stats.convertTime += av_gettime_relative() - start;
+  }
+  ioBuffer->pBuffer = model->data[0];
+  ioBuffer->lineSize = model->linesize[0];
   ioBuffer->pts = in->pts;
   ioBuffer->duration = in->duration;
+  return 0;
 }
 
-AVFrame* ff_tvai_prepareBufferOutput(AVFilterLink *outlink, TVAIBuffer* oBuffer) {
-  AVFrame* out = ff_get_video_buffer(outlink, outlink->w, outlink->h);
+AVFrame* ff_tvai_prepareBufferOutput(AVFilterLink *outlink, TVAIPipeline *pipe, TVAIBuffer* oBuffer) {
+  TVAIConverter *conv = pipe ? &pipe->converter : NULL;
+  AVFrame* out = pipe && pipe->pool.pool ? ff_tvai_frame_pool_get(&pipe->pool) : ff_get_video_buffer(outlink, outlink->w, outlink->h);
+  AVFrame* model = out;
   if (!out) {
-      av_log(NULL, AV_LOG_ERROR, "The processing has failed, unable to create output buffer of size:%dx%d\n", outlink->w, outlink->h);
+      av_log(outlink->src, AV_LOG_ERROR, "The processing has failed, unable to create output buffer of size:%dx%d\n", outlink->w, outlink->h);
       return NULL;
   }
-  oBuffer->pBuffer = out->data[0];
-  oBuffer->lineSize = out->linesize[0];
+  if(conv && conv->output)
+    model = conv->output;
+  oBuffer->pBuffer = model->data[0];
+  oBuffer->lineSize = model->linesize[0];
   return out;
 }
 
+void ff_tvai_finishBufferOutput(TVAIPipeline *pipe, AVFrame *out) {
+  TVAIConverter *conv = pipe ? &pipe->converter : NULL;
+  if(conv && conv->output) {
+    TVAIConvertThreadData td = { .src = conv->output, .dst = out };
+    int64_t start = av_gettime_relative();
+    tvai_setup_matrix(&td, conv, out);
+    ff_filter_execute(conv->ctx, tvai_convert_from_model, &td, NULL,
+                      FFMIN((out->height + 1) >> 1, ff_filter_get_nb_threads(conv->ctx)));
+    pipe->stats.convertTime += av_gettime_relative() - start;
+  }
+}
+
+void ff_tvai_convert_output_band(TVAIPipeline *pipe, AVFrame *out, const uint8_t *src, int srcLinesize, int y, int h) {
+  TVAIConverter *conv = &pipe->converter;
+  const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(out->format);
+  AVFrame model = { 0 }, band = { 0 };
+  TVAIConvertThreadData td = { .src = &model, .dst = &band };
+  int64_t start;
+  if(out->format == conv->modelFormat) {
+    av_image_copy_plane(out->data[0] + y*out->linesize[0], out->linesize[0], src, srcLinesize, 6*out->width, h);
+    return;
+  }
+  start = av_gettime_relative();
+  model.format = conv->modelFormat;
+  model.width = out->width;
+  model.height = h;
+  model.data[0] = (uint8_t*)src;
+  model.linesize[0] = srcLinesize;
+  band.format = out->format;
+  band.width = out->width;
+  band.height = h;
+  band.colorspace = out->colorspace;
+  band.color_range = out->color_range;
+  for(int i=0;i<4 && out->data[i];i++) {
+    const int shift = (i == 1 || i == 2) ? desc->log2_chroma_h : 0;
+    band.data[i] = out->data[i] + (y >> shift)*out->linesize[i];
+    band.linesize[i] = out->linesize[i];
+  }
+  tvai_setup_matrix(&td, conv, &band);
+  ff_filter_execute(conv->ctx, tvai_convert_from_model, &td, NULL,
+                    FFMIN((h + 1) >> 1, ff_filter_get_nb_threads(conv->ctx)));
+  pipe->stats.convertTime += av_gettime_relative() - start;
+}
+
 int ff_tvai_prepareProcessorInfo(char *deviceString, VideoProcessorInfo* pProcessorInfo, ModelType modelType, AVFilterLink *pOutlink, BasicProcessorInfo* pBasic, int procIndex, DictionaryItem *pParameters, int parameterCount) {
   ff_tvai_handleLogging();
   AVFilterContext *pCtx = pOutlink->src;
@@ -87,36 +750,58 @@ int ff_tvai_prepareProcessorInfo(char *deviceString, VideoProcessorInfo* pProces
   return 0;
 }
 
-int ff_tvai_process(void *pFrameProcessor, AVFrame* frame) {
+int ff_tvai_process(void *pFrameProcessor, TVAIPipeline *pipe, AVFrame* frame) {
     TVAIBuffer iBuffer;
-    ff_tvai_prepareBufferInput(&iBuffer, frame);
-    if(pFrameProcessor == NULL || tvai_process(pFrameProcessor, &iBuffer)) 
+    int64_t start;
+    ff_tvai_prepareBufferInput(pipe, &iBuffer, frame);
+    start = av_gettime_relative();
+    if(pFrameProcessor == NULL || ff_tvai_submit(pFrameProcessor, pipe, &iBuffer))
         return 1;
+    if(pipe)
+        ff_tvai_stats_submit(&pipe->stats, pFrameProcessor, iBuffer.pts, start, tvai_remaining_frames(pFrameProcessor));
     return 0;
 }
 
-int ff_tvai_add_output(void *pProcessor, AVFilterLink *outlink, AVFrame* frame) {
-    int n = tvai_output_count(pProcessor), i;
+int ff_tvai_get_output(void *pProcessor, TVAIPipeline *pipe, AVFilterLink *outlink, const AVFrame* frame, AVFifo *sources, AVFrame **pOut) {
+    AVFilterContext *ctx = outlink->src;
+    TVAIBuffer oBuffer;
+    AVFrame *out = ff_tvai_prepareBufferOutput(outlink, pipe, &oBuffer);
+    *pOut = NULL;
+    if(out == NULL || tvai_output_frame(pProcessor, &oBuffer)) {
+        av_frame_free(&out);
+        av_log(ctx, AV_LOG_ERROR, "Error processing frame\n");
+        return AVERROR(ENOSYS);
+    }
+    if(oBuffer.pts < 0) {
+        // Dropped by the processor, neither convert nor copy anything
+        av_frame_free(&out);
+        av_log(ctx, AV_LOG_ERROR, "Ignoring frame %"PRId64"\n", (int64_t)oBuffer.pts);
+        if(pipe)
+            ff_tvai_stats_output(&pipe->stats, pProcessor, NULL, oBuffer.pts, 0);
+        return 0;
+    }
+    if(!frame && sources)
+        frame = ff_tvai_sources_match(sources, ctx, oBuffer.pts);
+    if(frame)
+        av_frame_copy_props(out, frame);
+    ff_tvai_finishBufferOutput(pipe, out);
+    out->duration = oBuffer.duration;
+    out->pts = oBuffer.pts;
+    if(pipe)
+        ff_tvai_stats_output(&pipe->stats, pProcessor, out, oBuffer.pts, tvai_remaining_frames(pProcessor));
+    av_log(ctx, AV_LOG_DEBUG, "Finished processing frame %"PRId64" %lf\n", out->pts, TS2T(out->pts, outlink->time_base));
+    *pOut = out;
+    return 0;
+}
+
+int ff_tvai_add_output(void *pProcessor, TVAIPipeline *pipe, AVFilterLink *outlink, const AVFrame* frame) {
+    int n = tvai_output_count(pProcessor), i, ret;
     for(i=0;i<n;i++) {
-        TVAIBuffer oBuffer;
-        AVFrame *out = ff_tvai_prepareBufferOutput(outlink, &oBuffer);
-        if(out != NULL && tvai_output_frame(pProcessor, &oBuffer) == 0) {
-            av_frame_copy_props(out, frame);
-            out->duration = oBuffer.duration;
-            out->pts = oBuffer.pts;
-            int ret = 0;
-            if(oBuffer.pts >= 0)
-                ret = ff_filter_frame(outlink, out);
-            if(oBuffer.pts < 0 || ret) {
-                av_frame_free(&out);
-                av_log(NULL, AV_LOG_ERROR, "Ignoring frame %ld %ld %lf\n", oBuffer.pts, frame->pts, TS2T(oBuffer.pts, outlink->time_base));
-                return ret;
-            }
-            av_log(NULL, AV_LOG_DEBUG, "Finished processing frame %ld %ld %lf\n", oBuffer.pts, frame->pts, TS2T(oBuffer.pts, outlink->time_base));
-        } else {
-            av_log(NULL, AV_LOG_ERROR, "Error processing frame %ld %ld %lf\n", oBuffer.pts, frame->pts, TS2T(oBuffer.pts, outlink->time_base));
-            return AVERROR(ENOSYS);
-        }
+        AVFrame *out;
+        if((ret = ff_tvai_get_output(pProcessor, pipe, outlink, frame, pipe ? pipe->sources : NULL, &out)))
+            return ret;
+        if(out && (ret = ff_filter_frame(outlink, out)))
+            return ret;
     }
     return 0;
 }
@@ -161,25 +846,141 @@ DictionaryItem* ff_tvai_alloc_copy_entries(AVDictionary* dict, int *pCount) {
     return pDictInfo;
 }
 
-int ff_tvai_postflight(AVFilterLink *outlink, void* pFrameProcessor, AVFrame* previousFrame) {
-    tvai_end_stream(pFrameProcessor);
-    int i = 0, remaining = tvai_remaining_frames(pFrameProcessor), pr = 0;
-    while(remaining > 0 && i < 50) {
-        int ret = ff_tvai_add_output(pFrameProcessor, outlink, previousFrame);
-        if(ret)
+static int tvai_remaining_total(void *const *pProcessors, int count) {
+    int remaining = 0;
+    for(int i=0;i<count;i++)
+        remaining += tvai_remaining_frames(pProcessors[i]);
+    return remaining;
+}
+
+int ff_tvai_drain_custom(void *const *pProcessors, int count, TVAIPipeline *pipe, int timeoutMs, TVAICollectFunc collect, void *opaque) {
+    int remaining, previous, ret, waitMs = TVAI_DRAIN_MIN_WAIT_MS, stalledMs = 0;
+    const int64_t start = av_gettime_relative();
+    for(int i=0;i<count;i++)
+        tvai_end_stream(pProcessors[i]);
+    remaining = tvai_remaining_total(pProcessors, count);
+    while(remaining > 0) {
+        if((ret = collect(opaque)))
             return ret;
-        tvai_wait(500);
-        pr = remaining;
-        remaining = tvai_remaining_frames(pFrameProcessor);
-        if(pr == remaining)
-            i++;
-        else
-            i = 0;
+        previous = remaining;
+        remaining = tvai_remaining_total(pProcessors, count);
+        if(remaining <= 0)
+            break;
+        if(remaining != previous) {
+            // Progress was made, poll again right away with a short backoff
+            waitMs = TVAI_DRAIN_MIN_WAIT_MS;
+            stalledMs = 0;
+            continue;
+        }
+        if(timeoutMs >= 0 && stalledMs >= timeoutMs) {
+            av_log(NULL, AV_LOG_WARNING, "Waited too long for processing, ending file %d\n", remaining);
+            break;
+        }
+        tvai_wait(waitMs);
+        stalledMs += waitMs;
+        waitMs = FFMIN(waitMs*2, TVAI_DRAIN_MAX_WAIT_MS);
     }
-    if(remaining > 0) {
-        av_log(NULL, AV_LOG_WARNING, "Waited too long for processing, ending file %d\n", remaining);    
+    // Pick up frames that finished together with the last remaining ones
+    ret = collect(opaque);
+    if(pipe)
+        pipe->stats.postflightTime += av_gettime_relative() - start;
+    return ret;
+}
+
+int ff_tvai_wait_output(AVFilterContext *ctx, void *const *pProcessors, int count) {
+    int waitMs = TVAI_DRAIN_MIN_WAIT_MS, stalledMs = 0, remaining = 0, previous = -1, i;
+    for(;;) {
+        previous = remaining;
+        remaining = 0;
+        for(i=0;i<count;i++) {
+            if(tvai_output_count(pProcessors[i]) > 0)
+                return 1;
+            remaining += tvai_remaining_frames(pProcessors[i]);
+        }
+        if(remaining <= 0)
+            return 0;
+        if(stalledMs && remaining != previous)
+            return 1;
+        if(stalledMs >= TVAI_DRAIN_TIMEOUT_MS) {
+            av_log(ctx, AV_LOG_ERROR, "No frame finished for %d ms with %d pending\n", stalledMs, remaining);
+            return AVERROR_EXTERNAL;
+        }
+        tvai_wait(waitMs);
+        stalledMs += waitMs;
+        waitMs = FFMIN(waitMs*2, TVAI_DRAIN_MAX_WAIT_MS);
     }
-    return 0;
 }
 
+typedef struct TVAIDrainOutput {
+    AVFilterLink *outlink;
+    void *pFrameProcessor;
+    TVAIPipeline *pipe;
+    const AVFrame *previousFrame;
+} TVAIDrainOutput;
 
+static int tvai_drain_collect(void *opaque) {
+    TVAIDrainOutput *d = opaque;
+    if(!d->outlink) {
+        ff_tvai_ignore_output(d->pFrameProcessor);
+        return 0;
+    }
+    return ff_tvai_add_output(d->pFrameProcessor, d->pipe, d->outlink, d->previousFrame);
+}
+
+int ff_tvai_drain(AVFilterLink *outlink, void* pFrameProcessor, TVAIPipeline *pipe, const AVFrame* previousFrame, int timeoutMs) {
+    TVAIDrainOutput d = { outlink, pFrameProcessor, pipe, previousFrame };
+    return ff_tvai_drain_custom(&pFrameProcessor, 1, pipe, timeoutMs, tvai_drain_collect, &d);
+}
+
+typedef struct TVAIActivate {
+    void *pFrameProcessor;
+    TVAIPipeline *pipe;
+    TVAISubmitFunc submit;
+} TVAIActivate;
+
+static int tvai_activate_submit(AVFilterContext *ctx, void *opaque, AVFrame *in) {
+    TVAIActivate *a = opaque;
+    int ret;
+    if(a->submit(ctx, in)) {
+        av_frame_free(&in);
+        return AVERROR(ENOSYS);
+    }
+    ret = ff_tvai_sources_push(a->pipe->sources, in);
+    av_frame_free(&in);
+    return ret;
+}
+
+static int tvai_activate_collect(AVFilterContext *ctx, void *opaque) {
+    TVAIActivate *a = opaque;
+    return ff_tvai_add_output(a->pFrameProcessor, a->pipe, ctx->outputs[0], NULL);
+}
+
+static int tvai_activate_in_flight(void *opaque) {
+    TVAIActivate *a = opaque;
+    return tvai_remaining_frames(a->pFrameProcessor);
+}
+
+static int tvai_activate_wait(AVFilterContext *ctx, void *opaque) {
+    TVAIActivate *a = opaque;
+    return ff_tvai_wait_output(ctx, &a->pFrameProcessor, 1);
+}
+
+static int tvai_activate_drain(AVFilterContext *ctx, void *opaque) {
+    TVAIActivate *a = opaque;
+    if(!av_fifo_can_read(a->pipe->sources))
+        return 0;
+    return ff_tvai_drain(ctx->outputs[0], a->pFrameProcessor, a->pipe, NULL, TVAI_DRAIN_TIMEOUT_MS);
+}
+
+static const TVAIWindowOps tvai_activate_ops = {
+    .submit    = tvai_activate_submit,
+    .collect   = tvai_activate_collect,
+    .in_flight = tvai_activate_in_flight,
+    .wait      = tvai_activate_wait,
+    .drain     = tvai_activate_drain,
+};
+
+int ff_tvai_activate(AVFilterContext *ctx, void *pFrameProcessor, TVAIPipeline *pipe, TVAISubmitFunc submit) {
+    TVAIActivate a = { pFrameProcessor, pipe, submit };
+    return ff_tvai_window_activate(ctx, &tvai_activate_ops, &a, pipe->maxInFlight);
+}
@@ -5,13 +5,83 @@
 #include "libavutil/imgutils.h"
 #include "libavutil/opt.h"
 #include "libavutil/avutil.h"
+#include "libavutil/buffer.h"
+#include "libavutil/fifo.h"
 #include "avfilter.h"
 #include "formats.h"
 #include "avfilter_internal.h"
 #include "video.h"
+#include "filters.h"
 #include "tvai_data.h"
 #include "tvai.h"
 #include "tvai_messages.h"
+#include "tvai_window.h"
+
+#define TVAI_DRAIN_MIN_WAIT_MS 1
+#define TVAI_DRAIN_MAX_WAIT_MS 64
+#define TVAI_DRAIN_TIMEOUT_MS  25000
+
+/**
+ * Pixel formats the tvai filters accept besides the packed 16 bit layout
+ * of the model. Conversion is done in a single slice threaded pass.
+ */
+#define TVAI_CONVERTED_PIX_FMTS AV_PIX_FMT_YUV420P10, AV_PIX_FMT_P010, AV_PIX_FMT_GBRP16, AV_PIX_FMT_GBRPF32
+
+typedef struct TVAIConverter {
+    AVFilterContext *ctx;
+    enum AVPixelFormat modelFormat; ///< AV_PIX_FMT_RGB48 or AV_PIX_FMT_BGR48
+    AVFrame *input;                 ///< staging frame handed to the model, NULL if the input is passed directly
+    AVFrame *output;                ///< staging frame filled by the model, NULL if the output is written directly
+} TVAIConverter;
+
+#define TVAI_MAX_PREALLOCATED_FRAMES 64
+
+/**
+ * Recycled output frames in the format and size of the output link.
+ */
+typedef struct TVAIFramePool {
+    AVBufferPool *pool;
+    int format, width, height;
+    int linesize[4];
+    size_t offset[4];
+    int hugePages;                  ///< back the buffers with transparent huge pages where supported
+    int64_t requests, misses, preallocated;
+} TVAIFramePool;
+
+#define TVAI_STATS_LATENCY_BUCKETS 12
+#define TVAI_STATS_MAX_PENDING 256
+
+/**
+ * Per filter instance counters, times are in microseconds.
+ */
+typedef struct TVAIStats {
+    int exportMetadata;             ///< attach lavfi.tvai.* metadata to output frames and log the summary at info level
+    int64_t submitted, output, dropped;
+    int64_t latency[TVAI_STATS_LATENCY_BUCKETS]; ///< submit to output latency, bucket i counts latencies below 2^i ms, the last one all longer
+    int64_t latencySum, latencyMax;
+    int64_t queueDepthSum;
+    int queueDepthMax;
+    int64_t convertTime;            ///< converting between link and model formats
+    int64_t submitTime;             ///< blocked in tvai_process
+    int64_t exportedConvertTime, exportedSubmitTime; ///< totals when the previous output frame was exported
+    int64_t postflightTime;         ///< draining the processor at the end of the stream
+    struct { const void *source; int64_t pts, time; } pending[TVAI_STATS_MAX_PENDING]; ///< submissions not yet output, with the processor they went to
+    int pendingFirst, pendingCount;
+} TVAIStats;
+
+/**
+ * Per filter instance state used when submitting frames to and retrieving
+ * frames from a processor.
+ */
+typedef struct TVAIPipeline {
+    TVAIConverter converter;
+    TVAIFramePool pool;
+    TVAIStats stats;
+    AVFifo *sources;                ///< properties of the submitted frames, see ff_tvai_sources_push()
+    int maxInFlight;                ///< maximum number of frames pending in the processor
+    int used;                       ///< a frame was submitted, the processors hold stream state
+    int bandOutput;                 ///< the filter converts its output band by band with ff_tvai_convert_output_band()
+} TVAIPipeline;
 
 int ff_tvai_checkDevice(char* deviceString, DeviceSetting* pDevice, AVFilterContext* ctx);
 int ff_tvai_checkScale(char* modelName, int scale, AVFilterContext* ctx);
@@ -19,16 +89,130 @@ int ff_tvai_checkModel(char* modelName, ModelType modelType, AVFilterContext* ct
 void ff_tvai_handleLogging(void);
 int ff_tvai_prepareProcessorInfo(char *deviceString, VideoProcessorInfo* pProcessorInfo, ModelType modelType, AVFilterLink *pOutlink, 
         BasicProcessorInfo* pBasic, int procIndex, DictionaryItem *pParameters, int parameterCount);
-void ff_tvai_prepareBufferInput(TVAIBuffer* ioBuffer, AVFrame *in);
-AVFrame* ff_tvai_prepareBufferOutput(AVFilterLink *outlink, TVAIBuffer* oBuffer);
 
-int ff_tvai_add_output(void *pProcessor, AVFilterLink *outlink, AVFrame* frame);
-int ff_tvai_process(void *pFrameProcessor, AVFrame* frame);
+/**
+ * Create a processor for pInfo, or reuse an idle one created with the same
+ * info by any filter instance in the process. cacheBudget is the estimated
+ * frame memory in MB idle processors may hold before the least recently
+ * used ones are destroyed, 0 disables caching and always creates a new
+ * processor. Each processor is checked out by a single filter at a time.
+ *
+ * The backend cannot reset a processor once it received a frame, so only
+ * processors released unused go back to the cache. This helps when a graph
+ * is configured again before any frame went through it, e.g. while probing
+ * or after a failed configuration, but a processor that filtered a stream
+ * is always destroyed and never reused. Idle processors left in the cache
+ * are destroyed when the process exits.
+ */
+void* ff_tvai_processor_acquire(AVFilterContext *ctx, VideoProcessorInfo *pInfo, int cacheBudget);
+/**
+ * Give back a processor from ff_tvai_processor_acquire(). used tells whether
+ * any frame was submitted to it, see TVAIPipeline.used.
+ */
+void ff_tvai_processor_release(AVFilterContext *ctx, void *pProcessor, int used);
+/**
+ * Submit buffer to the processor with tvai_process() and set pipe->used,
+ * returns 0 on success.
+ */
+int ff_tvai_submit(void *pProcessor, TVAIPipeline *pipe, TVAIBuffer *buffer);
+
+/**
+ * Set up conversion between the negotiated link formats and modelFormat and
+ * the output frame pool. outputFrames is the number of output frames to
+ * preallocate, filters passing their input frames through pass -1 so
+ * neither output conversion nor the pool are set up.
+ */
+int ff_tvai_pipeline_init(TVAIPipeline *pipe, AVFilterContext *ctx, enum AVPixelFormat modelFormat, int outputFrames, int hugePages);
+void ff_tvai_pipeline_uninit(TVAIPipeline *pipe, AVFilterContext *ctx);
+
+int ff_tvai_frame_pool_init(TVAIFramePool *pool, AVFilterLink *outlink, int preallocate, int hugePages);
+AVFrame* ff_tvai_frame_pool_get(TVAIFramePool *pool);
+/**
+ * Free the pool, hit and miss counters are logged to ctx if not NULL.
+ */
+void ff_tvai_frame_pool_uninit(TVAIFramePool *pool, AVFilterContext *ctx);
+
+/**
+ * Account for a frame with processor pts submitted at time start, queueDepth
+ * is the number of frames pending in the processor afterwards.
+ */
+void ff_tvai_stats_submit(TVAIStats *stats, const void *source, int64_t pts, int64_t start, int queueDepth);
+/**
+ * Account for a finished frame with processor pts, out is NULL if the frame
+ * was dropped.
+ */
+void ff_tvai_stats_output(TVAIStats *stats, const void *source, AVFrame *out, int64_t pts, int queueDepth);
+
+int ff_tvai_prepareBufferInput(TVAIPipeline *pipe, TVAIBuffer* ioBuffer, AVFrame *in);
+AVFrame* ff_tvai_prepareBufferOutput(AVFilterLink *outlink, TVAIPipeline *pipe, TVAIBuffer* oBuffer);
+void ff_tvai_finishBufferOutput(TVAIPipeline *pipe, AVFrame *out);
+/**
+ * Convert h rows starting at row y of out from the model format rows in src.
+ * y and h must be even unless the band ends at the bottom of the frame.
+ */
+void ff_tvai_convert_output_band(TVAIPipeline *pipe, AVFrame *out, const uint8_t *src, int srcLinesize, int y, int h);
+
+/**
+ * Retrieve one finished frame from the processor, taking the properties
+ * not set by the processor from frame, or from the matching entry of
+ * sources if frame is NULL. *pOut is set to NULL for frames the processor
+ * marks to be dropped.
+ */
+int ff_tvai_get_output(void *pProcessor, TVAIPipeline *pipe, AVFilterLink *outlink, const AVFrame* frame, AVFifo *sources, AVFrame **pOut);
+/**
+ * Forward all finished frames, see ff_tvai_get_output(). Frames without
+ * frame take their properties from pipe->sources.
+ */
+int ff_tvai_add_output(void *pProcessor, TVAIPipeline *pipe, AVFilterLink *outlink, const AVFrame* frame);
+int ff_tvai_process(void *pFrameProcessor, TVAIPipeline *pipe, AVFrame* frame);
 void ff_tvai_ignore_output(void *pProcessor);
 void av_dict_set_float(AVDictionary **dict, const char *key, float value, int flag);
 void ff_av_dict_log(AVFilterContext *ctx, const char* msg, const AVDictionary *dict);
 DictionaryItem* ff_tvai_alloc_copy_entries(AVDictionary* dict, int *pCount);
 int ff_tvai_copy_entries(AVDictionary* dict, DictionaryItem* pDictInfo);
-int ff_tvai_postflight(AVFilterLink *outlink, void* pFrameProcessor, AVFrame* previousFrame);
+/**
+ * Signal the end of stream and wait for the processor to finish all queued
+ * frames. Each finished frame is forwarded to outlink as soon as it is
+ * reported, or discarded if outlink is NULL. Polling backs off from
+ * TVAI_DRAIN_MIN_WAIT_MS to TVAI_DRAIN_MAX_WAIT_MS while nothing finishes
+ * and gives up after timeoutMs without progress, or never if timeoutMs is
+ * negative.
+ */
+int ff_tvai_drain(AVFilterLink *outlink, void* pFrameProcessor, TVAIPipeline *pipe, const AVFrame* previousFrame, int timeoutMs);
+
+/**
+ * Retrieve and forward the frames the processor finished so far.
+ */
+typedef int (*TVAICollectFunc)(void *opaque);
+
+/**
+ * Same as ff_tvai_drain() over count processors for filters assembling
+ * their outputs themselves, collect(opaque) is called whenever frames may
+ * have finished.
+ */
+int ff_tvai_drain_custom(void *const *pProcessors, int count, TVAIPipeline *pipe, int timeoutMs, TVAICollectFunc collect, void *opaque);
+
+/**
+ * Block until one of the count processors has finished frames, backing off
+ * like ff_tvai_drain(). Returns 1 once output is available, 0 if none of
+ * them has frames pending and a negative error code after
+ * TVAI_DRAIN_TIMEOUT_MS without progress.
+ */
+int ff_tvai_wait_output(AVFilterContext *ctx, void *const *pProcessors, int count);
+
+/**
+ * Submit a single input frame to the processor, returns 0 on success.
+ */
+typedef int (*TVAISubmitFunc)(AVFilterContext *ctx, AVFrame *in);
+
+/**
+ * Shared activate() callback body for the tvai filters, runs
+ * ff_tvai_window_activate() over a single processor.
+ *
+ * No more than pipe->maxInFlight frames are pending in the processor.
+ * Finished frames are forwarded in processor order and take their
+ * properties from the submitted frames queued in pipe->sources.
+ */
+int ff_tvai_activate(AVFilterContext *ctx, void *pFrameProcessor, TVAIPipeline *pipe, TVAISubmitFunc submit);
 
 #endif
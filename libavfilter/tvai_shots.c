@@ -0,0 +1,208 @@
+/*
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include "libavutil/common.h"
+#include "libavutil/mathematics.h"
+#include "filters.h"
+#include "tvai_shots.h"
+#include "tvai_window.h"
+
+int ff_tvai_shots_init(TVAIShots *s) {
+    s->maxShots = av_clip(s->maxShots, 1, TVAI_SHOTS_MAX);
+    for(int i=0;i<s->maxShots;i++) {
+        TVAIShot *shot = &s->shots[i];
+        shot->input = av_fifo_alloc2(8, sizeof(AVFrame*), AV_FIFO_FLAG_AUTO_GROW);
+        shot->output = av_fifo_alloc2(8, sizeof(AVFrame*), AV_FIFO_FLAG_AUTO_GROW);
+        shot->sources = av_fifo_alloc2(8, sizeof(AVFrame*), AV_FIFO_FLAG_AUTO_GROW);
+        if(!shot->input || !shot->output || !shot->sources)
+            return AVERROR(ENOMEM);
+    }
+    return 0;
+}
+
+/**
+ * Clear a slot for its next shot and give back its processor.
+ */
+static void shot_retire(AVFilterContext *ctx, TVAIShots *s, TVAIShot *shot) {
+    AVFrame *frame;
+    while(shot->input && av_fifo_read(shot->input, &frame, 1) >= 0)
+        av_frame_free(&frame);
+    while(shot->output && av_fifo_read(shot->output, &frame, 1) >= 0)
+        av_frame_free(&frame);
+    if(shot->sources)
+        ff_tvai_sources_reset(shot->sources);
+    if(shot->processor)
+        s->ops->release(ctx, shot->processor, shot->used);
+    shot->processor = NULL;
+    shot->used = shot->ended = shot->flushed = 0;
+}
+
+void ff_tvai_shots_uninit(AVFilterContext *ctx, TVAIShots *s) {
+    for(int i=0;i<s->maxShots;i++) {
+        TVAIShot *shot = &s->shots[i];
+        shot_retire(ctx, s, shot);
+        av_fifo_freep2(&shot->input);
+        av_fifo_freep2(&shot->output);
+        av_fifo_freep2(&shot->sources);
+    }
+    av_frame_free(&s->pendingFrame);
+}
+
+static int shot_start(AVFilterContext *ctx, TVAIShots *s) {
+    TVAIShot *shot = &s->shots[(s->firstShot + s->shotCount) % s->maxShots];
+    shot->processor = s->ops->acquire(ctx);
+    if(!shot->processor)
+        return AVERROR(EINVAL);
+    if(s->shotCount > 0)
+        s->shots[(s->firstShot + s->shotCount - 1) % s->maxShots].ended = 1;
+    s->shotCount++;
+    av_log(ctx, AV_LOG_DEBUG, "Starting shot with %d shots in progress\n", s->shotCount);
+    return 0;
+}
+
+static int shot_process(AVFilterContext *ctx, TVAIShots *s, TVAIShot *shot, int oldest) {
+    AVFilterLink *outlink = ctx->outputs[0];
+    AVFrame *frame;
+    int n = s->ops->output_count(shot->processor), i, ret;
+    for(i=0;i<n;i++) {
+        if((ret = s->ops->output(ctx, shot->processor, shot->sources, &frame)))
+            return ret;
+        if(!frame)
+            continue;
+        if(oldest && !av_fifo_can_read(shot->output)) {
+            if((ret = ff_filter_frame(outlink, frame)) < 0)
+                return ret;
+        } else if(av_fifo_write(shot->output, &frame, 1) < 0) {
+            av_frame_free(&frame);
+            return AVERROR(ENOMEM);
+        }
+    }
+    // Later shots stop once their reorder queue holds a look-ahead worth of frames
+    while(av_fifo_can_read(shot->input) && s->ops->remaining(shot->processor) < s->maxInFlight &&
+          (oldest || av_fifo_can_read(shot->output) < s->lookahead)) {
+        av_fifo_read(shot->input, &frame, 1);
+        s->buffered--;
+        shot->used = 1;
+        if((ret = s->ops->submit(ctx, shot->processor, frame)) < 0) {
+            av_log(ctx, AV_LOG_ERROR, "The processing has failed\n");
+            av_frame_free(&frame);
+            return ret;
+        }
+        ret = ff_tvai_sources_push(shot->sources, frame);
+        av_frame_free(&frame);
+        if(ret < 0)
+            return ret;
+    }
+    if(shot->ended && !shot->flushed && !av_fifo_can_read(shot->input)) {
+        s->ops->end_stream(shot->processor);
+        shot->flushed = 1;
+    }
+    return 0;
+}
+
+int ff_tvai_shots_activate(AVFilterContext *ctx, TVAIShots *s) {
+    AVFilterLink *inlink = ctx->inputs[0];
+    AVFilterLink *outlink = ctx->outputs[0];
+    AVFrame *frame;
+    int64_t pts;
+    int ret, status, i;
+
+    FF_FILTER_FORWARD_STATUS_BACK(outlink, inlink);
+
+    // Split the input into shots at scene cuts, up to the look-ahead limit
+    while(!s->eof && s->buffered < s->lookahead) {
+        int cut = s->pendingCut;
+        frame = s->pendingFrame;
+        s->pendingFrame = NULL;
+        if(!frame) {
+            ret = ff_inlink_consume_frame(inlink, &frame);
+            if(ret <= 0) {
+                if(ret < 0)
+                    return ret;
+                break;
+            }
+            cut = s->ops->scene_score(ctx, frame) >= s->threshold;
+        }
+        if(s->shotCount == 0 || cut) {
+            if(s->shotCount == s->maxShots) {
+                // The newest shot is complete, let it flush while waiting for a free slot
+                s->shots[(s->firstShot + s->shotCount - 1) % s->maxShots].ended = 1;
+                s->pendingFrame = frame;
+                s->pendingCut = cut;
+                break;
+            }
+            if((ret = shot_start(ctx, s)) < 0) {
+                av_frame_free(&frame);
+                return ret;
+            }
+        }
+        if(av_fifo_write(s->shots[(s->firstShot + s->shotCount - 1) % s->maxShots].input, &frame, 1) < 0) {
+            av_frame_free(&frame);
+            return AVERROR(ENOMEM);
+        }
+        s->buffered++;
+    }
+
+    if(!s->eof && !s->pendingFrame && ff_inlink_acknowledge_status(inlink, &status, &pts)) {
+        s->eof = status;
+        s->eofPts = av_rescale_q(pts, inlink->time_base, outlink->time_base);
+        if(s->shotCount > 0)
+            s->shots[(s->firstShot + s->shotCount - 1) % s->maxShots].ended = 1;
+    }
+
+    for(i=0;i<s->shotCount;i++) {
+        if((ret = shot_process(ctx, s, &s->shots[(s->firstShot + i) % s->maxShots], i == 0)))
+            return ret;
+    }
+
+    // Send finished shots in order and retire them
+    while(s->shotCount > 0) {
+        TVAIShot *shot = &s->shots[s->firstShot];
+        while(av_fifo_read(shot->output, &frame, 1) >= 0) {
+            if((ret = ff_filter_frame(outlink, frame)) < 0)
+                return ret;
+        }
+        if(!shot->flushed || s->ops->remaining(shot->processor) > 0 || s->ops->output_count(shot->processor) > 0)
+            break;
+        shot_retire(ctx, s, shot);
+        s->firstShot = (s->firstShot + 1) % s->maxShots;
+        s->shotCount--;
+        ff_filter_set_ready(ctx, 100);
+    }
+
+    if(s->eof && s->shotCount == 0 && !s->pendingFrame) {
+        ff_outlink_set_status(outlink, s->eof, s->eofPts);
+        return 0;
+    }
+    if(!ff_outlink_frame_wanted(outlink))
+        return 0;
+    if(!s->eof && !s->pendingFrame && s->buffered < s->lookahead) {
+        ff_inlink_request_frame(inlink);
+    } else {
+        // Wait for any shot in progress rather than polling
+        void *processors[TVAI_SHOTS_MAX];
+        for(i=0;i<s->shotCount;i++)
+            processors[i] = s->shots[(s->firstShot + i) % s->maxShots].processor;
+        ret = s->ops->wait(ctx, processors, s->shotCount);
+        if(ret < 0)
+            return ret;
+        if(ret > 0)
+            ff_filter_set_ready(ctx, 100);
+    }
+    return 0;
+}
@@ -0,0 +1,117 @@
+/*
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef AVFILTER_TVAI_SHOTS_H
+#define AVFILTER_TVAI_SHOTS_H
+
+#include "libavutil/fifo.h"
+#include "libavutil/frame.h"
+#include "avfilter.h"
+
+#define TVAI_SHOTS_MAX 8
+
+/**
+ * Processor backend of the shots scheduler. Like TVAIWindowOps none of the
+ * callbacks depends on the Topaz Video AI SDK.
+ */
+typedef struct TVAIShotOps {
+    /**
+     * Create the processor for a shot starting, NULL on failure. Processors
+     * cannot be reset, so every shot gets a processor of its own.
+     */
+    void* (*acquire)(AVFilterContext *ctx);
+    /**
+     * Give back the processor of a retired shot, used is set if any frame
+     * was submitted to it.
+     */
+    void (*release)(AVFilterContext *ctx, void *processor, int used);
+    /**
+     * Submit one frame without taking ownership of it, returns 0 on
+     * success and a negative error code otherwise.
+     */
+    int (*submit)(AVFilterContext *ctx, void *processor, AVFrame *in);
+    /**
+     * Retrieve one finished frame, taking the properties from the matching
+     * entry of sources, see ff_tvai_sources_match(). *out is set to NULL
+     * for dropped frames.
+     */
+    int (*output)(AVFilterContext *ctx, void *processor, AVFifo *sources, AVFrame **out);
+    /**
+     * Number of finished frames ready to be retrieved.
+     */
+    int (*output_count)(void *processor);
+    /**
+     * Number of submitted frames not retrieved yet.
+     */
+    int (*remaining)(void *processor);
+    /**
+     * Signal that no more frames will be submitted.
+     */
+    void (*end_stream)(void *processor);
+    /**
+     * Block until one of the count processors has finished frames, see
+     * TVAIWindowOps.wait.
+     */
+    int (*wait)(AVFilterContext *ctx, void *const *processors, int count);
+    /**
+     * Scene change score of frame against the previous input frame, on
+     * the scale of the threshold.
+     */
+    double (*scene_score)(AVFilterContext *ctx, AVFrame *frame);
+} TVAIShotOps;
+
+/**
+ * A slot for a run of frames between two scene cuts.
+ */
+typedef struct TVAIShot {
+    void *processor;                ///< acquired when the shot starts, released when it is retired
+    AVFifo *input;                  ///< frames of the shot not yet submitted
+    AVFifo *output;                 ///< finished frames waiting for the previous shots to be sent
+    AVFifo *sources;                ///< properties of the submitted frames
+    int used, ended, flushed;
+} TVAIShot;
+
+/**
+ * Splits the input at scene cuts into shots processed in parallel by
+ * separate processors, and sends their output in input order.
+ */
+typedef struct TVAIShots {
+    const TVAIShotOps *ops;
+    int maxShots;                   ///< number of slots, at most TVAI_SHOTS_MAX
+    int maxInFlight;                ///< maximum number of frames pending in each processor
+    int lookahead;                  ///< maximum number of input frames buffered ahead of the oldest shot
+    double threshold;               ///< scene_score() at or above which a new shot starts
+    TVAIShot shots[TVAI_SHOTS_MAX]; ///< ring of shots in progress, oldest first
+    int firstShot, shotCount, buffered, eof, pendingCut;
+    int64_t eofPts;
+    AVFrame *pendingFrame;          ///< frame starting a new shot while all slots are busy
+} TVAIShots;
+
+/**
+ * Allocate the slots, the parameters must be set before.
+ */
+int ff_tvai_shots_init(TVAIShots *s);
+void ff_tvai_shots_uninit(AVFilterContext *ctx, TVAIShots *s);
+
+/**
+ * activate() callback body for single input, single output filters
+ * processing shots in parallel.
+ */
+int ff_tvai_shots_activate(AVFilterContext *ctx, TVAIShots *s);
+
+#endif /* AVFILTER_TVAI_SHOTS_H */
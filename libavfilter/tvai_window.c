@@ -0,0 +1,103 @@
+/*
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include "libavutil/common.h"
+#include "libavutil/mathematics.h"
+#include "filters.h"
+#include "tvai_window.h"
+
+int ff_tvai_window_activate(AVFilterContext *ctx, const TVAIWindowOps *ops, void *opaque, int maxInFlight) {
+    AVFilterLink *inlink = ctx->inputs[0];
+    AVFilterLink *outlink = ctx->outputs[0];
+    AVFrame *in = NULL;
+    int64_t pts;
+    int ret = 0, status, inFlight;
+
+    maxInFlight = FFMAX(maxInFlight, 1);
+
+    FF_FILTER_FORWARD_STATUS_BACK(outlink, inlink);
+
+    if((ret = ops->collect(ctx, opaque)))
+        return ret;
+
+    inFlight = ops->in_flight(opaque);
+    while(inFlight < maxInFlight && (ret = ff_inlink_consume_frame(inlink, &in)) > 0) {
+        if((ret = ops->submit(ctx, opaque, in)) < 0) {
+            av_log(ctx, AV_LOG_ERROR, "The processing has failed\n");
+            return ret;
+        }
+        inFlight++;
+    }
+    if(ret < 0)
+        return ret;
+
+    if((ret = ops->collect(ctx, opaque)))
+        return ret;
+
+    if(ff_inlink_acknowledge_status(inlink, &status, &pts)) {
+        ret = 0;
+        if(status == AVERROR_EOF)
+            ret = ops->drain(ctx, opaque);
+        ff_outlink_set_status(outlink, status, av_rescale_q(pts, inlink->time_base, outlink->time_base));
+        return ret;
+    }
+
+    if(!ff_outlink_frame_wanted(outlink))
+        return 0;
+    if(inFlight < maxInFlight) {
+        ff_inlink_request_frame(inlink);
+    } else {
+        // Window is full and nothing finished yet, wait for the backend instead of spinning
+        ret = ops->wait(ctx, opaque);
+        if(ret < 0)
+            return ret;
+        if(ret > 0)
+            ff_filter_set_ready(ctx, 100);
+    }
+    return 0;
+}
+
+int ff_tvai_sources_push(AVFifo *sources, const AVFrame *in) {
+    AVFrame *source = av_frame_alloc();
+    int ret;
+    if(!source)
+        return AVERROR(ENOMEM);
+    if((ret = av_frame_copy_props(source, in)) < 0 || (ret = av_fifo_write(sources, &source, 1)) < 0) {
+        av_frame_free(&source);
+        return ret;
+    }
+    return 0;
+}
+
+const AVFrame* ff_tvai_sources_match(AVFifo *sources, AVFilterContext *ctx, int64_t pts) {
+    AVFrame *source, *next;
+    pts = av_rescale_q(pts, ctx->outputs[0]->time_base, ctx->inputs[0]->time_base);
+    while(av_fifo_peek(sources, &next, 1, 1) >= 0 && next->pts <= pts) {
+        av_fifo_read(sources, &source, 1);
+        av_frame_free(&source);
+    }
+    if(av_fifo_peek(sources, &source, 1, 0) < 0)
+        return NULL;
+    return source;
+}
+
+void ff_tvai_sources_reset(AVFifo *sources) {
+    AVFrame *source;
+    while(av_fifo_read(sources, &source, 1) >= 0)
+        av_frame_free(&source);
+}
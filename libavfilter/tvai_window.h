@@ -0,0 +1,87 @@
+/*
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef AVFILTER_TVAI_WINDOW_H
+#define AVFILTER_TVAI_WINDOW_H
+
+#include "libavutil/fifo.h"
+#include "libavutil/frame.h"
+#include "avfilter.h"
+
+/**
+ * Asynchronous backend driven by ff_tvai_window_activate(). opaque is
+ * passed through to every callback. None of them depends on the Topaz
+ * Video AI SDK, so the window logic can be tested against a stub backend.
+ */
+typedef struct TVAIWindowOps {
+    /**
+     * Submit one input frame, taking ownership of it. Returns 0 on success
+     * and a negative error code otherwise.
+     */
+    int (*submit)(AVFilterContext *ctx, void *opaque, AVFrame *in);
+    /**
+     * Forward the frames the backend finished so far to the output.
+     */
+    int (*collect)(AVFilterContext *ctx, void *opaque);
+    /**
+     * Number of submitted frames the backend has not finished yet.
+     */
+    int (*in_flight)(void *opaque);
+    /**
+     * Block until the backend finished frames. Returns 1 once output is
+     * available, 0 if no frame is pending and a negative error code on
+     * failure.
+     */
+    int (*wait)(AVFilterContext *ctx, void *opaque);
+    /**
+     * Signal the end of stream and forward all remaining frames.
+     */
+    int (*drain)(AVFilterContext *ctx, void *opaque);
+} TVAIWindowOps;
+
+/**
+ * activate() callback body for single input, single output filters
+ * feeding a backend with latency.
+ *
+ * Input frames are submitted as soon as they arrive, while no more than
+ * maxInFlight frames are pending in the backend. Finished frames are
+ * forwarded as soon as they are reported. When the window is full and the
+ * output wants a frame, the backend is waited on instead of spinning.
+ */
+int ff_tvai_window_activate(AVFilterContext *ctx, const TVAIWindowOps *ops, void *opaque, int maxInFlight);
+
+/**
+ * Queue the properties of a submitted input frame in sources, a FIFO of
+ * AVFrame pointers. The data is not referenced, so the input buffers go
+ * back to their pool. Frames must be queued in pts order.
+ */
+int ff_tvai_sources_push(AVFifo *sources, const AVFrame *in);
+
+/**
+ * Return the queued frame an output with pts in the output time base of
+ * ctx takes its properties from, i.e. the last one not after it, and drop
+ * the frames before it. Returns NULL if nothing is queued.
+ */
+const AVFrame* ff_tvai_sources_match(AVFifo *sources, AVFilterContext *ctx, int64_t pts);
+
+/**
+ * Free all frames queued in sources.
+ */
+void ff_tvai_sources_reset(AVFifo *sources);
+
+#endif /* AVFILTER_TVAI_WINDOW_H */
@@ -954,6 +954,21 @@ static int filter_frame(AVFilterLink *inlink, AVFrame *in)
     return ff_filter_frame(outlink, out);
 }
 
+static int get_lut(AVFilterLink *inlink, int comp, uint16_t *table)
+{
+    CurvesContext *curves = inlink->dst->priv;
+
+    /* the alpha component is left untouched */
+    if (comp < NB_COMP) {
+        memcpy(table, curves->graph[comp], curves->lut_size * sizeof(*table));
+    } else {
+        for (int i = 0; i < curves->lut_size; i++)
+            table[i] = i;
+    }
+
+    return 0;
+}
+
 static int process_command(AVFilterContext *ctx, const char *cmd, const char *args,
                            char *res, int res_len, int flags)
 {
@@ -1004,6 +1019,7 @@ static const AVFilterPad curves_inputs[] = {
         .name         = "default",
         .type         = AVMEDIA_TYPE_VIDEO,
         .filter_frame = filter_frame,
+        .get_lut      = get_lut,
         .config_props = config_input,
     },
 };
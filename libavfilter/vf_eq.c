@@ -29,6 +29,7 @@
 
 #include "libavutil/common.h"
 #include "libavutil/imgutils.h"
+#include "libavutil/mem_internal.h"
 #include "libavutil/opt.h"
 #include "libavutil/pixdesc.h"
 
@@ -86,6 +87,14 @@ static void check_values(EQParameters *param, EQContext *eq)
         param->adjust = apply_lut;
 }
 
+/* Build the tables now, so that bands filtered concurrently only read them. */
+static void prepare_luts(EQContext *eq)
+{
+    for (int i = 0; i < 3; i++)
+        if (eq->param[i].adjust == apply_lut && !eq->param[i].lut_clean)
+            create_lut(&eq->param[i]);
+}
+
 static void set_contrast(EQContext *eq)
 {
     eq->contrast = av_clipf(av_expr_eval(eq->contrast_pexpr, eq->var_values, eq), -1000.0, 1000.0);
@@ -177,6 +186,7 @@ static int initialize(AVFilterContext *ctx)
         set_contrast(eq);
         set_brightness(eq);
         set_saturation(eq);
+        prepare_luts(eq);
     }
 
     return 0;
@@ -277,6 +287,47 @@ FF_ENABLE_DEPRECATION_WARNINGS
     return ff_filter_frame(outlink, out);
 }
 
+static int filter_band(AVFilterLink *inlink, AVFrame *out, AVFrame *in,
+                       int band, int nb_bands)
+{
+    EQContext *eq = inlink->dst->priv;
+    const AVPixFmtDescriptor *desc;
+
+    /* the parameters may depend on the frame */
+    if (eq->eval_mode == EVAL_MODE_FRAME)
+        return AVERROR(ENOSYS);
+    if (!out)
+        return 0;
+
+    desc = av_pix_fmt_desc_get(inlink->format);
+    for (int i = 0; i < desc->nb_components; i++) {
+        int w = inlink->w;
+        int h = inlink->h;
+        int y0, y1;
+
+        if (i == 1 || i == 2) {
+            w = AV_CEIL_RSHIFT(w, desc->log2_chroma_w);
+            h = AV_CEIL_RSHIFT(h, desc->log2_chroma_h);
+        }
+        y0 = h *  band      / nb_bands;
+        y1 = h * (band + 1) / nb_bands;
+
+        if (i == 3 || !eq->param[i].adjust) {
+            if (out != in)
+                av_image_copy_plane(out->data[i] + y0 * out->linesize[i], out->linesize[i],
+                                    in->data[i]  + y0 * in->linesize[i],  in->linesize[i],
+                                    w, y1 - y0);
+        } else {
+            eq->param[i].adjust(&eq->param[i],
+                                out->data[i] + y0 * out->linesize[i], out->linesize[i],
+                                in->data[i]  + y0 * in->linesize[i],  in->linesize[i],
+                                w, y1 - y0);
+        }
+    }
+
+    return 0;
+}
+
 static inline int set_param(AVExpr **pexpr, const char *args, const char *cmd,
                             void (*set_fn)(EQContext *eq), AVFilterContext *ctx)
 {
@@ -284,8 +335,10 @@ static inline int set_param(AVExpr **pexpr, const char *args, const char *cmd,
     int ret;
     if ((ret = set_expr(pexpr, args, cmd, ctx)) < 0)
         return ret;
-    if (eq->eval_mode == EVAL_MODE_INIT)
+    if (eq->eval_mode == EVAL_MODE_INIT) {
         set_fn(eq);
+        prepare_luts(eq);
+    }
     return 0;
 }
 
@@ -308,12 +361,36 @@ static int process_command(AVFilterContext *ctx, const char *cmd, const char *ar
     else return AVERROR(ENOSYS);
 }
 
+static int get_lut(AVFilterLink *inlink, int comp, uint16_t *table)
+{
+    EQContext *eq = inlink->dst->priv;
+    DECLARE_ALIGNED(32, uint8_t, src)[256];
+    DECLARE_ALIGNED(32, uint8_t, dst)[256];
+
+    /* the parameters may depend on the frame */
+    if (eq->eval_mode == EVAL_MODE_FRAME)
+        return AVERROR(ENOSYS);
+
+    for (int i = 0; i < 256; i++)
+        src[i] = dst[i] = i;
+    if (comp < 3 && eq->param[comp].adjust)
+        eq->param[comp].adjust(&eq->param[comp], dst, sizeof(dst), src, sizeof(src),
+                               256, 1);
+    for (int i = 0; i < 256; i++)
+        table[i] = dst[i];
+
+    return 0;
+}
+
 static const AVFilterPad eq_inputs[] = {
     {
         .name = "default",
         .type = AVMEDIA_TYPE_VIDEO,
         .filter_frame = filter_frame,
+        .filter_band  = filter_band,
+        .get_lut      = get_lut,
         .config_props = config_props,
+        .flags        = AVFILTERPAD_FLAG_BAND_IN_PLACE,
     },
 };
 
@@ -135,11 +135,22 @@ static int filter_frame(AVFilterLink *inlink, AVFrame *in)
     return ff_filter_frame(outlink, out);
 }
 
+static int filter_band(AVFilterLink *inlink, AVFrame *out, AVFrame *in,
+                       int band, int nb_bands)
+{
+    ThreadData td = { .in = in, .out = out };
+
+    if (!out)
+        return 0;
+    return filter_slice(inlink->dst, &td, band, nb_bands);
+}
+
 static const AVFilterPad avfilter_vf_hflip_inputs[] = {
     {
         .name         = "default",
         .type         = AVMEDIA_TYPE_VIDEO,
         .filter_frame = filter_frame,
+        .filter_band  = filter_band,
         .config_props = config_props,
     },
 };
@@ -151,5 +162,6 @@ const AVFilter ff_vf_hflip = {
     FILTER_INPUTS(avfilter_vf_hflip_inputs),
     FILTER_OUTPUTS(ff_video_default_filterpad),
     FILTER_QUERY_FUNC(query_formats),
-    .flags         = AVFILTER_FLAG_SLICE_THREADS | AVFILTER_FLAG_SUPPORT_TIMELINE_GENERIC,
+    .flags         = AVFILTER_FLAG_SLICE_THREADS | AVFILTER_FLAG_FRAME_THREADS |
+                     AVFILTER_FLAG_SUPPORT_TIMELINE_GENERIC,
 };
@@ -565,6 +565,42 @@ static int filter_frame(AVFilterLink *inlink, AVFrame *in)
     return ff_filter_frame(outlink, out);
 }
 
+static int filter_band(AVFilterLink *inlink, AVFrame *out, AVFrame *in,
+                       int band, int nb_bands)
+{
+    AVFilterContext *ctx = inlink->dst;
+    LutContext *s = ctx->priv;
+
+    if (!out)
+        return 0;
+    if (s->is_rgb && s->is_16bit && !s->is_planar) {
+        PACKED_THREAD_DATA
+        return lut_packed_16bits(ctx, &td, band, nb_bands);
+    } else if (s->is_rgb && !s->is_planar) {
+        PACKED_THREAD_DATA
+        return lut_packed_8bits(ctx, &td, band, nb_bands);
+    } else if (s->is_16bit) {
+        PLANAR_THREAD_DATA
+        return lut_planar_16bits(ctx, &td, band, nb_bands);
+    } else {
+        PLANAR_THREAD_DATA
+        return lut_planar_8bits(ctx, &td, band, nb_bands);
+    }
+}
+
+static int get_lut(AVFilterLink *inlink, int comp, uint16_t *table)
+{
+    LutContext *s = inlink->dst->priv;
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(inlink->format);
+    const AVComponentDescriptor *c = &desc->comp[comp];
+    /* the tables follow the planes, or the samples of packed pixels */
+    const int idx = s->is_rgb && !s->is_planar ? c->offset / ((c->depth + 7) >> 3) :
+                                                 c->plane;
+
+    memcpy(table, s->lut[idx], sizeof(*table) << c->depth);
+    return 0;
+}
+
 static int process_command(AVFilterContext *ctx, const char *cmd, const char *args,
                            char *res, int res_len, int flags)
 {
@@ -580,7 +616,10 @@ static const AVFilterPad inputs[] = {
     { .name         = "default",
       .type         = AVMEDIA_TYPE_VIDEO,
       .filter_frame = filter_frame,
+      .filter_band  = filter_band,
+      .get_lut      = get_lut,
       .config_props = config_props,
+      .flags        = AVFILTERPAD_FLAG_BAND_IN_PLACE,
     },
 };
 
@@ -596,7 +635,8 @@ static const AVFilterPad inputs[] = {
         FILTER_OUTPUTS(ff_video_default_filterpad),                     \
         FILTER_QUERY_FUNC(query_formats),                               \
         .flags         = AVFILTER_FLAG_SUPPORT_TIMELINE_GENERIC |       \
-                         AVFILTER_FLAG_SLICE_THREADS,                   \
+                         AVFILTER_FLAG_SLICE_THREADS |                  \
+                         AVFILTER_FLAG_FRAME_THREADS,                   \
         .process_command = process_command,                             \
     }
 
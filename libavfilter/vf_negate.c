@@ -329,6 +329,32 @@ static int filter_frame(AVFilterLink *inlink, AVFrame *in)
     return ff_filter_frame(outlink, out);
 }
 
+static int filter_band(AVFilterLink *inlink, AVFrame *out, AVFrame *in,
+                       int band, int nb_bands)
+{
+    ThreadData td = { .in = in, .out = out };
+
+    if (!out)
+        return 0;
+    return filter_slice(inlink->dst, &td, band, nb_bands);
+}
+
+static int get_lut(AVFilterLink *inlink, int comp, uint16_t *table)
+{
+    NegateContext *s = inlink->dst->priv;
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(inlink->format);
+    const AVComponentDescriptor *c = &desc->comp[comp];
+    const int is_packed = !(desc->flags & AV_PIX_FMT_FLAG_PLANAR) &&
+                           (desc->nb_components > 1);
+    const int negate = is_packed ? s->components & (1 << (c->offset / ((c->depth + 7) >> 3))) :
+                                   s->planes & (1 << c->plane);
+
+    for (int i = 0; i < 1 << c->depth; i++)
+        table[i] = negate ? s->max - i : i;
+
+    return 0;
+}
+
 static int process_command(AVFilterContext *ctx, const char *cmd, const char *args,
                            char *res, int res_len, int flags)
 {
@@ -351,7 +377,10 @@ static const AVFilterPad inputs[] = {
         .name         = "default",
         .type         = AVMEDIA_TYPE_VIDEO,
         .filter_frame = filter_frame,
+        .filter_band  = filter_band,
+        .get_lut      = get_lut,
         .config_props = config_input,
+        .flags        = AVFILTERPAD_FLAG_BAND_IN_PLACE,
     },
 };
 
@@ -363,6 +392,7 @@ const AVFilter ff_vf_negate = {
     FILTER_INPUTS(inputs),
     FILTER_OUTPUTS(ff_video_default_filterpad),
     FILTER_PIXFMTS_ARRAY(pix_fmts),
-    .flags         = AVFILTER_FLAG_SUPPORT_TIMELINE_GENERIC | AVFILTER_FLAG_SLICE_THREADS,
+    .flags         = AVFILTER_FLAG_SUPPORT_TIMELINE_GENERIC | AVFILTER_FLAG_SLICE_THREADS |
+                     AVFILTER_FLAG_FRAME_THREADS,
     .process_command = process_command,
 };
@@ -42,10 +42,12 @@ typedef struct TVAICPEContext {
     BasicProcessorInfo basicInfo;
     char *filename;
     void *pFrameProcessor;
+    TVAIPipeline pipeline;
     AVDictionary *parameters;
     DictionaryItem *pModelParameters;
     int modelParametersCount;
     char *deviceString;
+    int cacheBudget;
 } TVAICPEContext;
 
 #define OFFSET(x) offsetof(TVAICPEContext, x)
@@ -57,6 +59,7 @@ static const AVOption tvai_cpe_options[] = {
     { "model", "Model short name", BASIC_OFFSET(modelName), AV_OPT_TYPE_STRING, {.str="cpe-1"}, .flags = FLAGS },
     { "filename", "CPE output filename", OFFSET(filename), AV_OPT_TYPE_STRING, {.str="cpe.json"}, .flags = FLAGS },
     { "device",  "Device index (Auto: -2, CPU: -1, GPU0: 0, ... or a . separated list of GPU indices e.g. 0.1.3)",  OFFSET(deviceString),  AV_OPT_TYPE_STRING, {.str="-2"}, .flags = FLAGS, "device" },
+    { "proccache",  "Estimated frame memory in MB of idle unused processors kept for reuse by later filter instances, 0 to disable",  OFFSET(cacheBudget),  AV_OPT_TYPE_INT, {.i64=0}, 0, INT_MAX, FLAGS, "proccache" },
     { "download",  "Enable model downloading",  BASIC_OFFSET(canDownloadModel),  AV_OPT_TYPE_INT, {.i64=1}, 0, 1, FLAGS, "canDownloadModels" },
     { "parameters", TVAI_CAM_POSE_ESTIMATION_PARAMETER_MESSAGE, OFFSET(parameters), AV_OPT_TYPE_DICT, {.str=""}, .flags = FLAGS, "parameters" },
     { NULL }
@@ -89,12 +92,15 @@ static int config_props(AVFilterLink *outlink) {
       return AVERROR(EINVAL);  
     }
     ff_av_dict_log(ctx, "Parameters", tvai->parameters);
-    tvai->pFrameProcessor = tvai_create(&info);
-    return tvai->pFrameProcessor == NULL ? AVERROR(EINVAL) : 0;
+    tvai->pFrameProcessor = ff_tvai_processor_acquire(ctx, &info, tvai->cacheBudget);
+    if(tvai->pFrameProcessor == NULL)
+        return AVERROR(EINVAL);
+    return ff_tvai_pipeline_init(&tvai->pipeline, ctx, AV_PIX_FMT_BGR48, -1, 0);
 }
 
 static const enum AVPixelFormat pix_fmts[] = {
     AV_PIX_FMT_BGR48,
+    TVAI_CONVERTED_PIX_FMTS,
     AV_PIX_FMT_NONE
 };
 
@@ -102,7 +108,7 @@ static int filter_frame(AVFilterLink *inlink, AVFrame *in) {
     AVFilterContext *ctx = inlink->dst;
     TVAICPEContext *tvai = ctx->priv;
     AVFilterLink *outlink = ctx->outputs[0];
-    if(ff_tvai_process(tvai->pFrameProcessor, in)) {
+    if(ff_tvai_process(tvai->pFrameProcessor, &tvai->pipeline, in)) {
         av_log(NULL, AV_LOG_ERROR, "The processing has failed\n");
         av_frame_free(&in);
         return AVERROR(ENOSYS);
@@ -116,11 +122,7 @@ static int request_frame(AVFilterLink *outlink) {
     TVAICPEContext *tvai = ctx->priv;
     int ret = ff_request_frame(ctx->inputs[0]);
     if (ret == AVERROR_EOF) {
-        tvai_end_stream(tvai->pFrameProcessor);
-        while(tvai_remaining_frames(tvai->pFrameProcessor) > 0) {
-            ff_tvai_ignore_output(tvai->pFrameProcessor);
-            tvai_wait(20);
-        }
+        ff_tvai_drain(NULL, tvai->pFrameProcessor, NULL, NULL, -1);
         av_log(ctx, AV_LOG_DEBUG, "End of file reached %s %d\n", tvai->basicInfo.modelName, tvai->pFrameProcessor == NULL);
     }
     return ret;
@@ -130,7 +132,8 @@ static av_cold void uninit(AVFilterContext *ctx) {
     TVAICPEContext *tvai = ctx->priv;
     av_log(ctx, AV_LOG_DEBUG, "Uninit called for %s\n", tvai->basicInfo.modelName);
     if(tvai->pFrameProcessor)
-        tvai_destroy(tvai->pFrameProcessor);
+        ff_tvai_processor_release(ctx, tvai->pFrameProcessor, tvai->pipeline.used);
+    ff_tvai_pipeline_uninit(&tvai->pipeline, ctx);
 }
 
 static const AVFilterPad tvai_cpe_inputs[] = {
@@ -160,5 +163,5 @@ const AVFilter ff_vf_tvai_cpe = {
     FILTER_OUTPUTS(tvai_cpe_outputs),
     FILTER_PIXFMTS_ARRAY(pix_fmts),
     .priv_class    = &tvai_cpe_class,
-    .flags         = AVFILTER_FLAG_SUPPORT_TIMELINE_GENERIC,
+    .flags         = AVFILTER_FLAG_SUPPORT_TIMELINE_GENERIC | AVFILTER_FLAG_SLICE_THREADS,
 };
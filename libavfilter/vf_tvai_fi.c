@@ -26,14 +26,20 @@
  */
 
 #include "libavutil/avassert.h"
+#include "libavutil/fifo.h"
 #include "libavutil/imgutils.h"
+#include "libavutil/mem.h"
+#include "libavutil/pixdesc.h"
 #include "libavutil/opt.h"
+#include "libavutil/time.h"
 #include "libavutil/avutil.h"
 #include "avfilter.h"
 #include "formats.h"
 #include "avfilter_internal.h"
 #include "video.h"
+#include "scene_sad.h"
 #include "tvai_common.h"
+#include "tvai_shots.h"
 
 typedef struct  {
     const AVClass *class;
@@ -41,13 +47,22 @@ typedef struct  {
     double slowmo;
     double rdt;
     int timebaseUpdated;
+    int maxInFlight, poolSize, hugePages;
     void* pFrameProcessor;
     AVRational frame_rate;
-    AVFrame* previousFrame;
+    TVAIPipeline pipeline;
     AVDictionary *parameters;
     DictionaryItem *pModelParameters;
     int modelParametersCount;
     char *deviceString;    
+    int cacheBudget;
+    VideoProcessorInfo info;        ///< processor settings, kept to create the processor of each shot
+    TVAIShots shots;
+    int useShots;
+    AVFrame *sceneFrame;
+    double sceneMafd;
+    ff_scene_sad_fn sad;
+    int sceneBitdepth, scenePlanes, sceneWidth[4], sceneHeight[4];
 } TVAIFIContext;
 
 #define OFFSET(x) offsetof(TVAIFIContext, x)
@@ -57,12 +72,20 @@ typedef struct  {
 static const AVOption tvai_fi_options[] = {
     { "model", "Model short name", BASIC_OFFSET(modelName), AV_OPT_TYPE_STRING, {.str="chr-2"}, .flags = FLAGS },
     { "device",  "Device index (Auto: -2, CPU: -1, GPU0: 0, ... or a . separated list of GPU indices e.g. 0.1.3)",  OFFSET(deviceString),  AV_OPT_TYPE_STRING, {.str="-2"}, .flags = FLAGS, "device" },
+    { "proccache",  "Estimated frame memory in MB of idle unused processors kept for reuse by later filter instances, 0 to disable",  OFFSET(cacheBudget),  AV_OPT_TYPE_INT, {.i64=0}, 0, INT_MAX, FLAGS, "proccache" },
     { "instances",  "Number of extra model instances to use on device",  DEVICE_OFFSET(extraThreadCount),  AV_OPT_TYPE_INT, {.i64=0}, 0, 3, FLAGS, "instances" },
     { "download",  "Enable model downloading",  BASIC_OFFSET(canDownloadModel),  AV_OPT_TYPE_INT, {.i64=1}, 0, 1, FLAGS, "canDownloadModels" },
     { "vram", "Max memory usage", DEVICE_OFFSET(maxMemory), AV_OPT_TYPE_DOUBLE, {.dbl=1.0}, 0.1, 1, .flags = FLAGS, "vram"},
     { "slowmo",  "Slowmo factor of the input video",  OFFSET(slowmo),  AV_OPT_TYPE_DOUBLE, {.dbl=1.0}, 0.1, 16, FLAGS, "slowmo" },
     { "rdt",  "Replace duplicate threshold. (0 or below means do not remove, high value will detect more duplicates)",  OFFSET(rdt),  AV_OPT_TYPE_DOUBLE, {.dbl=0.01}, -0.01, 0.2, FLAGS, "rdt" },
     { "fps", "output's frame rate, same as input frame rate if value is invalid", OFFSET(frame_rate), AV_OPT_TYPE_VIDEO_RATE, {.str = "0"}, 0, INT_MAX, FLAGS },
+    { "inflight",  "Maximum number of frames queued in the model before waiting for output",  OFFSET(maxInFlight),  AV_OPT_TYPE_INT, {.i64=8}, 1, 64, FLAGS, "inflight" },
+    { "pool",  "Number of output frames to preallocate, -1 to match inflight",  OFFSET(poolSize),  AV_OPT_TYPE_INT, {.i64=-1}, -1, TVAI_MAX_PREALLOCATED_FRAMES, FLAGS, "pool" },
+    { "hugepages",  "Back output frames with transparent huge pages where supported",  OFFSET(hugePages),  AV_OPT_TYPE_INT, {.i64=0}, 0, 1, FLAGS, "hugepages" },
+    { "stats",  "Attach lavfi.tvai.* latency, queue depth and timing metadata to output frames",  OFFSET(pipeline.stats.exportMetadata),  AV_OPT_TYPE_INT, {.i64=0}, 0, 1, FLAGS, "stats" },
+    { "shots",  "Number of shots separated by scene cuts to interpolate in parallel",  OFFSET(shots.maxShots),  AV_OPT_TYPE_INT, {.i64=1}, 1, TVAI_SHOTS_MAX, FLAGS, "shots" },
+    { "sct",  "Scene cut threshold used to split shots, same scale as scdet",  OFFSET(shots.threshold),  AV_OPT_TYPE_DOUBLE, {.dbl=10}, 0, 100, FLAGS, "sct" },
+    { "lookahead",  "Maximum number of input frames buffered ahead of the oldest shot",  OFFSET(shots.lookahead),  AV_OPT_TYPE_INT, {.i64=64}, 1, 1024, FLAGS, "lookahead" },
     { "parameters", TVAI_FRAME_INTERPOLATION_PARAMETER_MESSAGE, OFFSET(parameters), AV_OPT_TYPE_DICT, {.str=""}, .flags = FLAGS, "parameters" },
     { NULL }
 };
@@ -72,10 +95,36 @@ AVFILTER_DEFINE_CLASS(tvai_fi);
 static av_cold int init(AVFilterContext *ctx) {
     TVAIFIContext *tvai = ctx->priv;
     av_log(ctx, AV_LOG_DEBUG, "Init with params: %s %d %d %lf %d/%d = %lf\n", tvai->basicInfo.modelName, tvai->basicInfo.device.index, tvai->basicInfo.device.extraThreadCount, tvai->slowmo, tvai->frame_rate.num, tvai->frame_rate.den, av_q2d(tvai->frame_rate));
-    tvai->previousFrame = NULL;
     return 0;
 }
 
+static const TVAIShotOps shot_ops;
+
+static int config_shots(AVFilterContext *ctx) {
+    TVAIFIContext *tvai = ctx->priv;
+    AVFilterLink *inlink = ctx->inputs[0];
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(inlink->format);
+    int plane;
+    if(desc->flags & AV_PIX_FMT_FLAG_FLOAT) {
+        av_log(ctx, AV_LOG_WARNING, "Scene cut detection is not supported for %s, interpolating shots sequentially\n", desc->name);
+        return 0;
+    }
+    tvai->sceneBitdepth = desc->comp[0].depth + desc->comp[0].shift;
+    tvai->scenePlanes = av_pix_fmt_count_planes(inlink->format);
+    for(plane=0;plane<tvai->scenePlanes;plane++) {
+        int lineSize = av_image_get_linesize(inlink->format, inlink->w, plane);
+        tvai->sceneWidth[plane] = lineSize >> (tvai->sceneBitdepth > 8);
+        tvai->sceneHeight[plane] = inlink->h >> ((plane == 1 || plane == 2) ? desc->log2_chroma_h : 0);
+    }
+    tvai->sad = ff_scene_sad_get_fn(tvai->sceneBitdepth == 8 ? 8 : 16);
+    if(!tvai->sad)
+        return AVERROR(ENOMEM);
+    tvai->shots.ops = &shot_ops;
+    tvai->shots.maxInFlight = tvai->maxInFlight;
+    tvai->useShots = 1;
+    return ff_tvai_shots_init(&tvai->shots);
+}
+
 static int config_props(AVFilterLink *outlink) {
     AVFilterContext *ctx = outlink->src;
     TVAIFIContext *tvai = ctx->priv;
@@ -103,7 +152,6 @@ static int config_props(AVFilterLink *outlink) {
     if(ff_tvai_prepareProcessorInfo(tvai->deviceString, &info, ModelTypeFrameInterpolation, outlink, &(tvai->basicInfo), 0, tvai->pModelParameters, tvai->modelParametersCount)) {
         return AVERROR(EINVAL);
     }
-    tvai->previousFrame = NULL;
     tvai->timebaseUpdated = tvai->frame_rate.num > 0 && av_q2d(av_inv_q(tvai->frame_rate)) < av_q2d(outlink->time_base);
     if(tvai->frame_rate.num > 0) {
         fOutlink->frame_rate = tvai->frame_rate;
@@ -115,66 +163,142 @@ static int config_props(AVFilterLink *outlink) {
     }
     info.basic.timebase = av_q2d(outlink->time_base);
 
-    tvai->pFrameProcessor = tvai_create(&info);
+    tvai->info = info;
+    if(tvai->shots.maxShots > 1) {
+        int ret = config_shots(ctx);
+        if(ret < 0)
+            return ret;
+    }
+    // Shots create a processor each as they start
+    if(!tvai->useShots)
+        tvai->pFrameProcessor = ff_tvai_processor_acquire(ctx, &info, tvai->cacheBudget);
     av_log(ctx, AV_LOG_DEBUG, "Set time base to %d/%d %lf -> %d/%d %lf\n", inlink->time_base.num, inlink->time_base.den, av_q2d(inlink->time_base), outlink->time_base.num, outlink->time_base.den, av_q2d(outlink->time_base));
     av_log(ctx, AV_LOG_DEBUG, "Set frame rate to %lf -> %lf\n", av_q2d(fInlink->frame_rate), av_q2d(fOutlink->frame_rate));
     av_log(ctx, AV_LOG_DEBUG, "Set fpsFactor to %lf generating %lf frames\n", fpsFactor, 1/fpsFactor);
-    return tvai->pFrameProcessor == NULL ? AVERROR(EINVAL) : 0;
+    if(tvai->pFrameProcessor == NULL && !tvai->useShots)
+        return AVERROR(EINVAL);
+    tvai->pipeline.maxInFlight = tvai->maxInFlight;
+    return ff_tvai_pipeline_init(&tvai->pipeline, ctx, AV_PIX_FMT_RGB48, tvai->poolSize < 0 ? tvai->maxInFlight : tvai->poolSize, tvai->hugePages);
 }
 
 static const enum AVPixelFormat pix_fmts[] = {
     AV_PIX_FMT_RGB48,
+    TVAI_CONVERTED_PIX_FMTS,
     AV_PIX_FMT_NONE
 };
 
-static int filter_frame(AVFilterLink *inlink, AVFrame *in) {
-    AVFilterContext *ctx = inlink->dst;
+static int submit_to(AVFilterContext *ctx, void *pFrameProcessor, AVFrame *in) {
     TVAIFIContext *tvai = ctx->priv;
+    AVFilterLink *inlink = ctx->inputs[0];
     AVFilterLink *outlink = ctx->outputs[0];
     TVAIBuffer iBuffer;
-    iBuffer.pBuffer = in->data[0];
-    iBuffer.lineSize = in->linesize[0];
+    int64_t start;
+    ff_tvai_prepareBufferInput(&tvai->pipeline, &iBuffer, in);
     if(tvai->timebaseUpdated) {
         iBuffer.pts = av_rescale_q_rnd(in->pts, inlink->time_base, outlink->time_base, AV_ROUND_PASS_MINMAX);
         iBuffer.duration = av_rescale_q_rnd(in->duration, inlink->time_base, outlink->time_base, AV_ROUND_PASS_MINMAX);
-    } else {
-        iBuffer.pts = in->pts;
-        iBuffer.duration = in->duration;
-    }
-    if(tvai->pFrameProcessor == NULL || tvai_process(tvai->pFrameProcessor, &iBuffer)) {
-        av_log(NULL, AV_LOG_ERROR, "The processing has failed\n");
-        av_frame_free(&in);
-        return AVERROR(ENOSYS);
     }
-    if(tvai->previousFrame)
-        av_frame_free(&tvai->previousFrame);
-    tvai->previousFrame = in;
-    return ff_tvai_add_output(tvai->pFrameProcessor, outlink, in);
+    start = av_gettime_relative();
+    if(pFrameProcessor == NULL || ff_tvai_submit(pFrameProcessor, &tvai->pipeline, &iBuffer))
+        return 1;
+    ff_tvai_stats_submit(&tvai->pipeline.stats, pFrameProcessor, iBuffer.pts, start, tvai_remaining_frames(pFrameProcessor));
+    return 0;
 }
 
-static int request_frame(AVFilterLink *outlink) {
-    AVFilterContext *ctx = outlink->src;
-    int ret = ff_request_frame(ctx->inputs[0]);
-    if (ret == AVERROR_EOF) {
-        TVAIFIContext *tvai = ctx->priv;
-        int r = ff_tvai_postflight(outlink, tvai->pFrameProcessor, tvai->previousFrame);
-        if(r)
-            return r;
+static int submit_frame(AVFilterContext *ctx, AVFrame *in) {
+    TVAIFIContext *tvai = ctx->priv;
+    return submit_to(ctx, tvai->pFrameProcessor, in);
+}
+
+static double scene_score(TVAIFIContext *tvai, AVFrame *frame) {
+    double score = 0;
+    if(tvai->sceneFrame) {
+        uint64_t sad = 0, count = 0;
+        double mafd, diff;
+        int plane;
+        for(plane=0;plane<tvai->scenePlanes;plane++) {
+            uint64_t planeSad;
+            tvai->sad(tvai->sceneFrame->data[plane], tvai->sceneFrame->linesize[plane], frame->data[plane], frame->linesize[plane],
+                      tvai->sceneWidth[plane], tvai->sceneHeight[plane], &planeSad);
+            sad += planeSad;
+            count += tvai->sceneWidth[plane] * tvai->sceneHeight[plane];
+        }
+        mafd = (double)sad * 100. / count / (1ULL << tvai->sceneBitdepth);
+        diff = fabs(mafd - tvai->sceneMafd);
+        score = av_clipf(FFMIN(mafd, diff), 0, 100.);
+        tvai->sceneMafd = mafd;
     }
-    return ret;
+    av_frame_free(&tvai->sceneFrame);
+    tvai->sceneFrame = av_frame_clone(frame);
+    return score;
+}
+
+static double shot_scene_score(AVFilterContext *ctx, AVFrame *frame) {
+    return scene_score(ctx->priv, frame);
+}
+
+static void* shot_acquire(AVFilterContext *ctx) {
+    TVAIFIContext *tvai = ctx->priv;
+    return ff_tvai_processor_acquire(ctx, &tvai->info, tvai->cacheBudget);
+}
+
+static void shot_release(AVFilterContext *ctx, void *processor, int used) {
+    ff_tvai_processor_release(ctx, processor, used);
+}
+
+static int shot_submit(AVFilterContext *ctx, void *processor, AVFrame *in) {
+    return submit_to(ctx, processor, in) ? AVERROR(ENOSYS) : 0;
+}
+
+static int shot_output(AVFilterContext *ctx, void *processor, AVFifo *sources, AVFrame **out) {
+    TVAIFIContext *tvai = ctx->priv;
+    return ff_tvai_get_output(processor, &tvai->pipeline, ctx->outputs[0], NULL, sources, out);
+}
+
+static int shot_output_count(void *processor) {
+    return tvai_output_count(processor);
+}
+
+static int shot_remaining(void *processor) {
+    return tvai_remaining_frames(processor);
+}
+
+static void shot_end_stream(void *processor) {
+    tvai_end_stream(processor);
+}
+
+static const TVAIShotOps shot_ops = {
+    .acquire      = shot_acquire,
+    .release      = shot_release,
+    .submit       = shot_submit,
+    .output       = shot_output,
+    .output_count = shot_output_count,
+    .remaining    = shot_remaining,
+    .end_stream   = shot_end_stream,
+    .wait         = ff_tvai_wait_output,
+    .scene_score  = shot_scene_score,
+};
+
+static int activate(AVFilterContext *ctx) {
+    TVAIFIContext *tvai = ctx->priv;
+    if(tvai->useShots)
+        return ff_tvai_shots_activate(ctx, &tvai->shots);
+    return ff_tvai_activate(ctx, tvai->pFrameProcessor, &tvai->pipeline, submit_frame);
 }
 
 static av_cold void uninit(AVFilterContext *ctx) {
     TVAIFIContext *tvai = ctx->priv;
     if(tvai->pFrameProcessor)
-      tvai_destroy(tvai->pFrameProcessor);
+      ff_tvai_processor_release(ctx, tvai->pFrameProcessor, tvai->pipeline.used);
+    ff_tvai_shots_uninit(ctx, &tvai->shots);
+    av_frame_free(&tvai->sceneFrame);
+    ff_tvai_pipeline_uninit(&tvai->pipeline, ctx);
 }
 
 static const AVFilterPad tvai_fi_inputs[] = {
     {
         .name         = "default",
         .type         = AVMEDIA_TYPE_VIDEO,
-        .filter_frame = filter_frame,
     },
 };
 
@@ -183,7 +307,6 @@ static const AVFilterPad tvai_fi_outputs[] = {
         .name = "default",
         .type = AVMEDIA_TYPE_VIDEO,
         .config_props = config_props,
-        .request_frame = request_frame,
     },
 };
 
@@ -193,9 +316,10 @@ const AVFilter ff_vf_tvai_fi = {
     .priv_size     = sizeof(TVAIFIContext),
     .init          = init,
     .uninit        = uninit,
+    .activate      = activate,
     FILTER_INPUTS(tvai_fi_inputs),
     FILTER_OUTPUTS(tvai_fi_outputs),
     FILTER_PIXFMTS_ARRAY(pix_fmts),
     .priv_class    = &tvai_fi_class,
-    .flags         = AVFILTER_FLAG_SUPPORT_TIMELINE_GENERIC,
+    .flags         = AVFILTER_FLAG_SLICE_THREADS,
 };
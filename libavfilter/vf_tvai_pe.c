@@ -35,6 +35,8 @@ typedef struct TVAIParamContext {
     const AVClass *class;
     BasicProcessorInfo basicInfo;
     void* pParamEstimator;
+    int cacheBudget;
+    TVAIPipeline pipeline;
 } TVAIParamContext;
 
 #define OFFSET(x) offsetof(TVAIParamContext, x)
@@ -44,6 +46,7 @@ typedef struct TVAIParamContext {
 static const AVOption tvai_pe_options[] = {
     { "model", "Model short name", BASIC_OFFSET(modelName), AV_OPT_TYPE_STRING, {.str="prap-3"}, .flags = FLAGS },
     { "download",  "Enable model downloading",  BASIC_OFFSET(canDownloadModel),  AV_OPT_TYPE_INT, {.i64=1}, 0, 1, FLAGS, "canDownloadModels" },
+    { "proccache",  "Estimated frame memory in MB of idle unused processors kept for reuse by later filter instances, 0 to disable",  OFFSET(cacheBudget),  AV_OPT_TYPE_INT, {.i64=0}, 0, INT_MAX, FLAGS, "proccache" },
     { NULL }
 };
 
@@ -65,13 +68,16 @@ static int config_props(AVFilterLink *outlink) {
     if(ff_tvai_prepareProcessorInfo("-1", &info, ModelTypeParameterEstimation, outlink, &(tvai->basicInfo), 0, NULL, 0)) {
       return AVERROR(EINVAL);  
     }
-    tvai->pParamEstimator = tvai_create(&info);
-    return tvai->pParamEstimator == NULL ? AVERROR(EINVAL) : 0;
+    tvai->pParamEstimator = ff_tvai_processor_acquire(ctx, &info, tvai->cacheBudget);
+    if(tvai->pParamEstimator == NULL)
+        return AVERROR(EINVAL);
+    return ff_tvai_pipeline_init(&tvai->pipeline, ctx, AV_PIX_FMT_RGB48, -1, 0);
 }
 
 
 static const enum AVPixelFormat pix_fmts[] = {
     AV_PIX_FMT_RGB48,
+    TVAI_CONVERTED_PIX_FMTS,
     AV_PIX_FMT_NONE
 };
 
@@ -79,7 +85,7 @@ static int filter_frame(AVFilterLink *inlink, AVFrame *in) {
     AVFilterContext *ctx = inlink->dst;
     TVAIParamContext *tvai = ctx->priv;
     AVFilterLink *outlink = ctx->outputs[0];
-    if(ff_tvai_process(tvai->pParamEstimator, in)) {
+    if(ff_tvai_process(tvai->pParamEstimator, &tvai->pipeline, in)) {
         av_log(ctx, AV_LOG_ERROR, "The processing has failed\n");
         av_frame_free(&in);
         return AVERROR(ENOSYS);
@@ -101,7 +107,8 @@ static int request_frame(AVFilterLink *outlink) {
 static av_cold void uninit(AVFilterContext *ctx) {
     TVAIParamContext *tvai = ctx->priv;
     if(tvai->pParamEstimator)
-        tvai_destroy(tvai->pParamEstimator);
+        ff_tvai_processor_release(ctx, tvai->pParamEstimator, tvai->pipeline.used);
+    ff_tvai_pipeline_uninit(&tvai->pipeline, ctx);
 }
 
 static const AVFilterPad tvai_pe_inputs[] = {
@@ -130,5 +137,5 @@ const AVFilter ff_vf_tvai_pe = {
     FILTER_OUTPUTS(tvai_pe_outputs),
     FILTER_PIXFMTS_ARRAY(pix_fmts),
     .priv_class    = &tvai_pe_class,
-    .flags         = AVFILTER_FLAG_SUPPORT_TIMELINE_GENERIC,
+    .flags         = AVFILTER_FLAG_SUPPORT_TIMELINE_GENERIC | AVFILTER_FLAG_SLICE_THREADS,
 };
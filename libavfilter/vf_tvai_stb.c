@@ -26,7 +26,10 @@
  */
 
 #include "libavutil/avassert.h"
+#include "libavutil/fifo.h"
+#include "libavutil/file_open.h"
 #include "libavutil/imgutils.h"
+#include "libavutil/mem.h"
 #include "libavutil/opt.h"
 #include "libavutil/avutil.h"
 #include "avfilter.h"
@@ -37,20 +40,43 @@
 #include "tvai_common.h"
 #include "tvai_messages.h"
 #include "float.h"
+#include "config.h"
+#include <stdio.h>
+#if HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#if HAVE_IO_H
+#include <io.h>
+#endif
 
 typedef struct TVAIStbContext {
     const AVClass *class;
     BasicProcessorInfo basicInfo;
-    char *filename, *filler;
+    char *filename, *filler, *cpeModel;
     void* pFrameProcessor;
+    void* pPoseEstimator;           ///< camera pose estimation run before stabilization, NULL if poses are read from filename
+    VideoProcessorInfo processorInfo;
+    AVFifo *pending;                ///< frames waiting for the pose estimation to finish, spilled ones only hold properties
+    size_t pendingSize;             ///< bytes of the frames in pending held in memory
+    int pendingLimit;               ///< maximum pendingSize in MB, later frames are spilled to spillFile
+    FILE *spillFile;
+    char *spillName;
+    uint8_t *spillBuffer;
+    unsigned int spillBufferSize;
+    int64_t spilled;                ///< frames written to spillFile
+    TVAIPipeline cpePipeline;
+    DictionaryItem *pCPEParameters;
+    AVDictionary *cpeParameters;
     double smoothness;
     int postFlight, windowSize, cacheSize, stabDOF, enableRSC, enableFullFrame, reduceMotion;
     double readStartTime, writeStartTime, canvasScaleX, canvasScaleY;
     AVFrame* previousFrame;
+    TVAIPipeline pipeline;
     AVDictionary *parameters;
     DictionaryItem *pModelParameters;
     int modelParametersCount;
     char *deviceString;    
+    int cacheBudget;
 } TVAIStbContext;
 
 #define OFFSET(x) offsetof(TVAIStbContext, x)
@@ -60,11 +86,15 @@ typedef struct TVAIStbContext {
 static const AVOption tvai_stb_options[] = {
     { "model", "Model short name", BASIC_OFFSET(modelName), AV_OPT_TYPE_STRING, {.str="ref-2"}, .flags = FLAGS },
     { "device",  "Device index (Auto: -2, CPU: -1, GPU0: 0, ... or a . separated list of GPU indices e.g. 0.1.3)",  OFFSET(deviceString),  AV_OPT_TYPE_STRING, {.str="-2"}, .flags = FLAGS, "device" },
+    { "proccache",  "Estimated frame memory in MB of idle unused processors kept for reuse by later filter instances, 0 to disable",  OFFSET(cacheBudget),  AV_OPT_TYPE_INT, {.i64=0}, 0, INT_MAX, FLAGS, "proccache" },
+    { "stats",  "Attach lavfi.tvai.* latency, queue depth and timing metadata to output frames",  OFFSET(pipeline.stats.exportMetadata),  AV_OPT_TYPE_INT, {.i64=0}, 0, 1, FLAGS, "stats" },
     { "instances",  "Number of extra model instances to use on device",  DEVICE_OFFSET(extraThreadCount),  AV_OPT_TYPE_INT, {.i64=0}, 0, 3, FLAGS, "instances" },
     { "download",  "Enable model downloading",  BASIC_OFFSET(canDownloadModel),  AV_OPT_TYPE_INT, {.i64=1}, 0, 1, FLAGS, "canDownloadModels" },
     { "vram", "Max memory usage", DEVICE_OFFSET(maxMemory), AV_OPT_TYPE_DOUBLE, {.dbl=1.0}, 0.1, 1, .flags = FLAGS, "vram"},
     { "full", "Perform full-frame stabilization. If disabled, performs auto-crop (ignores full-reame related options)", OFFSET(enableFullFrame), AV_OPT_TYPE_INT, {.i64=1}, 0, 1, .flags = FLAGS, "full" },
     { "filename", "CPE output filename", OFFSET(filename), AV_OPT_TYPE_STRING, {.str="cpe.json"}, .flags = FLAGS, "filename"},
+    { "cpe", "Estimate camera poses with this model in the same pass instead of reading them from a previous tvai_cpe run, frames are buffered until the estimation finishes", OFFSET(cpeModel), AV_OPT_TYPE_STRING, {.str=NULL}, .flags = FLAGS, "cpe"},
+    { "cpemem", "Maximum memory in MB of the frames buffered during the in-pass camera pose estimation, further frames are spilled to a temporary file", OFFSET(pendingLimit), AV_OPT_TYPE_INT, {.i64=4096}, 1, INT_MAX, .flags = FLAGS, "cpemem"},
     { "rst", "Read start time relative to CPE", OFFSET(readStartTime), AV_OPT_TYPE_DOUBLE, {.dbl=0}, 0, DBL_MAX, .flags = FLAGS, "rst" },
     { "wst", "Write start time relative to read start time (rst)", OFFSET(writeStartTime), AV_OPT_TYPE_DOUBLE, {.dbl=0}, 0, DBL_MAX, .flags = FLAGS, "wst" },
     { "postFlight", "Enable postflight", OFFSET(postFlight), AV_OPT_TYPE_INT, {.i64=1}, 0, 1, .flags = FLAGS, "postFlight"  },
@@ -89,6 +119,55 @@ static av_cold int init(AVFilterContext *ctx) {
   return 0;
 }
 
+static int config_poses(AVFilterContext *ctx) {
+    TVAIStbContext *tvai = ctx->priv;
+    AVFilterLink *outlink = ctx->outputs[0];
+    BasicProcessorInfo basic = tvai->basicInfo;
+    VideoProcessorInfo info;
+    int count;
+    if(!tvai->enableFullFrame) {
+        av_log(ctx, AV_LOG_ERROR, "Auto-crop needs the camera poses to configure the output size, run tvai_cpe separately or use full=1\n");
+        return AVERROR(EINVAL);
+    }
+    basic.modelName = tvai->cpeModel;
+    basic.device.maxMemory = 1;
+    basic.device.extraThreadCount = 0;
+    av_dict_set(&tvai->cpeParameters, "cpePath", tvai->filename, 0);
+    av_dict_set_int(&tvai->cpeParameters, "rsc", strncmp(tvai->cpeModel, "cpe-1", 5) != 0, 0);
+    tvai->pCPEParameters = ff_tvai_alloc_copy_entries(tvai->cpeParameters, &count);
+    if(ff_tvai_prepareProcessorInfo(tvai->deviceString, &info, ModelTypeCamPoseEstimation, outlink, &basic, 0, tvai->pCPEParameters, count))
+        return AVERROR(EINVAL);
+    tvai->pPoseEstimator = ff_tvai_processor_acquire(ctx, &info, tvai->cacheBudget);
+    if(!tvai->pPoseEstimator)
+        return AVERROR(EINVAL);
+    tvai->pending = av_fifo_alloc2(64, sizeof(AVFrame*), AV_FIFO_FLAG_AUTO_GROW);
+    if(!tvai->pending)
+        return AVERROR(ENOMEM);
+    return ff_tvai_pipeline_init(&tvai->cpePipeline, ctx, AV_PIX_FMT_BGR48, -1, 0);
+}
+
+/**
+ * Finish the pose estimation and start stabilizing the buffered frames.
+ */
+static int finish_poses(AVFilterContext *ctx) {
+    TVAIStbContext *tvai = ctx->priv;
+    int ret = ff_tvai_drain(NULL, tvai->pPoseEstimator, &tvai->cpePipeline, NULL, -1);
+    ff_tvai_processor_release(ctx, tvai->pPoseEstimator, tvai->cpePipeline.used);
+    tvai->pPoseEstimator = NULL;
+    if(ret < 0)
+        return ret;
+    av_log(ctx, AV_LOG_VERBOSE, "Camera poses estimated, stabilizing %zu buffered frames\n", av_fifo_can_read(tvai->pending));
+    if(tvai->spillFile) {
+        av_log(ctx, AV_LOG_VERBOSE, "Reading %"PRId64" of them back from %s\n", tvai->spilled, tvai->spillName);
+        if(fflush(tvai->spillFile) || fseek(tvai->spillFile, 0, SEEK_SET)) {
+            av_log(ctx, AV_LOG_ERROR, "Cannot read back %s\n", tvai->spillName);
+            return AVERROR(EIO);
+        }
+    }
+    tvai->pFrameProcessor = ff_tvai_processor_acquire(ctx, &tvai->processorInfo, tvai->cacheBudget);
+    return tvai->pFrameProcessor ? 0 : AVERROR(EINVAL);
+}
+
 static int config_props(AVFilterLink *outlink) {
     AVFilterContext *ctx = outlink->src;
     TVAIStbContext *tvai = ctx->priv;
@@ -112,7 +191,15 @@ static int config_props(AVFilterLink *outlink) {
   if(ff_tvai_prepareProcessorInfo(tvai->deviceString, &info, ModelTypeStabilization, outlink, &(tvai->basicInfo), tvai->enableFullFrame > 0, tvai->pModelParameters, tvai->modelParametersCount)) {
     return AVERROR(EINVAL);  
   }
-  tvai->pFrameProcessor = tvai_create(&info);
+  if(tvai->cpeModel) {
+    int ret = config_poses(ctx);
+    if(ret < 0)
+      return ret;
+    // The stabilization model reads the poses when it is created
+    tvai->processorInfo = info;
+    return ff_tvai_pipeline_init(&tvai->pipeline, ctx, AV_PIX_FMT_BGR48, 0, 0);
+  }
+  tvai->pFrameProcessor = ff_tvai_processor_acquire(ctx, &info, tvai->cacheBudget);
   if(tvai->pFrameProcessor == NULL) {
     return AVERROR(EINVAL);
   }
@@ -120,19 +207,19 @@ static int config_props(AVFilterLink *outlink) {
     tvai_stabilize_get_output_size(tvai->pFrameProcessor, &(outlink->w), &(outlink->h));
     av_log(NULL, AV_LOG_VERBOSE, "Auto-crop stabilization output size: %d x %d\n", outlink->w, outlink->h);
   }
-  return 0;
+  return ff_tvai_pipeline_init(&tvai->pipeline, ctx, AV_PIX_FMT_BGR48, 0, 0);
 }
 
 static const enum AVPixelFormat pix_fmts[] = {
     AV_PIX_FMT_BGR48,
+    TVAI_CONVERTED_PIX_FMTS,
     AV_PIX_FMT_NONE
 };
 
-static int filter_frame(AVFilterLink *inlink, AVFrame *in) {
-    AVFilterContext *ctx = inlink->dst;
+static int stabilize_frame(AVFilterContext *ctx, AVFrame *in) {
     TVAIStbContext *tvai = ctx->priv;
     AVFilterLink *outlink = ctx->outputs[0];
-    if(ff_tvai_process(tvai->pFrameProcessor, in)) {
+    if(ff_tvai_process(tvai->pFrameProcessor, &tvai->pipeline, in)) {
         av_log(NULL, AV_LOG_ERROR, "The processing has failed\n");
         av_frame_free(&in);
         return AVERROR(ENOSYS);
@@ -140,15 +227,134 @@ static int filter_frame(AVFilterLink *inlink, AVFrame *in) {
     if(tvai->previousFrame)
         av_frame_free(&tvai->previousFrame);
     tvai->previousFrame = in;
-    return ff_tvai_add_output(tvai->pFrameProcessor, outlink, in);
+    return ff_tvai_add_output(tvai->pFrameProcessor, &tvai->pipeline, outlink, in);
+}
+
+/**
+ * Write the data of in to the spill file and return a frame with only its
+ * properties, read back by unspill_frame() in the same order.
+ */
+static AVFrame* spill_frame(AVFilterContext *ctx, const AVFrame *in, int size) {
+    TVAIStbContext *tvai = ctx->priv;
+    AVFrame *held;
+    if(!tvai->spillFile) {
+        int fd = avpriv_tempfile("tvai_stb", &tvai->spillName, 0, ctx);
+        if(fd < 0)
+            return NULL;
+        tvai->spillFile = fdopen(fd, "w+b");
+        if(!tvai->spillFile) {
+            close(fd);
+            return NULL;
+        }
+        av_log(ctx, AV_LOG_VERBOSE, "cpemem=%d MB reached, spilling the buffered frames to %s\n", tvai->pendingLimit, tvai->spillName);
+    }
+    av_fast_malloc(&tvai->spillBuffer, &tvai->spillBufferSize, size);
+    if(!tvai->spillBuffer)
+        return NULL;
+    if(av_image_copy_to_buffer(tvai->spillBuffer, size, (const uint8_t * const*)in->data, in->linesize, in->format, in->width, in->height, 1) < 0 ||
+       fwrite(tvai->spillBuffer, 1, size, tvai->spillFile) != size)
+        return NULL;
+    held = av_frame_alloc();
+    if(!held || av_frame_copy_props(held, in) < 0) {
+        av_frame_free(&held);
+        return NULL;
+    }
+    held->format = in->format;
+    held->width = in->width;
+    held->height = in->height;
+    tvai->spilled++;
+    return held;
+}
+
+static int unspill_frame(AVFilterContext *ctx, AVFrame *frame) {
+    TVAIStbContext *tvai = ctx->priv;
+    const int size = av_image_get_buffer_size(frame->format, frame->width, frame->height, 1);
+    uint8_t *data[4];
+    int linesize[4], ret;
+    if((ret = av_frame_get_buffer(frame, 0)) < 0)
+        return ret;
+    if(fread(tvai->spillBuffer, 1, size, tvai->spillFile) != size) {
+        av_log(ctx, AV_LOG_ERROR, "Cannot read back %s\n", tvai->spillName);
+        return AVERROR(EIO);
+    }
+    av_image_fill_arrays(data, linesize, tvai->spillBuffer, frame->format, frame->width, frame->height, 1);
+    av_image_copy(frame->data, frame->linesize, (const uint8_t **)data, linesize, frame->format, frame->width, frame->height);
+    return 0;
+}
+
+/**
+ * Keep a copy of in until the pose estimation ends, in memory up to
+ * cpemem and in the spill file afterwards. Copying releases the input
+ * buffers, which may belong to a decoder pool.
+ */
+static int hold_frame(AVFilterContext *ctx, AVFrame *in) {
+    TVAIStbContext *tvai = ctx->priv;
+    const int size = av_image_get_buffer_size(in->format, in->width, in->height, 1);
+    AVFrame *held;
+    if(size < 0)
+        return size;
+    if(!tvai->spillFile && tvai->pendingSize + size <= ((size_t)tvai->pendingLimit << 20)) {
+        held = av_frame_alloc();
+        if(!held)
+            return AVERROR(ENOMEM);
+        held->format = in->format;
+        held->width = in->width;
+        held->height = in->height;
+        if(av_frame_get_buffer(held, 0) < 0 || av_frame_copy(held, in) < 0 || av_frame_copy_props(held, in) < 0) {
+            av_frame_free(&held);
+            return AVERROR(ENOMEM);
+        }
+        tvai->pendingSize += size;
+    } else if(!(held = spill_frame(ctx, in, size))) {
+        av_log(ctx, AV_LOG_ERROR, "Cannot spill the frames buffered for the camera pose estimation to disk\n");
+        return AVERROR(EIO);
+    }
+    if(av_fifo_write(tvai->pending, &held, 1) < 0) {
+        av_frame_free(&held);
+        return AVERROR(ENOMEM);
+    }
+    return 0;
+}
+
+static int filter_frame(AVFilterLink *inlink, AVFrame *in) {
+    AVFilterContext *ctx = inlink->dst;
+    TVAIStbContext *tvai = ctx->priv;
+    int ret;
+    if(!tvai->pPoseEstimator)
+        return stabilize_frame(ctx, in);
+    if(ff_tvai_process(tvai->pPoseEstimator, &tvai->cpePipeline, in)) {
+        av_log(ctx, AV_LOG_ERROR, "The pose estimation has failed\n");
+        av_frame_free(&in);
+        return AVERROR(ENOSYS);
+    }
+    ff_tvai_ignore_output(tvai->pPoseEstimator);
+    // The stabilization model needs the poses of the whole clip when it is
+    // created, so every frame is held until the estimation ends
+    ret = hold_frame(ctx, in);
+    av_frame_free(&in);
+    return ret;
 }
 
 static int request_frame(AVFilterLink *outlink) {
     AVFilterContext *ctx = outlink->src;
     TVAIStbContext *tvai = ctx->priv;
+    AVFrame *in;
     int ret = ff_request_frame(ctx->inputs[0]);
+    if (ret == AVERROR_EOF && tvai->pPoseEstimator) {
+        int r = finish_poses(ctx);
+        if(r)
+            return r;
+    }
+    if (ret == AVERROR_EOF && tvai->pending && av_fifo_read(tvai->pending, &in, 1) >= 0) {
+        int r = in->buf[0] ? 0 : unspill_frame(ctx, in);
+        if(r < 0) {
+            av_frame_free(&in);
+            return r;
+        }
+        return stabilize_frame(ctx, in);
+    }
     if (ret == AVERROR_EOF) {
-        int r = ff_tvai_postflight(outlink, tvai->pFrameProcessor, tvai->previousFrame);
+        int r = ff_tvai_drain(outlink, tvai->pFrameProcessor, &tvai->pipeline, tvai->previousFrame, TVAI_DRAIN_TIMEOUT_MS);
         if(r)
             return r;
     }
@@ -157,9 +363,25 @@ static int request_frame(AVFilterLink *outlink) {
 
 static av_cold void uninit(AVFilterContext *ctx) {
     TVAIStbContext *tvai = ctx->priv;
+    AVFrame *frame;
     av_log(ctx, AV_LOG_DEBUG, "Uninit called for %s %d\n", tvai->basicInfo.modelName, tvai->pFrameProcessor == NULL);
     if(tvai->pFrameProcessor)
-        tvai_destroy(tvai->pFrameProcessor);
+        ff_tvai_processor_release(ctx, tvai->pFrameProcessor, tvai->pipeline.used);
+    if(tvai->pPoseEstimator)
+        ff_tvai_processor_release(ctx, tvai->pPoseEstimator, tvai->cpePipeline.used);
+    while(tvai->pending && av_fifo_read(tvai->pending, &frame, 1) >= 0)
+        av_frame_free(&frame);
+    av_fifo_freep2(&tvai->pending);
+    if(tvai->spillFile) {
+        fclose(tvai->spillFile);
+        unlink(tvai->spillName);
+    }
+    av_freep(&tvai->spillName);
+    av_freep(&tvai->spillBuffer);
+    av_freep(&tvai->pCPEParameters);
+    av_dict_free(&tvai->cpeParameters);
+    ff_tvai_pipeline_uninit(&tvai->cpePipeline, ctx);
+    ff_tvai_pipeline_uninit(&tvai->pipeline, ctx);
 }
 
 static const AVFilterPad tvai_stb_inputs[] = {
@@ -189,5 +411,5 @@ const AVFilter ff_vf_tvai_stb = {
     FILTER_OUTPUTS(tvai_stb_outputs),
     FILTER_PIXFMTS_ARRAY(pix_fmts),
     .priv_class    = &tvai_stb_class,
-    .flags         = AVFILTER_FLAG_SUPPORT_TIMELINE_GENERIC,
+    .flags         = AVFILTER_FLAG_SUPPORT_TIMELINE_GENERIC | AVFILTER_FLAG_SLICE_THREADS,
 };
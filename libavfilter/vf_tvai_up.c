@@ -27,7 +27,9 @@
 
 #include "libavutil/avassert.h"
 #include "libavutil/imgutils.h"
+#include "libavutil/mem.h"
 #include "libavutil/opt.h"
+#include "libavutil/time.h"
 #include "libavutil/avutil.h"
 #include "avfilter.h"
 #include "formats.h"
@@ -35,18 +37,38 @@
 #include "video.h"
 #include "tvai_common.h"
 
+/**
+ * One tile position of the tiled mode. Each position has its own
+ * processor, so models keeping state across frames only ever see the same
+ * region and every processor gets each pts once.
+ */
+typedef struct TVAIUpTile {
+    int x, y;                       ///< top left corner in the input including the overlap, may be negative
+    int column, row;
+} TVAIUpTile;
+
 typedef struct TVAIUpContext {
     const AVClass *class;
     BasicProcessorInfo basicInfo;
-    int estimateFrameCount, count, estimating, w, h, canKeepColor;
+    int estimateFrameCount, count, estimating, w, h, canKeepColor, maxInFlight, poolSize, hugePages;
     double preBlur, noise, details, halo, blur, compression;
     double prenoise, grain, grainSize, blend;
     void* pFrameProcessor;
-    AVFrame* previousFrame;
+    TVAIPipeline pipeline;
     AVDictionary *parameters;
     DictionaryItem* modelParameters;
     int modelParameterCount;
     char *deviceString;    
+    int cacheBudget;
+    int tileWidth, tileHeight, tileOverlap;
+    int tilesX, tilesY, overlapX, overlapY;
+    TVAIUpTile *tiles;
+    void **tileProcessors;          ///< processor of each tile position, in raster order
+    AVFrame *tileIn, *tileOut;      ///< staging for a single tile in the model format
+    float *weightsX, *weightsY;     ///< feathering weights of each grid column/row across its output extent
+    AVFrame *band;                  ///< blended output rows in the model format not yet converted, one tile row high
+    int bandTop;                    ///< output row of the first row of band
+    AVFrame *assembled;             ///< output frame the finished tiles are written to
 } TVAIUpContext;
 
 #define OFFSET(x) offsetof(TVAIUpContext, x)
@@ -60,6 +82,7 @@ static const AVOption tvai_up_options[] = {
     { "w",  "Estimate scale based on output width",  OFFSET(w),  AV_OPT_TYPE_INT, {.i64=0}, 0, 100000, FLAGS, "w" },
     { "h",  "Estimate scale based on output height",  OFFSET(h),  AV_OPT_TYPE_INT, {.i64=0}, 0, 100000, FLAGS, "h" },
     { "device",  "Device index (Auto: -2, CPU: -1, GPU0: 0, ... or a . separated list of GPU indices e.g. 0.1.3)",  OFFSET(deviceString),  AV_OPT_TYPE_STRING, {.str="-2"}, .flags = FLAGS, "device" },
+    { "proccache",  "Estimated frame memory in MB of idle unused processors kept for reuse by later filter instances, 0 to disable",  OFFSET(cacheBudget),  AV_OPT_TYPE_INT, {.i64=0}, 0, INT_MAX, FLAGS, "proccache" },
     { "instances",  "Number of extra model instances to use on device",  DEVICE_OFFSET(extraThreadCount),  AV_OPT_TYPE_INT, {.i64=0}, 0, 3, FLAGS, "instances" },
     { "download",  "Enable model downloading",  BASIC_OFFSET(canDownloadModel),  AV_OPT_TYPE_INT, {.i64=1}, 0, 1, FLAGS, "canDownloadModels" },
     { "vram", "Max memory usage", DEVICE_OFFSET(maxMemory), AV_OPT_TYPE_DOUBLE, {.dbl=1.0}, 0.1, 1, .flags = FLAGS, "vram"},
@@ -75,6 +98,12 @@ static const AVOption tvai_up_options[] = {
     { "gsize",  "The size of grain to be added",  OFFSET(grainSize),  AV_OPT_TYPE_DOUBLE, {.dbl=0}, 0.0, 5.0, FLAGS, "gsize" },
     { "kcolor",  "Run extra color correction if required by model",  OFFSET(canKeepColor),  AV_OPT_TYPE_INT, {.i64=1}, 0, 1, FLAGS, "kcolor" },
     { "blend",  "The amount of input to be blended with output",  OFFSET(blend),  AV_OPT_TYPE_DOUBLE, {.dbl=0}, 0.0, 1.0, FLAGS, "blend" },
+    { "inflight",  "Maximum number of frames queued in the model before waiting for output",  OFFSET(maxInFlight),  AV_OPT_TYPE_INT, {.i64=8}, 1, 64, FLAGS, "inflight" },
+    { "pool",  "Number of output frames to preallocate, -1 to match inflight",  OFFSET(poolSize),  AV_OPT_TYPE_INT, {.i64=-1}, -1, TVAI_MAX_PREALLOCATED_FRAMES, FLAGS, "pool" },
+    { "hugepages",  "Back output frames with transparent huge pages where supported",  OFFSET(hugePages),  AV_OPT_TYPE_INT, {.i64=0}, 0, 1, FLAGS, "hugepages" },
+    { "stats",  "Attach lavfi.tvai.* latency, queue depth and timing metadata to output frames",  OFFSET(pipeline.stats.exportMetadata),  AV_OPT_TYPE_INT, {.i64=0}, 0, 1, FLAGS, "stats" },
+    { "tile",  "Process the frame in tiles of at most this size with a processor per tile, 0 to disable",  OFFSET(tileWidth),  AV_OPT_TYPE_IMAGE_SIZE, {.str=NULL}, 0, 0, FLAGS, "tile" },
+    { "overlap",  "Overlap between adjacent tiles in input pixels, blended across in the output",  OFFSET(tileOverlap),  AV_OPT_TYPE_INT, {.i64=16}, 0, 512, FLAGS, "overlap" },
     { "parameters", TVAI_UPSCALE_PARAMETER_MESSAGE, OFFSET(parameters), AV_OPT_TYPE_DICT, {.str=""}, .flags = FLAGS, "parameters" },
     { NULL }
 };
@@ -85,11 +114,90 @@ static av_cold int init(AVFilterContext *ctx) {
   TVAIUpContext *tvai = ctx->priv;
   av_log(ctx, AV_LOG_VERBOSE, "Here init with params: %s %d %d %lf %lf %lf %lf %lf %lf\n", tvai->basicInfo.modelName, tvai->basicInfo.scale, tvai->basicInfo.device.index,
         tvai->preBlur, tvai->noise, tvai->details, tvai->halo, tvai->blur, tvai->compression);
-  tvai->previousFrame = NULL;
   tvai->count = 0;
   return 0;
 }
 
+static float* tile_weights(int tiles, int core, int overlap, int scale) {
+    const int extent = (core + 2*overlap)*scale, band = 2*overlap*scale;
+    float *weights = av_malloc_array(tiles*extent, sizeof(*weights));
+    int i, x;
+    if(!weights)
+        return NULL;
+    // Linear ramps across each overlap, adjacent ramps sum up to one
+    for(i=0;i<tiles;i++) {
+        float *w = weights + i*extent;
+        for(x=0;x<extent;x++) {
+            w[x] = 1;
+            if(i > 0 && x < band)
+                w[x] = (x + 0.5f)/band;
+            if(i < tiles - 1 && x >= extent - band)
+                w[x] = (extent - x - 0.5f)/band;
+        }
+    }
+    return weights;
+}
+
+static int config_tiles(AVFilterContext *ctx, VideoProcessorInfo *pInfo) {
+    TVAIUpContext *tvai = ctx->priv;
+    AVFilterLink *inlink = ctx->inputs[0];
+    VideoProcessorInfo info = *pInfo;
+    const int scale = info.basic.scale;
+    int coreWidth, coreHeight, tileWidth, tileHeight, i;
+
+    tvai->tilesX = (inlink->w + tvai->tileWidth - 1)/tvai->tileWidth;
+    tvai->tilesY = (inlink->h + tvai->tileHeight - 1)/tvai->tileHeight;
+    coreWidth = (inlink->w + tvai->tilesX - 1)/tvai->tilesX;
+    coreHeight = (inlink->h + tvai->tilesY - 1)/tvai->tilesY;
+    tvai->tilesX = (inlink->w + coreWidth - 1)/coreWidth;
+    tvai->tilesY = (inlink->h + coreHeight - 1)/coreHeight;
+    tvai->overlapX = tvai->tilesX > 1 ? FFMIN(tvai->tileOverlap, coreWidth/2) : 0;
+    tvai->overlapY = tvai->tilesY > 1 ? FFMIN(tvai->tileOverlap, coreHeight/2) : 0;
+    tileWidth = coreWidth + 2*tvai->overlapX;
+    tileHeight = coreHeight + 2*tvai->overlapY;
+
+    tvai->tiles = av_calloc(tvai->tilesX*tvai->tilesY, sizeof(*tvai->tiles));
+    tvai->tileProcessors = av_calloc(tvai->tilesX*tvai->tilesY, sizeof(*tvai->tileProcessors));
+    tvai->weightsX = tile_weights(tvai->tilesX, coreWidth, tvai->overlapX, scale);
+    tvai->weightsY = tile_weights(tvai->tilesY, coreHeight, tvai->overlapY, scale);
+    tvai->tileIn = av_frame_alloc();
+    tvai->tileOut = av_frame_alloc();
+    tvai->band = av_frame_alloc();
+    if(!tvai->tiles || !tvai->tileProcessors || !tvai->weightsX || !tvai->weightsY || !tvai->tileIn || !tvai->tileOut || !tvai->band)
+        return AVERROR(ENOMEM);
+    tvai->tileIn->format = tvai->tileOut->format = tvai->band->format = AV_PIX_FMT_RGB48;
+    tvai->tileIn->width = tileWidth;
+    tvai->tileIn->height = tileHeight;
+    tvai->tileOut->width = tileWidth*scale;
+    tvai->tileOut->height = tileHeight*scale;
+    // One row more than a tile to carry an odd row over to the next band
+    tvai->band->width = inlink->w*scale;
+    tvai->band->height = tileHeight*scale + 1;
+    if(av_frame_get_buffer(tvai->tileIn, 0) < 0 || av_frame_get_buffer(tvai->tileOut, 0) < 0 ||
+       av_frame_get_buffer(tvai->band, 0) < 0)
+        return AVERROR(ENOMEM);
+    for(i=0;i<tvai->band->height;i++)
+        memset(tvai->band->data[0] + i*tvai->band->linesize[0], 0, 6*tvai->band->width);
+
+    info.basic.inputWidth = tileWidth;
+    info.basic.inputHeight = tileHeight;
+    info.outputWidth = tileWidth*scale;
+    info.outputHeight = tileHeight*scale;
+    for(i=0;i<tvai->tilesX*tvai->tilesY;i++) {
+        TVAIUpTile *tile = &tvai->tiles[i];
+        tile->column = i % tvai->tilesX;
+        tile->row = i / tvai->tilesX;
+        tile->x = tile->column*coreWidth - tvai->overlapX;
+        tile->y = tile->row*coreHeight - tvai->overlapY;
+        tvai->tileProcessors[i] = ff_tvai_processor_acquire(ctx, &info, tvai->cacheBudget);
+        if(tvai->tileProcessors[i] == NULL)
+            return AVERROR(EINVAL);
+    }
+    av_log(ctx, AV_LOG_VERBOSE, "Processing %dx%d in %dx%d tiles of %dx%d with %dx%d overlap\n", inlink->w, inlink->h,
+           tvai->tilesX, tvai->tilesY, tileWidth, tileHeight, tvai->overlapX, tvai->overlapY);
+    return 0;
+}
+
 static int config_props(AVFilterLink *outlink) {
     AVFilterContext *ctx = outlink->src;
     TVAIUpContext *tvai = ctx->priv;
@@ -123,55 +231,250 @@ static int config_props(AVFilterLink *outlink) {
         return AVERROR(EINVAL);
       return AVERROR(EINVAL);  
     }
-    tvai->pFrameProcessor = tvai_create(&info);
-    tvai->previousFrame = NULL;
-    return tvai->pFrameProcessor == NULL ? AVERROR(EINVAL) : 0;
+    if(tvai->tileWidth > 0 && tvai->tileHeight > 0 && (tvai->tileWidth < inlink->w || tvai->tileHeight < inlink->h)) {
+        int ret = config_tiles(ctx, &info);
+        if(ret < 0)
+            return ret;
+    } else {
+        tvai->pFrameProcessor = ff_tvai_processor_acquire(ctx, &info, tvai->cacheBudget);
+        if(tvai->pFrameProcessor == NULL)
+            return AVERROR(EINVAL);
+    }
+    tvai->pipeline.maxInFlight = tvai->maxInFlight;
+    if(tvai->tiles) {
+        // Tiles are assembled into a single output frame at a time
+        tvai->pipeline.bandOutput = 1;
+        return ff_tvai_pipeline_init(&tvai->pipeline, ctx, AV_PIX_FMT_RGB48, tvai->poolSize < 0 ? 1 : tvai->poolSize, tvai->hugePages);
+    }
+    return ff_tvai_pipeline_init(&tvai->pipeline, ctx, AV_PIX_FMT_RGB48, tvai->poolSize < 0 ? tvai->maxInFlight : tvai->poolSize, tvai->hugePages);
 }
 
 static const enum AVPixelFormat pix_fmts[] = {
     AV_PIX_FMT_RGB48,
+    TVAI_CONVERTED_PIX_FMTS,
     AV_PIX_FMT_NONE
 };
 
-static int filter_frame(AVFilterLink *inlink, AVFrame *in) {
-    AVFilterContext *ctx = inlink->dst;
+static int submit_frame(AVFilterContext *ctx, AVFrame *in) {
     TVAIUpContext *tvai = ctx->priv;
-    AVFilterLink *outlink = ctx->outputs[0];
-    if(ff_tvai_process(tvai->pFrameProcessor, in)) {
-        av_log(NULL, AV_LOG_ERROR, "The processing has failed\n");
-        av_frame_free(&in);
-        return AVERROR(ENOSYS);
+    return ff_tvai_process(tvai->pFrameProcessor, &tvai->pipeline, in);
+}
+
+typedef struct TileBlendThreadData {
+    const TVAIUpTile *tile;
+} TileBlendThreadData;
+
+static int blend_tile(AVFilterContext *ctx, void *arg, int jobnr, int nb_jobs) {
+    TVAIUpContext *tvai = ctx->priv;
+    const TileBlendThreadData *td = arg;
+    const AVFilterLink *outlink = ctx->outputs[0];
+    const int scale = tvai->basicInfo.scale;
+    const AVFrame *src = tvai->tileOut;
+    AVFrame *band = tvai->band;
+    const float *wx = tvai->weightsX + td->tile->column*src->width;
+    const float *wy = tvai->weightsY + td->tile->row*src->height;
+    const int ox = td->tile->x*scale, oy = td->tile->y*scale;
+    const int x0 = FFMAX(0, -ox), x1 = FFMIN(src->width, outlink->w - ox);
+    const int y0 = FFMAX(0, -oy), y1 = FFMIN(src->height, outlink->h - oy);
+    const int start = y0 + ((y1 - y0)*jobnr)/nb_jobs, end = y0 + ((y1 - y0)*(jobnr+1))/nb_jobs;
+    int x, y, c;
+    for(y=start;y<end;y++) {
+        const uint16_t *s = (const uint16_t*)(src->data[0] + y*src->linesize[0]);
+        uint16_t *d = (uint16_t*)(band->data[0] + (oy + y - tvai->bandTop)*band->linesize[0]) + 3*ox;
+        for(x=x0;x<x1;x++) {
+            const float w = wx[x]*wy[y];
+            for(c=0;c<3;c++)
+                d[3*x+c] = av_clip_uint16(d[3*x+c] + lrintf(s[3*x+c]*w));
+        }
     }
-    if(tvai->previousFrame)
-        av_frame_free(&tvai->previousFrame);
-    tvai->previousFrame = in;
-    return ff_tvai_add_output(tvai->pFrameProcessor, outlink, in);
+    return 0;
 }
 
-static int request_frame(AVFilterLink *outlink) {
-    AVFilterContext *ctx = outlink->src;
+/**
+ * Convert the rows above the next tile row, which no later tile overlaps,
+ * and move the remaining rows to the top of the band.
+ */
+static void flush_band(AVFilterContext *ctx, int row) {
     TVAIUpContext *tvai = ctx->priv;
-    int ret = ff_request_frame(ctx->inputs[0]);
-    if (ret == AVERROR_EOF) {
-        int r = ff_tvai_postflight(outlink, tvai->pFrameProcessor, tvai->previousFrame);
-        if(r)
-            return r;
+    AVFilterLink *outlink = ctx->outputs[0];
+    AVFrame *band = tvai->band;
+    int end = outlink->h, rows, kept, y;
+    if(row < tvai->tilesY - 1)
+        end = FFMAX(tvai->tiles[(row + 1)*tvai->tilesX].y*tvai->basicInfo.scale, 0) & ~1;
+    rows = end - tvai->bandTop;
+    if(rows <= 0)
+        return;
+    ff_tvai_convert_output_band(&tvai->pipeline, tvai->assembled, band->data[0], band->linesize[0], tvai->bandTop, rows);
+    kept = band->height - rows;
+    for(y=0;y<kept;y++)
+        memcpy(band->data[0] + y*band->linesize[0], band->data[0] + (y + rows)*band->linesize[0], 6*band->width);
+    for(;y<band->height;y++)
+        memset(band->data[0] + y*band->linesize[0], 0, 6*band->width);
+    tvai->bandTop = end;
+}
+
+static int tiles_submit(AVFilterContext *ctx, void *opaque, AVFrame *in) {
+    TVAIUpContext *tvai = ctx->priv;
+    AVFrame *tileIn = tvai->tileIn;
+    TVAIBuffer iBuffer, tBuffer;
+    int64_t start;
+    int i, x, y, ret;
+    ff_tvai_prepareBufferInput(&tvai->pipeline, &iBuffer, in);
+    start = av_gettime_relative();
+    tBuffer = iBuffer;
+    tBuffer.pBuffer = tileIn->data[0];
+    tBuffer.lineSize = tileIn->linesize[0];
+    for(i=0;i<tvai->tilesX*tvai->tilesY;i++) {
+        const TVAIUpTile *tile = &tvai->tiles[i];
+        // Copy the tile, replicating the frame edges where the tile sticks out
+        for(y=0;y<tileIn->height;y++) {
+            const int sy = av_clip(tile->y + y, 0, in->height - 1);
+            const uint16_t *s = (const uint16_t*)(iBuffer.pBuffer + sy*iBuffer.lineSize);
+            uint16_t *d = (uint16_t*)(tileIn->data[0] + y*tileIn->linesize[0]);
+            for(x=0;x<tileIn->width;x++) {
+                const int sx = av_clip(tile->x + x, 0, in->width - 1);
+                d[3*x  ] = s[3*sx  ];
+                d[3*x+1] = s[3*sx+1];
+                d[3*x+2] = s[3*sx+2];
+            }
+        }
+        if(ff_tvai_submit(tvai->tileProcessors[i], &tvai->pipeline, &tBuffer)) {
+            av_frame_free(&in);
+            return AVERROR(ENOSYS);
+        }
     }
+    ff_tvai_stats_submit(&tvai->pipeline.stats, tvai->tileProcessors[0], iBuffer.pts, start, tvai_remaining_frames(tvai->tileProcessors[0]));
+    ret = ff_tvai_sources_push(tvai->pipeline.sources, in);
+    av_frame_free(&in);
     return ret;
 }
 
+static int tiles_ready(TVAIUpContext *tvai) {
+    for(int i=0;i<tvai->tilesX*tvai->tilesY;i++) {
+        if(tvai_output_count(tvai->tileProcessors[i]) <= 0)
+            return 0;
+    }
+    return 1;
+}
+
+static int tiles_collect(void *opaque) {
+    AVFilterContext *ctx = opaque;
+    TVAIUpContext *tvai = ctx->priv;
+    AVFilterLink *outlink = ctx->outputs[0];
+    int ret, i;
+    while(tiles_ready(tvai)) {
+        const AVFrame *source;
+        int64_t pts = 0, duration = 0;
+        AVFrame *out;
+        tvai->assembled = ff_tvai_frame_pool_get(&tvai->pipeline.pool);
+        if(!tvai->assembled)
+            return AVERROR(ENOMEM);
+        tvai->bandTop = 0;
+        // Every processor is read even for dropped frames to keep the tile positions in step
+        for(i=0;i<tvai->tilesX*tvai->tilesY;i++) {
+            TileBlendThreadData td = { .tile = &tvai->tiles[i] };
+            TVAIBuffer tBuffer = { .pBuffer = tvai->tileOut->data[0], .lineSize = tvai->tileOut->linesize[0] };
+            if(tvai_output_frame(tvai->tileProcessors[i], &tBuffer)) {
+                av_log(ctx, AV_LOG_ERROR, "Error processing tile %d\n", i);
+                return AVERROR(ENOSYS);
+            }
+            if(i == 0) {
+                pts = tBuffer.pts;
+                duration = tBuffer.duration;
+            }
+            if(pts < 0)
+                continue;
+            ff_filter_execute(ctx, blend_tile, &td, NULL, FFMIN(tvai->tileOut->height, ff_filter_get_nb_threads(ctx)));
+            if(td.tile->column == tvai->tilesX - 1)
+                flush_band(ctx, td.tile->row);
+        }
+
+        out = tvai->assembled;
+        tvai->assembled = NULL;
+        if(pts < 0) {
+            av_log(ctx, AV_LOG_ERROR, "Ignoring frame %"PRId64"\n", pts);
+            ff_tvai_stats_output(&tvai->pipeline.stats, tvai->tileProcessors[0], NULL, pts, 0);
+            av_frame_free(&out);
+            continue;
+        }
+        if((source = ff_tvai_sources_match(tvai->pipeline.sources, ctx, pts)))
+            av_frame_copy_props(out, source);
+        out->pts = pts;
+        out->duration = duration;
+        ff_tvai_stats_output(&tvai->pipeline.stats, tvai->tileProcessors[0], out, out->pts, tvai_remaining_frames(tvai->tileProcessors[0]));
+        if((ret = ff_filter_frame(outlink, out)))
+            return ret;
+    }
+    return 0;
+}
+
+static int tiles_window_collect(AVFilterContext *ctx, void *opaque) {
+    return tiles_collect(ctx);
+}
+
+static int tiles_in_flight(void *opaque) {
+    TVAIUpContext *tvai = opaque;
+    int inFlight = 0;
+    for(int i=0;i<tvai->tilesX*tvai->tilesY;i++)
+        inFlight = FFMAX(inFlight, tvai_remaining_frames(tvai->tileProcessors[i]));
+    return inFlight;
+}
+
+static int tiles_wait(AVFilterContext *ctx, void *opaque) {
+    TVAIUpContext *tvai = opaque;
+    // A frame is complete once every tile position has finished it
+    for(int i=0;i<tvai->tilesX*tvai->tilesY;i++) {
+        int ret = ff_tvai_wait_output(ctx, &tvai->tileProcessors[i], 1);
+        if(ret < 0)
+            return ret;
+    }
+    return tiles_in_flight(tvai) > 0;
+}
+
+static int tiles_drain(AVFilterContext *ctx, void *opaque) {
+    TVAIUpContext *tvai = opaque;
+    if(!av_fifo_can_read(tvai->pipeline.sources))
+        return 0;
+    return ff_tvai_drain_custom(tvai->tileProcessors, tvai->tilesX*tvai->tilesY, &tvai->pipeline, TVAI_DRAIN_TIMEOUT_MS, tiles_collect, ctx);
+}
+
+static const TVAIWindowOps tiles_ops = {
+    .submit    = tiles_submit,
+    .collect   = tiles_window_collect,
+    .in_flight = tiles_in_flight,
+    .wait      = tiles_wait,
+    .drain     = tiles_drain,
+};
+
+static int activate(AVFilterContext *ctx) {
+    TVAIUpContext *tvai = ctx->priv;
+    if(tvai->tiles)
+        return ff_tvai_window_activate(ctx, &tiles_ops, tvai, tvai->maxInFlight);
+    return ff_tvai_activate(ctx, tvai->pFrameProcessor, &tvai->pipeline, submit_frame);
+}
+
 static av_cold void uninit(AVFilterContext *ctx) {
     TVAIUpContext *tvai = ctx->priv;
     av_log(ctx, AV_LOG_DEBUG, "Uninit called for %s %d\n", tvai->basicInfo.modelName, tvai->pFrameProcessor == NULL);
     if(tvai->pFrameProcessor)
-        tvai_destroy(tvai->pFrameProcessor);
+        ff_tvai_processor_release(ctx, tvai->pFrameProcessor, tvai->pipeline.used);
+    for(int i=0;tvai->tileProcessors && i<tvai->tilesX*tvai->tilesY;i++)
+        ff_tvai_processor_release(ctx, tvai->tileProcessors[i], tvai->pipeline.used);
+    av_freep(&tvai->tileProcessors);
+    av_freep(&tvai->tiles);
+    av_frame_free(&tvai->tileIn);
+    av_frame_free(&tvai->tileOut);
+    av_frame_free(&tvai->band);
+    av_frame_free(&tvai->assembled);
+    av_freep(&tvai->weightsX);
+    av_freep(&tvai->weightsY);
+    ff_tvai_pipeline_uninit(&tvai->pipeline, ctx);
 }
 
 static const AVFilterPad tvai_up_inputs[] = {
     {
         .name         = "default",
         .type         = AVMEDIA_TYPE_VIDEO,
-        .filter_frame = filter_frame,
     },
 };
 
@@ -180,7 +483,6 @@ static const AVFilterPad tvai_up_outputs[] = {
         .name = "default",
         .type = AVMEDIA_TYPE_VIDEO,
         .config_props = config_props,
-        .request_frame = request_frame,
     },
 };
 
@@ -190,9 +492,10 @@ const AVFilter ff_vf_tvai_up = {
     .priv_size     = sizeof(TVAIUpContext),
     .init          = init,
     .uninit        = uninit,
+    .activate      = activate,
     FILTER_INPUTS(tvai_up_inputs),
     FILTER_OUTPUTS(tvai_up_outputs),
     FILTER_PIXFMTS_ARRAY(pix_fmts),
     .priv_class    = &tvai_up_class,
-    .flags         = AVFILTER_FLAG_SUPPORT_TIMELINE_GENERIC,
+    .flags         = AVFILTER_FLAG_SLICE_THREADS,
 };
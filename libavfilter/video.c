@@ -46,30 +46,14 @@ AVFrame *ff_null_get_video_buffer(AVFilterLink *link, int w, int h)
     return ff_get_video_buffer(link->dst->outputs[0], w, h);
 }
 
-AVFrame *ff_default_get_video_buffer2(AVFilterLink *link, int w, int h, int align)
+static AVFrame *pool_get_video_buffer(FilterLinkInternal *li, int w, int h, int align)
 {
-    FilterLinkInternal *const li = ff_link_internal(link);
-    AVFrame *frame = NULL;
+    AVFilterLink *const link = &li->l.pub;
     int pool_width = 0;
     int pool_height = 0;
     int pool_align = 0;
     enum AVPixelFormat pool_format = AV_PIX_FMT_NONE;
 
-    if (li->l.hw_frames_ctx &&
-        ((AVHWFramesContext*)li->l.hw_frames_ctx->data)->format == link->format) {
-        int ret;
-        frame = av_frame_alloc();
-
-        if (!frame)
-            return NULL;
-
-        ret = av_hwframe_get_buffer(li->l.hw_frames_ctx, frame, 0);
-        if (ret < 0)
-            av_frame_free(&frame);
-
-        return frame;
-    }
-
     if (!li->frame_pool) {
         li->frame_pool = ff_frame_pool_video_init(CONFIG_MEMORY_POISONING
                                                      ? NULL
@@ -97,7 +81,33 @@ AVFrame *ff_default_get_video_buffer2(AVFilterLink *link, int w, int h, int alig
         }
     }
 
-    frame = ff_frame_pool_get(li->frame_pool);
+    return ff_frame_pool_get(li->frame_pool);
+}
+
+AVFrame *ff_default_get_video_buffer2(AVFilterLink *link, int w, int h, int align)
+{
+    FilterLinkInternal *const li = ff_link_internal(link);
+    AVFrame *frame = NULL;
+    int locked;
+
+    if (li->l.hw_frames_ctx &&
+        ((AVHWFramesContext*)li->l.hw_frames_ctx->data)->format == link->format) {
+        int ret;
+        frame = av_frame_alloc();
+
+        if (!frame)
+            return NULL;
+
+        ret = av_hwframe_get_buffer(li->l.hw_frames_ctx, frame, 0);
+        if (ret < 0)
+            av_frame_free(&frame);
+
+        return frame;
+    }
+
+    locked = ff_link_pool_lock(li);
+    frame = pool_get_video_buffer(li, w, h, align);
+    ff_link_pool_unlock(li, locked);
     if (!frame)
         return NULL;
 
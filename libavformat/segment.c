@@ -26,6 +26,7 @@
 
 #include "config_components.h"
 
+#include <errno.h>
 #include <time.h>
 
 #include "avformat.h"
@@ -124,6 +125,11 @@ typedef struct SegmentContext {
     int use_rename;
     char temp_list_filename[1024];
 
+    char *checkpoint;      ///< filename of the checkpoint to write
+    int   resume;          ///< continue from the checkpoint if it exists
+    int64_t resume_offset; ///< offset added to resumed timestamps, in microseconds
+    AVDictionary *checkpoint_meta; ///< strings metadata of the packet starting the current segment
+
     SegmentListEntry cur_entry;
     SegmentListEntry *segment_list_entries;
     SegmentListEntry *segment_list_entries_end;
@@ -344,6 +350,161 @@ static void segment_list_print_entry(AVIOContext      *list_ioctx,
     }
 }
 
+static int segment_checkpoint_write(AVFormatContext *s, int finished)
+{
+    SegmentContext *seg = s->priv_data;
+    const char *proto = avio_find_protocol_name(seg->checkpoint);
+    int use_rename = proto && !strcmp(proto, "file");
+    const AVDictionaryEntry *e = NULL;
+    char filename[1024];
+    AVIOContext *pb;
+    int ret;
+
+    /* replace the previous checkpoint atomically, so that it is never found
+     * half-written */
+    snprintf(filename, sizeof(filename), use_rename ? "%s.tmp" : "%s",
+             seg->checkpoint);
+    ret = s->io_open(s, &pb, filename, AVIO_FLAG_WRITE, NULL);
+    if (ret < 0) {
+        av_log(s, AV_LOG_ERROR, "Failed to open checkpoint '%s'\n", filename);
+        return ret;
+    }
+
+    avio_printf(pb, "segment_index=%d\n", seg->segment_idx);
+    avio_printf(pb, "segment_wrap_number=%d\n", seg->segment_idx_wrap_nb);
+    avio_printf(pb, "segment_count=%d\n", seg->segment_count);
+    avio_printf(pb, "frame_count=%d\n", seg->frame_count);
+    avio_printf(pb, "first_pts=%"PRId64"\n", seg->reference_stream_first_pts);
+    avio_printf(pb, "start_pts=%"PRId64"\n", seg->cur_entry.start_pts);
+    avio_printf(pb, "resume_time=%"PRId64"\n",
+                seg->cur_entry.start_pts - seg->reference_stream_first_pts);
+    avio_printf(pb, "finished=%d\n", finished);
+    while ((e = av_dict_iterate(seg->checkpoint_meta, e)))
+        avio_printf(pb, "packet.%s=%s\n", e->key, e->value);
+
+    ret = ff_format_io_close(s, &pb);
+    if (ret < 0)
+        return ret;
+
+    return use_rename ? ff_rename(filename, seg->checkpoint, s) : 0;
+}
+
+static int segment_checkpoint_get(AVFormatContext *s, const AVDictionary *d,
+                                  const char *key, int64_t *val)
+{
+    const AVDictionaryEntry *e = av_dict_get(d, key, NULL, 0);
+    char *end;
+
+    if (e) {
+        errno = 0;
+        *val  = strtoll(e->value, &end, 10);
+    }
+    if (!e || !*e->value || *end || errno) {
+        av_log(s, AV_LOG_ERROR, "Missing or invalid '%s' in checkpoint '%s'\n",
+               key, ((SegmentContext *)s->priv_data)->checkpoint);
+        return AVERROR_INVALIDDATA;
+    }
+
+    return 0;
+}
+
+static int segment_checkpoint_read(AVFormatContext *s)
+{
+    SegmentContext *seg = s->priv_data;
+    static const char *const keys[] = {
+        "segment_index", "segment_wrap_number", "segment_count", "frame_count",
+        "first_pts", "start_pts", "resume_time", "finished",
+    };
+    int64_t idx, wrap_nb, count, frames, first_pts, start_pts, finished;
+    const AVDictionaryEntry *e = NULL;
+    AVDictionary *d = NULL;
+    AVIOContext *pb;
+    char buf[4096];
+    int ret;
+
+    ret = s->io_open(s, &pb, seg->checkpoint, AVIO_FLAG_READ, NULL);
+    if (ret == AVERROR(ENOENT)) {
+        av_log(s, AV_LOG_VERBOSE, "No checkpoint '%s', starting from the beginning\n",
+               seg->checkpoint);
+        return 0;
+    } else if (ret < 0) {
+        av_log(s, AV_LOG_ERROR, "Failed to open checkpoint '%s'\n", seg->checkpoint);
+        return ret;
+    }
+    ret = avio_read(pb, buf, sizeof(buf));
+    ff_format_io_close(s, &pb);
+    if (ret < 0)
+        return ret;
+    if (ret == sizeof(buf)) {
+        av_log(s, AV_LOG_ERROR, "Checkpoint '%s' is too large\n", seg->checkpoint);
+        return AVERROR_INVALIDDATA;
+    }
+    buf[ret] = 0;
+
+    /* one key=value pair per line, as written by segment_checkpoint_write() */
+    ret = av_dict_parse_string(&d, buf, "=", "\n", 0);
+    if (ret < 0) {
+        av_log(s, AV_LOG_ERROR, "Invalid checkpoint '%s'\n", seg->checkpoint);
+        goto end;
+    }
+    while ((e = av_dict_iterate(d, e))) {
+        int known = 0;
+
+        for (int i = 0; i < FF_ARRAY_ELEMS(keys); i++)
+            known |= !strcmp(e->key, keys[i]);
+        if (av_strstart(e->key, "packet.", NULL))
+            ret = av_dict_set(&seg->checkpoint_meta, e->key + strlen("packet."),
+                              e->value, 0);
+        else if (!known) {
+            av_log(s, AV_LOG_ERROR, "Unknown key '%s' in checkpoint '%s'\n",
+                   e->key, seg->checkpoint);
+            ret = AVERROR_INVALIDDATA;
+        }
+        if (ret < 0)
+            goto end;
+    }
+
+    if ((ret = segment_checkpoint_get(s, d, "segment_index",       &idx))       < 0 ||
+        (ret = segment_checkpoint_get(s, d, "segment_wrap_number", &wrap_nb))   < 0 ||
+        (ret = segment_checkpoint_get(s, d, "segment_count",       &count))     < 0 ||
+        (ret = segment_checkpoint_get(s, d, "frame_count",         &frames))    < 0 ||
+        (ret = segment_checkpoint_get(s, d, "first_pts",           &first_pts)) < 0 ||
+        (ret = segment_checkpoint_get(s, d, "start_pts",           &start_pts)) < 0 ||
+        (ret = segment_checkpoint_get(s, d, "finished",            &finished))  < 0)
+        goto end;
+
+    if (finished) {
+        av_log(s, AV_LOG_ERROR, "Checkpoint '%s' belongs to a finished output\n",
+               seg->checkpoint);
+        ret = AVERROR(EINVAL);
+        goto end;
+    }
+    if (idx < 0 || idx > INT_MAX || wrap_nb < 0 || wrap_nb > INT_MAX ||
+        count < 0 || count > INT_MAX || frames < 0 || frames > INT_MAX ||
+        first_pts == AV_NOPTS_VALUE || start_pts < first_pts) {
+        av_log(s, AV_LOG_ERROR, "Invalid checkpoint '%s'\n", seg->checkpoint);
+        ret = AVERROR_INVALIDDATA;
+        goto end;
+    }
+
+    seg->segment_idx                = idx;
+    seg->segment_idx_wrap_nb        = wrap_nb;
+    seg->segment_count              = count;
+    seg->frame_count                = frames;
+    seg->reference_stream_first_pts = first_pts;
+    seg->cur_entry.start_pts        = start_pts;
+    seg->cur_entry.start_time       = start_pts / (double)AV_TIME_BASE;
+    seg->cur_entry.end_time         = seg->cur_entry.start_time;
+    seg->resume_offset              = start_pts - first_pts;
+
+    av_log(s, AV_LOG_INFO, "Resuming at segment %d, time %s\n", seg->segment_idx,
+           av_ts2timestr(seg->resume_offset, &AV_TIME_BASE_Q));
+
+end:
+    av_dict_free(&d);
+    return ret;
+}
+
 static int segment_end(AVFormatContext *s, int write_trailer, int is_last)
 {
     SegmentContext *seg = s->priv_data;
@@ -659,6 +820,7 @@ static void seg_free(AVFormatContext *s)
     av_freep(&seg->times);
     av_freep(&seg->frames);
     av_freep(&seg->cur_entry.filename);
+    av_dict_free(&seg->checkpoint_meta);
 
     cur = seg->segment_list_entries;
     while (cur) {
@@ -749,6 +911,20 @@ static int seg_init(AVFormatContext *s)
 
     seg->reference_stream_first_pts = AV_NOPTS_VALUE;
 
+    if (seg->resume) {
+        if (!seg->checkpoint) {
+            av_log(s, AV_LOG_ERROR, "segment_resume requires segment_checkpoint\n");
+            return AVERROR(EINVAL);
+        }
+        if (seg->list || seg->use_clocktime) {
+            av_log(s, AV_LOG_ERROR, "segment_resume cannot be used together with "
+                   "segment_list or segment_atclocktime\n");
+            return AVERROR(EINVAL);
+        }
+        if ((ret = segment_checkpoint_read(s)) < 0)
+            return ret;
+    }
+
     seg->oformat = av_guess_format(seg->format, s->url, NULL);
 
     if (!seg->oformat)
@@ -860,6 +1036,15 @@ static int seg_write_packet(AVFormatContext *s, AVPacket *pkt)
     if (!seg->avf || !seg->avf->pb)
         return AVERROR(EINVAL);
 
+    /* continue the timeline of the checkpointed run */
+    if (seg->resume_offset) {
+        offset = av_rescale_q(seg->resume_offset, AV_TIME_BASE_Q, st->time_base);
+        if (pkt->pts != AV_NOPTS_VALUE)
+            pkt->pts += offset;
+        if (pkt->dts != AV_NOPTS_VALUE)
+            pkt->dts += offset;
+    }
+
     if (!st->codecpar->extradata_size) {
         size_t pkt_extradata_size;
         uint8_t *pkt_extradata = av_packet_get_side_data(pkt, AV_PKT_DATA_NEW_EXTRADATA, &pkt_extradata_size);
@@ -940,6 +1125,20 @@ calc_times:
         seg->cur_entry.start_pts = av_rescale_q(pkt->pts, st->time_base, AV_TIME_BASE_Q);
         seg->cur_entry.end_time = seg->cur_entry.start_time;
 
+        /* everything before this packet is in finished segments */
+        if (seg->checkpoint) {
+            const uint8_t *sd;
+            size_t sd_size;
+
+            av_dict_free(&seg->checkpoint_meta);
+            sd = av_packet_get_side_data(pkt, AV_PKT_DATA_STRINGS_METADATA, &sd_size);
+            if (sd && (ret = av_packet_unpack_dictionary(sd, sd_size,
+                                                         &seg->checkpoint_meta)) < 0)
+                goto fail;
+            if ((ret = segment_checkpoint_write(s, 0)) < 0)
+                goto fail;
+        }
+
         if (seg->times || (!seg->frames && !seg->use_clocktime) && seg->write_empty)
             goto calc_times;
     }
@@ -975,6 +1174,11 @@ calc_times:
            av_ts2str(pkt->pts), av_ts2timestr(pkt->pts, &st->time_base),
            av_ts2str(pkt->dts), av_ts2timestr(pkt->dts, &st->time_base));
 
+    /* the metadata is only meant for the checkpoint */
+    if (seg->checkpoint)
+        av_packet_side_data_remove(pkt->side_data, &pkt->side_data_elems,
+                                   AV_PKT_DATA_STRINGS_METADATA);
+
     ret = ff_write_chained(seg->avf, pkt->stream_index, pkt, s,
                            seg->initial_offset || seg->reset_timestamps ||
                            ffofmt(seg->avf->oformat)->interleave_packet);
@@ -1009,6 +1213,8 @@ static int seg_write_trailer(struct AVFormatContext *s)
     } else {
         ret = segment_end(s, 1, 1);
     }
+    if (ret >= 0 && seg->checkpoint)
+        ret = segment_checkpoint_write(s, 1);
     return ret;
 }
 
@@ -1038,6 +1244,8 @@ static const AVOption options[] = {
     { "segment_format",    "set container format used for the segments", OFFSET(format),  AV_OPT_TYPE_STRING, {.str = NULL},  0, 0,       E },
     { "segment_format_options", "set list of options for the container format used for the segments", OFFSET(format_options), AV_OPT_TYPE_DICT, {.str = NULL}, 0, 0, E },
     { "segment_list",      "set the segment list filename",              OFFSET(list),    AV_OPT_TYPE_STRING, {.str = NULL},  0, 0,       E },
+    { "segment_checkpoint", "write a checkpoint to this file whenever a segment is finished", OFFSET(checkpoint), AV_OPT_TYPE_STRING, {.str = NULL}, 0, 0, E },
+    { "segment_resume",    "continue from segment_checkpoint if it exists", OFFSET(resume), AV_OPT_TYPE_BOOL, {.i64 = 0}, 0, 1, E },
     { "segment_header_filename", "write a single file containing the header", OFFSET(header_filename), AV_OPT_TYPE_STRING, {.str = NULL}, 0, 0, E },
 
     { "segment_list_flags","set flags affecting segment list generation", OFFSET(list_flags), AV_OPT_TYPE_FLAGS, {.i64 = SEGMENT_LIST_FLAG_CACHE }, 0, UINT_MAX, E, .unit = "list_flags"},
@@ -0,0 +1,396 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/**
+ * fftools thread queue test and benchmark
+ *
+ * Several threads send packets to one receiving thread through the fftools
+ * ThreadQueue, once with a fixed size and once growing under a memory
+ * budget, and through a reference queue protected by a single mutex; the
+ * packet rate of each is printed. Packet order, the
+ * per stream EOF and finishing a stream from the receiving side are checked
+ * along the way. Many short runs then check that a stream's EOF never
+ * overtakes its packets while other senders are writing concurrently.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "libavcodec/packet.h"
+#include "libavutil/avassert.h"
+#include "libavutil/fifo.h"
+#include "libavutil/mem.h"
+#include "libavutil/thread.h" // not public
+#include "libavutil/time.h"
+
+#include "fftools/objpool.c"
+#include "fftools/thread_queue.c"
+
+/* reference implementation: one mutex and condition variable around a FIFO */
+typedef struct LockedQueue {
+    int            *finished;
+    unsigned int nb_streams;
+    AVFifo         *fifo;
+    ObjPool        *obj_pool;
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+} LockedQueue;
+
+typedef struct LockedElem {
+    void        *obj;
+    unsigned int stream_idx;
+} LockedElem;
+
+static void *lq_alloc(unsigned int nb_streams, size_t queue_size)
+{
+    LockedQueue *lq = av_mallocz(sizeof(*lq));
+
+    if (!lq)
+        return NULL;
+    lq->finished   = av_calloc(nb_streams, sizeof(*lq->finished));
+    lq->fifo       = av_fifo_alloc2(queue_size, sizeof(LockedElem), 0);
+    lq->obj_pool   = objpool_alloc_packets();
+    lq->nb_streams = nb_streams;
+    av_assert0(lq->finished && lq->fifo && lq->obj_pool);
+    pthread_mutex_init(&lq->lock, NULL);
+    pthread_cond_init(&lq->cond, NULL);
+    return lq;
+}
+
+static void lq_free(void **q)
+{
+    LockedQueue *lq = *q;
+    LockedElem elem;
+
+    while (av_fifo_read(lq->fifo, &elem, 1) >= 0)
+        objpool_release(lq->obj_pool, &elem.obj);
+    av_fifo_freep2(&lq->fifo);
+    objpool_free(&lq->obj_pool);
+    av_freep(&lq->finished);
+    pthread_cond_destroy(&lq->cond);
+    pthread_mutex_destroy(&lq->lock);
+    av_freep(q);
+}
+
+static int lq_send(void *q, unsigned int stream_idx, void *data)
+{
+    LockedQueue *lq = q;
+    int *finished = &lq->finished[stream_idx];
+    int ret = 0;
+
+    pthread_mutex_lock(&lq->lock);
+    while (!(*finished & FINISHED_RECV) && !av_fifo_can_write(lq->fifo))
+        pthread_cond_wait(&lq->cond, &lq->lock);
+    if (*finished & FINISHED_RECV) {
+        *finished |= FINISHED_SEND;
+        ret = AVERROR_EOF;
+    } else {
+        LockedElem elem = { .stream_idx = stream_idx };
+        ret = objpool_get(lq->obj_pool, &elem.obj);
+        av_assert0(ret >= 0);
+        av_packet_move_ref(elem.obj, data);
+        av_fifo_write(lq->fifo, &elem, 1);
+        pthread_cond_broadcast(&lq->cond);
+    }
+    pthread_mutex_unlock(&lq->lock);
+    return ret;
+}
+
+static void lq_set_finished(void *q, unsigned int stream_idx, int flag)
+{
+    LockedQueue *lq = q;
+
+    pthread_mutex_lock(&lq->lock);
+    lq->finished[stream_idx] |= flag;
+    pthread_cond_broadcast(&lq->cond);
+    pthread_mutex_unlock(&lq->lock);
+}
+
+static void lq_send_finish(void *q, unsigned int stream_idx)
+{
+    lq_set_finished(q, stream_idx, FINISHED_SEND);
+}
+
+static void lq_receive_finish(void *q, unsigned int stream_idx)
+{
+    lq_set_finished(q, stream_idx, FINISHED_RECV);
+}
+
+static int lq_receive(void *q, int *stream_idx, void *data)
+{
+    LockedQueue *lq = q;
+    LockedElem elem;
+    int ret;
+
+    *stream_idx = -1;
+    pthread_mutex_lock(&lq->lock);
+    while (1) {
+        unsigned int nb_finished = 0;
+
+        if (av_fifo_read(lq->fifo, &elem, 1) >= 0) {
+            pthread_cond_broadcast(&lq->cond);
+            if (lq->finished[elem.stream_idx] & FINISHED_RECV) {
+                objpool_release(lq->obj_pool, &elem.obj);
+                continue;
+            }
+            av_packet_move_ref(data, elem.obj);
+            objpool_release(lq->obj_pool, &elem.obj);
+            *stream_idx = elem.stream_idx;
+            ret = 0;
+            break;
+        }
+
+        ret = AVERROR(EAGAIN);
+        for (unsigned int i = 0; i < lq->nb_streams; i++) {
+            if (!lq->finished[i])
+                continue;
+            if (!(lq->finished[i] & FINISHED_RECV)) {
+                lq->finished[i] |= FINISHED_RECV;
+                *stream_idx = i;
+                ret = AVERROR_EOF;
+                break;
+            }
+            nb_finished++;
+        }
+        if (ret == AVERROR(EAGAIN) && nb_finished == lq->nb_streams)
+            ret = AVERROR_EOF;
+        if (ret != AVERROR(EAGAIN))
+            break;
+        pthread_cond_wait(&lq->cond, &lq->lock);
+    }
+    pthread_mutex_unlock(&lq->lock);
+    return ret;
+}
+
+static void pkt_move(void *dst, void *src)
+{
+    av_packet_move_ref(dst, src);
+}
+
+static void *tq_alloc_packets(unsigned int nb_streams, size_t queue_size)
+{
+    ObjPool *op = objpool_alloc_packets();
+    ThreadQueue *tq;
+
+    av_assert0(op);
+    tq = tq_alloc(nb_streams, queue_size, 0, op, pkt_move);
+    av_assert0(tq);
+    return tq;
+}
+
+/* every packet counts as 1 KiB against a budget of 16 packets */
+static ThreadQueueMem adaptive_mem;
+
+static size_t pkt_size(const void *obj)
+{
+    return 1 << 10;
+}
+
+static void *tq_alloc_adaptive(unsigned int nb_streams, size_t queue_size)
+{
+    ObjPool *op = objpool_alloc_packets();
+    ThreadQueue *tq;
+
+    av_assert0(op);
+    tq = tq_alloc(nb_streams, queue_size, queue_size * 16, op, pkt_move);
+    av_assert0(tq);
+    tq_set_mem_limit(tq, &adaptive_mem, pkt_size);
+    return tq;
+}
+
+static void *tq_alloc_batched(unsigned int nb_streams, size_t queue_size)
+{
+    ThreadQueue *tq = tq_alloc_packets(nb_streams, queue_size);
+
+    tq_set_batch(tq, queue_size / 2, 1000);
+    return tq;
+}
+
+static void tq_free_packets(void **q)
+{
+    tq_free((ThreadQueue **)q);
+}
+
+static int tq_send_packet(void *q, unsigned int stream_idx, void *data)
+{
+    return tq_send(q, stream_idx, data);
+}
+
+static int tq_receive_packet(void *q, int *stream_idx, void *data)
+{
+    return tq_receive(q, stream_idx, data);
+}
+
+static void tq_send_finish_stream(void *q, unsigned int stream_idx)
+{
+    tq_send_finish(q, stream_idx);
+}
+
+static void tq_receive_finish_stream(void *q, unsigned int stream_idx)
+{
+    tq_receive_finish(q, stream_idx);
+}
+
+typedef struct QueueImpl {
+    const char *name;
+    void *(*alloc)(unsigned int nb_streams, size_t queue_size);
+    void  (*free)(void **q);
+    int   (*send)(void *q, unsigned int stream_idx, void *data);
+    void  (*send_finish)(void *q, unsigned int stream_idx);
+    int   (*receive)(void *q, int *stream_idx, void *data);
+    void  (*receive_finish)(void *q, unsigned int stream_idx);
+} QueueImpl;
+
+static const QueueImpl impls[] = {
+    { "threadqueue", tq_alloc_packets, tq_free_packets, tq_send_packet,
+      tq_send_finish_stream, tq_receive_packet, tq_receive_finish_stream },
+    { "adaptive",    tq_alloc_adaptive, tq_free_packets, tq_send_packet,
+      tq_send_finish_stream, tq_receive_packet, tq_receive_finish_stream },
+    { "batched",     tq_alloc_batched,  tq_free_packets, tq_send_packet,
+      tq_send_finish_stream, tq_receive_packet, tq_receive_finish_stream },
+    { "locked",      lq_alloc,         lq_free,         lq_send,
+      lq_send_finish,        lq_receive,        lq_receive_finish },
+};
+
+typedef struct SenderData {
+    const QueueImpl *impl;
+    void            *queue;
+    pthread_t        tid;
+    unsigned int     id;
+    int              workload;
+    int              sent;
+} SenderData;
+
+static void *sender_thread(void *arg)
+{
+    SenderData *s = arg;
+    AVPacket *pkt = av_packet_alloc();
+
+    av_assert0(pkt);
+    for (s->sent = 0; s->sent < s->workload; s->sent++) {
+        int ret;
+
+        pkt->pts          = s->sent;
+        pkt->stream_index = s->id;
+        ret = s->impl->send(s->queue, s->id, pkt);
+        if (ret == AVERROR_EOF)
+            break;
+        av_assert0(ret >= 0);
+    }
+    s->impl->send_finish(s->queue, s->id);
+    av_packet_free(&pkt);
+    return NULL;
+}
+
+static int run(const QueueImpl *impl, int nb_senders, int workload, int queue_size,
+               int print)
+{
+    SenderData *senders = av_calloc(nb_senders, sizeof(*senders));
+    int64_t    *next    = av_calloc(nb_senders, sizeof(*next));
+    AVPacket   *pkt     = av_packet_alloc();
+    void       *queue   = impl->alloc(nb_senders, queue_size);
+    int64_t received = 0, start;
+    int nb_eof = 0, stream_idx, ret;
+
+    av_assert0(senders && next && pkt);
+
+    start = av_gettime_relative();
+    for (int i = 0; i < nb_senders; i++) {
+        senders[i] = (SenderData){ .impl = impl, .queue = queue, .id = i,
+                                   .workload = workload };
+        ret = pthread_create(&senders[i].tid, NULL, sender_thread, &senders[i]);
+        av_assert0(!ret);
+    }
+
+    while (1) {
+        ret = impl->receive(queue, &stream_idx, pkt);
+        if (ret == AVERROR_EOF && stream_idx < 0)
+            break;
+        if (ret == AVERROR_EOF) {
+            /* stream 0 is finished from the receiving side halfway through */
+            av_assert0(stream_idx > 0 || nb_senders == 1 || workload < 2);
+            av_assert0(next[stream_idx] == workload);
+            nb_eof++;
+            continue;
+        }
+        av_assert0(ret >= 0);
+        av_assert0(pkt->stream_index == stream_idx);
+        av_assert0(pkt->pts == next[stream_idx]);
+        next[stream_idx]++;
+        received++;
+        av_packet_unref(pkt);
+
+        if (nb_senders > 1 && stream_idx == 0 && next[0] == workload / 2)
+            impl->receive_finish(queue, 0);
+    }
+
+    for (int i = 0; i < nb_senders; i++)
+        pthread_join(senders[i].tid, NULL);
+
+    if (print)
+        printf("%-12s %d senders, %d packets each, queue size %d: %.0f packets/s\n",
+               impl->name, nb_senders, workload, queue_size,
+               received * 1e6 / FFMAX(av_gettime_relative() - start, 1));
+
+    av_assert0(nb_eof == (nb_senders > 1 && workload >= 2 ? nb_senders - 1 : nb_senders));
+    if (nb_senders > 1 && workload >= 2)
+        av_assert0(next[0] == workload / 2);
+
+    impl->free(&queue);
+    av_assert0(!atomic_load(&adaptive_mem.used));
+    av_packet_free(&pkt);
+    av_freep(&next);
+    av_freep(&senders);
+    return 0;
+}
+
+int main(int ac, char **av)
+{
+    int nb_senders, workload, queue_size;
+
+    if (ac != 4) {
+        fprintf(stderr, "%s <nb_senders> <packets_per_sender> <queue_size>\n", av[0]);
+        return 1;
+    }
+
+    nb_senders = atoi(av[1]);
+    workload   = atoi(av[2]);
+    queue_size = atoi(av[3]);
+    if (nb_senders < 1 || workload < 0 || queue_size < 1)
+        return 1;
+
+    if (tq_mem_init(&adaptive_mem, 16 << 10) < 0)
+        return 1;
+
+    for (int i = 0; i < FF_ARRAY_ELEMS(impls); i++)
+        run(&impls[i], nb_senders, workload, queue_size, 1);
+
+    /* senders finishing right after a few packets on a tiny ring, so that a
+     * stream is often finished while another sender has claimed a slot
+     * ahead of its last packet but not written it yet */
+    for (int i = 0; i < FF_ARRAY_ELEMS(impls); i++) {
+        for (int round = 0; round < 200; round++)
+            run(&impls[i], FFMAX(nb_senders, 2) * 2, 3, 2, 0);
+        printf("%-12s multi-producer EOF: ok\n", impls[i].name);
+    }
+
+    tq_mem_uninit(&adaptive_mem);
+    return 0;
+}
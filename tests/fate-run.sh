@@ -617,6 +617,40 @@ concat(){
     fi
 }
 
+format_plan(){
+    ffmpeg -v verbose -filter_format_cost "$@" -f null - 2>&1 |
+        grep "format plan" | sed 's/^\[[^]]*\] //'
+}
+
+segment_resume(){
+    srcfile=$1
+    dec_opt=$2
+    enc_opt=$3
+    nb_segments=$4
+    ckptfile="${outdir}/${test}.ckpt"
+    segments=""
+    for i in $(seq 0 $((nb_segments - 1))); do
+        segments="$segments ${outdir}/${test}-0$i.nut"
+    done
+    cleanfiles="$cleanfiles $ckptfile $segments"
+    rm -f $ckptfile $segments
+    tsrcfile=$(target_path $srcfile)
+    seg_opt="-f segment -segment_format nut -segment_format_options fflags=+bitexact"
+    seg_opt="$seg_opt -fflags +bitexact $(target_path ${outdir}/${test})-%02d.nut"
+
+    # interrupt the first run by making the third segment impossible to open
+    mkdir ${outdir}/${test}-02.nut
+    ffmpeg -resume $(target_path $ckptfile) $dec_opt -i $tsrcfile $enc_opt $seg_opt 2>/dev/null
+    err=$?
+    rmdir ${outdir}/${test}-02.nut
+    test $err != 0 || return 1
+
+    ffmpeg -resume $(target_path $ckptfile) $dec_opt -i $tsrcfile $enc_opt $seg_opt || return
+    for seg in $segments; do
+        framecrc -i $(target_path $seg) || return
+    done
+}
+
 venc_data(){
     file=$1
     stream=$2
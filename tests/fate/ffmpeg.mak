@@ -249,6 +249,149 @@ fate-ffmpeg-filter-in-eof: CMD = framecrc
     -filter_complex "[0][1]concat" -c:v rawvideo
 FATE_FFMPEG-$(call FRAMECRC, RAWVIDEO, RAWVIDEO, CONCAT_FILTER) += fate-ffmpeg-filter-in-eof
 
+# Test a simple filtergraph split into stages running in separate threads,
+# the output must match the unsplit filtergraph.
+fate-ffmpeg-filter-pipeline: tests/data/vsynth1.yuv
+fate-ffmpeg-filter-pipeline: CMD = framecrc                                                \
+    -f rawvideo -s 352x288 -pix_fmt yuv420p -t 1 -i $(TARGET_PATH)/tests/data/vsynth1.yuv  \
+    -vf hflip,unsharp,boxblur=2,vflip -filter_pipeline 3 -c:v rawvideo
+FATE_FFMPEG-$(call FRAMECRC, RAWVIDEO, RAWVIDEO, HFLIP_FILTER UNSHARP_FILTER BOXBLUR_FILTER VFLIP_FILTER) += fate-ffmpeg-filter-pipeline
+
+# Same with timestamps rewritten in one stage and frame rate conversion in the
+# next, which depends on the frame durations and the EOF timestamp passed on.
+fate-ffmpeg-filter-pipeline-fps: tests/data/vsynth1.yuv
+fate-ffmpeg-filter-pipeline-fps: CMD = framecrc                                            \
+    -f rawvideo -s 352x288 -pix_fmt yuv420p -t 1 -i $(TARGET_PATH)/tests/data/vsynth1.yuv  \
+    -vf setpts=PTS*1.5,hflip,fps=30,vflip -filter_pipeline 3 -r 20 -c:v rawvideo
+FATE_FFMPEG-$(call FRAMECRC, RAWVIDEO, RAWVIDEO, SETPTS_FILTER HFLIP_FILTER FPS_FILTER VFLIP_FILTER) += fate-ffmpeg-filter-pipeline-fps
+
+# Test activating the branches of a split concurrently and merging them again,
+# the output must match the one of a serial run.
+fate-ffmpeg-filter-graph-threads: tests/data/vsynth1.yuv
+fate-ffmpeg-filter-graph-threads: CMD = framecrc -filter_thread_type slice+graph -filter_threads 4 \
+    -f rawvideo -s 352x288 -pix_fmt yuv420p -t 1 -i $(TARGET_PATH)/tests/data/vsynth1.yuv  \
+    -filter_complex "split=3[a][b][c];[a]hflip[x];[b]vflip,negate[y];[c]boxblur=2[z];[x][y][z]hstack=3" \
+    -c:v rawvideo
+FATE_FFMPEG-$(call FRAMECRC, RAWVIDEO, RAWVIDEO, SPLIT_FILTER HFLIP_FILTER VFLIP_FILTER NEGATE_FILTER BOXBLUR_FILTER HSTACK_FILTER) += fate-ffmpeg-filter-graph-threads
+
+# Test streaming bands through a chain of row-local filters, the output must
+# match the one of the same chain processing whole frames.
+FILTER_BAND_CHAIN = negate,hflip,eq=contrast=1.3:brightness=0.05:gamma=1.2,hflip,lutyuv=y=negval
+
+fate-ffmpeg-filter-band-frame: tests/data/vsynth1.yuv
+fate-ffmpeg-filter-band-frame: CMD = framecrc                                              \
+    -f rawvideo -s 352x288 -pix_fmt yuv420p -t 1 -i $(TARGET_PATH)/tests/data/vsynth1.yuv  \
+    -vf $(FILTER_BAND_CHAIN) -c:v rawvideo
+
+fate-ffmpeg-filter-band: tests/data/vsynth1.yuv
+fate-ffmpeg-filter-band: CMD = framecrc -filter_band_height 16 -filter_threads 3           \
+    -f rawvideo -s 352x288 -pix_fmt yuv420p -t 1 -i $(TARGET_PATH)/tests/data/vsynth1.yuv  \
+    -vf $(FILTER_BAND_CHAIN) -c:v rawvideo
+fate-ffmpeg-filter-band: REF = $(SRC_PATH)/tests/ref/fate/ffmpeg-filter-band-frame
+
+FATE_FFMPEG-$(call FRAMECRC, RAWVIDEO, RAWVIDEO, NEGATE_FILTER HFLIP_FILTER EQ_FILTER LUTYUV_FILTER) += fate-ffmpeg-filter-band-frame fate-ffmpeg-filter-band
+
+# Test fusing chains of pointwise filters, alone and as members of band
+# chains, the output must match the one of the unfused filters.
+FILTER_FUSE_CHAIN = lutyuv=y=negval,negate,eq=contrast=1.3:brightness=0.05:gamma=1.2,scale=flags=accurate_rnd+bitexact,format=gbrp,curves=preset=vintage,lutrgb=r=negval,negate
+
+fate-ffmpeg-filter-fuse-off: tests/data/vsynth1.yuv
+fate-ffmpeg-filter-fuse-off: CMD = framecrc -nofilter_fuse_pointwise                      \
+    -f rawvideo -s 352x288 -pix_fmt yuv420p -t 1 -i $(TARGET_PATH)/tests/data/vsynth1.yuv  \
+    -vf $(FILTER_FUSE_CHAIN) -c:v rawvideo
+
+fate-ffmpeg-filter-fuse: tests/data/vsynth1.yuv
+fate-ffmpeg-filter-fuse: CMD = framecrc                                                    \
+    -f rawvideo -s 352x288 -pix_fmt yuv420p -t 1 -i $(TARGET_PATH)/tests/data/vsynth1.yuv  \
+    -vf $(FILTER_FUSE_CHAIN) -c:v rawvideo
+fate-ffmpeg-filter-fuse: REF = $(SRC_PATH)/tests/ref/fate/ffmpeg-filter-fuse-off
+
+fate-ffmpeg-filter-fuse-band: tests/data/vsynth1.yuv
+fate-ffmpeg-filter-fuse-band: CMD = framecrc -filter_band_height 16 -filter_threads 3      \
+    -f rawvideo -s 352x288 -pix_fmt yuv420p -t 1 -i $(TARGET_PATH)/tests/data/vsynth1.yuv  \
+    -vf $(FILTER_FUSE_CHAIN) -c:v rawvideo
+fate-ffmpeg-filter-fuse-band: REF = $(SRC_PATH)/tests/ref/fate/ffmpeg-filter-fuse-off
+
+FATE_FFMPEG-$(call FRAMECRC, RAWVIDEO, RAWVIDEO, LUTYUV_FILTER NEGATE_FILTER EQ_FILTER SCALE_FILTER FORMAT_FILTER CURVES_FILTER LUTRGB_FILTER) += fate-ffmpeg-filter-fuse-off fate-ffmpeg-filter-fuse fate-ffmpeg-filter-fuse-band
+
+# Test running stateless filters on several frames at once, the output must
+# match the one of the filters running in a single thread.
+FILTER_FRAME_THREADS_CHAIN = lut=y=255-val,lutyuv=u=val/2+64:v=negval,negate,hflip
+FILTER_FRAME_THREADS_INPUT = -f rawvideo -s 352x288 -pix_fmt yuv420p -t 1 -i $(TARGET_PATH)/tests/data/vsynth1.yuv
+
+fate-ffmpeg-filter-frame-threads-1: tests/data/vsynth1.yuv
+fate-ffmpeg-filter-frame-threads-1: CMD = framecrc -filter_threads 1 \
+    $(FILTER_FRAME_THREADS_INPUT) -vf $(FILTER_FRAME_THREADS_CHAIN) -c:v rawvideo
+
+fate-ffmpeg-filter-frame-threads-2: tests/data/vsynth1.yuv
+fate-ffmpeg-filter-frame-threads-2: CMD = framecrc -filter_thread_type frame -filter_threads 2 \
+    $(FILTER_FRAME_THREADS_INPUT) -vf $(FILTER_FRAME_THREADS_CHAIN) -c:v rawvideo
+fate-ffmpeg-filter-frame-threads-2: REF = $(SRC_PATH)/tests/ref/fate/ffmpeg-filter-frame-threads-1
+
+fate-ffmpeg-filter-frame-threads-3: tests/data/vsynth1.yuv
+fate-ffmpeg-filter-frame-threads-3: CMD = framecrc -filter_thread_type frame -filter_threads 3 \
+    $(FILTER_FRAME_THREADS_INPUT) -vf $(FILTER_FRAME_THREADS_CHAIN) -c:v rawvideo
+fate-ffmpeg-filter-frame-threads-3: REF = $(SRC_PATH)/tests/ref/fate/ffmpeg-filter-frame-threads-1
+
+fate-ffmpeg-filter-frame-threads-8: tests/data/vsynth1.yuv
+fate-ffmpeg-filter-frame-threads-8: CMD = framecrc -filter_thread_type frame -filter_threads 8 \
+    $(FILTER_FRAME_THREADS_INPUT) -vf $(FILTER_FRAME_THREADS_CHAIN) -c:v rawvideo
+fate-ffmpeg-filter-frame-threads-8: REF = $(SRC_PATH)/tests/ref/fate/ffmpeg-filter-frame-threads-1
+
+FATE_FFMPEG-$(call FRAMECRC, RAWVIDEO, RAWVIDEO, LUT_FILTER LUTYUV_FILTER NEGATE_FILTER HFLIP_FILTER) += \
+    fate-ffmpeg-filter-frame-threads-1 fate-ffmpeg-filter-frame-threads-2 \
+    fate-ffmpeg-filter-frame-threads-3 fate-ffmpeg-filter-frame-threads-8
+
+# Test picking the pixel formats of the whole graph by conversion cost, going
+# from yuv420p to rgb48 through a filter accepting yuv420p10 or rgb48 must
+# convert once, to rgb48, instead of twice through yuv420p10.
+fate-ffmpeg-format-cost: tests/data/vsynth1.yuv
+fate-ffmpeg-format-cost: CMD = format_plan                                                 \
+    -f rawvideo -s 352x288 -pix_fmt yuv420p -t 0.2 -i $(TARGET_PATH)/tests/data/vsynth1.yuv \
+    -vf "scale,format=yuv420p10le|rgb48le,scale" -pix_fmt rgb48le
+FATE_FFMPEG-$(call ALLYES, RAWVIDEO_DEMUXER RAWVIDEO_DECODER SCALE_FILTER FORMAT_FILTER WRAPPED_AVFRAME_ENCODER NULL_MUXER) += fate-ffmpeg-format-cost
+
+# Test cascading the scale filters of an encoding ladder, each rendition is
+# scaled from the next larger one.
+fate-ffmpeg-scale-cascade: tests/data/vsynth1.yuv
+fate-ffmpeg-scale-cascade: CMD = framecrc -scale_cascade                                    \
+    -f rawvideo -s 352x288 -pix_fmt yuv420p -t 0.2 -i $(TARGET_PATH)/tests/data/vsynth1.yuv \
+    -filter_complex "split=3[a][b][c];[a]scale=176:144:flags=bicubic+bitexact[hd];[b]scale=88:72:flags=bicubic+bitexact[md];[c]scale=44:36:flags=bicubic+bitexact[sd]" \
+    -map "[hd]" -map "[md]" -map "[sd]"
+FATE_FFMPEG-$(call FRAMECRC, RAWVIDEO, RAWVIDEO, SPLIT_FILTER SCALE_FILTER) += fate-ffmpeg-scale-cascade
+
+# Scale filters with different options are not cascaded, the output must match
+# the one without -scale_cascade.
+fate-ffmpeg-scale-cascade-opts: tests/data/vsynth1.yuv
+fate-ffmpeg-scale-cascade-opts: CMD = framecrc -scale_cascade                               \
+    -f rawvideo -s 352x288 -pix_fmt yuv420p -t 0.2 -i $(TARGET_PATH)/tests/data/vsynth1.yuv \
+    -filter_complex "split=2[a][b];[a]scale=176:144:flags=bicubic+bitexact[hd];[b]scale=88:72:flags=bilinear+bitexact:out_range=full[sd]" \
+    -map "[hd]" -map "[sd]"
+FATE_FFMPEG-$(call FRAMECRC, RAWVIDEO, RAWVIDEO, SPLIT_FILTER SCALE_FILTER) += fate-ffmpeg-scale-cascade-opts
+
+# Test resuming a segmented transcode that was interrupted by an error while
+# opening its third segment. The input has to be skipped by less than the
+# output was written, because of setpts. The output must match the one written
+# without interruption.
+fate-ffmpeg-segment-resume: tests/data/vsynth1.yuv
+fate-ffmpeg-segment-resume: CMD = segment_resume tests/data/vsynth1.yuv             \
+    "-f rawvideo -s 352x288 -pix_fmt yuv420p -t 1"                                  \
+    "-vf setpts=2*PTS -fps_mode passthrough -c:v rawvideo -segment_time 0.6" 4
+FATE_FFMPEG-$(call ALLYES, RAWVIDEO_DEMUXER RAWVIDEO_DECODER SETPTS_FILTER RAWVIDEO_ENCODER SEGMENT_MUXER NUT_MUXER NUT_DEMUXER FRAMECRC_MUXER) += fate-ffmpeg-segment-resume
+
+# Test decoding keyframe-delimited segments in parallel, the output must match
+# serial decoding.
+fate-ffmpeg-gop-threads: tests/data/vsynth1.yuv
+fate-ffmpeg-gop-threads: CMD = framecrc -gop_threads 3                        \
+    -f rawvideo -s 352x288 -pix_fmt yuv420p -t 1 -i $(TARGET_PATH)/tests/data/vsynth1.yuv  \
+    -c:v rawvideo
+FATE_FFMPEG-$(call FRAMECRC, RAWVIDEO, RAWVIDEO) += fate-ffmpeg-gop-threads
+
+# Same with an H.264 elementary stream, where the frame rate is only known
+# from the SPS the decoder parses. The output must match fate-h264-timecode.
+fate-ffmpeg-gop-threads-h264: CMD = framecrc -gop_threads 3 -i $(TARGET_SAMPLES)/h264/crew_cif_timecode-2.h264
+FATE_SAMPLES_FFMPEG-$(call FRAMECRC, H264, H264, H264_PARSER) += fate-ffmpeg-gop-threads-h264
+
 # Test termination on streamcopy with -t as an output option.
 fate-ffmpeg-streamcopy-t: tests/data/vsynth1.yuv
 fate-ffmpeg-streamcopy-t: CMP = null